@@ -6,6 +6,14 @@
 #include <string.h>
 #include <stdlib.h>
 #include <assert.h>
+#include <time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <arpa/inet.h>
 
 #include "block.h"
 #include "portsentry.h"
@@ -13,14 +21,138 @@
 #include "util.h"
 #include "config_data.h"
 
-static void FreeBlockedNodeList(struct BlockedNode *node);
-static struct BlockedNode *AddBlockedNode(struct BlockedState *bs, const struct sockaddr *address);
-static int RemoveBlockedNode(struct BlockedState *bs, const struct BlockedNode *node);
-static int WriteAddressToBlockFile(FILE *fp, const struct sockaddr_in6 *addr);
+#define BLOCKED_SET_MIN_BITS 4
+#define BLOCKED_SET_MAX_BITS 31
+#define FIBONACCI_HASH_64 0x9E3779B97F4A7C15ULL
 
-int IsBlocked(const struct sockaddr *address, const struct BlockedState *bs) {
-  struct BlockedNode *node;
+#define BLOCKED_FILE_MAGIC "PSBLOCK"
+#define BLOCKED_FILE_VERSION 3
+#define BLOCKED_RECORD_ADD_IPV4 0x04
+#define BLOCKED_RECORD_ADD_IPV6 0x06
+#define BLOCKED_RECORD_DEL_IPV4 0x84
+#define BLOCKED_RECORD_DEL_IPV6 0x86
+#define BLOCKED_RECORD_SIZE_MAX (1 + sizeof(struct in6_addr) + sizeof(uint64_t) + sizeof(uint32_t))
+#define LEGACY_RECORD_SIZE_IPV4 (sizeof(sa_family_t) + sizeof(uint32_t))
+#define LEGACY_RECORD_SIZE_IPV6 (sizeof(sa_family_t) + sizeof(struct in6_addr))
+#define BLOCKED_LOG_BUFFER 4096
+#define BLOCKED_SYNC_INTERVAL 1   // seconds
+#define BLOCKED_COMPACT_MIN 4096  // records
+#define BLOCKED_TIMERS_MIN 1024
+#define BLOCKED_PREFETCH_DISTANCE 16
+
+/* Blocked file layout (version 3), header fields, block times and checksums are in host byte order and addresses
+ * in network byte order:
+ *   header
+ *   noIpv4 IPv4 addresses, 4 bytes each, sorted in ascending order
+ *   noIpv6 IPv6 addresses, 16 bytes each, sorted in ascending order
+ *   noIpv4 + noIpv6 block times, 8 bytes each, in the order of the addresses
+ *   log of the changes since the file was last compacted, one record per added or removed address:
+ *     a type byte (BLOCKED_RECORD_*), the address, the block time of an added address and the CRC-32 of the
+ *     preceding fields
+ * Block times are seconds since the epoch. The header checksum covers the sorted sections. The log is only ever
+ * appended to, a record torn by a crash fails its checksum and is cut off at startup. MaintainBlockedFile()
+ * compacts the log into the sorted sections.
+ * Version 2 files have no block times, version 1 files in addition have records without type bit 0x80 or
+ * checksum. Files without the magic are read as the legacy format, one sa_family_t followed by the address per
+ * record. The addresses of these files are given the time they are loaded and they are converted on startup.
+ */
+struct BlockedFileHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t headerSize;
+  uint32_t noIpv4;
+  uint32_t noIpv6;
+  uint32_t checksum;  // CRC-32 of the sorted sections
+  uint32_t reserved;
+};
+
+// Data of an expiry timer
+struct BlockedTimer {
+  union {
+    uint32_t addr4;
+    struct in6_addr addr6;
+  } addr;
+  sa_family_t family;
+};
+
+// Removal records are collected in records and written in as few writes as possible
+struct ExpireContext {
+  struct BlockedState *bs;
+  struct ExpiredBlocks *expired;
+  uint8_t records[BLOCKED_LOG_BUFFER];
+  size_t recordsLen;
+  uint32_t noRecords;
+};
+
+// An address and its block time, the entries are sorted by address when the blocked file is rewritten
+struct BlockedEntry4 {
+  uint32_t addr;
+  uint64_t blockTime;
+};
+
+struct BlockedEntry6 {
+  struct in6_addr addr;
+  uint64_t blockTime;
+};
+
+static inline uint32_t HashIpv4(const uint32_t addr, const uint8_t bits);
+static inline uint32_t HashIpv6(const struct in6_addr *addr, const uint8_t bits);
+static inline int IsZeroIpv6(const struct in6_addr *addr);
+static uint8_t GetSetBits(const uint32_t count);
+static int ReserveSet4(struct BlockedSet4 *set, const uint32_t count);
+static int ReserveSet6(struct BlockedSet6 *set, const uint32_t count);
+static int InsertSet4(struct BlockedSet4 *set, const uint32_t addr, const uint64_t blockTime);
+static int InsertSet6(struct BlockedSet6 *set, const struct in6_addr *addr, const uint64_t blockTime);
+static int ContainsSet4(const struct BlockedSet4 *set, const uint32_t addr);
+static int ContainsSet6(const struct BlockedSet6 *set, const struct in6_addr *addr);
+static int RemoveSet4(struct BlockedSet4 *set, const uint32_t addr);
+static int RemoveSet6(struct BlockedSet6 *set, const struct in6_addr *addr);
+static uint64_t GetMonotonicSeconds(void);
+static uint64_t GetRealSeconds(void);
+static uint64_t GetRemainingTimeout(const uint64_t blockTime, const uint64_t now);
+static int AddExpiryTimer(struct BlockedState *bs, const int family, const void *addr, const uint64_t expires);
+static int InitBlockedExpiry(struct BlockedState *bs);
+static void ExpireAddress(void *data, void *ctx);
+static int AddBlockedAddress(struct BlockedState *bs, const struct sockaddr *address, const uint64_t blockTime);
+static int LoadBlockedFile(const uint8_t *buf, const size_t bufLen, struct BlockedState *bs, size_t *validLen, int *isDamaged);
+static int LoadLegacyBlockedFile(const uint8_t *buf, const size_t bufLen, struct BlockedState *bs, int *isDamaged);
+static int MoveDamagedBlockedFile(void);
+static int SyncParentDirectory(const char *path);
+static int ParseLogRecords(const uint8_t *buf, const size_t bufLen, const uint32_t version, const uint64_t loadTime, struct BlockedState *bs, uint32_t *noIpv4, uint32_t *noIpv6, size_t *validLen);
+static size_t GetRecordSize(const uint32_t version, const uint8_t type, size_t *addrLen, size_t *timeLen);
+static size_t EncodeRecord(uint8_t *buf, const uint8_t type, const void *addr, const uint64_t blockTime);
+static int AppendRecords(struct BlockedState *bs, const uint8_t *buf, const size_t len, const uint32_t noRecords);
+static int WriteFully(const int fd, const void *buf, const size_t len);
+static int OpenBlockedLog(struct BlockedState *bs, const off_t validLen);
+static int SyncBlockedFile(struct BlockedState *bs);
+static int ParseLegacyBuffer(const uint8_t *buf, const size_t bufLen, const uint64_t loadTime, struct BlockedState *bs, uint32_t *noIpv4, uint32_t *noIpv6);
+static void InitBlockedFileHeader(struct BlockedFileHeader *header, const uint32_t noIpv4, const uint32_t noIpv6, const uint32_t checksum);
+static int CompareIpv4(const void *a, const void *b);
+static int CompareIpv6(const void *a, const void *b);
+
+#ifdef FUZZ_BLOCKED_FILE_LOAD
+int LLVMFuzzerTestOneInput(const uint8_t *Data, size_t Size) {
+  struct BlockedState bs;
+  size_t validLen = 0;
+  int isDamaged = FALSE;
+
+  memset(&bs, 0, sizeof(struct BlockedState));
+  bs.log.fd = -1;
+  bs.isInitialized = TRUE;
+
+  // Same dispatch as BlockedStateInit()
+  if (Size >= sizeof(struct BlockedFileHeader) && memcmp(Data, BLOCKED_FILE_MAGIC, sizeof(BLOCKED_FILE_MAGIC)) == 0) {
+    LoadBlockedFile(Data, Size, &bs, &validLen, &isDamaged);
+  } else {
+    LoadLegacyBlockedFile(Data, Size, &bs, &isDamaged);
+  }
+
+  BlockedStateFree(&bs);
+  return 0;
+}
+#endif
 
+int IsBlocked(const struct sockaddr *address, const struct BlockedState *bs) {
   assert(address != NULL);
   assert(bs != NULL);
 
@@ -28,101 +160,115 @@ int IsBlocked(const struct sockaddr *address, const struct BlockedState *bs) {
     return FALSE;
   }
 
-  node = bs->head;
-
-  while (node != NULL) {
-    if (address->sa_family == AF_INET && node->address.sin6_family == AF_INET) {
-      struct sockaddr_in *target = (struct sockaddr_in *)address;
-      struct sockaddr_in *current = (struct sockaddr_in *)&node->address;
-      if (memcmp(&current->sin_addr.s_addr, &target->sin_addr.s_addr, sizeof(target->sin_addr.s_addr)) == 0) {
-        return TRUE;
-      }
-    } else if (address->sa_family == AF_INET6 && node->address.sin6_family == AF_INET6) {
-      struct sockaddr_in6 *target = (struct sockaddr_in6 *)address;
-      struct sockaddr_in6 *current = (struct sockaddr_in6 *)&node->address;
-      if (memcmp(&current->sin6_addr, &target->sin6_addr, sizeof(target->sin6_addr)) == 0) {
-        return TRUE;
-      }
-    }
-
-    node = node->next;
+  if (address->sa_family == AF_INET) {
+    return ContainsSet4(&bs->ipv4, ((const struct sockaddr_in *)address)->sin_addr.s_addr);
+  } else if (address->sa_family == AF_INET6) {
+    return ContainsSet6(&bs->ipv6, &((const struct sockaddr_in6 *)address)->sin6_addr);
   }
 
   return FALSE;
 }
 
-/* Initialize the BlockedState structure by reading the blocked file.
+// Start loading the slot an address is probed from, ahead of IsBlocked()
+void PrefetchBlocked(const struct sockaddr *address, const struct BlockedState *bs) {
+  if (address->sa_family == AF_INET && bs->ipv4.slots != NULL) {
+    __builtin_prefetch(&bs->ipv4.slots[HashIpv4(((const struct sockaddr_in *)address)->sin_addr.s_addr, bs->ipv4.bits)], 0);
+  } else if (address->sa_family == AF_INET6 && bs->ipv6.slots != NULL) {
+    __builtin_prefetch(&bs->ipv6.slots[HashIpv6(&((const struct sockaddr_in6 *)address)->sin6_addr, bs->ipv6.bits)], 0);
+  }
+}
+
+/* Initialize the BlockedState structure from the blocked file. The file is mapped rather than read,
+ * the sorted sections are inserted straight into the sets which are sized up front from the header,
+ * then the log is replayed. The file is kept open to append to the log.
  * returns:
  *  TRUE: Success
- *  FALSE: Potentially partial success, but the structure is not fully initialized but usable
+ *  FALSE: Potentially partial success, or a file in the legacy format. The structure is usable but the
+ *         file should be rewritten
  *  ERROR: Failure, unrecoverable error
  */
 int BlockedStateInit(struct BlockedState *bs) {
-  int status = ERROR;
-  FILE *fp = NULL;
+  int status = ERROR, fd = -1, isDamaged = FALSE;
+  void *map = MAP_FAILED;
+  size_t validLen = 0;
+  struct stat st;
+  struct timespec start, end;
   char err[ERRNOMAXBUF];
-  sa_family_t family;
-  struct sockaddr_in6 sa;  // Use the larger sockaddr_in6 to hold both IPv4 and IPv6 addresses. Otherwise _FORTIFY_SOURCE=2 will erroneously complain in AddBlockedNode
 
   assert(bs != NULL);
 
   memset(bs, 0, sizeof(struct BlockedState));
+  bs->log.fd = -1;
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
 
-  if ((fp = fopen(configData.blockedFile, "r")) == NULL) {
+  if ((fd = open(configData.blockedFile, O_RDONLY)) == -1) {
     Error("Cannot open blocked file: %s for reading: %s", configData.blockedFile, ErrnoString(err, sizeof(err)));
     goto exit;
   }
 
-  while (TRUE) {
-    memset(&sa, 0, sizeof(sa));
+  if (fstat(fd, &st) == -1) {
+    Error("Unable to stat blocked file: %s: %s", configData.blockedFile, ErrnoString(err, sizeof(err)));
+    goto exit;
+  }
 
-    if (fread(&family, sizeof(family), 1, fp) != 1) {
-      if (feof(fp)) {
-        break;
-      }
-      Error("Unable to read address family from blocked file: %s", configData.blockedFile);
-      status = FALSE;
-      goto exit;
+  if (st.st_size == 0) {
+    status = (configData.blockTimeout > 0) ? InitBlockedExpiry(bs) : TRUE;
+    if (status == TRUE && OpenBlockedLog(bs, 0) != TRUE) {
+      status = ERROR;
     }
+    goto exit;
+  }
 
-    if (family == AF_INET) {
-      struct sockaddr_in *sa4 = (struct sockaddr_in *)&sa;
-      if (fread(&sa4->sin_addr.s_addr, sizeof(sa4->sin_addr.s_addr), 1, fp) != 1) {
-        Error("Unable to read address from blocked file: %s", configData.blockedFile);
-        status = FALSE;
-        goto exit;
-      }
+  if ((map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED) {
+    Error("Unable to map blocked file: %s: %s", configData.blockedFile, ErrnoString(err, sizeof(err)));
+    goto exit;
+  }
 
-      sa.sin6_family = family;
-      AddBlockedNode(bs, (struct sockaddr *)&sa);
-    } else if (family == AF_INET6) {
-      if (fread(&sa.sin6_addr, sizeof(sa.sin6_addr), 1, fp) != 1) {
-        Error("Unable to read address from blocked file: %s", configData.blockedFile);
-        status = FALSE;
-        goto exit;
-      }
+  madvise(map, st.st_size, MADV_SEQUENTIAL);
 
-      sa.sin6_family = family;
-      AddBlockedNode(bs, (struct sockaddr *)&sa);
-    } else {
-      Error("Unsupported address family: %d", family);
-      status = FALSE;
-      goto exit;
-    }
+  if ((size_t)st.st_size >= sizeof(struct BlockedFileHeader) && memcmp(map, BLOCKED_FILE_MAGIC, sizeof(BLOCKED_FILE_MAGIC)) == 0) {
+    status = LoadBlockedFile(map, st.st_size, bs, &validLen, &isDamaged);
+  } else {
+    status = LoadLegacyBlockedFile(map, st.st_size, bs, &isDamaged);
+  }
+
+  // Never rewrite over a damaged file, it's kept for recovery and a new file is written with what could be loaded
+  if (status != ERROR && isDamaged == TRUE) {
+    status = (MoveDamagedBlockedFile() == TRUE) ? FALSE : ERROR;
+  }
+
+  if (status != ERROR && configData.blockTimeout > 0 && InitBlockedExpiry(bs) != TRUE) {
+    status = ERROR;
+    goto exit;
+  }
+
+  // A file that needs rewriting gets a new log once it's rewritten
+  if (status == TRUE && OpenBlockedLog(bs, (off_t)validLen) != TRUE) {
+    status = ERROR;
+    goto exit;
   }
 
-  status = TRUE;
+  clock_gettime(CLOCK_MONOTONIC, &end);
+
+  Debug("Loaded %u IPv4 and %u IPv6 addresses from blocked file: %s in %ld us", bs->ipv4.count + bs->ipv4.hasZero, bs->ipv6.count + bs->ipv6.hasZero,
+        configData.blockedFile, (long)((end.tv_sec - start.tv_sec) * 1000000 + (end.tv_nsec - start.tv_nsec) / 1000));
 
 exit:
   if (status == TRUE || status == FALSE) {
     bs->isInitialized = TRUE;
   }
 
-  if (fp != NULL) {
-    fclose(fp);
+  if (map != MAP_FAILED) {
+    munmap(map, st.st_size);
+  }
+
+  if (fd != -1) {
+    close(fd);
   }
 
   if (status == ERROR) {
+    bs->isInitialized = TRUE;  // Let BlockedStateFree() release partially loaded sets
     BlockedStateFree(bs);
   }
 
@@ -134,176 +280,1232 @@ void BlockedStateFree(struct BlockedState *bs) {
     return;
   }
 
-  FreeBlockedNodeList(bs->head);
+  if (bs->ipv4.slots != NULL) {
+    free(bs->ipv4.slots);
+    free(bs->ipv4.times);
+  }
+
+  if (bs->ipv6.slots != NULL) {
+    free(bs->ipv6.slots);
+    free(bs->ipv6.times);
+  }
+
+  FreeTimerWheel(&bs->expiry);
+
+  if (bs->log.fd != -1) {
+    SyncBlockedFile(bs);
+    close(bs->log.fd);
+  }
+
   memset(bs, 0, sizeof(struct BlockedState));
   bs->isInitialized = FALSE;
 }
 
+/* Add the address to the blocked state and append it to the log. The record is handed to the kernel
+ * right away, it's flushed to disk by MaintainBlockedFile() together with the other recent records.
+ */
 int WriteBlockedFile(const struct sockaddr *address, struct BlockedState *bs) {
-  int status = ERROR;
-  FILE *fp = NULL;
-  struct BlockedNode *node = NULL;
-  char err[ERRNOMAXBUF];
+  uint8_t record[BLOCKED_RECORD_SIZE_MAX];
+  const uint64_t blockTime = GetRealSeconds();
+  size_t len;
+  int ret;
 
   assert(address != NULL);
   assert(bs != NULL);
   assert(address->sa_family == AF_INET || address->sa_family == AF_INET6);
 
-  if ((fp = fopen(configData.blockedFile, "a")) == NULL) {
-    Error("Unable to open blocked file: %s for writing: %s", configData.blockedFile, ErrnoString(err, sizeof(err)));
-    goto exit;
+  if ((ret = AddBlockedAddress(bs, address, blockTime)) == ERROR) {
+    Error("Unable to add blocked address");
+    return ERROR;
+  } else if (ret == FALSE) {
+    return TRUE;  // Already in the log
   }
 
-  if ((node = AddBlockedNode(bs, address)) == NULL) {
-    Error("Unable to add blocked node");
-    goto exit;
+  if (address->sa_family == AF_INET) {
+    len = EncodeRecord(record, BLOCKED_RECORD_ADD_IPV4, &((const struct sockaddr_in *)address)->sin_addr.s_addr, blockTime);
+  } else {
+    len = EncodeRecord(record, BLOCKED_RECORD_ADD_IPV6, &((const struct sockaddr_in6 *)address)->sin6_addr, blockTime);
   }
 
-  // Ignore file write errors. Atlreast the addr is in memory and will be ignored in this session.
+  // Ignore file write errors. Atleast the addr is in memory and will be ignored in this session.
   // The function will report any errors to the log.
-  WriteAddressToBlockFile(fp, (struct sockaddr_in6 *)address);
-  status = TRUE;
-
-exit:
-  if (fp != NULL) {
-    fclose(fp);
-  }
-
-  if (status != TRUE && node != NULL) {
-    RemoveBlockedNode(bs, node);
-  }
+  AppendRecords(bs, record, len, 1);
 
-  return status;
+  return TRUE;
 }
 
-int RewriteBlockedFile(const struct BlockedState *bs) {
-  int status = ERROR;
+/* Write all blocked addresses and their block times as sorted sections to a new file which then replaces the
+ * blocked file, so the file is never left half written. The log starts over in the new file.
+ */
+int RewriteBlockedFile(struct BlockedState *bs) {
+  int status = ERROR, fd = -1;
   FILE *fp = NULL;
-  struct BlockedNode *node = NULL;
+  uint32_t i, noIpv4 = 0, noIpv6 = 0, *addrs4 = NULL;
+  uint64_t *times = NULL;
+  struct in6_addr *addrs6 = NULL;
+  struct BlockedEntry4 *entries4 = NULL;
+  struct BlockedEntry6 *entries6 = NULL;
+  struct BlockedFileHeader header;
+  struct stat st;
+  char tempFile[PATH_MAX];
   char err[ERRNOMAXBUF];
 
   assert(bs != NULL);
 
-  if (bs == NULL || bs->isInitialized == FALSE || bs->head == NULL) {
+  // An empty set still truncates the file, all blocks might just have expired
+  if (bs == NULL || bs->isInitialized == FALSE) {
     return FALSE;
   }
 
-  if ((fp = fopen(configData.blockedFile, "w")) == NULL) {
-    Error("Unable to open blocked file: %s for writing: %s", configData.blockedFile, ErrnoString(err, sizeof(err)));
+  if (snprintf(tempFile, sizeof(tempFile), "%s.XXXXXX", configData.blockedFile) >= (int)sizeof(tempFile)) {
+    Error("Blocked file path too long: %s", configData.blockedFile);
+    return ERROR;
+  }
+
+  /* The replacement gets the owner and mode of the blocked file. Like hosts.deny, a symbolic link isn't replaced by a
+   * regular file. A blocked file which was moved aside as damaged is replaced by one only accessible by us.
+   */
+  if (lstat(configData.blockedFile, &st) == -1) {
+    if (errno != ENOENT) {
+      Error("Unable to stat blocked file: %s: %s", configData.blockedFile, ErrnoString(err, sizeof(err)));
+      return ERROR;
+    }
+    st.st_mode = 0;
+  } else if (S_ISLNK(st.st_mode)) {
+    Error("Blocked file: %s is a symbolic link, refusing to replace it", configData.blockedFile);
+    return ERROR;
+  }
+
+  if ((entries4 = malloc(((size_t)bs->ipv4.count + 1) * sizeof(struct BlockedEntry4))) == NULL ||
+      (entries6 = malloc(((size_t)bs->ipv6.count + 1) * sizeof(struct BlockedEntry6))) == NULL ||
+      (addrs4 = malloc(((size_t)bs->ipv4.count + 1) * sizeof(uint32_t))) == NULL ||
+      (addrs6 = malloc(((size_t)bs->ipv6.count + 1) * sizeof(struct in6_addr))) == NULL ||
+      (times = malloc(((size_t)bs->ipv4.count + bs->ipv6.count + 2) * sizeof(uint64_t))) == NULL) {
+    Error("Unable to allocate memory for rewriting blocked file: %s", configData.blockedFile);
     goto exit;
   }
 
-  node = bs->head;
-  while (node != NULL) {
-    if (WriteAddressToBlockFile(fp, &node->address) == ERROR) {
-      goto exit;
+  if (bs->ipv4.hasZero == TRUE) {
+    entries4[noIpv4].addr = 0;
+    entries4[noIpv4++].blockTime = bs->ipv4.zeroTime;
+  }
+
+  for (i = 0; bs->ipv4.slots != NULL && i < (1U << bs->ipv4.bits); i++) {
+    if (bs->ipv4.slots[i] != 0) {
+      entries4[noIpv4].addr = bs->ipv4.slots[i];
+      entries4[noIpv4++].blockTime = bs->ipv4.times[i];
+    }
+  }
+
+  if (bs->ipv6.hasZero == TRUE) {
+    memset(&entries6[noIpv6].addr, 0, sizeof(struct in6_addr));
+    entries6[noIpv6++].blockTime = bs->ipv6.zeroTime;
+  }
+
+  for (i = 0; bs->ipv6.slots != NULL && i < (1U << bs->ipv6.bits); i++) {
+    if (IsZeroIpv6(&bs->ipv6.slots[i]) == FALSE) {
+      entries6[noIpv6].addr = bs->ipv6.slots[i];
+      entries6[noIpv6++].blockTime = bs->ipv6.times[i];
     }
+  }
+
+  // The address is the first member of an entry, so the entries sort by address
+  qsort(entries4, noIpv4, sizeof(struct BlockedEntry4), CompareIpv4);
+  qsort(entries6, noIpv6, sizeof(struct BlockedEntry6), CompareIpv6);
+
+  for (i = 0; i < noIpv4; i++) {
+    addrs4[i] = entries4[i].addr;
+    times[i] = entries4[i].blockTime;
+  }
+
+  for (i = 0; i < noIpv6; i++) {
+    addrs6[i] = entries6[i].addr;
+    times[noIpv4 + i] = entries6[i].blockTime;
+  }
+
+  InitBlockedFileHeader(&header, noIpv4, noIpv6,
+                        Crc32(Crc32(Crc32(0, addrs4, (size_t)noIpv4 * sizeof(uint32_t)), addrs6, (size_t)noIpv6 * sizeof(struct in6_addr)),
+                              times, ((size_t)noIpv4 + noIpv6) * sizeof(uint64_t)));
+
+  // The blocked file might be in a world-writable directory, so the temporary file must get an unpredictable name
+  if ((fd = mkstemp(tempFile)) == -1) {
+    Error("Unable to create temporary blocked file: %s: %s", tempFile, ErrnoString(err, sizeof(err)));
+    goto exit;
+  }
+
+  if (fcntl(fd, F_SETFD, FD_CLOEXEC) == -1 || (fp = fdopen(fd, "w")) == NULL) {
+    Error("Unable to open blocked file: %s for writing: %s", tempFile, ErrnoString(err, sizeof(err)));
+    close(fd);
+    goto exit;
+  }
+
+  if (st.st_mode != 0 && SetReplacementFileAttributes(fp, &st, tempFile) != TRUE) {
+    goto exit;
+  }
+
+  if (fwrite(&header, sizeof(header), 1, fp) != 1 ||
+      fwrite(addrs4, sizeof(uint32_t), noIpv4, fp) != noIpv4 ||
+      fwrite(addrs6, sizeof(struct in6_addr), noIpv6, fp) != noIpv6 ||
+      fwrite(times, sizeof(uint64_t), (size_t)noIpv4 + noIpv6, fp) != (size_t)noIpv4 + noIpv6) {
+    Error("Unable to write blocked file: %s", tempFile);
+    goto exit;
+  }
+
+  // The new file has to be on disk before it replaces the old one
+  if (fflush(fp) != 0 || fdatasync(fileno(fp)) == -1) {
+    Error("Unable to flush blocked file: %s: %s", tempFile, ErrnoString(err, sizeof(err)));
+    goto exit;
+  }
+
+  if (fclose(fp) != 0) {
+    fp = NULL;
+    Error("Unable to write blocked file: %s: %s", tempFile, ErrnoString(err, sizeof(err)));
+    goto exit;
+  }
+  fp = NULL;
+
+  if (rename(tempFile, configData.blockedFile) == -1) {
+    Error("Unable to replace blocked file: %s: %s", configData.blockedFile, ErrnoString(err, sizeof(err)));
+    goto exit;
+  }
+
+  // The rename itself is only durable once the directory is flushed
+  SyncParentDirectory(configData.blockedFile);
 
-    node = node->next;
+  if (bs->log.fd != -1) {
+    close(bs->log.fd);
+    bs->log.fd = -1;
   }
 
-  status = TRUE;
+  bs->log.noSnapshot = noIpv4 + noIpv6;
+  bs->log.noRecords = 0;
+  status = OpenBlockedLog(bs, -1);
 
 exit:
   if (fp != NULL) {
     fclose(fp);
   }
 
+  if (status != TRUE && fd != -1) {
+    unlink(tempFile);
+  }
+
+  free(entries4);
+  free(entries6);
+  free(addrs4);
+  free(addrs6);
+  free(times);
+
   return status;
 }
 
-static void FreeBlockedNodeList(struct BlockedNode *node) {
-  if (node == NULL) {
-    return;
+/* Remove the addresses whose BLOCK_TIMEOUT has passed and append their removal to the log.
+ * The removed addresses are returned in expired so the caller can undo the blocking actions.
+ * Returns the number of expired addresses, 0 if BLOCK_TIMEOUT isn't set or nothing expired.
+ */
+int ExpireBlocked(struct BlockedState *bs, struct ExpiredBlocks *expired) {
+  struct ExpireContext ctx;
+  uint32_t noExpired;
+
+  assert(bs != NULL);
+  assert(expired != NULL);
+
+  expired->count = 0;
+
+  if (bs->expiry.isInitialized == FALSE) {
+    return 0;
+  }
+
+  ctx.bs = bs;
+  ctx.expired = expired;
+  ctx.recordsLen = 0;
+  ctx.noRecords = 0;
+
+  if ((noExpired = AdvanceTimerWheel(&bs->expiry, GetMonotonicSeconds(), ExpireAddress, &ctx)) == 0) {
+    return 0;
+  }
+
+  if (ctx.recordsLen > 0) {
+    AppendRecords(bs, ctx.records, ctx.recordsLen, ctx.noRecords);
+  }
+
+  Debug("Expired %u blocked addresses, %u still blocked", noExpired, bs->expiry.count);
+
+  return (int)noExpired;
+}
+
+void FreeExpiredBlocks(struct ExpiredBlocks *expired) {
+  if (expired->targets != NULL) {
+    free(expired->targets);
   }
 
-  FreeBlockedNodeList(node->next);
-  free(node);
+  memset(expired, 0, sizeof(struct ExpiredBlocks));
 }
 
-static struct BlockedNode *AddBlockedNode(struct BlockedState *bs, const struct sockaddr *address) {
-  struct BlockedNode *node = NULL;
+/* Called periodically. Flushes the records appended since the last flush to disk, so a burst of blocks
+ * costs a single fdatasync(), and compacts the log into the sorted sections once it has grown larger
+ * than them. Returns ERROR if the file couldn't be flushed or compacted, otherwise TRUE.
+ */
+int MaintainBlockedFile(struct BlockedState *bs) {
+  int status = TRUE;
 
   assert(bs != NULL);
-  assert(address != NULL);
-  assert(address->sa_family == AF_INET || address->sa_family == AF_INET6);
 
-  if ((node = calloc(1, sizeof(struct BlockedNode))) == NULL) {
-    Error("Unable to allocate memory for blocked node");
-    return NULL;
+  if (bs->log.fd == -1) {
+    return TRUE;
   }
 
-  if (address->sa_family == AF_INET) {
-    struct sockaddr_in *addr = (struct sockaddr_in *)address;
-    memcpy(&node->address, addr, sizeof(struct sockaddr_in));
-  } else if (address->sa_family == AF_INET6) {
-    struct sockaddr_in6 *addr = (struct sockaddr_in6 *)address;
-    memcpy(&node->address, addr, sizeof(struct sockaddr_in6));
-  } else {
-    free(node);
-    return NULL;
+  if (bs->log.noUnsynced > 0 && GetMonotonicSeconds() >= bs->log.lastSync + BLOCKED_SYNC_INTERVAL) {
+    status = SyncBlockedFile(bs);
+  }
+
+  if (bs->log.noRecords >= BLOCKED_COMPACT_MIN && bs->log.noRecords > bs->log.noSnapshot) {
+    Debug("Compacting %u log records of blocked file: %s", bs->log.noRecords, configData.blockedFile);
+    if (RewriteBlockedFile(bs) != TRUE) {
+      status = ERROR;
+    }
   }
 
-  node->next = bs->head;
-  bs->head = node;
-  return node;
+  return status;
 }
 
-static int RemoveBlockedNode(struct BlockedState *bs, const struct BlockedNode *node) {
-  struct BlockedNode *prev = NULL;
-  struct BlockedNode *current = bs->head;
+/* Call callback for every blocked address, addr points to an IPv4 (network byte order) or IPv6 address.
+ * Stops and returns ERROR if the callback returns ERROR, otherwise returns TRUE.
+ */
+int ForEachBlockedAddress(const struct BlockedState *bs, int (*callback)(const int family, const void *addr, void *ctx), void *ctx) {
+  uint32_t i, zero4 = 0;
+  struct in6_addr zero6;
+
+  assert(bs != NULL);
 
-  if (node == NULL) {
-    return FALSE;
+  if (bs->ipv4.hasZero == TRUE && callback(AF_INET, &zero4, ctx) == ERROR) {
+    return ERROR;
   }
 
-  while (current != NULL) {
-    if (current == node) {
-      if (prev == NULL) {
-        bs->head = current->next;
-      } else {
-        prev->next = current->next;
-      }
-      free(current);
-      return TRUE;
+  for (i = 0; bs->ipv4.slots != NULL && i < (1U << bs->ipv4.bits); i++) {
+    if (bs->ipv4.slots[i] != 0 && callback(AF_INET, &bs->ipv4.slots[i], ctx) == ERROR) {
+      return ERROR;
     }
-    prev = current;
-    current = current->next;
   }
-  return FALSE;
+
+  memset(&zero6, 0, sizeof(zero6));
+  if (bs->ipv6.hasZero == TRUE && callback(AF_INET6, &zero6, ctx) == ERROR) {
+    return ERROR;
+  }
+
+  for (i = 0; bs->ipv6.slots != NULL && i < (1U << bs->ipv6.bits); i++) {
+    if (IsZeroIpv6(&bs->ipv6.slots[i]) == FALSE && callback(AF_INET6, &bs->ipv6.slots[i], ctx) == ERROR) {
+      return ERROR;
+    }
+  }
+
+  return TRUE;
 }
 
-static int WriteAddressToBlockFile(FILE *fp, const struct sockaddr_in6 *addr) {
-  assert(fp != NULL);
-  assert(addr != NULL);
+static inline uint32_t HashIpv4(const uint32_t addr, const uint8_t bits) {
+  return (uint32_t)(((uint64_t)addr * FIBONACCI_HASH_64) >> (64 - bits));
+}
 
-  if (fp == NULL || addr == NULL || (addr->sin6_family != AF_INET && addr->sin6_family != AF_INET6)) {
-    return FALSE;
+static inline uint32_t HashIpv6(const struct in6_addr *addr, const uint8_t bits) {
+  uint64_t hi, lo;
+
+  memcpy(&hi, addr->s6_addr, sizeof(hi));
+  memcpy(&lo, addr->s6_addr + sizeof(hi), sizeof(lo));
+
+  return (uint32_t)(((hi ^ (lo * FIBONACCI_HASH_64)) * FIBONACCI_HASH_64) >> (64 - bits));
+}
+
+static inline int IsZeroIpv6(const struct in6_addr *addr) {
+  uint64_t hi, lo;
+
+  memcpy(&hi, addr->s6_addr, sizeof(hi));
+  memcpy(&lo, addr->s6_addr + sizeof(hi), sizeof(lo));
+
+  return (hi | lo) == 0;
+}
+
+/* Smallest number of bits giving a capacity of at least twice the count, i.e. a max load factor of 0.5 */
+static uint8_t GetSetBits(const uint32_t count) {
+  uint8_t bits = BLOCKED_SET_MIN_BITS;
+
+  while (bits < BLOCKED_SET_MAX_BITS && (1ULL << bits) < (uint64_t)count * 2) {
+    bits++;
+  }
+
+  return bits;
+}
+
+static int ReserveSet4(struct BlockedSet4 *set, const uint32_t count) {
+  uint32_t *oldSlots = set->slots, i, slot, mask;
+  uint64_t *oldTimes = set->times;
+  uint8_t oldBits = set->bits, bits = GetSetBits(count);
+
+  if (set->slots != NULL && bits <= set->bits) {
+    return TRUE;
   }
 
-  if (addr->sin6_family == AF_INET) {
-    struct sockaddr_in *addr4 = (struct sockaddr_in *)addr;
+  if ((set->slots = calloc(1U << bits, sizeof(uint32_t))) == NULL ||
+      (set->times = malloc((size_t)(1U << bits) * sizeof(uint64_t))) == NULL) {
+    Error("Unable to allocate memory for blocked IPv4 addresses");
+    free(set->slots);
+    set->slots = oldSlots;
+    set->times = oldTimes;
+    return ERROR;
+  }
+  set->bits = bits;
+  mask = (1U << bits) - 1;
 
-    if (fwrite(&addr4->sin_family, sizeof(addr4->sin_family), 1, fp) != 1) {
-      Error("Unable to write sin_family to blocked file: %s", configData.blockedFile);
-      return ERROR;
+  for (i = 0; oldSlots != NULL && i < (1U << oldBits); i++) {
+    if (oldSlots[i] == 0) {
+      continue;
     }
 
-    if (fwrite(&addr4->sin_addr.s_addr, sizeof(addr4->sin_addr.s_addr), 1, fp) != 1) {
-      Error("Unable to write sin_addr to blocked file: %s", configData.blockedFile);
-      return ERROR;
+    for (slot = HashIpv4(oldSlots[i], bits); set->slots[slot] != 0; slot = (slot + 1) & mask)
+      ;
+    set->slots[slot] = oldSlots[i];
+    set->times[slot] = oldTimes[i];
+  }
+
+  if (oldSlots != NULL) {
+    free(oldSlots);
+    free(oldTimes);
+  }
+
+  return TRUE;
+}
+
+static int ReserveSet6(struct BlockedSet6 *set, const uint32_t count) {
+  struct in6_addr *oldSlots = set->slots;
+  uint64_t *oldTimes = set->times;
+  uint32_t i, slot, mask;
+  uint8_t oldBits = set->bits, bits = GetSetBits(count);
+
+  if (set->slots != NULL && bits <= set->bits) {
+    return TRUE;
+  }
+
+  if ((set->slots = calloc(1U << bits, sizeof(struct in6_addr))) == NULL ||
+      (set->times = malloc((size_t)(1U << bits) * sizeof(uint64_t))) == NULL) {
+    Error("Unable to allocate memory for blocked IPv6 addresses");
+    free(set->slots);
+    set->slots = oldSlots;
+    set->times = oldTimes;
+    return ERROR;
+  }
+  set->bits = bits;
+  mask = (1U << bits) - 1;
+
+  for (i = 0; oldSlots != NULL && i < (1U << oldBits); i++) {
+    if (IsZeroIpv6(&oldSlots[i]) == TRUE) {
+      continue;
     }
-  } else if (addr->sin6_family == AF_INET6) {
-    if (fwrite(&addr->sin6_family, sizeof(addr->sin6_family), 1, fp) != 1) {
-      Error("Unable to write sin6_family to blocked file: %s", configData.blockedFile);
-      return ERROR;
+
+    for (slot = HashIpv6(&oldSlots[i], bits); IsZeroIpv6(&set->slots[slot]) == FALSE; slot = (slot + 1) & mask)
+      ;
+    set->slots[slot] = oldSlots[i];
+    set->times[slot] = oldTimes[i];
+  }
+
+  if (oldSlots != NULL) {
+    free(oldSlots);
+    free(oldTimes);
+  }
+
+  return TRUE;
+}
+
+/* Returns TRUE if the address was added, FALSE if it was already present (its block time is kept) and ERROR
+ * on allocation failure
+ */
+static int InsertSet4(struct BlockedSet4 *set, const uint32_t addr, const uint64_t blockTime) {
+  uint32_t slot, mask;
+
+  if (addr == 0) {
+    if (set->hasZero == TRUE) {
+      return FALSE;
     }
+    set->hasZero = TRUE;
+    set->zeroTime = blockTime;
+    return TRUE;
+  }
 
-    if (fwrite(&addr->sin6_addr, sizeof(addr->sin6_addr), 1, fp) != 1) {
-      Error("Unable to write sin6_addr to blocked file: %s", configData.blockedFile);
-      return ERROR;
+  if (ReserveSet4(set, set->count + 1) != TRUE) {
+    return ERROR;
+  }
+
+  mask = (1U << set->bits) - 1;
+  for (slot = HashIpv4(addr, set->bits); set->slots[slot] != 0; slot = (slot + 1) & mask) {
+    if (set->slots[slot] == addr) {
+      return FALSE;
+    }
+  }
+
+  set->slots[slot] = addr;
+  set->times[slot] = blockTime;
+  set->count++;
+
+  return TRUE;
+}
+
+static int InsertSet6(struct BlockedSet6 *set, const struct in6_addr *addr, const uint64_t blockTime) {
+  uint32_t slot, mask;
+
+  if (IsZeroIpv6(addr) == TRUE) {
+    if (set->hasZero == TRUE) {
+      return FALSE;
+    }
+    set->hasZero = TRUE;
+    set->zeroTime = blockTime;
+    return TRUE;
+  }
+
+  if (ReserveSet6(set, set->count + 1) != TRUE) {
+    return ERROR;
+  }
+
+  mask = (1U << set->bits) - 1;
+  for (slot = HashIpv6(addr, set->bits); IsZeroIpv6(&set->slots[slot]) == FALSE; slot = (slot + 1) & mask) {
+    if (memcmp(&set->slots[slot], addr, sizeof(struct in6_addr)) == 0) {
+      return FALSE;
+    }
+  }
+
+  set->slots[slot] = *addr;
+  set->times[slot] = blockTime;
+  set->count++;
+
+  return TRUE;
+}
+
+static int ContainsSet4(const struct BlockedSet4 *set, const uint32_t addr) {
+  uint32_t slot, mask;
+
+  if (addr == 0) {
+    return set->hasZero;
+  }
+
+  if (set->slots == NULL) {
+    return FALSE;
+  }
+
+  mask = (1U << set->bits) - 1;
+  for (slot = HashIpv4(addr, set->bits); set->slots[slot] != 0; slot = (slot + 1) & mask) {
+    if (set->slots[slot] == addr) {
+      return TRUE;
     }
   }
 
+  return FALSE;
+}
+
+static int ContainsSet6(const struct BlockedSet6 *set, const struct in6_addr *addr) {
+  uint32_t slot, mask;
+
+  if (IsZeroIpv6(addr) == TRUE) {
+    return set->hasZero;
+  }
+
+  if (set->slots == NULL) {
+    return FALSE;
+  }
+
+  mask = (1U << set->bits) - 1;
+  for (slot = HashIpv6(addr, set->bits); IsZeroIpv6(&set->slots[slot]) == FALSE; slot = (slot + 1) & mask) {
+    if (memcmp(&set->slots[slot], addr, sizeof(struct in6_addr)) == 0) {
+      return TRUE;
+    }
+  }
+
+  return FALSE;
+}
+
+/* Backward shift deletion, the entries following the removed one in the probe sequence are moved back
+ * into the hole unless they would end up before their home slot. No tombstones are needed.
+ * Returns TRUE if the address was removed and FALSE if it wasn't present.
+ */
+static int RemoveSet4(struct BlockedSet4 *set, const uint32_t addr) {
+  uint32_t slot, hole, home, mask;
+
+  if (addr == 0) {
+    if (set->hasZero == FALSE) {
+      return FALSE;
+    }
+    set->hasZero = FALSE;
+    return TRUE;
+  }
+
+  if (set->slots == NULL) {
+    return FALSE;
+  }
+
+  mask = (1U << set->bits) - 1;
+  for (hole = HashIpv4(addr, set->bits); set->slots[hole] != addr; hole = (hole + 1) & mask) {
+    if (set->slots[hole] == 0) {
+      return FALSE;
+    }
+  }
+
+  for (slot = (hole + 1) & mask; set->slots[slot] != 0; slot = (slot + 1) & mask) {
+    home = HashIpv4(set->slots[slot], set->bits);
+    if (((slot - home) & mask) >= ((slot - hole) & mask)) {
+      set->slots[hole] = set->slots[slot];
+      set->times[hole] = set->times[slot];
+      hole = slot;
+    }
+  }
+
+  set->slots[hole] = 0;
+  set->count--;
+
+  return TRUE;
+}
+
+static int RemoveSet6(struct BlockedSet6 *set, const struct in6_addr *addr) {
+  uint32_t slot, hole, home, mask;
+
+  if (IsZeroIpv6(addr) == TRUE) {
+    if (set->hasZero == FALSE) {
+      return FALSE;
+    }
+    set->hasZero = FALSE;
+    return TRUE;
+  }
+
+  if (set->slots == NULL) {
+    return FALSE;
+  }
+
+  mask = (1U << set->bits) - 1;
+  for (hole = HashIpv6(addr, set->bits); memcmp(&set->slots[hole], addr, sizeof(struct in6_addr)) != 0; hole = (hole + 1) & mask) {
+    if (IsZeroIpv6(&set->slots[hole]) == TRUE) {
+      return FALSE;
+    }
+  }
+
+  for (slot = (hole + 1) & mask; IsZeroIpv6(&set->slots[slot]) == FALSE; slot = (slot + 1) & mask) {
+    home = HashIpv6(&set->slots[slot], set->bits);
+    if (((slot - home) & mask) >= ((slot - hole) & mask)) {
+      set->slots[hole] = set->slots[slot];
+      set->times[hole] = set->times[slot];
+      hole = slot;
+    }
+  }
+
+  memset(&set->slots[hole], 0, sizeof(struct in6_addr));
+  set->count--;
+
+  return TRUE;
+}
+
+static int AddBlockedAddress(struct BlockedState *bs, const struct sockaddr *address, const uint64_t blockTime) {
+  const void *addr;
+  int ret = ERROR;
+
+  assert(bs != NULL);
+  assert(address != NULL);
+  assert(address->sa_family == AF_INET || address->sa_family == AF_INET6);
+
+  if (address->sa_family == AF_INET) {
+    addr = &((const struct sockaddr_in *)address)->sin_addr.s_addr;
+    ret = InsertSet4(&bs->ipv4, ((const struct sockaddr_in *)address)->sin_addr.s_addr, blockTime);
+  } else {
+    addr = &((const struct sockaddr_in6 *)address)->sin6_addr;
+    ret = InsertSet6(&bs->ipv6, &((const struct sockaddr_in6 *)address)->sin6_addr, blockTime);
+  }
+
+  if (ret == TRUE && bs->expiry.isInitialized == TRUE) {
+    AddExpiryTimer(bs, address->sa_family, addr, GetMonotonicSeconds() + (uint64_t)configData.blockTimeout);
+  }
+
+  return ret;
+}
+
+static uint64_t GetMonotonicSeconds(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return (uint64_t)ts.tv_sec;
+}
+
+// Block times are stored as wall clock time since they have to survive a restart
+static uint64_t GetRealSeconds(void) {
+  return (uint64_t)time(NULL);
+}
+
+// The part of BLOCK_TIMEOUT left at now, a block time in the future (the clock was set back) gets the full timeout
+static uint64_t GetRemainingTimeout(const uint64_t blockTime, const uint64_t now) {
+  const uint64_t timeout = (uint64_t)configData.blockTimeout;
+
+  if (blockTime > now) {
+    return timeout;
+  } else if (now - blockTime >= timeout) {
+    return 0;
+  }
+
+  return timeout - (now - blockTime);
+}
+
+// expires is in monotonic seconds
+static int AddExpiryTimer(struct BlockedState *bs, const int family, const void *addr, const uint64_t expires) {
+  struct BlockedTimer *timer;
+
+  if ((timer = AddTimer(&bs->expiry, expires)) == NULL) {
+    Error("Unable to add expiry timer, the block will not expire");
+    return ERROR;
+  }
+
+  timer->family = (sa_family_t)family;
+  if (family == AF_INET) {
+    memcpy(&timer->addr.addr4, addr, sizeof(uint32_t));
+  } else {
+    memcpy(&timer->addr.addr6, addr, sizeof(struct in6_addr));
+  }
+
+  return TRUE;
+}
+
+/* Each address loaded from the blocked file gets what remains of its BLOCK_TIMEOUT. Blocks which expired
+ * while portsentry wasn't running fire on the first ExpireBlocked(), which InitSentry() calls before the
+ * blocked hosts are restored so their blocking actions are undone as well.
+ */
+static int InitBlockedExpiry(struct BlockedState *bs) {
+  const uint64_t now = GetRealSeconds(), tick = GetMonotonicSeconds();
+  uint32_t i, zero4 = 0, capacity = bs->ipv4.count + bs->ipv4.hasZero + bs->ipv6.count + bs->ipv6.hasZero;
+  struct in6_addr zero6;
+
+  if (capacity < BLOCKED_TIMERS_MIN) {
+    capacity = BLOCKED_TIMERS_MIN;
+  }
+
+  if (InitTimerWheel(&bs->expiry, sizeof(struct BlockedTimer), capacity, tick) != TRUE) {
+    return ERROR;
+  }
+
+  if (bs->ipv4.hasZero == TRUE && AddExpiryTimer(bs, AF_INET, &zero4, tick + GetRemainingTimeout(bs->ipv4.zeroTime, now)) != TRUE) {
+    return ERROR;
+  }
+
+  for (i = 0; bs->ipv4.slots != NULL && i < (1U << bs->ipv4.bits); i++) {
+    if (bs->ipv4.slots[i] != 0 && AddExpiryTimer(bs, AF_INET, &bs->ipv4.slots[i], tick + GetRemainingTimeout(bs->ipv4.times[i], now)) != TRUE) {
+      return ERROR;
+    }
+  }
+
+  memset(&zero6, 0, sizeof(zero6));
+  if (bs->ipv6.hasZero == TRUE && AddExpiryTimer(bs, AF_INET6, &zero6, tick + GetRemainingTimeout(bs->ipv6.zeroTime, now)) != TRUE) {
+    return ERROR;
+  }
+
+  for (i = 0; bs->ipv6.slots != NULL && i < (1U << bs->ipv6.bits); i++) {
+    if (IsZeroIpv6(&bs->ipv6.slots[i]) == FALSE && AddExpiryTimer(bs, AF_INET6, &bs->ipv6.slots[i], tick + GetRemainingTimeout(bs->ipv6.times[i], now)) != TRUE) {
+      return ERROR;
+    }
+  }
+
+  return TRUE;
+}
+
+static void ExpireAddress(void *data, void *ctx) {
+  const struct BlockedTimer *timer = data;
+  struct ExpireContext *ec = ctx;
+  struct ExpiredBlocks *expired = ec->expired;
+  void *p;
+
+  if (ec->recordsLen + BLOCKED_RECORD_SIZE_MAX > sizeof(ec->records)) {
+    AppendRecords(ec->bs, ec->records, ec->recordsLen, ec->noRecords);
+    ec->recordsLen = 0;
+    ec->noRecords = 0;
+  }
+
+  if (timer->family == AF_INET) {
+    RemoveSet4(&ec->bs->ipv4, timer->addr.addr4);
+    ec->recordsLen += EncodeRecord(ec->records + ec->recordsLen, BLOCKED_RECORD_DEL_IPV4, &timer->addr.addr4, 0);
+  } else {
+    RemoveSet6(&ec->bs->ipv6, &timer->addr.addr6);
+    ec->recordsLen += EncodeRecord(ec->records + ec->recordsLen, BLOCKED_RECORD_DEL_IPV6, &timer->addr.addr6, 0);
+  }
+  ec->noRecords++;
+
+  if (expired->count == expired->size) {
+    if ((p = realloc(expired->targets, (expired->size == 0 ? 64 : (size_t)expired->size * 2) * INET6_ADDRSTRLEN)) == NULL) {
+      Error("Unable to allocate memory for expired blocks, the blocking actions will not be undone");
+      return;
+    }
+    expired->targets = p;
+    expired->size = (expired->size == 0) ? 64 : expired->size * 2;
+  }
+
+  if (inet_ntop(timer->family, &timer->addr, expired->targets[expired->count], INET6_ADDRSTRLEN) != NULL) {
+    expired->count++;
+  }
+}
+
+/* Returns TRUE if the whole file was valid, or if only a torn write at the end of the log was cut off.
+ * FALSE if the file is in an older version or damaged, and ERROR on allocation failure or if the file has
+ * a version this build can't read. isDamaged is set if the sorted sections fail their checksum or are
+ * truncated, in which case nothing is loaded since the log only makes sense on top of them, or if invalid
+ * records are followed by more than a torn write, in which case the sections and the valid records are loaded.
+ * validLen is set to the length of the file up to the last valid record.
+ */
+static int LoadBlockedFile(const uint8_t *buf, const size_t bufLen, struct BlockedState *bs, size_t *validLen, int *isDamaged) {
+  struct BlockedFileHeader header;
+  const uint8_t *sections, *times;
+  const uint64_t now = GetRealSeconds();
+  size_t sectionsLen, logLen;
+  uint32_t i, addr4, noLogged4 = 0, noLogged6 = 0;
+  uint64_t blockTime = now;
+  struct in6_addr addr6;
+  int status = TRUE, ret;
+
+  memcpy(&header, buf, sizeof(header));
+
+  if (header.version < 1 || header.version > BLOCKED_FILE_VERSION || header.headerSize < sizeof(header) || header.headerSize > bufLen) {
+    Error("Unsupported version %u of blocked file: %s", header.version, configData.blockedFile);
+    return ERROR;
+  }
+
+  sections = buf + header.headerSize;
+  sectionsLen = (size_t)header.noIpv4 * sizeof(uint32_t) + (size_t)header.noIpv6 * sizeof(struct in6_addr);
+  times = sections + sectionsLen;
+  if (header.version >= 3) {
+    sectionsLen += ((size_t)header.noIpv4 + header.noIpv6) * sizeof(uint64_t);
+  }
+
+  if (bufLen - header.headerSize < sectionsLen) {
+    Error("Blocked file: %s is truncated, unable to load %u blocked addresses", configData.blockedFile, header.noIpv4 + header.noIpv6);
+    *isDamaged = TRUE;
+    return FALSE;
+  }
+
+  if (Crc32(0, sections, sectionsLen) != header.checksum) {
+    Error("Checksum mismatch in blocked file: %s, unable to load %u blocked addresses", configData.blockedFile, header.noIpv4 + header.noIpv6);
+    *isDamaged = TRUE;
+    return FALSE;
+  }
+
+  logLen = bufLen - header.headerSize - sectionsLen;
+
+  // The log is counted first so the sets only need to be sized once
+  ParseLogRecords(sections + sectionsLen, logLen, header.version, now, NULL, &noLogged4, &noLogged6, validLen);
+
+  // Records are appended at most BLOCKED_LOG_BUFFER bytes at a time, so only that much can be torn by a crash
+  if (logLen - *validLen > BLOCKED_LOG_BUFFER) {
+    Error("Invalid record in the log of blocked file: %s, %zu bytes after it can't be loaded", configData.blockedFile, logLen - *validLen);
+    *isDamaged = TRUE;
+    status = FALSE;
+  } else if (logLen > *validLen) {
+    Log("Discarding %zu bytes of torn records at the end of blocked file: %s", logLen - *validLen, configData.blockedFile);
+  }
+
+  if (ReserveSet4(&bs->ipv4, header.noIpv4 + noLogged4) != TRUE || ReserveSet6(&bs->ipv6, header.noIpv6 + noLogged6) != TRUE) {
+    return ERROR;
+  }
+
+  // The slots of the sorted addresses are scattered over the set, fetch them ahead of the inserts
+  for (i = 0; i < header.noIpv4; i++) {
+    if (i + BLOCKED_PREFETCH_DISTANCE < header.noIpv4) {
+      memcpy(&addr4, sections + (size_t)(i + BLOCKED_PREFETCH_DISTANCE) * sizeof(uint32_t), sizeof(addr4));
+      __builtin_prefetch(&bs->ipv4.slots[HashIpv4(addr4, bs->ipv4.bits)], 1);
+    }
+
+    memcpy(&addr4, sections + (size_t)i * sizeof(uint32_t), sizeof(addr4));
+    if (header.version >= 3) {
+      memcpy(&blockTime, times + (size_t)i * sizeof(uint64_t), sizeof(blockTime));
+    }
+    if (InsertSet4(&bs->ipv4, addr4, blockTime) == ERROR) {
+      return ERROR;
+    }
+  }
+
+  for (i = 0; i < header.noIpv6; i++) {
+    if (i + BLOCKED_PREFETCH_DISTANCE < header.noIpv6) {
+      memcpy(&addr6, sections + (size_t)header.noIpv4 * sizeof(uint32_t) + (size_t)(i + BLOCKED_PREFETCH_DISTANCE) * sizeof(struct in6_addr), sizeof(addr6));
+      __builtin_prefetch(&bs->ipv6.slots[HashIpv6(&addr6, bs->ipv6.bits)], 1);
+    }
+
+    memcpy(&addr6, sections + (size_t)header.noIpv4 * sizeof(uint32_t) + (size_t)i * sizeof(struct in6_addr), sizeof(addr6));
+    if (header.version >= 3) {
+      memcpy(&blockTime, times + ((size_t)header.noIpv4 + i) * sizeof(uint64_t), sizeof(blockTime));
+    }
+    if (InsertSet6(&bs->ipv6, &addr6, blockTime) == ERROR) {
+      return ERROR;
+    }
+  }
+
+  bs->log.noSnapshot = header.noIpv4 + header.noIpv6;
+
+  if ((ret = ParseLogRecords(sections + sectionsLen, logLen, header.version, now, bs, &noLogged4, &noLogged6, validLen)) == ERROR) {
+    return ERROR;
+  }
+
+  bs->log.noRecords = noLogged4 + noLogged6;
+  *validLen += header.headerSize + sectionsLen;
+
+  if (header.version < BLOCKED_FILE_VERSION) {
+    Log("Converting blocked file: %s to version %d", configData.blockedFile, BLOCKED_FILE_VERSION);
+    return FALSE;
+  }
+
+  return status;
+}
+
+// Returns FALSE on success so the file is rewritten in the current format, otherwise as LoadBlockedFile()
+static int LoadLegacyBlockedFile(const uint8_t *buf, const size_t bufLen, struct BlockedState *bs, int *isDamaged) {
+  const uint64_t now = GetRealSeconds();
+  uint32_t noIpv4 = 0, noIpv6 = 0;
+  int ret;
+
+  // First pass only counts the records, the second pass inserts them into the presized sets
+  ParseLegacyBuffer(buf, bufLen, now, NULL, &noIpv4, &noIpv6);
+
+  if (ReserveSet4(&bs->ipv4, noIpv4) != TRUE || ReserveSet6(&bs->ipv6, noIpv6) != TRUE) {
+    return ERROR;
+  }
+
+  if ((ret = ParseLegacyBuffer(buf, bufLen, now, bs, &noIpv4, &noIpv6)) == ERROR) {
+    return ERROR;
+  } else if (ret == FALSE) {
+    *isDamaged = TRUE;
+  }
+
+  Log("Converting blocked file: %s to version %d", configData.blockedFile, BLOCKED_FILE_VERSION);
+
+  return FALSE;
+}
+
+/* Replay the log following the sorted sections. If bs is NULL the records are only counted.
+ * validLen is set to the length of the valid records, parsing stops at the first torn or invalid record.
+ * Added addresses without a block time (before version 3) are given loadTime.
+ * The records must only be replayed on top of sorted sections which passed their checksum.
+ * Returns TRUE unless an allocation fails.
+ */
+static int ParseLogRecords(const uint8_t *buf, const size_t bufLen, const uint32_t version, const uint64_t loadTime, struct BlockedState *bs, uint32_t *noIpv4, uint32_t *noIpv6, size_t *validLen) {
+  size_t offset = 0, recordSize, addrLen, timeLen;
+  uint32_t crc, addr4;
+  uint64_t blockTime;
+  struct in6_addr addr6;
+  uint8_t type;
+  int ret;
+
+  *noIpv4 = 0;
+  *noIpv6 = 0;
+
+  while (offset < bufLen) {
+    type = buf[offset];
+    if ((recordSize = GetRecordSize(version, type, &addrLen, &timeLen)) == 0 || bufLen - offset < recordSize) {
+      break;
+    }
+
+    if (version > 1) {
+      memcpy(&crc, buf + offset + 1 + addrLen + timeLen, sizeof(crc));
+      if (Crc32(0, buf + offset, 1 + addrLen + timeLen) != crc) {
+        break;
+      }
+    }
+
+    if (bs != NULL) {
+      blockTime = loadTime;
+      if (timeLen > 0) {
+        memcpy(&blockTime, buf + offset + 1 + addrLen, sizeof(blockTime));
+      }
+
+      if (addrLen == sizeof(uint32_t)) {
+        memcpy(&addr4, buf + offset + 1, sizeof(addr4));
+        ret = (type == BLOCKED_RECORD_ADD_IPV4) ? InsertSet4(&bs->ipv4, addr4, blockTime) : RemoveSet4(&bs->ipv4, addr4);
+      } else {
+        memcpy(&addr6, buf + offset + 1, sizeof(addr6));
+        ret = (type == BLOCKED_RECORD_ADD_IPV6) ? InsertSet6(&bs->ipv6, &addr6, blockTime) : RemoveSet6(&bs->ipv6, &addr6);
+      }
+
+      if (ret == ERROR) {
+        return ERROR;
+      }
+    }
+
+    if (addrLen == sizeof(uint32_t)) {
+      (*noIpv4)++;
+    } else {
+      (*noIpv6)++;
+    }
+    offset += recordSize;
+  }
+
+  *validLen = offset;
+
+  return TRUE;
+}
+
+/* Returns the size of a log record of type in a file of version, 0 if there is no such record.
+ * addrLen and timeLen are set to the length of the address and of the block time in the record.
+ */
+static size_t GetRecordSize(const uint32_t version, const uint8_t type, size_t *addrLen, size_t *timeLen) {
+  if ((type & 0x7F) == BLOCKED_RECORD_ADD_IPV4) {
+    *addrLen = sizeof(uint32_t);
+  } else if ((type & 0x7F) == BLOCKED_RECORD_ADD_IPV6) {
+    *addrLen = sizeof(struct in6_addr);
+  } else {
+    return 0;
+  }
+
+  // Version 1 only has add records, without checksum
+  if (version == 1) {
+    *timeLen = 0;
+    return ((type & 0x80) == 0) ? 1 + *addrLen : 0;
+  }
+
+  *timeLen = (version >= 3 && (type & 0x80) == 0) ? sizeof(uint64_t) : 0;
+
+  return 1 + *addrLen + *timeLen + sizeof(uint32_t);
+}
+
+/* Walk the records of a legacy blocked file. If bs is NULL the records are only counted, otherwise the addresses
+ * are inserted with loadTime as their block time.
+ * Returns TRUE if all records were read, FALSE on a truncated or unknown record (the records before it are kept)
+ * and ERROR if an allocation fails.
+ */
+static int ParseLegacyBuffer(const uint8_t *buf, const size_t bufLen, const uint64_t loadTime, struct BlockedState *bs, uint32_t *noIpv4, uint32_t *noIpv6) {
+  size_t offset = 0;
+  sa_family_t family;
+  uint32_t addr4;
+  struct in6_addr addr6;
+
+  *noIpv4 = 0;
+  *noIpv6 = 0;
+
+  while (offset < bufLen) {
+    if (bufLen - offset < sizeof(family)) {
+      if (bs != NULL)
+        Error("Unable to read address family from blocked file: %s", configData.blockedFile);
+      return FALSE;
+    }
+    memcpy(&family, buf + offset, sizeof(family));
+
+    if (family == AF_INET) {
+      if (bufLen - offset < LEGACY_RECORD_SIZE_IPV4) {
+        if (bs != NULL)
+          Error("Unable to read address from blocked file: %s", configData.blockedFile);
+        return FALSE;
+      }
+
+      if (bs != NULL) {
+        memcpy(&addr4, buf + offset + sizeof(family), sizeof(addr4));
+        if (InsertSet4(&bs->ipv4, addr4, loadTime) == ERROR) {
+          return ERROR;
+        }
+      }
+
+      (*noIpv4)++;
+      offset += LEGACY_RECORD_SIZE_IPV4;
+    } else if (family == AF_INET6) {
+      if (bufLen - offset < LEGACY_RECORD_SIZE_IPV6) {
+        if (bs != NULL)
+          Error("Unable to read address from blocked file: %s", configData.blockedFile);
+        return FALSE;
+      }
+
+      if (bs != NULL) {
+        memcpy(&addr6, buf + offset + sizeof(family), sizeof(addr6));
+        if (InsertSet6(&bs->ipv6, &addr6, loadTime) == ERROR) {
+          return ERROR;
+        }
+      }
+
+      (*noIpv6)++;
+      offset += LEGACY_RECORD_SIZE_IPV6;
+    } else {
+      if (bs != NULL)
+        Error("Unsupported address family: %d", family);
+      return FALSE;
+    }
+  }
+
+  return TRUE;
+}
+
+/* Rename a damaged blocked file to <file>.corrupt-<time> so it's kept for recovery.
+ * Returns TRUE if the file was moved, ERROR otherwise.
+ */
+static int MoveDamagedBlockedFile(void) {
+  char corruptFile[PATH_MAX];
+  char err[ERRNOMAXBUF];
+
+  if (snprintf(corruptFile, sizeof(corruptFile), "%s.corrupt-%ld", configData.blockedFile, (long)time(NULL)) >= (int)sizeof(corruptFile)) {
+    Error("Blocked file path too long: %s", configData.blockedFile);
+    return ERROR;
+  }
+
+  if (rename(configData.blockedFile, corruptFile) == -1) {
+    Error("Unable to move damaged blocked file: %s to %s: %s", configData.blockedFile, corruptFile, ErrnoString(err, sizeof(err)));
+    return ERROR;
+  }
+
+  SyncParentDirectory(corruptFile);
+
+  Error("Blocked file: %s is damaged and has been moved to %s, only the addresses which could be verified are loaded", configData.blockedFile, corruptFile);
+
+  return TRUE;
+}
+
+static int SyncParentDirectory(const char *path) {
+  char dir[PATH_MAX];
+  char err[ERRNOMAXBUF];
+  const char *slash;
+  int fd, status = TRUE;
+
+  if ((slash = strrchr(path, '/')) == NULL) {
+    SafeStrncpy(dir, ".", sizeof(dir));
+  } else if (slash == path) {
+    SafeStrncpy(dir, "/", sizeof(dir));
+  } else {
+    snprintf(dir, sizeof(dir), "%.*s", (int)(slash - path), path);
+  }
+
+  if ((fd = open(dir, O_RDONLY | O_DIRECTORY)) == -1) {
+    Error("Unable to open directory: %s: %s", dir, ErrnoString(err, sizeof(err)));
+    return ERROR;
+  }
+
+  if (fsync(fd) == -1) {
+    Error("Unable to flush directory: %s: %s", dir, ErrnoString(err, sizeof(err)));
+    status = ERROR;
+  }
+
+  close(fd);
+
+  return status;
+}
+
+static void InitBlockedFileHeader(struct BlockedFileHeader *header, const uint32_t noIpv4, const uint32_t noIpv6, const uint32_t checksum) {
+  memset(header, 0, sizeof(struct BlockedFileHeader));
+  memcpy(header->magic, BLOCKED_FILE_MAGIC, sizeof(BLOCKED_FILE_MAGIC));
+  header->version = BLOCKED_FILE_VERSION;
+  header->headerSize = sizeof(struct BlockedFileHeader);
+  header->noIpv4 = noIpv4;
+  header->noIpv6 = noIpv6;
+  header->checksum = checksum;
+}
+
+// Sort in address order, the addresses are in network byte order
+static int CompareIpv4(const void *a, const void *b) {
+  uint32_t x = ntohl(*(const uint32_t *)a), y = ntohl(*(const uint32_t *)b);
+
+  return (x > y) - (x < y);
+}
+
+static int CompareIpv6(const void *a, const void *b) {
+  return memcmp(a, b, sizeof(struct in6_addr));
+}
+
+// Returns the size of the record written to buf, blockTime is only written for added addresses
+static size_t EncodeRecord(uint8_t *buf, const uint8_t type, const void *addr, const uint64_t blockTime) {
+  size_t addrLen, timeLen, recordSize = GetRecordSize(BLOCKED_FILE_VERSION, type, &addrLen, &timeLen);
+  uint32_t crc;
+
+  buf[0] = type;
+  memcpy(buf + 1, addr, addrLen);
+  if (timeLen > 0) {
+    memcpy(buf + 1 + addrLen, &blockTime, sizeof(blockTime));
+  }
+  crc = Crc32(0, buf, 1 + addrLen + timeLen);
+  memcpy(buf + 1 + addrLen + timeLen, &crc, sizeof(crc));
+
+  return recordSize;
+}
+
+// A new file gets its header with the first records
+static int AppendRecords(struct BlockedState *bs, const uint8_t *buf, const size_t len, const uint32_t noRecords) {
+  struct BlockedFileHeader header;
+
+  if (bs->log.fd == -1) {
+    return FALSE;
+  }
+
+  if (bs->log.hasHeader == FALSE) {
+    InitBlockedFileHeader(&header, 0, 0, Crc32(0, NULL, 0));
+    if (WriteFully(bs->log.fd, &header, sizeof(header)) != TRUE) {
+      return ERROR;
+    }
+    bs->log.hasHeader = TRUE;
+  }
+
+  if (WriteFully(bs->log.fd, buf, len) != TRUE) {
+    return ERROR;
+  }
+
+  bs->log.noRecords += noRecords;
+  bs->log.noUnsynced += noRecords;
+
+  return TRUE;
+}
+
+static int WriteFully(const int fd, const void *buf, const size_t len) {
+  size_t written = 0;
+  ssize_t ret;
+  char err[ERRNOMAXBUF];
+
+  while (written < len) {
+    if ((ret = write(fd, (const uint8_t *)buf + written, len - written)) == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      Error("Unable to write to blocked file: %s: %s", configData.blockedFile, ErrnoString(err, sizeof(err)));
+      return ERROR;
+    }
+    written += (size_t)ret;
+  }
+
+  return TRUE;
+}
+
+/* Open the blocked file for appending. A validLen shorter than the file cuts off torn records,
+ * -1 keeps the file as it is.
+ */
+static int OpenBlockedLog(struct BlockedState *bs, const off_t validLen) {
+  struct stat st;
+  char err[ERRNOMAXBUF];
+
+  if ((bs->log.fd = open(configData.blockedFile, O_WRONLY | O_APPEND)) == -1) {
+    Error("Unable to open blocked file: %s for writing: %s", configData.blockedFile, ErrnoString(err, sizeof(err)));
+    return ERROR;
+  }
+
+  if (fstat(bs->log.fd, &st) == -1) {
+    Error("Unable to stat blocked file: %s: %s", configData.blockedFile, ErrnoString(err, sizeof(err)));
+    close(bs->log.fd);
+    bs->log.fd = -1;
+    return ERROR;
+  }
+
+  if (validLen >= 0 && st.st_size > validLen) {
+    if (ftruncate(bs->log.fd, validLen) == -1) {
+      Error("Unable to truncate blocked file: %s: %s", configData.blockedFile, ErrnoString(err, sizeof(err)));
+    } else {
+      st.st_size = validLen;
+    }
+  }
+
+  bs->log.hasHeader = (st.st_size > 0) ? TRUE : FALSE;
+  bs->log.noUnsynced = 0;
+  bs->log.lastSync = GetMonotonicSeconds();
+
+  return TRUE;
+}
+
+static int SyncBlockedFile(struct BlockedState *bs) {
+  char err[ERRNOMAXBUF];
+
+  if (bs->log.noUnsynced == 0) {
+    return TRUE;
+  }
+
+  bs->log.lastSync = GetMonotonicSeconds();
+  bs->log.noUnsynced = 0;
+
+  if (fdatasync(bs->log.fd) == -1) {
+    Error("Unable to flush blocked file: %s: %s", configData.blockedFile, ErrnoString(err, sizeof(err)));
+    return ERROR;
+  }
+
   return TRUE;
 }
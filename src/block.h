@@ -8,18 +8,64 @@
 #include <sys/socket.h>
 #include <netinet/in.h>
 
-struct BlockedNode {
-  struct sockaddr_in6 address;  // Will be casred to sockaddr_in or sockaddr_in6 depending on address family
-  struct BlockedNode *next;
+#include "timer_wheel.h"
+
+/* Open addressing hash sets (linear probing) holding the blocked addresses, one per address family.
+ * An all-zero slot marks an empty slot, so the all-zero address (0.0.0.0 / ::) is tracked with a separate flag.
+ */
+struct BlockedSet4 {
+  uint32_t *slots;  // IPv4 addresses in network byte order
+  uint64_t *times;  // When the address in the same slot was blocked, seconds since the epoch
+  uint32_t count;
+  uint8_t bits;  // capacity is 1 << bits
+  uint8_t hasZero;
+  uint64_t zeroTime;
+};
+
+struct BlockedSet6 {
+  struct in6_addr *slots;
+  uint64_t *times;
+  uint32_t count;
+  uint8_t bits;  // capacity is 1 << bits
+  uint8_t hasZero;
+  uint64_t zeroTime;
 };
 
+// The blocked file, kept open to append changes to its log
+struct BlockedLog {
+  int fd;
+  uint8_t hasHeader;
+  uint32_t noSnapshot;  // Addresses in the sorted sections
+  uint32_t noRecords;   // Records in the log
+  uint32_t noUnsynced;  // Records not yet flushed to disk
+  uint64_t lastSync;    // Seconds of CLOCK_MONOTONIC
+};
+
+/* With BLOCK_TIMEOUT set every blocked address has a timer in expiry, ticks are seconds of CLOCK_MONOTONIC.
+ * The block times are kept in the blocked file, so a timer is restarted with what remains of the timeout.
+ */
 struct BlockedState {
   uint8_t isInitialized;
-  struct BlockedNode *head;
+  struct BlockedSet4 ipv4;
+  struct BlockedSet6 ipv6;
+  struct TimerWheel expiry;
+  struct BlockedLog log;
+};
+
+// Addresses removed by ExpireBlocked(), the buffer is reused between calls
+struct ExpiredBlocks {
+  char (*targets)[INET6_ADDRSTRLEN];
+  uint32_t count;
+  uint32_t size;
 };
 
 int WriteBlockedFile(const struct sockaddr *address, struct BlockedState *bs);
 int IsBlocked(const struct sockaddr *address, const struct BlockedState *bs);
+void PrefetchBlocked(const struct sockaddr *address, const struct BlockedState *bs);
 int BlockedStateInit(struct BlockedState *bs);
 void BlockedStateFree(struct BlockedState *bs);
-int RewriteBlockedFile(const struct BlockedState *bs);
+int RewriteBlockedFile(struct BlockedState *bs);
+int MaintainBlockedFile(struct BlockedState *bs);
+int ExpireBlocked(struct BlockedState *bs, struct ExpiredBlocks *expired);
+void FreeExpiredBlocks(struct ExpiredBlocks *expired);
+int ForEachBlockedAddress(const struct BlockedState *bs, int (*callback)(const int family, const void *addr, void *ctx), void *ctx);
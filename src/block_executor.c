@@ -0,0 +1,360 @@
+// SPDX-FileCopyrightText: 2024 Marcus Hufvudsson <mh@protohuf.com>
+//
+// SPDX-License-Identifier: CPL-1.0
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <assert.h>
+#include <pthread.h>
+#include <signal.h>
+#include <time.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "portsentry.h"
+#include "config_data.h"
+#include "block_executor.h"
+#include "block.h"
+#include "io.h"
+#include "util.h"
+
+#define BLOCK_QUEUE_SIZE 64
+
+struct BlockJob {
+  char target[INET6_ADDRSTRLEN];
+  struct sockaddr_storage address;
+  int port;
+  int protocol;
+  struct timespec queuedAt;
+};
+
+/* The blocking actions (KILL_ROUTE, KILL_HOSTS_DENY, KILL_RUN_CMD) are run by a worker thread so
+ * the packet loop doesn't stall while the commands run. Jobs are handed over in a ring, noQueued and
+ * noCompleted only ever increase and the jobs between them are either waiting or being run.
+ * All fields below, as well as the BlockedState, are protected by lock once the worker is started.
+ */
+static struct BlockJob *queue = NULL;
+static uint32_t queueSize = 0;
+static uint32_t noQueued = 0;
+static uint32_t noCompleted = 0;
+static uint32_t noDropped = 0;
+static uint8_t isStopping = FALSE;
+static uint8_t isInitialized = FALSE;
+static struct BlockedState *blockedState = NULL;
+static pthread_t worker;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t jobQueued;
+
+// Only used by the worker
+static struct BlockTarget *batchTargets = NULL;
+static int *batchStatuses = NULL;
+static struct ExpiredBlocks expired = {0};
+
+static void *BlockWorker(void *arg);
+static void WaitForJob(void);
+static void WaitForBatch(void);
+static void RunExpiry(void);
+static void RunJobs(const uint32_t first, const uint32_t count, int *statuses);
+static int IsSameAddress(const struct sockaddr *a, const struct sockaddr *b);
+
+int InitBlockExecutor(struct BlockedState *bs) {
+  sigset_t allSignals, oldSignals;
+  pthread_condattr_t condAttr;
+  int ret;
+
+  assert(bs != NULL);
+
+  if (isInitialized == TRUE) {
+    return TRUE;
+  }
+
+  // Leave room to queue the next batch while one is being run
+  queueSize = (uint32_t)configData.blockBatchSize * 2;
+  if (queueSize < BLOCK_QUEUE_SIZE) {
+    queueSize = BLOCK_QUEUE_SIZE;
+  }
+
+  if ((queue = calloc(queueSize, sizeof(struct BlockJob))) == NULL ||
+      (batchTargets = calloc(configData.blockBatchSize, sizeof(struct BlockTarget))) == NULL ||
+      (batchStatuses = calloc(configData.blockBatchSize, sizeof(int))) == NULL) {
+    Error("Unable to allocate memory for block executor");
+    goto error;
+  }
+
+  // The batch window is measured on the monotonic clock
+  pthread_condattr_init(&condAttr);
+  pthread_condattr_setclock(&condAttr, CLOCK_MONOTONIC);
+  pthread_cond_init(&jobQueued, &condAttr);
+  pthread_condattr_destroy(&condAttr);
+
+  blockedState = bs;
+  noQueued = 0;
+  noCompleted = 0;
+  noDropped = 0;
+  isStopping = FALSE;
+
+  // Signals are handled by the main thread, so that they interrupt the poll() in the packet loop
+  sigfillset(&allSignals);
+  pthread_sigmask(SIG_BLOCK, &allSignals, &oldSignals);
+  ret = pthread_create(&worker, NULL, BlockWorker, NULL);
+  pthread_sigmask(SIG_SETMASK, &oldSignals, NULL);
+
+  if (ret != 0) {
+    Error("Unable to start block executor thread: %s", strerror(ret));
+    pthread_cond_destroy(&jobQueued);
+    goto error;
+  }
+
+  isInitialized = TRUE;
+
+  return TRUE;
+
+error:
+  free(queue);
+  free(batchTargets);
+  free(batchStatuses);
+  queue = NULL;
+  batchTargets = NULL;
+  batchStatuses = NULL;
+  return ERROR;
+}
+
+// Blocks already queued are run before the worker exits
+void FreeBlockExecutor(void) {
+  if (isInitialized == FALSE) {
+    return;
+  }
+
+  pthread_mutex_lock(&lock);
+  isStopping = TRUE;
+  pthread_cond_signal(&jobQueued);
+  pthread_mutex_unlock(&lock);
+
+  pthread_join(worker, NULL);
+  pthread_cond_destroy(&jobQueued);
+
+  free(queue);
+  free(batchTargets);
+  free(batchStatuses);
+  queue = NULL;
+  batchTargets = NULL;
+  batchStatuses = NULL;
+  FreeExpiredBlocks(&expired);
+
+  blockedState = NULL;
+  isInitialized = FALSE;
+}
+
+// Returns TRUE if the address is already blocked, BLOCK_QUEUED if it's waiting to be blocked and FALSE otherwise
+int IsBlockedOrQueued(const struct sockaddr *address) {
+  uint32_t i;
+  int status;
+
+  assert(isInitialized == TRUE);
+
+  pthread_mutex_lock(&lock);
+
+  if ((status = IsBlocked(address, blockedState)) == FALSE) {
+    for (i = noCompleted; i != noQueued; i++) {
+      if (IsSameAddress((struct sockaddr *)&queue[i % queueSize].address, address) == TRUE) {
+        status = BLOCK_QUEUED;
+        break;
+      }
+    }
+  }
+
+  pthread_mutex_unlock(&lock);
+
+  return status;
+}
+
+/* Returns TRUE if the block was queued. If the queue is full the block is dropped rather than stalling the
+ * packet loop, FALSE is returned and the worker reports the number of dropped blocks.
+ */
+int QueueBlock(const char *target, const struct sockaddr *address, const int port, const int protocol) {
+  struct BlockJob *job;
+
+  assert(isInitialized == TRUE);
+  assert(address->sa_family == AF_INET || address->sa_family == AF_INET6);
+
+  pthread_mutex_lock(&lock);
+
+  if (noQueued - noCompleted == queueSize) {
+    noDropped++;
+    pthread_mutex_unlock(&lock);
+    return FALSE;
+  }
+
+  job = &queue[noQueued % queueSize];
+  snprintf(job->target, sizeof(job->target), "%s", target);
+  memset(&job->address, 0, sizeof(job->address));
+  memcpy(&job->address, address, (address->sa_family == AF_INET) ? sizeof(struct sockaddr_in) : sizeof(struct sockaddr_in6));
+  job->port = port;
+  job->protocol = protocol;
+  clock_gettime(CLOCK_MONOTONIC, &job->queuedAt);
+
+  noQueued++;
+  pthread_cond_signal(&jobQueued);
+
+  pthread_mutex_unlock(&lock);
+
+  return TRUE;
+}
+
+/* The jobs from noCompleted aren't reused by QueueBlock() until noCompleted is increased,
+ * so they are safe to read without holding the lock while the blocking actions run.
+ * Expired blocks are also undone by the worker, so all blocking actions are run by the same thread.
+ */
+static void *BlockWorker(void *arg) {
+  uint32_t i, count, dropped;
+
+  (void)arg;
+
+  pthread_mutex_lock(&lock);
+
+  while (TRUE) {
+    WaitForJob();
+
+    // Reported at most once per wakeup, the worker is slow to wake up while the queue is full
+    if ((dropped = noDropped) > 0) {
+      noDropped = 0;
+      pthread_mutex_unlock(&lock);
+      Error("Block queue full, dropped %u blocks. The hosts are blocked on their next detected packet", dropped);
+      pthread_mutex_lock(&lock);
+    }
+
+    if (configData.blockTimeout > 0) {
+      RunExpiry();
+    }
+
+    // Only the worker changes the blocked state, so the file can be flushed and compacted without the lock
+    pthread_mutex_unlock(&lock);
+    MaintainBlockedFile(blockedState);
+    pthread_mutex_lock(&lock);
+
+    if (noCompleted == noQueued) {
+      if (isStopping == TRUE) {
+        break;
+      }
+      continue;
+    }
+
+    if (configData.blockBatchSize > 1) {
+      WaitForBatch();
+    }
+
+    count = noQueued - noCompleted;
+    if (count > (uint32_t)configData.blockBatchSize) {
+      count = (uint32_t)configData.blockBatchSize;
+    }
+
+    pthread_mutex_unlock(&lock);
+
+    RunJobs(noCompleted, count, batchStatuses);
+
+    pthread_mutex_lock(&lock);
+
+    for (i = 0; i < count; i++) {
+      if (batchStatuses[i] != TRUE) {
+        Error("attackalert: Error during target dispose %s!", queue[(noCompleted + i) % queueSize].target);
+      } else {
+        WriteBlockedFile((struct sockaddr *)&queue[(noCompleted + i) % queueSize].address, blockedState);
+      }
+    }
+
+    noCompleted += count;
+  }
+
+  pthread_mutex_unlock(&lock);
+
+  return NULL;
+}
+
+/* Called with the lock held. With BLOCK_TIMEOUT set, or blocks not yet flushed to the blocked file,
+ * wake up at least once a second to expire blocks and flush the file.
+ */
+static void WaitForJob(void) {
+  struct timespec deadline;
+
+  if (configData.blockTimeout == 0 && blockedState->log.noUnsynced == 0) {
+    while (noCompleted == noQueued && isStopping == FALSE) {
+      pthread_cond_wait(&jobQueued, &lock);
+    }
+    return;
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &deadline);
+  deadline.tv_sec++;
+
+  while (noCompleted == noQueued && isStopping == FALSE) {
+    if (pthread_cond_timedwait(&jobQueued, &lock, &deadline) == ETIMEDOUT) {
+      break;
+    }
+  }
+}
+
+/* Called with the lock held. The expired addresses are removed from the blocked state under the lock,
+ * the lock is released while the blocking actions are undone.
+ */
+static void RunExpiry(void) {
+  if (ExpireBlocked(blockedState, &expired) == 0) {
+    return;
+  }
+
+  pthread_mutex_unlock(&lock);
+  UndisposeTargets(&expired);
+  pthread_mutex_lock(&lock);
+}
+
+// Called with the lock held. Wait for a full batch or until the oldest job has waited BLOCK_BATCH_WINDOW ms
+static void WaitForBatch(void) {
+  struct timespec deadline = queue[noCompleted % queueSize].queuedAt;
+
+  deadline.tv_sec += configData.blockBatchWindow / 1000;
+  deadline.tv_nsec += (long)(configData.blockBatchWindow % 1000) * 1000000;
+  if (deadline.tv_nsec >= 1000000000) {
+    deadline.tv_sec++;
+    deadline.tv_nsec -= 1000000000;
+  }
+
+  while (noQueued - noCompleted < (uint32_t)configData.blockBatchSize && isStopping == FALSE) {
+    if (pthread_cond_timedwait(&jobQueued, &lock, &deadline) == ETIMEDOUT) {
+      break;
+    }
+  }
+}
+
+static void RunJobs(const uint32_t first, const uint32_t count, int *statuses) {
+  struct BlockJob *job;
+  uint32_t i;
+
+  if (configData.blockBatchSize == 1) {
+    job = &queue[first % queueSize];
+    statuses[0] = (DisposeTarget(job->target, job->port, job->protocol) == TRUE) ? TRUE : FALSE;
+    return;
+  }
+
+  for (i = 0; i < count; i++) {
+    job = &queue[(first + i) % queueSize];
+    batchTargets[i].target = job->target;
+    batchTargets[i].port = job->port;
+    batchTargets[i].protocol = job->protocol;
+  }
+
+  Debug("Running block batch of %u hosts", count);
+  DisposeTargets(batchTargets, (int)count, statuses);
+}
+
+static int IsSameAddress(const struct sockaddr *a, const struct sockaddr *b) {
+  if (a->sa_family != b->sa_family) {
+    return FALSE;
+  }
+
+  if (a->sa_family == AF_INET) {
+    return (((const struct sockaddr_in *)a)->sin_addr.s_addr == ((const struct sockaddr_in *)b)->sin_addr.s_addr) ? TRUE : FALSE;
+  }
+
+  return (memcmp(&((const struct sockaddr_in6 *)a)->sin6_addr, &((const struct sockaddr_in6 *)b)->sin6_addr, sizeof(struct in6_addr)) == 0) ? TRUE : FALSE;
+}
@@ -0,0 +1,16 @@
+// SPDX-FileCopyrightText: 2024 Marcus Hufvudsson <mh@protohuf.com>
+//
+// SPDX-License-Identifier: CPL-1.0
+
+#pragma once
+
+#include <sys/socket.h>
+
+#include "block.h"
+
+#define BLOCK_QUEUED 2  // Returned by IsBlockedOrQueued() for a host waiting to be blocked
+
+int InitBlockExecutor(struct BlockedState *bs);
+void FreeBlockExecutor(void);
+int IsBlockedOrQueued(const struct sockaddr *address);
+int QueueBlock(const char *target, const struct sockaddr *address, const int port, const int protocol);
@@ -17,10 +17,17 @@ struct ConfigData configData;
 
 static int IsInterfacePresent(const struct ConfigData *cd, const char *interface);
 static char *GetSentryMethodString(const enum SentryMethod sentryMethod);
+static char *GetHistoryFormatString(const enum HistoryFormat historyFormat);
 
 void ResetConfigData(struct ConfigData *cd) {
   memset(cd, 0, sizeof(struct ConfigData));
 
+  cd->rawRingTimeout = DEFAULT_RAW_RING_TIMEOUT;
+  cd->listenCacheRefresh = DEFAULT_LISTEN_CACHE_REFRESH;
+  cd->scanStateSize = DEFAULT_SCAN_STATE_SIZE;
+  cd->blockBatchSize = DEFAULT_BLOCK_BATCH_SIZE;
+  snprintf(cd->nftFamily, sizeof(cd->nftFamily), "%s", DEFAULT_NFT_FAMILY);
+
 #ifndef USE_PCAP
   cd->sentryMethod = SENTRY_METHOD_RAW;
 #endif
@@ -56,6 +63,12 @@ void PrintConfigData(const struct ConfigData cd) {
   printf("debug: killRoute: %s\n", cd.killRoute);
   printf("debug: killHostsDeny: %s\n", cd.killHostsDeny);
   printf("debug: killRunCmd: %s\n", cd.killRunCmd);
+  printf("debug: unblockCmd: %s\n", cd.unblockCmd);
+  printf("debug: nftFamily: %s\n", cd.nftFamily);
+  printf("debug: nftTable: %s\n", cd.nftTable);
+  printf("debug: nftSetIpv4: %s\n", cd.nftSetIpv4);
+  printf("debug: nftSetIpv6: %s\n", cd.nftSetIpv6);
+  printf("debug: nftRestore: %d\n", cd.nftRestore);
 
   if (GetNoInterfaces(&cd) > 0) {
     i = 0;
@@ -94,13 +107,26 @@ void PrintConfigData(const struct ConfigData cd) {
   printf("debug: configFile: %s\n", cd.configFile);
   printf("debug: blockedFile: %s\n", cd.blockedFile);
   printf("debug: historyFile: %s\n", cd.historyFile);
+  printf("debug: historyFormat: %s\n", GetHistoryFormatString(cd.historyFormat));
+  printf("debug: coarseTimestamps: %d\n", cd.coarseTimestamps);
   printf("debug: ignoreFile: %s\n", cd.ignoreFile);
 
   printf("debug: blockTCP: %d\n", cd.blockTCP);
   printf("debug: blockUDP: %d\n", cd.blockUDP);
   printf("debug: runCmdFirst: %d\n", cd.runCmdFirst);
+  printf("debug: blockAsync: %d\n", cd.blockAsync);
+  printf("debug: blockBatchSize: %d\n", cd.blockBatchSize);
+  printf("debug: blockBatchWindow: %d\n", cd.blockBatchWindow);
+  printf("debug: blockTimeout: %d\n", cd.blockTimeout);
   printf("debug: resolveHost: %d\n", cd.resolveHost);
   printf("debug: configTriggerCount: %d\n", cd.configTriggerCount);
+  printf("debug: scanTriggerWindow: %d\n", cd.scanTriggerWindow);
+  printf("debug: scanStateSize: %d\n", cd.scanStateSize);
+  printf("debug: rawRingSize: %d\n", cd.rawRingSize);
+  printf("debug: rawRingTimeout: %d\n", cd.rawRingTimeout);
+  printf("debug: rawBatchSize: %d\n", cd.rawBatchSize);
+  printf("debug: captureSnaplen: %d\n", cd.captureSnaplen);
+  printf("debug: listenCacheRefresh: %d\n", cd.listenCacheRefresh);
 
   printf("debug: sentryMode: %s\n", GetSentryModeString(cd.sentryMode));
 
@@ -136,6 +162,17 @@ static char *GetSentryMethodString(const enum SentryMethod sentryMethod) {
   }
 }
 
+static char *GetHistoryFormatString(const enum HistoryFormat historyFormat) {
+  switch (historyFormat) {
+  case HISTORY_FORMAT_TEXT:
+    return "text";
+  case HISTORY_FORMAT_JSON:
+    return "json";
+  default:
+    return "unknown";
+  }
+}
+
 int AddInterface(struct ConfigData *cd, const char *interface) {
   int noInterfaces;
 
@@ -215,4 +252,14 @@ void FreeConfigData(struct ConfigData *cd) {
     free(cd->udpPorts);
     cd->udpPorts = NULL;
   }
+
+  if (cd->tcpPortBitmap != NULL) {
+    free(cd->tcpPortBitmap);
+    cd->tcpPortBitmap = NULL;
+  }
+
+  if (cd->udpPortBitmap != NULL) {
+    free(cd->udpPortBitmap);
+    cd->udpPortBitmap = NULL;
+  }
 }
@@ -16,16 +16,37 @@
 #define LOGFLAG_OUTPUT_STDOUT 0x4
 #define LOGFLAG_OUTPUT_SYSLOG 0x8
 
+#define DEFAULT_RAW_RING_TIMEOUT 100
+#define MAX_RAW_BATCH_SIZE 1024
+#define MIN_CAPTURE_SNAPLEN 128
+#define MAX_CAPTURE_SNAPLEN 65535
+#define DEFAULT_LISTEN_CACHE_REFRESH 1000
+#define DEFAULT_SCAN_STATE_SIZE 1000000
+#define DEFAULT_NFT_FAMILY "inet"
+#define DEFAULT_BLOCK_BATCH_SIZE 1
+
+#define NFT_MAX_NAME 256
+
 enum SentryMode { SENTRY_MODE_STEALTH = 0,
                   SENTRY_MODE_CONNECT };
 
 enum SentryMethod { SENTRY_METHOD_PCAP = 0,
                     SENTRY_METHOD_RAW };
 
+enum HistoryFormat { HISTORY_FORMAT_TEXT = 0,
+                     HISTORY_FORMAT_JSON };
+
 struct ConfigData {
   char killRoute[MAXBUF];
   char killHostsDeny[MAXBUF];
   char killRunCmd[MAXBUF];
+  char unblockCmd[MAXBUF];
+
+  char nftFamily[8];
+  char nftTable[NFT_MAX_NAME];
+  char nftSetIpv4[NFT_MAX_NAME];
+  char nftSetIpv6[NFT_MAX_NAME];
+  int nftRestore;
 
   char **interfaces;
 
@@ -33,6 +54,8 @@ struct ConfigData {
   int tcpPortsLength;
   struct Port *udpPorts;
   int udpPortsLength;
+  struct PortBitmap *tcpPortBitmap;
+  struct PortBitmap *udpPortBitmap;
 
   char portBanner[MAXBUF];
   uint8_t portBannerPresent;
@@ -40,13 +63,27 @@ struct ConfigData {
   char configFile[PATH_MAX];
   char blockedFile[PATH_MAX];
   char historyFile[PATH_MAX];
+  enum HistoryFormat historyFormat;
+  int coarseTimestamps;
   char ignoreFile[PATH_MAX];
 
   int blockTCP;
   int blockUDP;
   int runCmdFirst;
+  int blockAsync;
+  int blockBatchSize;
+  int blockBatchWindow;
+  int blockTimeout;
   int resolveHost;
   int configTriggerCount;
+  int scanTriggerWindow;
+  int scanStateSize;
+
+  int rawRingSize;
+  int rawRingTimeout;
+  int rawBatchSize;
+  int captureSnaplen;
+  int listenCacheRefresh;
 
   enum SentryMode sentryMode;
   enum SentryMethod sentryMethod;
@@ -87,6 +87,13 @@ void readConfigFile(void) {
   /* Make sure config is valid */
   validateConfig(&fileConfig);
 
+  /* The port lists are only used for logging from here on, lookups are done in the bitmaps */
+  if ((fileConfig.tcpPortBitmap = AllocPortBitmap(fileConfig.tcpPorts, fileConfig.tcpPortsLength)) == NULL ||
+      (fileConfig.udpPortBitmap = AllocPortBitmap(fileConfig.udpPorts, fileConfig.udpPortsLength)) == NULL) {
+    fprintf(stderr, "Unable to allocate port bitmaps\n");
+    Exit(EXIT_FAILURE);
+  }
+
   mergeToConfigData(&fileConfig);
 }
 
@@ -125,6 +132,36 @@ static void setConfiguration(const char *buffer, const size_t keySize, char *ptr
       fprintf(stderr, "Invalid config file entry for RESOLVE_HOST\n");
       Exit(EXIT_FAILURE);
     }
+  } else if (strncmp(buffer, "BLOCK_ASYNC", keySize) == 0) {
+    if (strncmp(ptr, "1", valueSize) == 0) {
+      fileConfig->blockAsync = TRUE;
+    } else if (strncmp(ptr, "0", valueSize) == 0) {
+      fileConfig->blockAsync = FALSE;
+    } else {
+      fprintf(stderr, "Invalid config file entry for BLOCK_ASYNC\n");
+      Exit(EXIT_FAILURE);
+    }
+  } else if (strncmp(buffer, "BLOCK_BATCH_SIZE", keySize) == 0) {
+    fileConfig->blockBatchSize = getLong(ptr);
+
+    if (fileConfig->blockBatchSize < 1) {
+      fprintf(stderr, "Invalid config file entry for BLOCK_BATCH_SIZE\n");
+      Exit(EXIT_FAILURE);
+    }
+  } else if (strncmp(buffer, "BLOCK_BATCH_WINDOW", keySize) == 0) {
+    fileConfig->blockBatchWindow = getLong(ptr);
+
+    if (fileConfig->blockBatchWindow < 0) {
+      fprintf(stderr, "Invalid config file entry for BLOCK_BATCH_WINDOW\n");
+      Exit(EXIT_FAILURE);
+    }
+  } else if (strncmp(buffer, "BLOCK_TIMEOUT", keySize) == 0) {
+    fileConfig->blockTimeout = getLong(ptr);
+
+    if (fileConfig->blockTimeout < 0) {
+      fprintf(stderr, "Invalid config file entry for BLOCK_TIMEOUT\n");
+      Exit(EXIT_FAILURE);
+    }
   } else if (strncmp(buffer, "SCAN_TRIGGER", keySize) == 0) {
     fileConfig->configTriggerCount = getLong(ptr);
 
@@ -132,6 +169,55 @@ static void setConfiguration(const char *buffer, const size_t keySize, char *ptr
       fprintf(stderr, "Invalid config file entry for SCAN_TRIGGER\n");
       Exit(EXIT_FAILURE);
     }
+  } else if (strncmp(buffer, "SCAN_TRIGGER_WINDOW", keySize) == 0) {
+    fileConfig->scanTriggerWindow = getLong(ptr);
+
+    if (fileConfig->scanTriggerWindow < 0) {
+      fprintf(stderr, "Invalid config file entry for SCAN_TRIGGER_WINDOW\n");
+      Exit(EXIT_FAILURE);
+    }
+  } else if (strncmp(buffer, "SCAN_STATE_SIZE", keySize) == 0) {
+    fileConfig->scanStateSize = getLong(ptr);
+
+    if (fileConfig->scanStateSize <= 0) {
+      fprintf(stderr, "Invalid config file entry for SCAN_STATE_SIZE\n");
+      Exit(EXIT_FAILURE);
+    }
+  } else if (strncmp(buffer, "LISTEN_CACHE_REFRESH", keySize) == 0) {
+    fileConfig->listenCacheRefresh = getLong(ptr);
+
+    if (fileConfig->listenCacheRefresh < 0) {
+      fprintf(stderr, "Invalid config file entry for LISTEN_CACHE_REFRESH\n");
+      Exit(EXIT_FAILURE);
+    }
+  } else if (strncmp(buffer, "RAW_RING_SIZE", keySize) == 0) {
+    fileConfig->rawRingSize = getLong(ptr);
+
+    if (fileConfig->rawRingSize < 0) {
+      fprintf(stderr, "Invalid config file entry for RAW_RING_SIZE\n");
+      Exit(EXIT_FAILURE);
+    }
+  } else if (strncmp(buffer, "RAW_RING_TIMEOUT", keySize) == 0) {
+    fileConfig->rawRingTimeout = getLong(ptr);
+
+    if (fileConfig->rawRingTimeout <= 0) {
+      fprintf(stderr, "Invalid config file entry for RAW_RING_TIMEOUT\n");
+      Exit(EXIT_FAILURE);
+    }
+  } else if (strncmp(buffer, "RAW_BATCH_SIZE", keySize) == 0) {
+    fileConfig->rawBatchSize = getLong(ptr);
+
+    if (fileConfig->rawBatchSize < 0 || fileConfig->rawBatchSize > MAX_RAW_BATCH_SIZE) {
+      fprintf(stderr, "Invalid config file entry for RAW_BATCH_SIZE, must be between 0 and %d\n", MAX_RAW_BATCH_SIZE);
+      Exit(EXIT_FAILURE);
+    }
+  } else if (strncmp(buffer, "CAPTURE_SNAPLEN", keySize) == 0) {
+    fileConfig->captureSnaplen = getLong(ptr);
+
+    if (fileConfig->captureSnaplen != 0 && (fileConfig->captureSnaplen < MIN_CAPTURE_SNAPLEN || fileConfig->captureSnaplen > MAX_CAPTURE_SNAPLEN)) {
+      fprintf(stderr, "Invalid config file entry for CAPTURE_SNAPLEN, must be 0 or between %d and %d\n", MIN_CAPTURE_SNAPLEN, MAX_CAPTURE_SNAPLEN);
+      Exit(EXIT_FAILURE);
+    }
   } else if (strncmp(buffer, "KILL_ROUTE", keySize) == 0) {
     if (snprintf(fileConfig->killRoute, MAXBUF, "%s", ptr) >= MAXBUF) {
       fprintf(stderr, "KILL_ROUTE value too long\n");
@@ -147,6 +233,11 @@ static void setConfiguration(const char *buffer, const size_t keySize, char *ptr
       fprintf(stderr, "KILL_RUN_CMD value too long\n");
       Exit(EXIT_FAILURE);
     }
+  } else if (strncmp(buffer, "UNBLOCK_CMD", keySize) == 0) {
+    if (snprintf(fileConfig->unblockCmd, MAXBUF, "%s", ptr) >= MAXBUF) {
+      fprintf(stderr, "UNBLOCK_CMD value too long\n");
+      Exit(EXIT_FAILURE);
+    }
   } else if (strncmp(buffer, "KILL_RUN_CMD_FIRST", keySize) == 0) {
     if (strncmp(ptr, "1", valueSize) == 0) {
       fileConfig->runCmdFirst = TRUE;
@@ -156,6 +247,36 @@ static void setConfiguration(const char *buffer, const size_t keySize, char *ptr
       fprintf(stderr, "Invalid config file entry for KILL_RUN_CMD_FIRST\n");
       Exit(EXIT_FAILURE);
     }
+  } else if (strncmp(buffer, "NFT_FAMILY", keySize) == 0) {
+    if (strcmp(ptr, "ip") != 0 && strcmp(ptr, "ip6") != 0 && strcmp(ptr, "inet") != 0) {
+      fprintf(stderr, "Invalid config file entry for NFT_FAMILY, must be ip, ip6 or inet\n");
+      Exit(EXIT_FAILURE);
+    }
+    snprintf(fileConfig->nftFamily, sizeof(fileConfig->nftFamily), "%s", ptr);
+  } else if (strncmp(buffer, "NFT_TABLE", keySize) == 0) {
+    if (snprintf(fileConfig->nftTable, NFT_MAX_NAME, "%s", ptr) >= NFT_MAX_NAME) {
+      fprintf(stderr, "NFT_TABLE value too long\n");
+      Exit(EXIT_FAILURE);
+    }
+  } else if (strncmp(buffer, "NFT_SET_IPV4", keySize) == 0) {
+    if (snprintf(fileConfig->nftSetIpv4, NFT_MAX_NAME, "%s", ptr) >= NFT_MAX_NAME) {
+      fprintf(stderr, "NFT_SET_IPV4 value too long\n");
+      Exit(EXIT_FAILURE);
+    }
+  } else if (strncmp(buffer, "NFT_SET_IPV6", keySize) == 0) {
+    if (snprintf(fileConfig->nftSetIpv6, NFT_MAX_NAME, "%s", ptr) >= NFT_MAX_NAME) {
+      fprintf(stderr, "NFT_SET_IPV6 value too long\n");
+      Exit(EXIT_FAILURE);
+    }
+  } else if (strncmp(buffer, "NFT_RESTORE", keySize) == 0) {
+    if (strncmp(ptr, "1", valueSize) == 0) {
+      fileConfig->nftRestore = TRUE;
+    } else if (strncmp(ptr, "0", valueSize) == 0) {
+      fileConfig->nftRestore = FALSE;
+    } else {
+      fprintf(stderr, "Invalid config file entry for NFT_RESTORE\n");
+      Exit(EXIT_FAILURE);
+    }
   } else if (strncmp(buffer, "BLOCKED_FILE", keySize) == 0) {
     if (snprintf(fileConfig->blockedFile, PATH_MAX, "%s", ptr) >= PATH_MAX) {
       fprintf(stderr, "BLOCKED_FILE path value too long\n");
@@ -176,6 +297,24 @@ static void setConfiguration(const char *buffer, const size_t keySize, char *ptr
       fprintf(stderr, "Unable to open history file for writing %s: %s\n", fileConfig->historyFile, ErrnoString(err, sizeof(err)));
       Exit(EXIT_FAILURE);
     }
+  } else if (strncmp(buffer, "HISTORY_FORMAT", keySize) == 0) {
+    if (strcmp(ptr, "text") == 0) {
+      fileConfig->historyFormat = HISTORY_FORMAT_TEXT;
+    } else if (strcmp(ptr, "json") == 0) {
+      fileConfig->historyFormat = HISTORY_FORMAT_JSON;
+    } else {
+      fprintf(stderr, "Invalid config file entry for HISTORY_FORMAT, must be text or json\n");
+      Exit(EXIT_FAILURE);
+    }
+  } else if (strncmp(buffer, "COARSE_TIMESTAMPS", keySize) == 0) {
+    if (strncmp(ptr, "1", valueSize) == 0) {
+      fileConfig->coarseTimestamps = TRUE;
+    } else if (strncmp(ptr, "0", valueSize) == 0) {
+      fileConfig->coarseTimestamps = FALSE;
+    } else {
+      fprintf(stderr, "Invalid config file entry for COARSE_TIMESTAMPS\n");
+      Exit(EXIT_FAILURE);
+    }
   } else if (strncmp(buffer, "IGNORE_FILE", keySize) == 0) {
     if (snprintf(fileConfig->ignoreFile, PATH_MAX, "%s", ptr) >= PATH_MAX) {
       fprintf(stderr, "IGNORE_FILE path value too long\n");
@@ -234,8 +373,48 @@ static void validateConfig(struct ConfigData *fileConfig) {
   }
 
   if ((fileConfig->blockTCP == 1 || fileConfig->blockUDP == 1) &&
-      (strlen(fileConfig->killHostsDeny) == 0 && strlen(fileConfig->killRoute) == 0)) {
-    fprintf(stderr, "KILL_HOSTS_DENY and/or KILL_ROUTE must be specified if BLOCK_TCP or BLOCK_UDP is set to 1\n");
+      (strlen(fileConfig->killHostsDeny) == 0 && strlen(fileConfig->killRoute) == 0 && strlen(fileConfig->nftTable) == 0)) {
+    fprintf(stderr, "KILL_HOSTS_DENY, KILL_ROUTE and/or NFT_TABLE must be specified if BLOCK_TCP or BLOCK_UDP is set to 1\n");
+    Exit(EXIT_FAILURE);
+  }
+
+  if (fileConfig->rawRingSize > 0 && fileConfig->rawBatchSize > 0) {
+    fprintf(stderr, "RAW_RING_SIZE and RAW_BATCH_SIZE can't be used together\n");
+    Exit(EXIT_FAILURE);
+  }
+
+  if (fileConfig->blockBatchSize > 1 && fileConfig->blockAsync == FALSE) {
+    fprintf(stderr, "BLOCK_ASYNC must be set to 1 if BLOCK_BATCH_SIZE is larger than 1\n");
+    Exit(EXIT_FAILURE);
+  }
+
+  if ((strstr(fileConfig->killRoute, "$TARGETS$") != NULL || strstr(fileConfig->killRunCmd, "$TARGETS$") != NULL) && fileConfig->blockBatchSize == 1) {
+    fprintf(stderr, "The $TARGETS$ token can only be used if BLOCK_BATCH_SIZE is larger than 1\n");
+    Exit(EXIT_FAILURE);
+  }
+
+  if ((strstr(fileConfig->killRoute, "$TARGETS$") != NULL && strstr(fileConfig->killRoute, "$PORT$") != NULL) ||
+      (strstr(fileConfig->killRunCmd, "$TARGETS$") != NULL && strstr(fileConfig->killRunCmd, "$PORT$") != NULL)) {
+    fprintf(stderr, "The $PORT$ token can't be used together with the $TARGETS$ token\n");
+    Exit(EXIT_FAILURE);
+  }
+
+  if (strlen(fileConfig->unblockCmd) > 0 && fileConfig->blockTimeout == 0) {
+    fprintf(stderr, "BLOCK_TIMEOUT must be set if UNBLOCK_CMD is specified\n");
+    Exit(EXIT_FAILURE);
+  }
+
+  if (strlen(fileConfig->nftTable) > 0) {
+#ifndef __linux__
+    fprintf(stderr, "NFT_TABLE is only supported on Linux\n");
+    Exit(EXIT_FAILURE);
+#endif
+    if (strlen(fileConfig->nftSetIpv4) == 0 && strlen(fileConfig->nftSetIpv6) == 0) {
+      fprintf(stderr, "NFT_SET_IPV4 and/or NFT_SET_IPV6 must be specified if NFT_TABLE is set\n");
+      Exit(EXIT_FAILURE);
+    }
+  } else if (strlen(fileConfig->nftSetIpv4) > 0 || strlen(fileConfig->nftSetIpv6) > 0 || fileConfig->nftRestore == TRUE) {
+    fprintf(stderr, "NFT_TABLE must be specified if NFT_SET_IPV4, NFT_SET_IPV6 or NFT_RESTORE is set\n");
     Exit(EXIT_FAILURE);
   }
 }
@@ -251,6 +430,7 @@ static void mergeToConfigData(struct ConfigData *fileConfig) {
    * char **interfaces - array of strings of interfaces to listen to. Set in cmdline (therefore present in configData)
    * struct Port *tcpPorts - array of Port structs for TCP ports to listen to. Set in config file (therefore present in fileConfig)
    * struct Port *udpPorts - array of Port structs for UDP ports to listen to. Set in config file (therefore present in fileConfig)
+   * struct PortBitmap *tcpPortBitmap, *udpPortBitmap - compiled from tcpPorts/udpPorts. Set in config file (therefore present in fileConfig)
    */
 
   // backup current configData (at this point,it's assumed the configData holds the cmdline options)
@@ -283,7 +463,7 @@ static size_t getKeySize(char *buffer) {
   char *ptr = buffer;
   size_t keySize = 0;
 
-  while (isupper((int)*ptr) || *ptr == '_') {
+  while (isupper((int)*ptr) || *ptr == '_' || (keySize > 0 && isdigit((int)*ptr))) {
     ptr++;
     keySize++;
   }
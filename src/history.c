@@ -0,0 +1,378 @@
+// SPDX-FileCopyrightText: 2024 Marcus Hufvudsson <mh@protohuf.com>
+//
+// SPDX-License-Identifier: CPL-1.0
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/uio.h>
+
+#include "portsentry.h"
+#include "config_data.h"
+#include "history.h"
+#include "io.h"
+#include "util.h"
+
+#define HISTORY_BUFFER_SIZE (256 * 1024)
+#define HISTORY_FLUSH_SIZE (16 * 1024)
+#define HISTORY_FLUSH_INTERVAL 1000  // ms
+#define HISTORY_REPORT_INTERVAL 10   // seconds between reports of dropped records
+
+/* Scan events are written to the history file by a writer thread, so the packet loop never waits for the disk.
+ * Records are copied into a byte ring, noWritten and noFlushed only ever increase and the bytes between them
+ * are waiting to be written. The writer wakes up once HISTORY_FLUSH_SIZE bytes are waiting, or when the
+ * oldest waiting record is HISTORY_FLUSH_INTERVAL ms old. If the ring is full the record is dropped.
+ * All fields below are protected by lock once the writer is started.
+ */
+static char *ring = NULL;
+static uint64_t noWritten = 0;
+static uint64_t noFlushed = 0;
+static uint32_t noDropped = 0;
+static struct timespec oldestWaiting;
+static uint8_t isStopping = FALSE;
+static uint8_t isInitialized = FALSE;
+static pthread_t writer;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t recordsWaiting;
+
+/* Only used by the writer, besides reopenRequested which is set from the SIGHUP handler.
+ * While the history file can't be opened, records are dropped and opening is retried on every flush.
+ */
+static int fd = -1;
+static uint8_t isOpenFailing = FALSE;
+static uint32_t noUnreported = 0;
+static uint32_t noUnwritten = 0;
+static struct timespec lastReport;
+static volatile sig_atomic_t reopenRequested = FALSE;
+
+static void *HistoryWriter(void *arg);
+static void WaitForRecords(void);
+static void FlushRecords(const uint64_t first, const uint64_t last);
+static int OpenHistoryFile(void);
+static uint32_t CountRecords(const uint64_t first, const uint64_t last);
+static void ReportDroppedRecords(const int force);
+
+int InitHistory(void) {
+  sigset_t allSignals, oldSignals;
+  pthread_condattr_t condAttr;
+  int ret;
+
+  if (isInitialized == TRUE || strlen(configData.historyFile) == 0) {
+    return TRUE;
+  }
+
+  if ((ring = malloc(HISTORY_BUFFER_SIZE)) == NULL) {
+    Error("Unable to allocate memory for history buffer");
+    return ERROR;
+  }
+
+  // Not fatal, like a failed write the records are dropped (and reported) until the file can be opened
+  isOpenFailing = FALSE;
+  OpenHistoryFile();
+
+  pthread_condattr_init(&condAttr);
+  pthread_condattr_setclock(&condAttr, CLOCK_MONOTONIC);
+  pthread_cond_init(&recordsWaiting, &condAttr);
+  pthread_condattr_destroy(&condAttr);
+
+  noWritten = 0;
+  noFlushed = 0;
+  noDropped = 0;
+  noUnreported = 0;
+  noUnwritten = 0;
+  clock_gettime(CLOCK_MONOTONIC, &lastReport);
+  isStopping = FALSE;
+
+  // Signals are handled by the main thread, so that they interrupt the poll() in the packet loop
+  sigfillset(&allSignals);
+  pthread_sigmask(SIG_BLOCK, &allSignals, &oldSignals);
+  ret = pthread_create(&writer, NULL, HistoryWriter, NULL);
+  pthread_sigmask(SIG_SETMASK, &oldSignals, NULL);
+
+  if (ret != 0) {
+    Error("Unable to start history writer thread: %s", strerror(ret));
+    pthread_cond_destroy(&recordsWaiting);
+    if (fd != -1) {
+      close(fd);
+      fd = -1;
+    }
+    free(ring);
+    ring = NULL;
+    return ERROR;
+  }
+
+  isInitialized = TRUE;
+
+  return TRUE;
+}
+
+// Records already in the ring are written before the writer exits
+void FreeHistory(void) {
+  if (isInitialized == FALSE) {
+    return;
+  }
+
+  pthread_mutex_lock(&lock);
+  isStopping = TRUE;
+  pthread_cond_signal(&recordsWaiting);
+  pthread_mutex_unlock(&lock);
+
+  pthread_join(writer, NULL);
+  pthread_cond_destroy(&recordsWaiting);
+
+  if (fd != -1) {
+    close(fd);
+    fd = -1;
+  }
+  free(ring);
+  ring = NULL;
+
+  isInitialized = FALSE;
+}
+
+// Queue one or more records (each including its newline) for the history file, never waits for the disk
+void WriteHistory(const char *record, const size_t len) {
+  uint64_t waiting;
+  uint32_t offset;
+  const char *p;
+
+  if (isInitialized == FALSE) {
+    return;
+  }
+
+  pthread_mutex_lock(&lock);
+
+  waiting = noWritten - noFlushed;
+
+  if (len > HISTORY_BUFFER_SIZE - waiting) {
+    for (p = record; (p = memchr(p, '\n', len - (size_t)(p - record))) != NULL; p++) {
+      noDropped++;
+    }
+    pthread_mutex_unlock(&lock);
+    return;
+  }
+
+  if (waiting == 0) {
+    clock_gettime(CLOCK_MONOTONIC, &oldestWaiting);
+  }
+
+  offset = (uint32_t)(noWritten % HISTORY_BUFFER_SIZE);
+  if (len <= HISTORY_BUFFER_SIZE - offset) {
+    memcpy(ring + offset, record, len);
+  } else {
+    memcpy(ring + offset, record, HISTORY_BUFFER_SIZE - offset);
+    memcpy(ring, record + (HISTORY_BUFFER_SIZE - offset), len - (HISTORY_BUFFER_SIZE - offset));
+  }
+  noWritten += len;
+
+  // Wake the writer to start the flush interval, or to flush right away once enough is waiting
+  if (waiting == 0 || (waiting < HISTORY_FLUSH_SIZE && waiting + len >= HISTORY_FLUSH_SIZE)) {
+    pthread_cond_signal(&recordsWaiting);
+  }
+
+  pthread_mutex_unlock(&lock);
+}
+
+// Called from the SIGHUP handler, the history file is reopened by the writer (e.g. after logrotate)
+void RequestHistoryReopen(void) {
+  reopenRequested = TRUE;
+}
+
+/* The bytes from noFlushed aren't reused by WriteHistory() until noFlushed is increased,
+ * so they are safe to read without holding the lock while they are written.
+ */
+static void *HistoryWriter(void *arg) {
+  uint64_t first, last;
+  uint32_t dropped;
+  uint8_t stopping;
+
+  (void)arg;
+
+  pthread_mutex_lock(&lock);
+
+  while (TRUE) {
+    WaitForRecords();
+
+    first = noFlushed;
+    last = noWritten;
+    dropped = noDropped;
+    noDropped = 0;
+    stopping = isStopping;
+
+    if (first == last && stopping == TRUE) {
+      break;
+    }
+
+    pthread_mutex_unlock(&lock);
+
+    if (reopenRequested == TRUE) {
+      reopenRequested = FALSE;
+      Log("Reopening history file: %s", configData.historyFile);
+      if (fd != -1) {
+        close(fd);
+        fd = -1;
+      }
+      OpenHistoryFile();
+    }
+
+    noUnreported += dropped;
+
+    if (first != last) {
+      FlushRecords(first, last);
+    }
+
+    ReportDroppedRecords(FALSE);
+
+    pthread_mutex_lock(&lock);
+    noFlushed = last;
+  }
+
+  pthread_mutex_unlock(&lock);
+
+  noUnreported += dropped;
+  ReportDroppedRecords(TRUE);
+
+  return NULL;
+}
+
+/* Called with the lock held. Returns once HISTORY_FLUSH_SIZE bytes are waiting, the oldest waiting record
+ * is HISTORY_FLUSH_INTERVAL ms old or the writer is stopping. Wakes up at least once a second to check for
+ * a requested reopen.
+ */
+static void WaitForRecords(void) {
+  struct timespec deadline;
+
+  while (isStopping == FALSE && noWritten - noFlushed < HISTORY_FLUSH_SIZE) {
+    if (noWritten == noFlushed) {
+      clock_gettime(CLOCK_MONOTONIC, &deadline);
+      deadline.tv_sec++;
+    } else {
+      deadline = oldestWaiting;
+      deadline.tv_sec += HISTORY_FLUSH_INTERVAL / 1000;
+      deadline.tv_nsec += (long)(HISTORY_FLUSH_INTERVAL % 1000) * 1000000;
+      if (deadline.tv_nsec >= 1000000000) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000;
+      }
+    }
+
+    if (pthread_cond_timedwait(&recordsWaiting, &lock, &deadline) == ETIMEDOUT) {
+      break;
+    }
+  }
+}
+
+// The waiting bytes are at most two pieces of the ring, written with a single writev()
+static void FlushRecords(const uint64_t first, const uint64_t last) {
+  struct iovec iov[2];
+  uint32_t offset = (uint32_t)(first % HISTORY_BUFFER_SIZE);
+  size_t len = (size_t)(last - first);
+  ssize_t ret;
+  int iovcnt = 1;
+  char err[ERRNOMAXBUF];
+
+  if (fd == -1 && OpenHistoryFile() != TRUE) {
+    noUnwritten += CountRecords(first, last);
+    return;
+  }
+
+  iov[0].iov_base = ring + offset;
+  if (len <= HISTORY_BUFFER_SIZE - offset) {
+    iov[0].iov_len = len;
+  } else {
+    iov[0].iov_len = HISTORY_BUFFER_SIZE - offset;
+    iov[1].iov_base = ring;
+    iov[1].iov_len = len - iov[0].iov_len;
+    iovcnt = 2;
+  }
+
+  while (iovcnt > 0) {
+    if ((ret = writev(fd, iov, iovcnt)) == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      Error("Unable to write history file: %s: %s", configData.historyFile, ErrnoString(err, sizeof(err)));
+      noUnwritten += CountRecords(first, last);
+      return;
+    }
+
+    // Skip what was written, in case of a short write
+    while (iovcnt > 0 && (size_t)ret >= iov[0].iov_len) {
+      ret -= (ssize_t)iov[0].iov_len;
+      if (--iovcnt > 0) {
+        iov[0] = iov[1];
+      }
+    }
+
+    if (iovcnt > 0) {
+      iov[0].iov_base = (char *)iov[0].iov_base + ret;
+      iov[0].iov_len -= (size_t)ret;
+    }
+  }
+}
+
+// Only the first of consecutive failures is logged, the dropped records are reported by ReportDroppedRecords()
+static int OpenHistoryFile(void) {
+  char err[ERRNOMAXBUF];
+
+  if ((fd = open(configData.historyFile, O_WRONLY | O_APPEND | O_CREAT, 0644)) == -1) {
+    if (isOpenFailing == FALSE) {
+      Error("Unable to open history log file: %s (%s), dropping history records until it can be opened", configData.historyFile, ErrnoString(err, sizeof(err)));
+      isOpenFailing = TRUE;
+    }
+    return ERROR;
+  }
+
+  if (isOpenFailing == TRUE) {
+    Log("History log file: %s is open again", configData.historyFile);
+    isOpenFailing = FALSE;
+  }
+
+  return TRUE;
+}
+
+// Every record ends with a newline
+static uint32_t CountRecords(const uint64_t first, const uint64_t last) {
+  uint32_t count = 0;
+  uint64_t i;
+
+  for (i = first; i < last; i++) {
+    if (ring[i % HISTORY_BUFFER_SIZE] == '\n') {
+      count++;
+    }
+  }
+
+  return count;
+}
+
+// Report the records dropped since the last report, at most once per HISTORY_REPORT_INTERVAL unless forced
+static void ReportDroppedRecords(const int force) {
+  struct timespec now;
+
+  if (noUnreported == 0 && noUnwritten == 0) {
+    return;
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  if (force == FALSE && now.tv_sec - lastReport.tv_sec < HISTORY_REPORT_INTERVAL) {
+    return;
+  }
+
+  if (noUnreported > 0) {
+    Error("History buffer full, dropped %u records", noUnreported);
+  }
+
+  if (noUnwritten > 0) {
+    Error("Unable to write history file: %s, dropped %u records", configData.historyFile, noUnwritten);
+  }
+
+  noUnreported = 0;
+  noUnwritten = 0;
+  lastReport = now;
+}
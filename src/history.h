@@ -0,0 +1,12 @@
+// SPDX-FileCopyrightText: 2024 Marcus Hufvudsson <mh@protohuf.com>
+//
+// SPDX-License-Identifier: CPL-1.0
+
+#pragma once
+
+#include <stddef.h>
+
+int InitHistory(void);
+void FreeHistory(void);
+void WriteHistory(const char *record, const size_t len);
+void RequestHistoryReopen(void);
@@ -16,8 +16,16 @@
 #include "ignore.h"
 #include "util.h"
 
+#define IGNORE_TRIE_MATCH UINT32_MAX
+
 static int IgnoreParse(const char *buffer, struct IgnoreIp *ignoreIp);
 static int IsValidIPChar(const char c);
+static int GetPrefixLength(const uint8_t *mask, const int maskLength);
+static inline uint8_t GetNibble(const uint8_t *key, const int level);
+static int AllocTrieNode(struct IgnoreTrie *trie, uint32_t *node);
+static int InsertTrie(struct IgnoreTrie *trie, const uint8_t *key, const int prefixLength);
+static int LookupTrie(const struct IgnoreTrie *trie, const uint8_t *key, const int keyLength);
+static void FreeTrie(struct IgnoreTrie *trie);
 
 static int IsValidIPChar(const char c) {
   if ((c >= '0' && c <= '9') || c == '.' || c == ':' || (c >= 'a' && c <= 'f') || c == '/') {
@@ -66,8 +74,13 @@ static int IgnoreParse(const char *buffer, struct IgnoreIp *ignoreIp) {
   if (res->ai_family == AF_INET) {
     ignoreIp->family = AF_INET;
     memcpy(&ignoreIp->ip.addr4, &((struct sockaddr_in *)res->ai_addr)->sin_addr, sizeof(struct in_addr));
-    if (mask == -1) {
+    if (mask > 32) {
+      Error("Invalid netmask in ignore file, must be 0-32 for IPv4: %s", buffer);
+      goto exit;
+    } else if (mask == -1) {
       ignoreIp->mask.mask4.s_addr = 0xffffffff;
+    } else if (mask == 0) {
+      ignoreIp->mask.mask4.s_addr = 0;
     } else {
       ignoreIp->mask.mask4.s_addr = htonl(0xffffffff << (32 - mask));
     }
@@ -110,6 +123,9 @@ void FreeIgnore(struct IgnoreState *is) {
     free(is->ignoreIpList);
   }
 
+  FreeTrie(&is->trie4);
+  FreeTrie(&is->trie6);
+
   memset(is, 0, sizeof(struct IgnoreState));
   is->isInitialized = FALSE;
 }
@@ -121,7 +137,7 @@ void FreeIgnore(struct IgnoreState *is) {
  */
 int InitIgnore(struct IgnoreState *is) {
   FILE *fp = NULL;
-  int status = ERROR;
+  int status = ERROR, ret;
   char buffer[MAXBUF];
   struct IgnoreIp ii;
 
@@ -162,6 +178,19 @@ int InitIgnore(struct IgnoreState *is) {
     memcpy(&is->ignoreIpList[is->ignoreIpListSize - 1], &ii, sizeof(struct IgnoreIp));
   }
 
+  // The list is kept for reporting, lookups are done in the tries
+  for (int i = 0; i < is->ignoreIpListSize; i++) {
+    if (is->ignoreIpList[i].family == AF_INET) {
+      ret = InsertTrie(&is->trie4, (uint8_t *)&is->ignoreIpList[i].ip.addr4, GetPrefixLength((uint8_t *)&is->ignoreIpList[i].mask.mask4, sizeof(struct in_addr)));
+    } else {
+      ret = InsertTrie(&is->trie6, is->ignoreIpList[i].ip.addr6.s6_addr, GetPrefixLength(is->ignoreIpList[i].mask.mask6.s6_addr, sizeof(struct in6_addr)));
+    }
+
+    if (ret != TRUE) {
+      goto exit;
+    }
+  }
+
   is->isInitialized = TRUE;
 
   if (configData.logFlags & LOGFLAG_VERBOSE) {
@@ -204,27 +233,133 @@ int IgnoreIpIsPresent(const struct IgnoreState *is, const struct sockaddr *sa) {
     return ERROR;
   }
 
-  for (int i = 0; i < is->ignoreIpListSize; i++) {
-    if (is->ignoreIpList[i].family != sa->sa_family) {
-      continue;
+  if (sa->sa_family == AF_INET) {
+    return LookupTrie(&is->trie4, (const uint8_t *)&((const struct sockaddr_in *)sa)->sin_addr, sizeof(struct in_addr) * 8);
+  } else if (sa->sa_family == AF_INET6) {
+    return LookupTrie(&is->trie6, ((const struct sockaddr_in6 *)sa)->sin6_addr.s6_addr, sizeof(struct in6_addr) * 8);
+  }
+
+  return FALSE;
+}
+
+/* Number of leading one bits in a netmask */
+static int GetPrefixLength(const uint8_t *mask, const int maskLength) {
+  int i, prefixLength = 0;
+  uint8_t byte;
+
+  for (i = 0; i < maskLength; i++) {
+    byte = mask[i];
+    while (byte & 0x80) {
+      prefixLength++;
+      byte <<= 1;
     }
 
-    if (sa->sa_family == AF_INET) {
-      struct sockaddr_in *sin = (struct sockaddr_in *)sa;
-      if ((sin->sin_addr.s_addr & is->ignoreIpList[i].mask.mask4.s_addr) == is->ignoreIpList[i].ip.addr4.s_addr) {
-        return TRUE;
-      }
-    } else if (sa->sa_family == AF_INET6) {
-      struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *)sa;
-      for (int j = 0; j < 16; j++) {
-        if ((sin6->sin6_addr.s6_addr[j] & is->ignoreIpList[i].mask.mask6.s6_addr[j]) != is->ignoreIpList[i].ip.addr6.s6_addr[j]) {
-          break;
-        }
-        if (j == 15) {
-          return TRUE;
-        }
+    if (mask[i] != 0xff) {
+      break;
+    }
+  }
+
+  return prefixLength;
+}
+
+static inline uint8_t GetNibble(const uint8_t *key, const int level) {
+  return (level & 1) ? (key[level >> 1] & 0x0f) : (key[level >> 1] >> 4);
+}
+
+static int AllocTrieNode(struct IgnoreTrie *trie, uint32_t *node) {
+  struct IgnoreTrieNode *nodes;
+
+  if (trie->noNodes == trie->size) {
+    if ((nodes = realloc(trie->nodes, ((trie->size == 0) ? 16 : trie->size * 2) * sizeof(struct IgnoreTrieNode))) == NULL) {
+      Error("Unable to allocate memory for ignore trie");
+      return ERROR;
+    }
+    trie->nodes = nodes;
+    trie->size = (trie->size == 0) ? 16 : trie->size * 2;
+  }
+
+  memset(&trie->nodes[trie->noNodes], 0, sizeof(struct IgnoreTrieNode));
+  *node = trie->noNodes++;
+
+  return TRUE;
+}
+
+/* Insert a prefix, key is the address in network byte order. A prefix which doesn't end on a
+ * nibble boundary is expanded to all entries of its last node sharing the leading bits (controlled prefix expansion).
+ * Since a lookup only need to know if any prefix covers the address, a match entry replaces any longer
+ * prefixes below it, and prefixes under an existing match are not inserted at all.
+ */
+static int InsertTrie(struct IgnoreTrie *trie, const uint8_t *key, const int prefixLength) {
+  uint32_t node = 0, child;
+  int level = 0, remaining, i;
+  uint8_t first;
+
+  if (prefixLength == 0) {
+    trie->matchAll = TRUE;
+    return TRUE;
+  }
+
+  if (trie->nodes == NULL && AllocTrieNode(trie, &node) != TRUE) {
+    return ERROR;
+  }
+
+  while (prefixLength - (level * IGNORE_TRIE_STRIDE) > IGNORE_TRIE_STRIDE) {
+    child = trie->nodes[node].entry[GetNibble(key, level)];
+
+    if (child == IGNORE_TRIE_MATCH) {
+      return TRUE;
+    } else if (child == 0) {
+      if (AllocTrieNode(trie, &child) != TRUE) {
+        return ERROR;
       }
+      trie->nodes[node].entry[GetNibble(key, level)] = child;
     }
+
+    node = child;
+    level++;
   }
+
+  remaining = prefixLength - (level * IGNORE_TRIE_STRIDE);
+  first = GetNibble(key, level) & (uint8_t)(0xf0 >> remaining);
+
+  for (i = 0; i < (1 << (IGNORE_TRIE_STRIDE - remaining)); i++) {
+    trie->nodes[node].entry[first + i] = IGNORE_TRIE_MATCH;
+  }
+
+  return TRUE;
+}
+
+static int LookupTrie(const struct IgnoreTrie *trie, const uint8_t *key, const int keyLength) {
+  uint32_t node = 0, entry;
+  int level;
+
+  if (trie->matchAll == TRUE) {
+    return TRUE;
+  }
+
+  if (trie->nodes == NULL) {
+    return FALSE;
+  }
+
+  for (level = 0; level < keyLength / IGNORE_TRIE_STRIDE; level++) {
+    entry = trie->nodes[node].entry[GetNibble(key, level)];
+
+    if (entry == IGNORE_TRIE_MATCH) {
+      return TRUE;
+    } else if (entry == 0) {
+      return FALSE;
+    }
+
+    node = entry;
+  }
+
   return FALSE;
 }
+
+static void FreeTrie(struct IgnoreTrie *trie) {
+  if (trie->nodes != NULL) {
+    free(trie->nodes);
+  }
+
+  memset(trie, 0, sizeof(struct IgnoreTrie));
+}
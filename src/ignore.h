@@ -5,6 +5,7 @@
 #pragma once
 
 #include <stdio.h>
+#include <stdint.h>
 #include <netinet/in.h>
 
 struct IgnoreIp {
@@ -19,9 +20,28 @@ struct IgnoreIp {
   int family;
 };
 
+#define IGNORE_TRIE_STRIDE 4
+#define IGNORE_TRIE_FANOUT (1 << IGNORE_TRIE_STRIDE)
+
+/* Multibit trie node, one entry per nibble value. An entry is either empty (0),
+ * a match (a prefix in the ignore list covers all addresses below it) or
+ * the index of the child node handling the next nibble */
+struct IgnoreTrieNode {
+  uint32_t entry[IGNORE_TRIE_FANOUT];
+};
+
+struct IgnoreTrie {
+  struct IgnoreTrieNode *nodes;  // nodes[0] is the root
+  uint32_t noNodes;
+  uint32_t size;
+  uint8_t matchAll;  // A /0 prefix is present
+};
+
 struct IgnoreState {
   struct IgnoreIp *ignoreIpList;
   int ignoreIpListSize;
+  struct IgnoreTrie trie4;
+  struct IgnoreTrie trie6;
   uint8_t isInitialized;
 };
 
@@ -8,7 +8,11 @@
 #include <ctype.h>
 #include <errno.h>
 #include <netinet/in.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <signal.h>
 #include <stdarg.h>
+#include <stdatomic.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -27,6 +31,9 @@
 #include "util.h"
 
 static int MkdirP(const char *path);
+static int RunTargetsCommand(const char *targets, const char *killString, const char *detectionType, const char *option, char **command);
+
+#define LOG_QUEUE_SIZE 1024  // Must be a power of 2
 
 static uint8_t isSyslogOpen = FALSE;
 
@@ -35,20 +42,83 @@ enum LogType { LogTypeNone,
                LogTypeDebug,
                LogTypeVerbose };
 
+/* Once the logger is started, log entries are formatted by the caller into a bounded lock-free queue
+ * (multiple producers, the logger thread is the only consumer) and written to stdout/syslog by the
+ * logger thread, so a slow syslog never stalls the packet loop. Each record's sequence tells whose turn
+ * it is: it equals the position when the record is free to be filled and position + 1 once it's ready
+ * to be written. If the queue is full the entry is dropped and counted.
+ */
+struct LogRecord {
+  _Atomic uint32_t sequence;
+  enum LogType logType;
+  char text[MAXBUF];
+};
+
+static struct LogRecord *logQueue = NULL;
+static _Atomic uint32_t enqueuePos;
+static uint32_t dequeuePos;  // Only used by the logger thread
+static _Atomic uint32_t noDropped;
+static atomic_int isLoggerStopping;
+static atomic_int isLoggerRunning = FALSE;
+static sem_t logRecordsReady;
+static pthread_t logger;
+
 static void LogEntry(const enum LogType logType, const char *logentry, va_list argsPtr);
+static void QueueLogEntry(const enum LogType logType, const char *logentry, va_list argsPtr);
+static void WriteLogEntry(const enum LogType logType, const char *logbuffer);
+static void *Logger(void *arg);
+static int DrainLogQueue(void);
 
 static void LogEntry(const enum LogType logType, const char *logentry, va_list argsPtr) {
   char logbuffer[MAXBUF];
 
+  if (atomic_load(&isLoggerRunning) == TRUE) {
+    QueueLogEntry(logType, logentry, argsPtr);
+    return;
+  }
+
   vsnprintf(logbuffer, MAXBUF, logentry, argsPtr);
+  WriteLogEntry(logType, logbuffer);
+  fflush(stdout);
+}
+
+static void QueueLogEntry(const enum LogType logType, const char *logentry, va_list argsPtr) {
+  struct LogRecord *record;
+  uint32_t pos = atomic_load_explicit(&enqueuePos, memory_order_relaxed), sequence;
+  int32_t diff;
+
+  while (TRUE) {
+    record = &logQueue[pos & (LOG_QUEUE_SIZE - 1)];
+    sequence = atomic_load_explicit(&record->sequence, memory_order_acquire);
+    diff = (int32_t)(sequence - pos);
+
+    if (diff == 0) {
+      if (atomic_compare_exchange_weak_explicit(&enqueuePos, &pos, pos + 1, memory_order_relaxed, memory_order_relaxed)) {
+        break;
+      }
+    } else if (diff < 0) {
+      atomic_fetch_add_explicit(&noDropped, 1, memory_order_relaxed);
+      return;
+    } else {
+      pos = atomic_load_explicit(&enqueuePos, memory_order_relaxed);
+    }
+  }
+
+  record->logType = logType;
+  vsnprintf(record->text, MAXBUF, logentry, argsPtr);
+  atomic_store_explicit(&record->sequence, pos + 1, memory_order_release);
+
+  sem_post(&logRecordsReady);
+}
 
+// stdout is flushed by the caller, the logger thread flushes once per drained batch
+static void WriteLogEntry(const enum LogType logType, const char *logbuffer) {
   if (configData.logFlags & LOGFLAG_OUTPUT_STDOUT) {
     if (logType == LogTypeError) {
       fprintf(stderr, "%s\n", logbuffer);
       fflush(stderr);
     } else {
       printf("%s%s\n", (logType == LogTypeDebug) ? "debug: " : "", logbuffer);
-      fflush(stdout);
     }
   }
 
@@ -64,6 +134,125 @@ static void LogEntry(const enum LogType logType, const char *logentry, va_list a
   }
 }
 
+/* Start writing log entries from a logger thread. Must be called after any fork(), e.g. daemon().
+ * If the thread can't be started, logging stays synchronous.
+ */
+int InitLogger(void) {
+  sigset_t allSignals, oldSignals;
+  uint32_t i;
+  int ret;
+
+  if (atomic_load(&isLoggerRunning) == TRUE) {
+    return TRUE;
+  }
+
+  // The queue of a stopped logger is reused, see FreeLogger()
+  if (logQueue == NULL && (logQueue = malloc(sizeof(struct LogRecord) * LOG_QUEUE_SIZE)) == NULL) {
+    Error("Unable to allocate memory for log queue");
+    return ERROR;
+  }
+
+  for (i = 0; i < LOG_QUEUE_SIZE; i++) {
+    atomic_init(&logQueue[i].sequence, i);
+  }
+
+  atomic_init(&enqueuePos, 0);
+  atomic_init(&noDropped, 0);
+  atomic_init(&isLoggerStopping, FALSE);
+  dequeuePos = 0;
+
+  if (sem_init(&logRecordsReady, 0, 0) == -1) {
+    Error("Unable to initialize log queue semaphore");
+    free(logQueue);
+    logQueue = NULL;
+    return ERROR;
+  }
+
+  // Signals are handled by the main thread, so that they interrupt the poll() in the packet loop
+  sigfillset(&allSignals);
+  pthread_sigmask(SIG_BLOCK, &allSignals, &oldSignals);
+  ret = pthread_create(&logger, NULL, Logger, NULL);
+  pthread_sigmask(SIG_SETMASK, &oldSignals, NULL);
+
+  if (ret != 0) {
+    Error("Unable to start logger thread: %s", strerror(ret));
+    sem_destroy(&logRecordsReady);
+    free(logQueue);
+    logQueue = NULL;
+    return ERROR;
+  }
+
+  atomic_store(&isLoggerRunning, TRUE);
+
+  return TRUE;
+}
+
+/* Entries already queued are written before the logger exits, logging is synchronous again afterwards.
+ * Exit() can be reached from the block executor and history threads or while they are still running
+ * (e.g. Crash() in the packet loop), so another thread might be inside QueueLogEntry() right now. The
+ * queue and semaphore are therefore never freed, an entry queued that late is lost instead.
+ */
+void FreeLogger(void) {
+  if (atomic_exchange(&isLoggerRunning, FALSE) == FALSE) {
+    return;
+  }
+
+  atomic_store(&isLoggerStopping, TRUE);
+  sem_post(&logRecordsReady);
+  pthread_join(logger, NULL);
+}
+
+static void *Logger(void *arg) {
+  (void)arg;
+
+  while (TRUE) {
+    while (sem_wait(&logRecordsReady) == -1 && errno == EINTR)
+      ;
+
+    if (atomic_load(&isLoggerStopping) == TRUE) {
+      while (DrainLogQueue() > 0)
+        ;
+      break;
+    }
+
+    DrainLogQueue();
+  }
+
+  return NULL;
+}
+
+// Write all ready entries, returns the number of entries written
+static int DrainLogQueue(void) {
+  struct LogRecord *record;
+  uint32_t dropped;
+  int noDrained = 0;
+  char logbuffer[MAXBUF];
+
+  while (TRUE) {
+    record = &logQueue[dequeuePos & (LOG_QUEUE_SIZE - 1)];
+    if ((int32_t)(atomic_load_explicit(&record->sequence, memory_order_acquire) - (dequeuePos + 1)) < 0) {
+      break;
+    }
+
+    WriteLogEntry(record->logType, record->text);
+
+    atomic_store_explicit(&record->sequence, dequeuePos + LOG_QUEUE_SIZE, memory_order_release);
+    dequeuePos++;
+    noDrained++;
+  }
+
+  if ((dropped = atomic_exchange_explicit(&noDropped, 0, memory_order_relaxed)) > 0) {
+    snprintf(logbuffer, sizeof(logbuffer), "Log queue full, dropped %u log entries", dropped);
+    WriteLogEntry(LogTypeError, logbuffer);
+  }
+
+  if (noDrained > 0) {
+    fflush(stdout);
+  }
+
+  return noDrained;
+}
+
 void Log(const char *logentry, ...) {
   va_list argsPtr;
   va_start(argsPtr, logentry);
@@ -114,6 +303,8 @@ void Crash(const int errCode, const char *logentry, ...) {
 void Exit(const int status) {
   Log("PortSentry is shutting down");
 
+  FreeLogger();
+
   if (isSyslogOpen == TRUE) {
     closelog();
     isSyslogOpen = FALSE;
@@ -131,6 +322,16 @@ void Exit(const int status) {
     configData.udpPortsLength = 0;
   }
 
+  if (configData.tcpPortBitmap != NULL) {
+    free(configData.tcpPortBitmap);
+    configData.tcpPortBitmap = NULL;
+  }
+
+  if (configData.udpPortBitmap != NULL) {
+    free(configData.udpPortBitmap);
+    configData.udpPortBitmap = NULL;
+  }
+
   exit(status);
 }
 
@@ -312,6 +513,44 @@ int KillRunCmd(const char *target, const int port, const char *killString, const
   return TRUE;
 }
 
+/* Run KILL_ROUTE once for a batch of hosts. The string $TARGETS$ is replaced
+ * with the hosts separated by spaces.
+ */
+int KillRouteTargets(const char *targets, const char *killString, const char *detectionType) {
+  char *command = NULL;
+  int status;
+
+  if ((status = RunTargetsCommand(targets, killString, detectionType, "KILL_ROUTE", &command)) == TRUE) {
+    Log("attackalert: Hosts %s have been blocked via dropped route using command: \"%s\"", targets, command);
+  } else if (status == ERROR) {
+    Error("There was an error trying to block hosts %s", targets);
+  }
+
+  if (command != NULL) {
+    free(command);
+  }
+
+  return status;
+}
+
+/* Run KILL_RUN_CMD once for a batch of hosts, see KillRouteTargets() */
+int KillRunCmdTargets(const char *targets, const char *killString, const char *detectionType) {
+  char *command = NULL;
+  int status;
+
+  if ((status = RunTargetsCommand(targets, killString, detectionType, "KILL_RUN_CMD", &command)) == TRUE) {
+    Log("attackalert: External command run for hosts: %s using command: \"%s\"", targets, command);
+  } else if (status == ERROR) {
+    Error("There was an error trying to run command for hosts %s", targets);
+  }
+
+  if (command != NULL) {
+    free(command);
+  }
+
+  return status;
+}
+
 /* this function will drop the host into the TCP wrappers hosts.deny file to deny
  * all access. The drop route metod is preferred as this stops UDP attacks as well
  * as TCP. You may find though that host.deny will be a more permanent home.. */
@@ -380,6 +619,12 @@ int KillHostsDeny(const char *target, const int port, const char *killString, co
     return ERROR;
   }
 
+  if (SetReplacementFileAttributes(output, &st, tempFile) != TRUE) {
+    fclose(output);
+    unlink(tempFile);
+    return ERROR;
+  }
+
   FILE *input = fopen(WRAPPER_HOSTS_DENY, "r");
   if (input != NULL) {
     char line[MAXBUF];
@@ -396,6 +641,13 @@ int KillHostsDeny(const char *target, const int port, const char *killString, co
     return ERROR;
   }
 
+  if (fflush(output) != 0 || fsync(fileno(output)) == -1) {
+    Error("Error writing to temporary file %s: %s", tempFile, ErrnoString(err, sizeof(err)));
+    fclose(output);
+    unlink(tempFile);
+    return ERROR;
+  }
+
   fclose(output);
 
   if (rename(tempFile, WRAPPER_HOSTS_DENY) == -1) {
@@ -408,6 +660,165 @@ int KillHostsDeny(const char *target, const int port, const char *killString, co
   return TRUE;
 }
 
+/* Run UNBLOCK_CMD for a host whose block has expired. $TARGET$ is the only token, the port and
+ * mode of the original detection aren't known anymore.
+ */
+int UnblockRunCmd(const char *target, const char *unblockString) {
+  char commandString[MAXBUF];
+  int unblockStatus;
+
+  if (strlen(unblockString) == 0)
+    return FALSE;
+
+  if (SubstString(target, "$TARGET$", unblockString, commandString, MAXBUF) == ERROR) {
+    Log("Error trying to parse $TARGET$ Token for UNBLOCK_CMD. Skipping.");
+    return ERROR;
+  }
+
+  unblockStatus = system(commandString);
+
+  if (unblockStatus == 127) {
+    Error("There was an error trying to unblock host (exec fail) %s", target);
+    return ERROR;
+  } else if (unblockStatus < 0) {
+    Error("There was an error trying to unblock host (system fail) %s", target);
+    return ERROR;
+  }
+
+  Log("attackalert: Host %s has been unblocked using command: \"%s\"", target, commandString);
+  return TRUE;
+}
+
+/* Remove the lines added by KillHostsDeny() for the given hosts from hosts.deny. A line is removed if it
+ * matches the KILL_HOSTS_DENY string with $TARGET$ being one of the hosts, $PORT$ and $MODE$ match any value.
+ * targets must be sorted with CompareStrings(), the file is rewritten once for all of them.
+ */
+int UnblockHostsDeny(const char *const *targets, const int count, const char *killString) {
+  FILE *input = NULL, *output = NULL;
+  char line[MAXBUF], target[INET6_ADDRSTRLEN], tempFile[MAXBUF];
+  const char *key = target;
+  size_t lineLen;
+  int status = ERROR, noRemoved = 0;
+  struct stat st;
+  char err[ERRNOMAXBUF];
+
+  if (strlen(killString) == 0 || count == 0)
+    return FALSE;
+
+  if (stat(WRAPPER_HOSTS_DENY, &st) == -1) {
+    Error("Cannot stat file %s: %s", WRAPPER_HOSTS_DENY, ErrnoString(err, sizeof(err)));
+    return ERROR;
+  }
+
+  if (S_ISLNK(st.st_mode)) {
+    Error("File %s is a symbolic link, refusing to modify", WRAPPER_HOSTS_DENY);
+    return ERROR;
+  }
+
+  if ((st.st_mode & S_IWOTH) != 0) {
+    Error("File %s is world-writable, refusing to modify", WRAPPER_HOSTS_DENY);
+    return ERROR;
+  }
+
+  snprintf(tempFile, sizeof(tempFile), "%s.tmp", WRAPPER_HOSTS_DENY);
+
+  if ((input = fopen(WRAPPER_HOSTS_DENY, "r")) == NULL) {
+    Error("Unable to open file %s for reading: %s", WRAPPER_HOSTS_DENY, ErrnoString(err, sizeof(err)));
+    goto exit;
+  }
+
+  if (fstat(fileno(input), &st) == -1) {
+    Error("Cannot stat file %s: %s", WRAPPER_HOSTS_DENY, ErrnoString(err, sizeof(err)));
+    goto exit;
+  }
+
+  if ((output = fopen(tempFile, "w")) == NULL) {
+    Error("Cannot create temporary file %s: %s", tempFile, ErrnoString(err, sizeof(err)));
+    goto exit;
+  }
+
+  if (SetReplacementFileAttributes(output, &st, tempFile) != TRUE) {
+    goto exit;
+  }
+
+  while (fgets(line, sizeof(line), input) != NULL) {
+    lineLen = strlen(line);
+
+    // Partial lines (longer than the buffer) are copied as is, portsentry never writes lines that long
+    if (lineLen > 0 && line[lineLen - 1] == '\n') {
+      line[lineLen - 1] = '\0';
+
+      if (MatchHostsDenyLine(line, killString, target, sizeof(target)) == TRUE &&
+          bsearch(&key, targets, count, sizeof(const char *), CompareStrings) != NULL) {
+        noRemoved++;
+        continue;
+      }
+
+      line[lineLen - 1] = '\n';
+    }
+
+    if (fputs(line, output) == EOF) {
+      Error("Error writing to temporary file %s", tempFile);
+      goto exit;
+    }
+  }
+
+  if (noRemoved == 0) {
+    status = FALSE;
+    goto exit;
+  }
+
+  // Make sure the new content is on disk before it replaces the original
+  if (fflush(output) != 0 || fsync(fileno(output)) == -1) {
+    Error("Error writing to temporary file %s: %s", tempFile, ErrnoString(err, sizeof(err)));
+    goto exit;
+  }
+
+  if (fclose(output) != 0) {
+    output = NULL;
+    Error("Error writing to temporary file %s", tempFile);
+    goto exit;
+  }
+  output = NULL;
+
+  if (rename(tempFile, WRAPPER_HOSTS_DENY) == -1) {
+    Error("Cannot rename temporary file %s to %s: %s", tempFile, WRAPPER_HOSTS_DENY, ErrnoString(err, sizeof(err)));
+    goto exit;
+  }
+
+  Log("attackalert: Removed %d expired hosts from %s", noRemoved, WRAPPER_HOSTS_DENY);
+  status = TRUE;
+
+exit:
+  if (input != NULL) {
+    fclose(input);
+  }
+
+  if (output != NULL) {
+    fclose(output);
+  }
+
+  if (status != TRUE) {
+    unlink(tempFile);
+  }
+
+  return status;
+}
+
+/* Files which are rewritten through a temporary file (hosts.deny, the blocked file) give the temporary
+ * file the owner and mode of the original instead of the defaults it was created with.
+ */
+int SetReplacementFileAttributes(FILE *fp, const struct stat *st, const char *path) {
+  char err[ERRNOMAXBUF];
+
+  if (fchown(fileno(fp), st->st_uid, st->st_gid) == -1 || fchmod(fileno(fp), st->st_mode & 07777) == -1) {
+    Error("Cannot set owner and mode of temporary file %s: %s", path, ErrnoString(err, sizeof(err)));
+    return ERROR;
+  }
+
+  return TRUE;
+}
+
 int FindInFile(const char *searchString, const char *filename) {
   FILE *fp = NULL;
   char line[MAXBUF];
@@ -650,3 +1061,97 @@ void XmitBannerIfConfigured(const int proto, const int socket, const struct sock
     Error("Could not write banner to socket (ignoring): %s", ErrnoString(err, sizeof(err)));
   }
 }
+
+/* The target list may be long, so the command is allocated to fit rather than using MAXBUF.
+ * The caller frees *command. Returns TRUE if the command was run, FALSE if no command is set and ERROR on failure.
+ */
+static int RunTargetsCommand(const char *targets, const char *killString, const char *detectionType, const char *option, char **command) {
+  const char *p;
+  char *temp = NULL;
+  int noTokens = 0, tempSize, commandSize, status = ERROR, killStatus;
+
+  if (strlen(killString) == 0)
+    return FALSE;
+
+  for (p = strstr(killString, "$TARGETS$"); p != NULL; p = strstr(p + 1, "$TARGETS$")) {
+    noTokens++;
+  }
+
+  tempSize = strlen(killString) + noTokens * strlen(targets) + 1;
+  commandSize = tempSize + MAXBUF;
+
+  if ((temp = malloc(tempSize)) == NULL || (*command = malloc(commandSize)) == NULL) {
+    Error("Unable to allocate memory for %s command", option);
+    goto exit;
+  }
+
+  if (SubstString(targets, "$TARGETS$", killString, temp, tempSize) == ERROR) {
+    Log("Error trying to parse $TARGETS$ Token for %s. Skipping.", option);
+    goto exit;
+  }
+
+  if (SubstString(detectionType, "$MODE$", temp, *command, commandSize) == ERROR) {
+    Log("Error trying to parse $MODE$ Token for %s. Skipping.", option);
+    goto exit;
+  }
+
+  Debug("RunTargetsCommand: running %s command: %s", option, *command);
+
+  killStatus = system(*command);
+
+  if (killStatus == 127) {
+    Error("There was an error trying to run %s (exec fail)", option);
+    goto exit;
+  } else if (killStatus < 0) {
+    Error("There was an error trying to run %s (system fail)", option);
+    goto exit;
+  }
+
+  status = TRUE;
+
+exit:
+  if (temp != NULL) {
+    free(temp);
+  }
+
+  return status;
+}
+
+/* Match a line against a KILL_HOSTS_DENY string, the address matched by $TARGET$ is copied to target */
+int MatchHostsDenyLine(const char *line, const char *killString, char *target, const size_t targetSize) {
+  const char *k = killString, *l = line;
+  size_t len;
+
+  while (*k != '\0') {
+    if (strncmp(k, "$TARGET$", 8) == 0) {
+      for (len = 0; isxdigit((unsigned char)l[len]) || l[len] == '.' || l[len] == ':'; len++)
+        ;
+      if (len == 0 || len >= targetSize) {
+        return FALSE;
+      }
+      memcpy(target, l, len);
+      target[len] = '\0';
+      k += 8;
+    } else if (strncmp(k, "$PORT$", 6) == 0) {
+      for (len = 0; isdigit((unsigned char)l[len]); len++)
+        ;
+      k += 6;
+    } else if (strncmp(k, "$MODE$", 6) == 0) {
+      for (len = 0; isalpha((unsigned char)l[len]); len++)
+        ;
+      k += 6;
+    } else if (*k == *l) {
+      len = 1;
+      k++;
+    } else {
+      return FALSE;
+    }
+
+    if (len == 0) {
+      return FALSE;
+    }
+    l += len;
+  }
+
+  return (*l == '\0') ? TRUE : FALSE;
+}
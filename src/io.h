@@ -7,6 +7,8 @@
 #include <netinet/in.h>
 #include <netinet/ip.h>
 #include <netinet/tcp.h>
+#include <stdio.h>
+#include <sys/stat.h>
 
 #include "packet_info.h"
 
@@ -16,6 +18,8 @@ __attribute__((format(printf, 1, 2))) void Debug(const char *logentry, ...);
 __attribute__((format(printf, 1, 2))) void Verbose(const char *logentry, ...);
 __attribute__((format(printf, 2, 3))) void Crash(const int errCode, const char *logentry, ...);
 void Exit(const int);
+int InitLogger(void);
+void FreeLogger(void);
 int NeverBlock(const char *, const char *);
 int CheckConfig(void);
 int OpenSocket(const int family, const int type, const int protocol, const uint8_t tcpReuseAddr);
@@ -23,6 +27,12 @@ int BindSocket(const int, const int, const int, const int);
 int KillRoute(const char *, const int, const char *, const char *);
 int KillHostsDeny(const char *, const int, const char *, const char *);
 int KillRunCmd(const char *, const int, const char *, const char *);
+int KillRouteTargets(const char *targets, const char *killString, const char *detectionType);
+int KillRunCmdTargets(const char *targets, const char *killString, const char *detectionType);
+int UnblockRunCmd(const char *target, const char *unblockString);
+int UnblockHostsDeny(const char *const *targets, const int count, const char *killString);
+int MatchHostsDenyLine(const char *line, const char *killString, char *target, const size_t targetSize);
+int SetReplacementFileAttributes(FILE *fp, const struct stat *st, const char *path);
 int FindInFile(const char *, const char *);
 int SubstString(const char *replaceToken, const char *findToken, const char *source, char *dest, const int destSize);
 int testFileAccess(const char *, const char *, const uint8_t);
@@ -0,0 +1,135 @@
+// SPDX-FileCopyrightText: 2024 Marcus Hufvudsson <mh@protohuf.com>
+//
+// SPDX-License-Identifier: CPL-1.0
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <netinet/in.h>
+
+#include "portsentry.h"
+#include "config_data.h"
+#include "listen_cache.h"
+#include "port.h"
+#include "io.h"
+#include "util.h"
+
+#define PROC_NET_LINE_MAX 256
+#define TCP_STATE_LISTEN 0x0A
+
+/* Snapshot of the local TCP ports in LISTEN state and the bound UDP ports,
+ * both IPv4 and IPv6, as read from /proc/net. A port is considered in use
+ * regardless of which address or family the socket is bound to, the same
+ * result a bind() probe to the wildcard address would give.
+ */
+struct ListenCache {
+  struct PortBitmap tcp;
+  struct PortBitmap udp;
+  struct timespec lastRefresh;
+  uint8_t isValid;
+  uint8_t isRefreshed;
+};
+
+static struct ListenCache lc;
+
+static int RefreshListenCache(void);
+static int ReadProcNet(const char *path, struct PortBitmap *bitmap, const int listenOnly);
+static long GetElapsedMs(const struct timespec *start, const struct timespec *end);
+
+/* Returns TRUE if a local socket occupies the port, FALSE if not and ERROR if
+ * the cache is unavailable, in which case the caller should probe the port itself.
+ * Only reads the bitmaps, the cache is refreshed by MaintainListenCache().
+ */
+int IsPortListening(const int protocol, const uint16_t port) {
+  if (lc.isValid == FALSE) {
+    return ERROR;
+  }
+
+  return IsPortInBitmap((protocol == IPPROTO_TCP) ? &lc.tcp : &lc.udp, port);
+}
+
+/* Called by the sentry loops after each poll(), before any packets are handled. Re-reads /proc/net
+ * once LISTEN_CACHE_REFRESH milliseconds have passed since the last refresh.
+ */
+void MaintainListenCache(void) {
+  struct timespec now;
+
+  if (configData.listenCacheRefresh == 0 || configData.sentryMode != SENTRY_MODE_STEALTH) {
+    return;
+  }
+
+  if (clock_gettime(CLOCK_MONOTONIC, &now) == -1) {
+    lc.isValid = FALSE;
+    return;
+  }
+
+  if (lc.isRefreshed == FALSE || GetElapsedMs(&lc.lastRefresh, &now) >= configData.listenCacheRefresh) {
+    lc.lastRefresh = now;
+    lc.isRefreshed = TRUE;
+    lc.isValid = (RefreshListenCache() == TRUE) ? TRUE : FALSE;
+  }
+}
+
+static int RefreshListenCache(void) {
+  memset(&lc.tcp, 0, sizeof(lc.tcp));
+  memset(&lc.udp, 0, sizeof(lc.udp));
+
+  if (ReadProcNet("/proc/net/tcp", &lc.tcp, TRUE) != TRUE ||
+      ReadProcNet("/proc/net/tcp6", &lc.tcp, TRUE) != TRUE ||
+      ReadProcNet("/proc/net/udp", &lc.udp, FALSE) != TRUE ||
+      ReadProcNet("/proc/net/udp6", &lc.udp, FALSE) != TRUE) {
+    Error("Unable to read listening sockets, falling back to probing ports with bind()");
+    return ERROR;
+  }
+
+  Debug("Listen cache refreshed, %d TCP and %d UDP ports in use", GetNoPorts(&lc.tcp), GetNoPorts(&lc.udp));
+
+  return TRUE;
+}
+
+/* Parse lines on the form:
+ *   sl  local_address rem_address   st ...
+ *    0: 0100007F:0035 00000000:0000 0A ...
+ */
+static int ReadProcNet(const char *path, struct PortBitmap *bitmap, const int listenOnly) {
+  FILE *fp;
+  char line[PROC_NET_LINE_MAX], err[ERRNOMAXBUF];
+  unsigned int port, state;
+
+  if ((fp = fopen(path, "r")) == NULL) {
+    // The IPv6 tables are missing when IPv6 is disabled
+    if (errno == ENOENT) {
+      return TRUE;
+    }
+
+    Error("Unable to open %s: %s", path, ErrnoString(err, sizeof(err)));
+    return ERROR;
+  }
+
+  // Skip header
+  if (fgets(line, sizeof(line), fp) == NULL) {
+    fclose(fp);
+    return TRUE;
+  }
+
+  while (fgets(line, sizeof(line), fp) != NULL) {
+    if (sscanf(line, "%*u: %*[0-9A-Fa-f]:%x %*[0-9A-Fa-f]:%*x %x", &port, &state) != 2) {
+      continue;
+    }
+
+    if (port > UINT16_MAX || (listenOnly == TRUE && state != TCP_STATE_LISTEN)) {
+      continue;
+    }
+
+    SetPortInBitmap(bitmap, (uint16_t)port);
+  }
+
+  fclose(fp);
+
+  return TRUE;
+}
+
+static long GetElapsedMs(const struct timespec *start, const struct timespec *end) {
+  return (end->tv_sec - start->tv_sec) * 1000 + (end->tv_nsec - start->tv_nsec) / 1000000;
+}
@@ -0,0 +1,9 @@
+// SPDX-FileCopyrightText: 2024 Marcus Hufvudsson <mh@protohuf.com>
+//
+// SPDX-License-Identifier: CPL-1.0
+
+#pragma once
+#include <stdint.h>
+
+int IsPortListening(const int protocol, const uint16_t port);
+void MaintainListenCache(void);
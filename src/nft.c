@@ -0,0 +1,680 @@
+// SPDX-FileCopyrightText: 2024 Marcus Hufvudsson <mh@protohuf.com>
+//
+// SPDX-License-Identifier: CPL-1.0
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <assert.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <linux/netlink.h>
+#include <linux/netfilter.h>
+#include <linux/netfilter/nfnetlink.h>
+#include <linux/netfilter/nf_tables.h>
+
+#include "portsentry.h"
+#include "config_data.h"
+#include "nft.h"
+#include "block.h"
+#include "io.h"
+#include "util.h"
+
+#ifndef SOL_NETLINK
+#define SOL_NETLINK 270
+#endif
+
+#define NFT_SOCKET_BUFFER_SIZE (4 * 1024 * 1024)
+#define NFT_RECEIVE_BUFFER_SIZE 8192
+#define NFT_RECEIVE_TIMEOUT 1  // seconds
+#define NFT_ELEMENT_SIZE_IPV4 16
+#define NFT_ELEMENT_SIZE_IPV6 28
+#define NFT_MAX_ELEMENTS_PER_MESSAGE 2048  // The element list is a single attribute, its length must fit in 16 bits
+
+struct NftBuffer {
+  uint8_t *data;
+  size_t length;
+  size_t size;
+};
+
+/* Addresses are collected with NftAddAddress() and sent to the kernel by NftCommit(), as one
+ * nfnetlink batch (transaction) per maxTransactionElements addresses. Elements are added without
+ * NLM_F_EXCL, so adding an address which is already in the set is not an error.
+ */
+struct NftState {
+  int sockfd;
+  int family;  // NFPROTO_*
+  uint32_t seq;
+  uint32_t maxTransactionElements;
+  uint32_t *pending4;
+  uint32_t noPending4;
+  uint32_t sizePending4;
+  struct in6_addr *pending6;
+  uint32_t noPending6;
+  uint32_t sizePending6;
+  struct NftBuffer buf;
+  uint8_t isInitialized;
+};
+
+static struct NftState nft = {.sockfd = -1};
+
+static int GetNftFamily(const char *family);
+static int SetSendBuffer(const int size);
+static int AddRestoredAddress(const int family, const void *addr, void *ctx);
+static int Reserve(struct NftBuffer *buf, const size_t len);
+static int PutMessage(struct NftBuffer *buf, const uint16_t type, const uint16_t flags, const uint8_t family, const uint16_t resId, size_t *offset);
+static void EndMessage(struct NftBuffer *buf, const size_t offset);
+static int PutAttr(struct NftBuffer *buf, const uint16_t type, const void *data, const uint16_t len);
+static int BeginNest(struct NftBuffer *buf, const uint16_t type, size_t *offset);
+static void EndNest(struct NftBuffer *buf, const size_t offset);
+static int PutSetElements(struct NftBuffer *buf, const char *set, const void *addrs, const uint16_t addrLen, const uint32_t count);
+static int PutSetMessages(struct NftBuffer *buf, const uint16_t msgType, const char *set, const void *addrs, const uint16_t addrLen, const uint32_t count, size_t *lastMsg);
+static int CommitPending(const uint16_t msgType);
+static int RemoveEachAddress(const uint32_t *addrs4, const uint32_t count4, const struct in6_addr *addrs6, const uint32_t count6);
+static int SendTransaction(const uint16_t msgType, const uint32_t *addrs4, const uint32_t count4, const struct in6_addr *addrs6, const uint32_t count6);
+static int ReceiveAck(const uint16_t msgType, const uint32_t firstSeq, const uint32_t lastSeq, const uint32_t ackSeq);
+static const char *GetActionString(const uint16_t msgType);
+static void DrainSocket(void);
+
+/* Open the netfilter netlink socket if NFT_TABLE is configured.
+ * Returns TRUE if nftables blocking is enabled, FALSE if not configured and ERROR on failure.
+ */
+int InitNft(void) {
+  struct sockaddr_nl addr;
+  struct timeval tv;
+  int one = 1;
+  char err[ERRNOMAXBUF];
+
+  if (nft.isInitialized == TRUE) {
+    return TRUE;
+  }
+
+  if (strlen(configData.nftTable) == 0) {
+    return FALSE;
+  }
+
+  if ((nft.family = GetNftFamily(configData.nftFamily)) == ERROR) {
+    Error("Invalid nftables family %s", configData.nftFamily);
+    return ERROR;
+  }
+
+  if ((nft.sockfd = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_NETFILTER)) == -1) {
+    Error("Unable to create nftables netlink socket: %s", ErrnoString(err, sizeof(err)));
+    goto error;
+  }
+
+  memset(&addr, 0, sizeof(addr));
+  addr.nl_family = AF_NETLINK;
+
+  if (bind(nft.sockfd, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+    Error("Unable to bind nftables netlink socket: %s", ErrnoString(err, sizeof(err)));
+    goto error;
+  }
+
+  // Don't echo the (possibly large) request in the acks
+  if (setsockopt(nft.sockfd, SOL_NETLINK, NETLINK_CAP_ACK, &one, sizeof(one)) == -1) {
+    Debug("Unable to set NETLINK_CAP_ACK on nftables socket: %s", ErrnoString(err, sizeof(err)));
+  }
+
+  tv.tv_sec = NFT_RECEIVE_TIMEOUT;
+  tv.tv_usec = 0;
+  if (setsockopt(nft.sockfd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) == -1) {
+    Error("Unable to set receive timeout on nftables socket: %s", ErrnoString(err, sizeof(err)));
+    goto error;
+  }
+
+  if (SetSendBuffer(NFT_SOCKET_BUFFER_SIZE) != TRUE) {
+    goto error;
+  }
+
+  nft.seq = (uint32_t)time(NULL);
+  nft.isInitialized = TRUE;
+
+  Debug("nftables blocking enabled, table: %s %s set IPv4: %s set IPv6: %s (max %u elements per transaction)", configData.nftFamily, configData.nftTable,
+        configData.nftSetIpv4, configData.nftSetIpv6, nft.maxTransactionElements);
+
+  return TRUE;
+
+error:
+  FreeNft();
+  return ERROR;
+}
+
+void FreeNft(void) {
+  if (nft.sockfd != -1) {
+    close(nft.sockfd);
+  }
+
+  if (nft.pending4 != NULL) {
+    free(nft.pending4);
+  }
+
+  if (nft.pending6 != NULL) {
+    free(nft.pending6);
+  }
+
+  if (nft.buf.data != NULL) {
+    free(nft.buf.data);
+  }
+
+  memset(&nft, 0, sizeof(nft));
+  nft.sockfd = -1;
+}
+
+/* Add an address to the pending transaction.
+ * Returns TRUE if the address was added, FALSE if no set is configured for the family and ERROR on failure.
+ */
+int NftAddAddress(const int family, const void *addr) {
+  void *p;
+
+  assert(nft.isInitialized == TRUE);
+  assert(family == AF_INET || family == AF_INET6);
+
+  if (family == AF_INET) {
+    if (strlen(configData.nftSetIpv4) == 0) {
+      return FALSE;
+    }
+
+    if (nft.noPending4 == nft.sizePending4) {
+      if ((p = realloc(nft.pending4, (nft.sizePending4 == 0 ? 64 : nft.sizePending4 * 2) * sizeof(uint32_t))) == NULL) {
+        Error("Unable to allocate memory for nftables elements");
+        return ERROR;
+      }
+      nft.pending4 = p;
+      nft.sizePending4 = (nft.sizePending4 == 0) ? 64 : nft.sizePending4 * 2;
+    }
+
+    memcpy(&nft.pending4[nft.noPending4++], addr, sizeof(uint32_t));
+  } else {
+    if (strlen(configData.nftSetIpv6) == 0) {
+      return FALSE;
+    }
+
+    if (nft.noPending6 == nft.sizePending6) {
+      if ((p = realloc(nft.pending6, (nft.sizePending6 == 0 ? 64 : nft.sizePending6 * 2) * sizeof(struct in6_addr))) == NULL) {
+        Error("Unable to allocate memory for nftables elements");
+        return ERROR;
+      }
+      nft.pending6 = p;
+      nft.sizePending6 = (nft.sizePending6 == 0) ? 64 : nft.sizePending6 * 2;
+    }
+
+    memcpy(&nft.pending6[nft.noPending6++], addr, sizeof(struct in6_addr));
+  }
+
+  return TRUE;
+}
+
+/* Send all pending addresses to the kernel. The pending list is cleared even on failure.
+ * Returns TRUE if all transactions were committed, ERROR otherwise.
+ */
+int NftCommit(void) {
+  return CommitPending(NFT_MSG_NEWSETELEM);
+}
+
+/* Add a target given as an address string to the pending transaction.
+ * Returns TRUE if added, FALSE if nftables blocking isn't configured for the address family and ERROR on failure.
+ */
+int NftAddTarget(const char *target) {
+  struct in6_addr addr;
+
+  if (nft.isInitialized == FALSE) {
+    return FALSE;
+  }
+
+  if (inet_pton(AF_INET, target, &addr) == 1) {
+    return NftAddAddress(AF_INET, &addr);
+  } else if (inet_pton(AF_INET6, target, &addr) == 1) {
+    return NftAddAddress(AF_INET6, &addr);
+  }
+
+  Error("Unable to parse target address %s for nftables blocking", target);
+  return ERROR;
+}
+
+/* Block a single target, called from DisposeTarget().
+ * Returns TRUE if blocked, FALSE if nftables blocking isn't configured for the address family and ERROR on failure.
+ */
+int NftBlockTarget(const char *target) {
+  int ret;
+
+  if ((ret = NftAddTarget(target)) != TRUE) {
+    return ret;
+  }
+
+  if (NftCommit() != TRUE) {
+    Error("There was an error trying to block host %s via nftables", target);
+    return ERROR;
+  }
+
+  Log("attackalert: Host %s has been blocked via nftables set %s %s %s", target, configData.nftFamily, configData.nftTable,
+      (strchr(target, ':') == NULL) ? configData.nftSetIpv4 : configData.nftSetIpv6);
+
+  return TRUE;
+}
+
+/* Remove expired targets from the sets, all in a single transaction if possible.
+ * Targets not in the set are ignored, they might have been removed by the kernel (set timeout) or by hand.
+ * Returns TRUE if removed, FALSE if nftables blocking isn't configured and ERROR on failure.
+ */
+int NftUnblockTargets(const char *const *targets, const int count) {
+  int i, ret, noTargets = 0;
+
+  if (nft.isInitialized == FALSE) {
+    return FALSE;
+  }
+
+  for (i = 0; i < count; i++) {
+    if ((ret = NftAddTarget(targets[i])) == ERROR) {
+      nft.noPending4 = 0;
+      nft.noPending6 = 0;
+      return ERROR;
+    } else if (ret == TRUE) {
+      noTargets++;
+    }
+  }
+
+  if (noTargets == 0) {
+    return FALSE;
+  }
+
+  if (CommitPending(NFT_MSG_DELSETELEM) != TRUE) {
+    Error("There was an error trying to unblock %d hosts via nftables", noTargets);
+    return ERROR;
+  }
+
+  Log("attackalert: %d hosts have been unblocked via nftables table %s %s", noTargets, configData.nftFamily, configData.nftTable);
+
+  return TRUE;
+}
+
+/* Add all addresses in the blocked file to the sets, so blocks made before a restart (or reboot) are
+ * in place again before any packets are inspected. Returns TRUE on success, ERROR otherwise.
+ */
+int NftRestoreBlocked(const struct BlockedState *bs) {
+  struct timespec start, end;
+  uint32_t noRestored = 0;
+
+  assert(nft.isInitialized == TRUE);
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  if (ForEachBlockedAddress(bs, AddRestoredAddress, &noRestored) != TRUE) {
+    nft.noPending4 = 0;
+    nft.noPending6 = 0;
+    return ERROR;
+  }
+
+  if (noRestored == 0) {
+    return TRUE;
+  }
+
+  if (NftCommit() != TRUE) {
+    Error("Unable to restore %u blocked hosts into nftables table %s %s", noRestored, configData.nftFamily, configData.nftTable);
+    return ERROR;
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &end);
+
+  Log("Restored %u blocked hosts into nftables table %s %s in %ld ms", noRestored, configData.nftFamily, configData.nftTable,
+      (long)((end.tv_sec - start.tv_sec) * 1000 + (end.tv_nsec - start.tv_nsec) / 1000000));
+
+  return TRUE;
+}
+
+static int AddRestoredAddress(const int family, const void *addr, void *ctx) {
+  int ret;
+
+  if ((ret = NftAddAddress(family, addr)) == TRUE) {
+    (*(uint32_t *)ctx)++;
+  }
+
+  return (ret == ERROR) ? ERROR : TRUE;
+}
+
+static int CommitPending(const uint16_t msgType) {
+  uint32_t offset4 = 0, offset6 = 0, count4, count6;
+  int status = TRUE, ret;
+
+  assert(nft.isInitialized == TRUE);
+
+  // Try to fit everything in a single transaction, the sizes are a worst case estimate
+  if (nft.noPending4 + nft.noPending6 > nft.maxTransactionElements &&
+      (uint64_t)(nft.noPending4 + nft.noPending6) * NFT_ELEMENT_SIZE_IPV6 * 8 / 7 < INT32_MAX / 2) {
+    SetSendBuffer((int)((uint64_t)(nft.noPending4 + nft.noPending6) * NFT_ELEMENT_SIZE_IPV6 * 8 / 7));
+  }
+
+  while (offset4 < nft.noPending4 || offset6 < nft.noPending6) {
+    count4 = nft.noPending4 - offset4;
+    if (count4 > nft.maxTransactionElements) {
+      count4 = nft.maxTransactionElements;
+    }
+
+    count6 = nft.noPending6 - offset6;
+    if (count6 > nft.maxTransactionElements - count4) {
+      count6 = nft.maxTransactionElements - count4;
+    }
+
+    ret = SendTransaction(msgType, nft.pending4 + offset4, count4, nft.pending6 + offset6, count6);
+
+    // A single element missing from the set aborts the whole transaction, retry the elements one by one
+    if (ret == FALSE) {
+      ret = RemoveEachAddress(nft.pending4 + offset4, count4, nft.pending6 + offset6, count6);
+    }
+
+    if (ret != TRUE) {
+      status = ERROR;
+      break;
+    }
+
+    offset4 += count4;
+    offset6 += count6;
+  }
+
+  nft.noPending4 = 0;
+  nft.noPending6 = 0;
+
+  return status;
+}
+
+// Returns TRUE unless a removal fails for another reason than the element not being in the set
+static int RemoveEachAddress(const uint32_t *addrs4, const uint32_t count4, const struct in6_addr *addrs6, const uint32_t count6) {
+  uint32_t i;
+
+  for (i = 0; i < count4; i++) {
+    if (SendTransaction(NFT_MSG_DELSETELEM, &addrs4[i], 1, NULL, 0) == ERROR) {
+      return ERROR;
+    }
+  }
+
+  for (i = 0; i < count6; i++) {
+    if (SendTransaction(NFT_MSG_DELSETELEM, NULL, 0, &addrs6[i], 1) == ERROR) {
+      return ERROR;
+    }
+  }
+
+  return TRUE;
+}
+
+/* A transaction must fit in a single send, so the send buffer limits the transaction size.
+ * SO_SNDBUFFORCE lets root go beyond wmem_max, otherwise the largest allowed buffer is used.
+ */
+static int SetSendBuffer(const int size) {
+  int bufferSize = size;
+  socklen_t optLen = sizeof(bufferSize);
+  char err[ERRNOMAXBUF];
+
+  if (setsockopt(nft.sockfd, SOL_SOCKET, SO_SNDBUFFORCE, &bufferSize, sizeof(bufferSize)) == -1) {
+    setsockopt(nft.sockfd, SOL_SOCKET, SO_SNDBUF, &bufferSize, sizeof(bufferSize));
+  }
+
+  if (getsockopt(nft.sockfd, SOL_SOCKET, SO_SNDBUF, &bufferSize, &optLen) == -1) {
+    Error("Unable to get send buffer size of nftables socket: %s", ErrnoString(err, sizeof(err)));
+    return ERROR;
+  }
+
+  // Leave room for the message headers, at most one per NFT_MAX_ELEMENTS_PER_MESSAGE elements
+  nft.maxTransactionElements = (uint32_t)(((uint64_t)bufferSize * 7 / 8) / NFT_ELEMENT_SIZE_IPV6);
+  if (nft.maxTransactionElements == 0) {
+    nft.maxTransactionElements = 1;
+  }
+
+  return TRUE;
+}
+
+static int GetNftFamily(const char *family) {
+  if (strcmp(family, "ip") == 0) {
+    return NFPROTO_IPV4;
+  } else if (strcmp(family, "ip6") == 0) {
+    return NFPROTO_IPV6;
+  } else if (strcmp(family, "inet") == 0) {
+    return NFPROTO_INET;
+  }
+
+  return ERROR;
+}
+
+static int Reserve(struct NftBuffer *buf, const size_t len) {
+  size_t size;
+  uint8_t *data;
+
+  if (buf->length + len <= buf->size) {
+    return TRUE;
+  }
+
+  size = (buf->size == 0) ? 65536 : buf->size;
+  while (size < buf->length + len) {
+    size *= 2;
+  }
+
+  if ((data = realloc(buf->data, size)) == NULL) {
+    Error("Unable to allocate memory for nftables message");
+    return ERROR;
+  }
+
+  buf->data = data;
+  buf->size = size;
+
+  return TRUE;
+}
+
+static int PutMessage(struct NftBuffer *buf, const uint16_t type, const uint16_t flags, const uint8_t family, const uint16_t resId, size_t *offset) {
+  struct nlmsghdr *nh;
+  struct nfgenmsg *nfg;
+  const size_t len = NLMSG_HDRLEN + NLMSG_ALIGN(sizeof(struct nfgenmsg));
+
+  if (Reserve(buf, len) != TRUE) {
+    return ERROR;
+  }
+
+  *offset = buf->length;
+  memset(buf->data + buf->length, 0, len);
+
+  nh = (struct nlmsghdr *)(buf->data + buf->length);
+  nh->nlmsg_type = type;
+  nh->nlmsg_flags = flags;
+  nh->nlmsg_seq = ++nft.seq;
+
+  nfg = (struct nfgenmsg *)(buf->data + buf->length + NLMSG_HDRLEN);
+  nfg->nfgen_family = family;
+  nfg->version = NFNETLINK_V0;
+  nfg->res_id = htons(resId);
+
+  buf->length += len;
+
+  return TRUE;
+}
+
+static void EndMessage(struct NftBuffer *buf, const size_t offset) {
+  ((struct nlmsghdr *)(buf->data + offset))->nlmsg_len = (uint32_t)(buf->length - offset);
+}
+
+static int PutAttr(struct NftBuffer *buf, const uint16_t type, const void *data, const uint16_t len) {
+  struct nlattr *nla;
+  const size_t attrLen = NLA_HDRLEN + NLA_ALIGN(len);
+
+  if (Reserve(buf, attrLen) != TRUE) {
+    return ERROR;
+  }
+
+  memset(buf->data + buf->length, 0, attrLen);
+  nla = (struct nlattr *)(buf->data + buf->length);
+  nla->nla_type = type;
+  nla->nla_len = NLA_HDRLEN + len;
+  memcpy(buf->data + buf->length + NLA_HDRLEN, data, len);
+
+  buf->length += attrLen;
+
+  return TRUE;
+}
+
+static int BeginNest(struct NftBuffer *buf, const uint16_t type, size_t *offset) {
+  if (Reserve(buf, NLA_HDRLEN) != TRUE) {
+    return ERROR;
+  }
+
+  *offset = buf->length;
+  ((struct nlattr *)(buf->data + buf->length))->nla_type = NLA_F_NESTED | type;
+  buf->length += NLA_HDRLEN;
+
+  return TRUE;
+}
+
+static void EndNest(struct NftBuffer *buf, const size_t offset) {
+  ((struct nlattr *)(buf->data + offset))->nla_len = (uint16_t)(buf->length - offset);
+}
+
+static int PutSetElements(struct NftBuffer *buf, const char *set, const void *addrs, const uint16_t addrLen, const uint32_t count) {
+  size_t elements, element, key;
+  uint32_t i;
+
+  if (PutAttr(buf, NFTA_SET_ELEM_LIST_TABLE, configData.nftTable, strlen(configData.nftTable) + 1) != TRUE ||
+      PutAttr(buf, NFTA_SET_ELEM_LIST_SET, set, strlen(set) + 1) != TRUE ||
+      BeginNest(buf, NFTA_SET_ELEM_LIST_ELEMENTS, &elements) != TRUE) {
+    return ERROR;
+  }
+
+  for (i = 0; i < count; i++) {
+    if (BeginNest(buf, NFTA_LIST_ELEM, &element) != TRUE ||
+        BeginNest(buf, NFTA_SET_ELEM_KEY, &key) != TRUE ||
+        PutAttr(buf, NFTA_DATA_VALUE, (const uint8_t *)addrs + (size_t)i * addrLen, addrLen) != TRUE) {
+      return ERROR;
+    }
+    EndNest(buf, key);
+    EndNest(buf, element);
+  }
+
+  EndNest(buf, elements);
+
+  return TRUE;
+}
+
+static int PutSetMessages(struct NftBuffer *buf, const uint16_t msgType, const char *set, const void *addrs, const uint16_t addrLen, const uint32_t count, size_t *lastMsg) {
+  uint32_t offset, chunk;
+  size_t msg;
+
+  for (offset = 0; offset < count; offset += chunk) {
+    chunk = count - offset;
+    if (chunk > NFT_MAX_ELEMENTS_PER_MESSAGE) {
+      chunk = NFT_MAX_ELEMENTS_PER_MESSAGE;
+    }
+
+    if (PutMessage(buf, (NFNL_SUBSYS_NFTABLES << 8) | msgType, (msgType == NFT_MSG_NEWSETELEM) ? NLM_F_REQUEST | NLM_F_CREATE : NLM_F_REQUEST, (uint8_t)nft.family, 0, &msg) != TRUE ||
+        PutSetElements(buf, set, (const uint8_t *)addrs + (size_t)offset * addrLen, addrLen, chunk) != TRUE) {
+      return ERROR;
+    }
+    EndMessage(buf, msg);
+    *lastMsg = msg;
+  }
+
+  return TRUE;
+}
+
+/* Returns TRUE if committed, FALSE if a removal was rejected because an element isn't in the set and ERROR on failure */
+static int SendTransaction(const uint16_t msgType, const uint32_t *addrs4, const uint32_t count4, const struct in6_addr *addrs6, const uint32_t count6) {
+  struct NftBuffer *buf = &nft.buf;
+  struct sockaddr_nl addr;
+  uint32_t firstSeq, ackSeq;
+  size_t msg, lastMsg = 0;
+  struct nlmsghdr *nh;
+  char err[ERRNOMAXBUF];
+
+  buf->length = 0;
+  firstSeq = nft.seq + 1;
+
+  if (PutMessage(buf, NFNL_MSG_BATCH_BEGIN, NLM_F_REQUEST, AF_UNSPEC, NFNL_SUBSYS_NFTABLES, &msg) != TRUE) {
+    return ERROR;
+  }
+  EndMessage(buf, msg);
+
+  if (PutSetMessages(buf, msgType, configData.nftSetIpv4, addrs4, sizeof(uint32_t), count4, &lastMsg) != TRUE ||
+      PutSetMessages(buf, msgType, configData.nftSetIpv6, addrs6, sizeof(struct in6_addr), count6, &lastMsg) != TRUE) {
+    return ERROR;
+  }
+
+  /* Errors are always reported, and any error aborts the whole transaction. So only the last message asks for
+   * an ack, one ack per message could overflow the receive buffer on large transactions.
+   */
+  nh = (struct nlmsghdr *)(buf->data + lastMsg);
+  nh->nlmsg_flags |= NLM_F_ACK;
+  ackSeq = nh->nlmsg_seq;
+
+  if (PutMessage(buf, NFNL_MSG_BATCH_END, NLM_F_REQUEST, AF_UNSPEC, NFNL_SUBSYS_NFTABLES, &msg) != TRUE) {
+    return ERROR;
+  }
+  EndMessage(buf, msg);
+
+  // Replies left over from an earlier failed transaction would otherwise be mistaken for ours
+  DrainSocket();
+
+  memset(&addr, 0, sizeof(addr));
+  addr.nl_family = AF_NETLINK;
+
+  if (sendto(nft.sockfd, buf->data, buf->length, 0, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+    Error("Unable to send nftables transaction of %zu bytes: %s", buf->length, ErrnoString(err, sizeof(err)));
+    return ERROR;
+  }
+
+  Debug("Sent nftables transaction with %u IPv4 and %u IPv6 elements (%zu bytes)", count4, count6, buf->length);
+
+  return ReceiveAck(msgType, firstSeq, nft.seq, ackSeq);
+}
+
+// Wait for the ack of ackSeq or an error for any message in the transaction
+static int ReceiveAck(const uint16_t msgType, const uint32_t firstSeq, const uint32_t lastSeq, const uint32_t ackSeq) {
+  uint8_t reply[NFT_RECEIVE_BUFFER_SIZE];
+  struct nlmsghdr *nh;
+  struct nlmsgerr *nlErr;
+  ssize_t len;
+  int len32;
+  char err[ERRNOMAXBUF];
+
+  while (TRUE) {
+    if ((len = recv(nft.sockfd, reply, sizeof(reply), 0)) == -1) {
+      if (errno == EINTR) {
+        continue;
+      } else if (errno == ENOBUFS) {
+        // Only errors can overflow the receive buffer, one per rejected message
+        Error("nftables rejected %s elements of table %s %s (replies overflowed)", GetActionString(msgType), configData.nftFamily, configData.nftTable);
+        return ERROR;
+      }
+      Error("Unable to receive nftables reply: %s", ErrnoString(err, sizeof(err)));
+      return ERROR;
+    }
+
+    len32 = (int)len;
+    for (nh = (struct nlmsghdr *)reply; NLMSG_OK(nh, len32); nh = NLMSG_NEXT(nh, len32)) {
+      if (nh->nlmsg_seq < firstSeq || nh->nlmsg_seq > lastSeq || nh->nlmsg_type != NLMSG_ERROR) {
+        continue;
+      }
+
+      nlErr = (struct nlmsgerr *)NLMSG_DATA(nh);
+      if (nlErr->error == -ENOENT && msgType == NFT_MSG_DELSETELEM) {
+        return FALSE;
+      } else if (nlErr->error != 0) {
+        Error("nftables rejected %s elements of table %s %s: %s", GetActionString(msgType), configData.nftFamily, configData.nftTable, strerror(-nlErr->error));
+        return ERROR;
+      }
+
+      if (nh->nlmsg_seq == ackSeq) {
+        return TRUE;
+      }
+    }
+  }
+}
+
+static void DrainSocket(void) {
+  uint8_t reply[NFT_RECEIVE_BUFFER_SIZE];
+
+  while (recv(nft.sockfd, reply, sizeof(reply), MSG_DONTWAIT) > 0) {
+  }
+}
+
+static const char *GetActionString(const uint16_t msgType) {
+  return (msgType == NFT_MSG_NEWSETELEM) ? "adding" : "removing";
+}
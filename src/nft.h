@@ -0,0 +1,16 @@
+// SPDX-FileCopyrightText: 2024 Marcus Hufvudsson <mh@protohuf.com>
+//
+// SPDX-License-Identifier: CPL-1.0
+
+#pragma once
+
+#include "block.h"
+
+int InitNft(void);
+void FreeNft(void);
+int NftAddAddress(const int family, const void *addr);
+int NftCommit(void);
+int NftAddTarget(const char *target);
+int NftBlockTarget(const char *target);
+int NftUnblockTargets(const char *const *targets, const int count);
+int NftRestoreBlocked(const struct BlockedState *bs);
@@ -0,0 +1,127 @@
+// SPDX-FileCopyrightText: 2024 Marcus Hufvudsson <mh@protohuf.com>
+//
+// SPDX-License-Identifier: CPL-1.0
+
+#define _GNU_SOURCE  // recvmmsg()
+
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <linux/if_packet.h>
+
+#include "portsentry.h"
+#include "packet_batch.h"
+#include "io.h"
+#include "util.h"
+
+void ResetPacketBatch(struct PacketBatch *batch) {
+  memset(batch, 0, sizeof(struct PacketBatch));
+  batch->fd = -1;
+}
+
+int SetupPacketBatch(struct PacketBatch *batch, const int fd, const unsigned int size, const unsigned int snaplen) {
+  unsigned int i;
+
+  assert(batch != NULL);
+  assert(fd >= 0);
+  assert(size > 0);
+  assert(snaplen > 0);
+
+  ResetPacketBatch(batch);
+
+  batch->msgs = calloc(size, sizeof(struct mmsghdr));
+  batch->iovs = calloc(size, sizeof(struct iovec));
+  batch->addrs = calloc(size, sizeof(struct sockaddr_ll));
+  batch->buffers = malloc((size_t)size * snaplen);
+
+  if (batch->msgs == NULL || batch->iovs == NULL || batch->addrs == NULL || batch->buffers == NULL) {
+    Error("Unable to allocate memory for %u packet batch buffers", size);
+    FreePacketBatch(batch);
+    return ERROR;
+  }
+
+  for (i = 0; i < size; i++) {
+    batch->iovs[i].iov_base = batch->buffers + (size_t)i * snaplen;
+    batch->iovs[i].iov_len = snaplen;
+    batch->msgs[i].msg_hdr.msg_iov = &batch->iovs[i];
+    batch->msgs[i].msg_hdr.msg_iovlen = 1;
+    batch->msgs[i].msg_hdr.msg_name = &batch->addrs[i];
+  }
+
+  batch->fd = fd;
+  batch->size = size;
+  batch->snaplen = snaplen;
+
+  Debug("Packet batch setup on socket %d: %u packets of %u bytes per call", fd, size, snaplen);
+
+  return TRUE;
+}
+
+void FreePacketBatch(struct PacketBatch *batch) {
+  free(batch->msgs);
+  free(batch->iovs);
+  free(batch->addrs);
+  free(batch->buffers);
+
+  ResetPacketBatch(batch);
+}
+
+/* Read the packets currently queued on the socket, up to the batch size, with a single recvmmsg().
+ * Returns the number of packets passed on to the handler, or ERROR.
+ */
+int PacketBatchDispatch(struct PacketBatch *batch, PacketRingHandler handler) {
+  int count = 0, noReceived, i;
+  char err[ERRNOMAXBUF];
+
+  assert(batch != NULL);
+  assert(batch->msgs != NULL);
+  assert(handler != NULL);
+
+  // The kernel updates the name length of each message, it has to be reset before every call
+  for (i = 0; i < (int)batch->size; i++) {
+    batch->msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_ll);
+  }
+
+  if ((noReceived = recvmmsg(batch->fd, batch->msgs, batch->size, MSG_DONTWAIT, NULL)) == -1) {
+    if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+      return 0;
+    }
+    Error("Could not read from socket %d: %s", batch->fd, ErrnoString(err, sizeof(err)));
+    return ERROR;
+  }
+
+  batch->noBatches++;
+  batch->noPackets += noReceived;
+  if ((unsigned int)noReceived == batch->size) {
+    batch->noFullBatches++;
+  }
+
+  for (i = 0; i < noReceived; i++) {
+    if ((batch->msgs[i].msg_hdr.msg_flags & MSG_TRUNC) != 0) {
+      batch->noTruncated++;
+    }
+
+    // Same as PacketRead(), only consider packets destined to this host
+    if (batch->addrs[i].sll_pkttype != PACKET_HOST) {
+      continue;
+    }
+
+    handler(batch->iovs[i].iov_base, batch->msgs[i].msg_len);
+    count++;
+  }
+
+  return count;
+}
+
+void LogPacketBatchStats(const struct PacketBatch *batch) {
+  if (batch->noBatches == 0) {
+    return;
+  }
+
+  Verbose("Packet batch on socket %d: %lu packets in %lu calls (%.1f per call), %lu full calls, %lu truncated packets",
+          batch->fd, (unsigned long)batch->noPackets, (unsigned long)batch->noBatches, (double)batch->noPackets / (double)batch->noBatches,
+          (unsigned long)batch->noFullBatches, (unsigned long)batch->noTruncated);
+}
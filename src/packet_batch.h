@@ -0,0 +1,37 @@
+// SPDX-FileCopyrightText: 2024 Marcus Hufvudsson <mh@protohuf.com>
+//
+// SPDX-License-Identifier: CPL-1.0
+
+#pragma once
+#include <stdint.h>
+#include <sys/socket.h>
+#include <linux/if_packet.h>
+
+#include "packet_ring.h"
+
+#define PACKET_BATCH_SNAPLEN 256  // Default bytes read of each packet, enough for the ip and tcp/udp headers
+
+/* Receive buffers for reading up to size packets per recvmmsg() call from an AF_PACKET socket,
+ * a lighter alternative to a PacketRing where PACKET_MMAP isn't available.
+ */
+struct PacketBatch {
+  int fd;
+  unsigned int size;
+  unsigned int snaplen;
+  struct mmsghdr *msgs;
+  struct iovec *iovs;
+  struct sockaddr_ll *addrs;
+  uint8_t *buffers;  // size buffers of snaplen bytes
+
+  // Statistics
+  uint64_t noBatches;      // recvmmsg() calls returning packets
+  uint64_t noPackets;      // Packets received
+  uint64_t noFullBatches;  // Calls which filled all buffers
+  uint64_t noTruncated;    // Packets larger than snaplen (only the headers are needed)
+};
+
+void ResetPacketBatch(struct PacketBatch *batch);
+int SetupPacketBatch(struct PacketBatch *batch, const int fd, const unsigned int size, const unsigned int snaplen);
+void FreePacketBatch(struct PacketBatch *batch);
+int PacketBatchDispatch(struct PacketBatch *batch, PacketRingHandler handler);
+void LogPacketBatchStats(const struct PacketBatch *batch);
@@ -18,8 +18,11 @@
 
 #define IPV4_MAPPED_IPV6_PREFIX "::ffff:"
 
-static int SetSockaddr4(struct sockaddr_in *sa, const in_addr_t *addr, const uint16_t port, char *buf, const size_t buflen);
-static int SetSockaddr6(struct sockaddr_in6 *sa6, const struct in6_addr *addr6, const uint16_t port, char *buf, const size_t buflen);
+static void SetSource4(struct PacketInfo *pi, const struct in_addr *addr, const uint16_t port);
+static void SetSource6(struct PacketInfo *pi, const struct in6_addr *addr6, const uint16_t port);
+static void LogShortPacket(const uint8_t isTruncated, const uint32_t packetLength, const char *reason);
+
+_Static_assert(sizeof(struct PacketInfo) <= 64, "struct PacketInfo should fit in a cache line");
 
 // Create a lookup table for IPv6 extension headers
 static const uint8_t IPV6_EXT_HEADERS[] = {
@@ -47,13 +50,11 @@ static int IsIpv6ExtensionHeader(uint8_t header) {
 
 void ClearPacketInfo(struct PacketInfo *pi) {
   memset(pi, 0, sizeof(struct PacketInfo));
-  pi->listenSocket = -1;
-  pi->tcpAcceptSocket = -1;
 }
 
 int SetPacketInfoFromPacket(struct PacketInfo *pi, const unsigned char *packet, const uint32_t packetLength) {
   int iplen, nextHeader;
-  uint8_t protocol, ipVersion;
+  uint8_t protocol, ipVersion, isTruncated;
   struct ip6_ext *ip6ext;
   struct ip *ip = NULL;
   struct ip6_hdr *ip6 = NULL;
@@ -75,6 +76,7 @@ int SetPacketInfoFromPacket(struct PacketInfo *pi, const unsigned char *packet,
     ip = (struct ip *)pi->packet;
     iplen = ip->ip_hl * 4;
     protocol = ip->ip_p;
+    isTruncated = (ntohs(ip->ip_len) > packetLength) ? TRUE : FALSE;
   } else if (ipVersion == 6) {
     if (packetLength < 40) {
       Error("IPv6 packet is too short (%d bytes), ignoring", packetLength);
@@ -84,12 +86,14 @@ int SetPacketInfoFromPacket(struct PacketInfo *pi, const unsigned char *packet,
     ip6 = (struct ip6_hdr *)pi->packet;
     nextHeader = ip6->ip6_nxt;
     iplen = sizeof(struct ip6_hdr);
+    // With CAPTURE_SNAPLEN set, a long extension header chain can legitimately end beyond the captured bytes
+    isTruncated = (ntohs(ip6->ip6_plen) + sizeof(struct ip6_hdr) > packetLength) ? TRUE : FALSE;
 
     while (IsIpv6ExtensionHeader(nextHeader)) {
       Debug("Processing IPv6 extension header %d", nextHeader);
 
       if (iplen + sizeof(struct ip6_ext) > packetLength) {
-        Error("IPv6 extension header exceeds packet length, ignoring");
+        LogShortPacket(isTruncated, packetLength, "IPv6 extension header exceeds packet length");
         return FALSE;
       }
 
@@ -116,7 +120,7 @@ int SetPacketInfoFromPacket(struct PacketInfo *pi, const unsigned char *packet,
 
       uint32_t extlen = (ip6ext->ip6e_len * 8) + 8;
       if (iplen + extlen > packetLength) {
-        Error("IPv6 extension header length exceeds packet bounds, ignoring");
+        LogShortPacket(isTruncated, packetLength, "IPv6 extension header length exceeds packet bounds");
         return FALSE;
       }
       iplen += extlen;
@@ -130,13 +134,13 @@ int SetPacketInfoFromPacket(struct PacketInfo *pi, const unsigned char *packet,
 
   if (protocol == IPPROTO_TCP) {
     if ((int)(packetLength - iplen) < (int)sizeof(struct tcphdr)) {
-      Error("Packet is too short for TCP header, ignoring");
+      LogShortPacket(isTruncated, packetLength, "Packet is too short for TCP header");
       return FALSE;
     }
     tcp = (struct tcphdr *)(pi->packet + iplen);
   } else if (protocol == IPPROTO_UDP) {
     if ((int)(packetLength - iplen) < (int)sizeof(struct udphdr)) {
-      Error("Packet is too short for UDP header, ignoring");
+      LogShortPacket(isTruncated, packetLength, "Packet is too short for UDP header");
       return FALSE;
     }
     udp = (struct udphdr *)(pi->packet + iplen);
@@ -145,72 +149,41 @@ int SetPacketInfoFromPacket(struct PacketInfo *pi, const unsigned char *packet,
     return FALSE;
   }
 
+  pi->packetLength = packetLength;
   pi->version = ipVersion;
   pi->protocol = protocol;
+  pi->l4Offset = (uint16_t)iplen;
   pi->port = (protocol == IPPROTO_TCP) ? ntohs(tcp->th_dport) : ntohs(udp->uh_dport);
-  pi->ip = (ip != NULL) ? ip : NULL;
-  pi->ip6 = (ip6 != NULL) ? ip6 : NULL;
-  pi->tcp = (tcp != NULL) ? tcp : NULL;
-  pi->udp = (udp != NULL) ? udp : NULL;
-
-  if (pi->version != 4 && pi->version != 6) {
-    Error("Packet validation failes, unknown IP version %d", pi->version);
-    return FALSE;
-  }
-
-  if (pi->protocol != IPPROTO_TCP && pi->protocol != IPPROTO_UDP) {
-    Error("Packet validation failed, unknown protocol %d", pi->protocol);
-    return FALSE;
-  }
-
-  if (pi->ip == NULL && pi->ip6 == NULL) {
-    Error("Packet validation failed, no IP header found");
-    return FALSE;
-  }
-
-  if (pi->tcp == NULL && pi->udp == NULL) {
-    Error("Packet validation failed, no TCP or UDP header found");
-    return FALSE;
-  }
+  pi->tcpFlags = (tcp != NULL) ? tcp->th_flags : 0;
 
-  if (pi->ip != NULL) {
-    if (SetSockaddr4(&pi->sa_saddr, &pi->ip->ip_src.s_addr, (tcp != NULL) ? tcp->th_sport : udp->uh_sport, pi->saddr, sizeof(pi->saddr)) != TRUE) {
-      return FALSE;
-    }
-    if (SetSockaddr4(&pi->sa_daddr, &pi->ip->ip_dst.s_addr, (tcp != NULL) ? tcp->th_dport : udp->uh_dport, pi->daddr, sizeof(pi->daddr)) != TRUE) {
-      return FALSE;
-    }
-  } else if (pi->ip6 != NULL) {
-    if (SetSockaddr6(&pi->sa6_saddr, &pi->ip6->ip6_src, (tcp != NULL) ? tcp->th_sport : udp->uh_sport, pi->saddr, sizeof(pi->saddr)) != TRUE) {
-      return FALSE;
-    }
-    if (SetSockaddr6(&pi->sa6_daddr, &pi->ip6->ip6_dst, (tcp != NULL) ? tcp->th_dport : udp->uh_dport, pi->daddr, sizeof(pi->daddr)) != TRUE) {
-      return FALSE;
-    }
+  if (ip != NULL) {
+    SetSource4(pi, &ip->ip_src, (tcp != NULL) ? tcp->th_sport : udp->uh_sport);
+  } else {
+    SetSource6(pi, &ip6->ip6_src, (tcp != NULL) ? tcp->th_sport : udp->uh_sport);
   }
 
   return TRUE;
 }
 
-int SetPacketInfoFromConnectData(struct PacketInfo *pi, const uint16_t port, const int family, const int protocol, const int sockfd, const int incomingSockfd, const struct sockaddr_in *client4, const struct sockaddr_in6 *client6) {
+int SetPacketInfoFromConnectData(struct PacketInfo *pi, struct ConnectInfo *ci, const uint16_t port, const int family, const int protocol, const int sockfd, const int incomingSockfd, const struct sockaddr_in *client4, const struct sockaddr_in6 *client6) {
   pi->protocol = protocol;
   pi->port = port;
   pi->version = (family == AF_INET) ? 4 : 6;
-  pi->listenSocket = sockfd;
-  pi->tcpAcceptSocket = incomingSockfd;
+  pi->connect = ci;
+  ci->listenSocket = sockfd;
+  ci->tcpAcceptSocket = incomingSockfd;
 
   // There will only by one correct client address, depending on the family (only valid in sentry_connect)
   if (pi->version == 4) {
-    pi->client4 = client4;
-    pi->client6 = NULL;
+    ci->client4 = client4;
+    ci->client6 = NULL;
   } else {
-    pi->client4 = NULL;
-    pi->client6 = client6;
+    ci->client4 = NULL;
+    ci->client6 = client6;
   }
 
   if (pi->version == 4) {
-    SetSockaddr4(&pi->sa_saddr, &client4->sin_addr.s_addr, client4->sin_port, pi->saddr, sizeof(pi->saddr));
-    pi->sa_daddr.sin_port = port;
+    SetSource4(pi, &client4->sin_addr, client4->sin_port);
   } else {
     // In a dual stack environment, we may receive an IPv4-mapped IPv6 address
     // In this case, extract the ipv4 address and port from the mapped address
@@ -218,106 +191,112 @@ int SetPacketInfoFromConnectData(struct PacketInfo *pi, const uint16_t port, con
     if (IN6_IS_ADDR_V4MAPPED(&client6->sin6_addr)) {
       struct in_addr addr4;
       memcpy(&addr4, &client6->sin6_addr.s6_addr[12], sizeof(struct in_addr));
-      SetSockaddr4(&pi->sa_saddr, &addr4.s_addr, client6->sin6_port, pi->saddr, sizeof(pi->saddr));
-      pi->sa_daddr.sin_port = port;
-      pi->version = 4;  // Since we are treating this as an IPv4 address and the sockaddr_in is set, set version to 4 too (needed by GetSourceSockaddr*())
+      SetSource4(pi, &addr4, client6->sin6_port);
+      pi->version = 4;  // Since we are treating this as an IPv4 address, set version to 4 too (needed by FillPacketInfoCold())
     } else {
-      SetSockaddr6(&pi->sa6_saddr, &client6->sin6_addr, client6->sin6_port, pi->saddr, sizeof(pi->saddr));
-      pi->sa6_daddr.sin6_port = port;
+      SetSource6(pi, &client6->sin6_addr, client6->sin6_port);
     }
   }
 
   return TRUE;
 }
 
-static int SetSockaddr4(struct sockaddr_in *sa, const in_addr_t *addr, const uint16_t port, char *buf, const size_t buflen) {
-  char err[ERRNOMAXBUF];
-
-  if (sa == NULL || addr == NULL) {
-    Error("Invalid NULL parameter");
+// Build the source address as a sockaddr and a string, only done for packets which reach the sentry engine
+int FillPacketInfoCold(const struct PacketInfo *pi, struct PacketInfoCold *cold) {
+  if (pi->version == 4) {
+    memset(&cold->sa_saddr, 0, sizeof(struct sockaddr_in));
+    memcpy(&cold->sa_saddr.sin_addr, &pi->source, sizeof(struct in_addr));
+    cold->sa_saddr.sin_family = AF_INET;
+    cold->sa_saddr.sin_port = pi->sourcePort;
+    cold->saLen = sizeof(struct sockaddr_in);
+  } else if (pi->version == 6) {
+    memset(&cold->sa6_saddr, 0, sizeof(struct sockaddr_in6));
+    memcpy(&cold->sa6_saddr.sin6_addr, &pi->source, sizeof(struct in6_addr));
+    cold->sa6_saddr.sin6_family = AF_INET6;
+    cold->sa6_saddr.sin6_port = pi->sourcePort;
+    cold->saLen = sizeof(struct sockaddr_in6);
+  } else {
+    Error("No source address in packet info");
     return ERROR;
   }
 
-  memset(sa, 0, sizeof(struct sockaddr_in));
-  sa->sin_addr.s_addr = *addr;
-  sa->sin_family = AF_INET;
-  sa->sin_port = port;
-
-  if (buf != NULL) {
-    if (buflen < INET_ADDRSTRLEN) {
-      Error("Buffer too small for IPv4 address");
-      return ERROR;
-    }
-    if (inet_ntop(AF_INET, &sa->sin_addr, buf, buflen) == NULL) {
-      Error("Unable to resolve IP address: %s", ErrnoString(err, sizeof(err)));
-      return ERROR;
-    }
-  }
-
-  return TRUE;
+  return GetSourceAddrString(pi, cold->saddr, sizeof(cold->saddr));
 }
 
-static int SetSockaddr6(struct sockaddr_in6 *sa6, const struct in6_addr *addr6, const uint16_t port, char *buf, const size_t buflen) {
+// Format the source address into buf, which should be at least INET6_ADDRSTRLEN bytes
+int GetSourceAddrString(const struct PacketInfo *pi, char *buf, const size_t buflen) {
   char err[ERRNOMAXBUF];
 
-  if (sa6 == NULL || addr6 == NULL) {
-    Error("Invalid NULL parameter");
+  if (pi->version != 4 && pi->version != 6) {
+    Error("No source address in packet info");
     return ERROR;
   }
 
-  memset(sa6, 0, sizeof(struct sockaddr_in6));
-  memcpy(&sa6->sin6_addr, addr6, sizeof(struct in6_addr));
-  sa6->sin6_family = AF_INET6;
-  sa6->sin6_port = port;
-
-  if (buf != NULL) {
-    if (buflen < INET6_ADDRSTRLEN) {
-      Error("Buffer too small for IPv6 address");
-      return ERROR;
-    }
-    if (inet_ntop(AF_INET6, &sa6->sin6_addr, buf, buflen) == NULL) {
-      Error("Unable to resolve IPv6 address: %s", ErrnoString(err, sizeof(err)));
-      return ERROR;
-    }
+  if (inet_ntop((pi->version == 4) ? AF_INET : AF_INET6, &pi->source, buf, buflen) == NULL) {
+    Error("Unable to resolve IP address: %s", ErrnoString(err, sizeof(err)));
+    return ERROR;
   }
 
   return TRUE;
 }
 
-struct sockaddr *GetSourceSockaddrFromPacketInfo(const struct PacketInfo *pi) {
-  if (pi->version == 6 && pi->sa6_saddr.sin6_family == AF_INET6) {
-    return (struct sockaddr *)&pi->sa6_saddr;
-  } else if (pi->version == 4 && pi->sa_saddr.sin_family == AF_INET) {
-    return (struct sockaddr *)&pi->sa_saddr;
-  }
+// The IP header is at the start of the packet, the tcp/udp header at l4Offset. NULL if not present (or in connect mode)
+const struct ip *GetIpHeader(const struct PacketInfo *pi) {
+  return (pi->packet != NULL && pi->version == 4) ? (const struct ip *)pi->packet : NULL;
+}
 
-  return NULL;
+const struct ip6_hdr *GetIp6Header(const struct PacketInfo *pi) {
+  return (pi->packet != NULL && pi->version == 6) ? (const struct ip6_hdr *)pi->packet : NULL;
 }
 
-socklen_t GetSourceSockaddrLenFromPacketInfo(const struct PacketInfo *pi) {
-  if (pi->version == 6 && pi->sa6_saddr.sin6_family == AF_INET6) {
-    return sizeof(struct sockaddr_in6);
-  } else if (pi->version == 4 && pi->sa_saddr.sin_family == AF_INET) {
-    return sizeof(struct sockaddr_in);
+const struct tcphdr *GetTcpHeader(const struct PacketInfo *pi) {
+  return (pi->packet != NULL && pi->protocol == IPPROTO_TCP) ? (const struct tcphdr *)(pi->packet + pi->l4Offset) : NULL;
+}
+
+const struct udphdr *GetUdpHeader(const struct PacketInfo *pi) {
+  return (pi->packet != NULL && pi->protocol == IPPROTO_UDP) ? (const struct udphdr *)(pi->packet + pi->l4Offset) : NULL;
+}
+
+/* A packet cut short by the capture length (the IP header claims more data than was captured) is expected
+ * with CAPTURE_SNAPLEN and can be sent on every packet of a flow, so it's only a debug message.
+ */
+static void LogShortPacket(const uint8_t isTruncated, const uint32_t packetLength, const char *reason) {
+  if (isTruncated == TRUE) {
+    Debug("%s, only %u bytes captured, ignoring", reason, packetLength);
+  } else {
+    Error("%s, ignoring", reason);
   }
+}
 
-  return 0;
+static void SetSource4(struct PacketInfo *pi, const struct in_addr *addr, const uint16_t port) {
+  memset(&pi->source, 0, sizeof(struct in6_addr));
+  memcpy(&pi->source, addr, sizeof(struct in_addr));
+  pi->sourcePort = port;
+}
+
+static void SetSource6(struct PacketInfo *pi, const struct in6_addr *addr6, const uint16_t port) {
+  memcpy(&pi->source, addr6, sizeof(struct in6_addr));
+  pi->sourcePort = port;
 }
 
 struct sockaddr *GetClientSockaddrFromPacketInfo(const struct PacketInfo *pi) {
-  if (pi->client4 != NULL) {
-    return (struct sockaddr *)pi->client4;
-  } else if (pi->client6 != NULL) {
-    return (struct sockaddr *)pi->client6;
+  if (pi->connect == NULL) {
+    return NULL;
+  } else if (pi->connect->client4 != NULL) {
+    return (struct sockaddr *)pi->connect->client4;
+  } else if (pi->connect->client6 != NULL) {
+    return (struct sockaddr *)pi->connect->client6;
   }
 
   return NULL;
 }
 
 socklen_t GetClientSockaddrLenFromPacketInfo(const struct PacketInfo *pi) {
-  if (pi->client4 != NULL) {
+  if (pi->connect == NULL) {
+    return 0;
+  } else if (pi->connect->client4 != NULL) {
     return sizeof(struct sockaddr_in);
-  } else if (pi->client6 != NULL) {
+  } else if (pi->connect->client6 != NULL) {
     return sizeof(struct sockaddr_in6);
   }
 
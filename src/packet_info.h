@@ -7,38 +7,55 @@
 #include <stdint.h>
 #include <netinet/ip.h>
 #include <netinet/ip6.h>
+#include <netinet/tcp.h>
+#include <netinet/udp.h>
+#include <sys/socket.h>
 
-/* Convenient information about a packet, used primarily
- * by the sentry engine to make decisions
- */
-struct PacketInfo {
-  uint8_t version;                // The IP version of the packet 4 or 6
-  uint8_t protocol;               // The protocol of the packet (IPPROTO_TCP/UDP)
-  uint16_t port;                  // The destination port for the packet
-  struct sockaddr_in sa_saddr;    // The source address for ipv4 connections
-  struct sockaddr_in6 sa6_saddr;  // The source address for ipv6 connections
-  struct sockaddr_in sa_daddr;    // The dest address for ipv4 connections
-  struct sockaddr_in6 sa6_daddr;  // The dest address for ipv6 connections
-  char saddr[INET6_ADDRSTRLEN];   // The source address as a string
-  char daddr[INET6_ADDRSTRLEN];   // The dest address as a string
-  const unsigned char *packet;    // The raw packet + pointers into the various headers, where applicable
-  int packetLength;
-  struct ip *ip;        // pointer into packet for ipv4 header
-  struct ip6_hdr *ip6;  // pointer into packet for ipv6 header
-  struct tcphdr *tcp;   // pointer into packet for tcp header (if it's a tcp packet, otherwise NULL)
-  struct udphdr *udp;   // pointer into packet for udp header (if it's a udp packet, otherwise NULL)
-
-  // Connection based (sentry_connect) information
+// Connection based (sentry_connect) information
+struct ConnectInfo {
   int listenSocket;                    // The listening socket for the connection (also used to sendUDP packets if applicable)
   int tcpAcceptSocket;                 // If TCP connection, the socket that accept()ed the connection
   const struct sockaddr_in *client4;   // The client address for ipv4 connections as returned by accept() or recvfrom()
   const struct sockaddr_in6 *client6;  // The client address for ipv6 connections as returned by accept() or recvfrom()
 };
 
+/* Convenient information about a packet, used primarily by the sentry engine to make decisions.
+ * This is the part needed to accept or discard a packet, kept to a single cache line. The headers
+ * are found from the packet and l4Offset with the Get*Header() functions, the source address as a
+ * sockaddr and a string is filled into a PacketInfoCold once the packet reaches the sentry engine.
+ */
+struct PacketInfo {
+  const unsigned char *packet;   // The raw packet, starting with the IP header (NULL in connect mode)
+  struct ConnectInfo *connect;   // Connection based (sentry_connect) information, otherwise NULL
+  struct in6_addr source;        // The source address, an ipv4 address is stored in the first 4 bytes
+  uint32_t packetLength;
+  uint16_t port;                 // The destination port for the packet
+  uint16_t sourcePort;           // The source port, in network byte order
+  uint16_t l4Offset;             // Offset of the tcp/udp header in packet
+  uint8_t version;               // The IP version of the packet 4 or 6
+  uint8_t protocol;              // The protocol of the packet (IPPROTO_TCP/UDP)
+  uint8_t tcpFlags;              // The tcp flags if it's a tcp packet, otherwise 0
+};
+
+// The source address in the forms needed to log and block it, see FillPacketInfoCold()
+struct PacketInfoCold {
+  union {
+    struct sockaddr sa;
+    struct sockaddr_in sa_saddr;    // The source address for ipv4 connections
+    struct sockaddr_in6 sa6_saddr;  // The source address for ipv6 connections
+  };
+  socklen_t saLen;
+  char saddr[INET6_ADDRSTRLEN];  // The source address as a string
+};
+
 void ClearPacketInfo(struct PacketInfo *pi);
 int SetPacketInfoFromPacket(struct PacketInfo *pi, const unsigned char *packet, const uint32_t packetLength);
-int SetPacketInfoFromConnectData(struct PacketInfo *pi, const uint16_t port, const int family, const int protocol, const int sockfd, const int incomingSockfd, const struct sockaddr_in *client4, const struct sockaddr_in6 *client6);
-struct sockaddr *GetSourceSockaddrFromPacketInfo(const struct PacketInfo *pi);
-socklen_t GetSourceSockaddrLenFromPacketInfo(const struct PacketInfo *pi);
+int SetPacketInfoFromConnectData(struct PacketInfo *pi, struct ConnectInfo *ci, const uint16_t port, const int family, const int protocol, const int sockfd, const int incomingSockfd, const struct sockaddr_in *client4, const struct sockaddr_in6 *client6);
+int FillPacketInfoCold(const struct PacketInfo *pi, struct PacketInfoCold *cold);
+int GetSourceAddrString(const struct PacketInfo *pi, char *buf, const size_t buflen);
+const struct ip *GetIpHeader(const struct PacketInfo *pi);
+const struct ip6_hdr *GetIp6Header(const struct PacketInfo *pi);
+const struct tcphdr *GetTcpHeader(const struct PacketInfo *pi);
+const struct udphdr *GetUdpHeader(const struct PacketInfo *pi);
 struct sockaddr *GetClientSockaddrFromPacketInfo(const struct PacketInfo *pi);
 socklen_t GetClientSockaddrLenFromPacketInfo(const struct PacketInfo *pi);
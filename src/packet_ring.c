@@ -0,0 +1,141 @@
+// SPDX-FileCopyrightText: 2024 Marcus Hufvudsson <mh@protohuf.com>
+//
+// SPDX-License-Identifier: CPL-1.0
+
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/mman.h>
+#include <linux/if_packet.h>
+
+#include "portsentry.h"
+#include "packet_ring.h"
+#include "io.h"
+#include "util.h"
+
+#define RING_BLOCK_SIZE (128 * 1024)
+#define RING_FRAME_SIZE 2048
+
+void ResetPacketRing(struct PacketRing *ring) {
+  memset(ring, 0, sizeof(struct PacketRing));
+  ring->fd = -1;
+  ring->map = MAP_FAILED;
+}
+
+/* Attach a TPACKET_V3 ring to the socket fd. The ring size is rounded up to a whole
+ * number of blocks. A block is handed over to userspace when it's full or when
+ * blockTimeoutMs has passed since the first packet was written into it, whichever comes first.
+ */
+int SetupPacketRing(struct PacketRing *ring, const int fd, const int ringSizeKb, const int blockTimeoutMs) {
+  int version = TPACKET_V3;
+  unsigned int i;
+  struct tpacket_req3 req;
+  char err[ERRNOMAXBUF];
+
+  assert(ring != NULL);
+  assert(fd >= 0);
+  assert(ringSizeKb > 0);
+
+  ResetPacketRing(ring);
+
+  if (setsockopt(fd, SOL_PACKET, PACKET_VERSION, &version, sizeof(version)) == -1) {
+    Error("Unable to set TPACKET_V3 on socket %d: %s", fd, ErrnoString(err, sizeof(err)));
+    return ERROR;
+  }
+
+  memset(&req, 0, sizeof(req));
+  req.tp_block_size = RING_BLOCK_SIZE;
+  req.tp_block_nr = ((size_t)ringSizeKb * 1024 + RING_BLOCK_SIZE - 1) / RING_BLOCK_SIZE;
+  req.tp_frame_size = RING_FRAME_SIZE;
+  req.tp_frame_nr = (RING_BLOCK_SIZE / RING_FRAME_SIZE) * req.tp_block_nr;
+  req.tp_retire_blk_tov = blockTimeoutMs;
+  req.tp_feature_req_word = 0;
+
+  if (setsockopt(fd, SOL_PACKET, PACKET_RX_RING, &req, sizeof(req)) == -1) {
+    Error("Unable to setup PACKET_RX_RING (%u blocks of %u bytes) on socket %d: %s", req.tp_block_nr, req.tp_block_size, fd, ErrnoString(err, sizeof(err)));
+    return ERROR;
+  }
+
+  ring->mapLength = (size_t)req.tp_block_size * req.tp_block_nr;
+  if ((ring->map = mmap(NULL, ring->mapLength, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_LOCKED, fd, 0)) == MAP_FAILED) {
+    Error("Unable to mmap packet ring on socket %d: %s", fd, ErrnoString(err, sizeof(err)));
+    goto fail;
+  }
+
+  if ((ring->blocks = calloc(req.tp_block_nr, sizeof(struct iovec))) == NULL) {
+    Error("Unable to allocate memory for packet ring block index");
+    goto fail;
+  }
+
+  for (i = 0; i < req.tp_block_nr; i++) {
+    ring->blocks[i].iov_base = ring->map + (i * req.tp_block_size);
+    ring->blocks[i].iov_len = req.tp_block_size;
+  }
+
+  ring->fd = fd;
+  ring->blockCount = req.tp_block_nr;
+  ring->current = 0;
+
+  Debug("Packet ring setup on socket %d: %u blocks of %u bytes, block timeout %d ms", fd, req.tp_block_nr, req.tp_block_size, blockTimeoutMs);
+
+  return TRUE;
+
+fail:
+  FreePacketRing(ring);
+  return ERROR;
+}
+
+void FreePacketRing(struct PacketRing *ring) {
+  if (ring->map != MAP_FAILED && ring->map != NULL) {
+    munmap(ring->map, ring->mapLength);
+  }
+
+  if (ring->blocks != NULL) {
+    free(ring->blocks);
+  }
+
+  ResetPacketRing(ring);
+}
+
+/* Process all blocks currently owned by userspace and return them to the kernel.
+ * Returns the number of packets passed on to the handler.
+ */
+int PacketRingDispatch(struct PacketRing *ring, PacketRingHandler handler) {
+  int count = 0;
+  uint32_t i;
+  struct tpacket_block_desc *bd;
+  struct tpacket3_hdr *ppd;
+  struct sockaddr_ll *sll;
+
+  assert(ring != NULL);
+  assert(ring->blocks != NULL);
+  assert(handler != NULL);
+
+  while (TRUE) {
+    bd = (struct tpacket_block_desc *)ring->blocks[ring->current].iov_base;
+
+    if ((__atomic_load_n(&bd->hdr.bh1.block_status, __ATOMIC_ACQUIRE) & TP_STATUS_USER) == 0) {
+      break;
+    }
+
+    ppd = (struct tpacket3_hdr *)((uint8_t *)bd + bd->hdr.bh1.offset_to_first_pkt);
+    for (i = 0; i < bd->hdr.bh1.num_pkts; i++) {
+      sll = (struct sockaddr_ll *)((uint8_t *)ppd + TPACKET_ALIGN(sizeof(struct tpacket3_hdr)));
+
+      // Same as PacketRead(), only consider packets destined to this host
+      if (sll->sll_pkttype == PACKET_HOST) {
+        handler((uint8_t *)ppd + ppd->tp_net, ppd->tp_snaplen);
+        count++;
+      }
+
+      ppd = (struct tpacket3_hdr *)((uint8_t *)ppd + ppd->tp_next_offset);
+    }
+
+    __atomic_store_n(&bd->hdr.bh1.block_status, TP_STATUS_KERNEL, __ATOMIC_RELEASE);
+    ring->current = (ring->current + 1) % ring->blockCount;
+  }
+
+  return count;
+}
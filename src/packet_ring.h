@@ -0,0 +1,28 @@
+// SPDX-FileCopyrightText: 2024 Marcus Hufvudsson <mh@protohuf.com>
+//
+// SPDX-License-Identifier: CPL-1.0
+
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/uio.h>
+
+/* A PACKET_MMAP (TPACKET_V3) receive ring attached to an AF_PACKET socket.
+ * The kernel fills one block at a time and hands it over to userspace,
+ * packets are then read in place from the shared memory area.
+ */
+struct PacketRing {
+  int fd;                   // The AF_PACKET socket the ring is attached to
+  uint8_t *map;             // The mmap()'ed ring memory
+  size_t mapLength;         // Total size of the mapped area
+  struct iovec *blocks;     // Pointers to the start of each block in the ring
+  unsigned int blockCount;  // Number of blocks in the ring
+  unsigned int current;     // Index of the next block to check for packets
+};
+
+typedef void (*PacketRingHandler)(const unsigned char *packet, const uint32_t packetLength);
+
+void ResetPacketRing(struct PacketRing *ring);
+int SetupPacketRing(struct PacketRing *ring, const int fd, const int ringSizeKb, const int blockTimeoutMs);
+void FreePacketRing(struct PacketRing *ring);
+int PacketRingDispatch(struct PacketRing *ring, PacketRingHandler handler);
@@ -504,7 +504,7 @@ uint8_t StartDevice(struct Device *device) {
     goto exit;
   }
 
-  if ((device->handle = PcapOpenLiveImmediate(device->name, BUFSIZ, 0, BUFFER_TIMEOUT, errbuf)) == NULL) {
+  if ((device->handle = PcapOpenLiveImmediate(device->name, (configData.captureSnaplen > 0) ? configData.captureSnaplen : BUFSIZ, 0, BUFFER_TIMEOUT, errbuf)) == NULL) {
     Error("StartDevice: Couldn't open device %s: %s", device->name, errbuf);
     status = ERROR;
     goto exit;
@@ -0,0 +1,97 @@
+// SPDX-FileCopyrightText: 2024 Marcus Hufvudsson <mh@protohuf.com>
+//
+// SPDX-License-Identifier: CPL-1.0
+
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include "portsentry.h"
+#include "pool.h"
+#include "io.h"
+
+/* The memory is reserved but not touched, pages are committed by the OS as objects are handed out.
+ * Returns TRUE on success and ERROR if the memory can't be reserved.
+ */
+int InitPool(struct Pool *pool, const size_t objectSize, const uint32_t capacity) {
+  assert(pool != NULL);
+  assert(objectSize >= sizeof(uint32_t));
+  assert(capacity > 0 && capacity < POOL_NONE);
+
+  memset(pool, 0, sizeof(struct Pool));
+
+  if ((pool->memory = malloc(objectSize * capacity)) == NULL) {
+    Error("Unable to allocate memory for pool of %u objects of %zu bytes", capacity, objectSize);
+    return ERROR;
+  }
+
+  pool->objectSize = objectSize;
+  pool->capacity = capacity;
+  pool->freeHead = POOL_NONE;
+
+  return TRUE;
+}
+
+void FreePool(struct Pool *pool) {
+  if (pool->memory != NULL) {
+    free(pool->memory);
+  }
+
+  memset(pool, 0, sizeof(struct Pool));
+  pool->freeHead = POOL_NONE;
+}
+
+/* Increase the capacity, existing objects keep their index but not their address.
+ * Returns TRUE on success and ERROR if the memory can't be reserved, the pool is unchanged on failure.
+ */
+int GrowPool(struct Pool *pool, const uint32_t capacity) {
+  uint8_t *memory;
+
+  assert(pool != NULL);
+  assert(capacity < POOL_NONE);
+
+  if (capacity <= pool->capacity) {
+    return TRUE;
+  }
+
+  if ((memory = realloc(pool->memory, pool->objectSize * capacity)) == NULL) {
+    Error("Unable to grow pool to %u objects of %zu bytes", capacity, pool->objectSize);
+    return ERROR;
+  }
+
+  pool->memory = memory;
+  pool->capacity = capacity;
+
+  return TRUE;
+}
+
+/* Returns NULL when all objects are in use */
+void *PoolAlloc(struct Pool *pool) {
+  void *object;
+
+  if (pool->freeHead != POOL_NONE) {
+    object = PoolAt(pool, pool->freeHead);
+    memcpy(&pool->freeHead, object, sizeof(uint32_t));
+    pool->noFree--;
+    return object;
+  }
+
+  if (pool->used < pool->capacity) {
+    return PoolAt(pool, pool->used++);
+  }
+
+  return NULL;
+}
+
+void PoolRelease(struct Pool *pool, void *object) {
+  assert(object != NULL);
+  assert((uint8_t *)object >= pool->memory && PoolIndex(pool, object) < pool->used);
+
+  memcpy(object, &pool->freeHead, sizeof(uint32_t));
+  pool->freeHead = PoolIndex(pool, object);
+  pool->noFree++;
+}
+
+uint32_t GetPoolNoAllocated(const struct Pool *pool) {
+  return pool->used - pool->noFree;
+}
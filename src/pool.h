@@ -0,0 +1,41 @@
+// SPDX-FileCopyrightText: 2024 Marcus Hufvudsson <mh@protohuf.com>
+//
+// SPDX-License-Identifier: CPL-1.0
+
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+
+/* Pool of equally sized objects in one block of memory reserved when the pool is created.
+ * Allocating and releasing objects is O(1) and doesn't call malloc()/free(), PoolAlloc() returns
+ * NULL once the capacity is used up. Released objects are kept on a free list threaded through
+ * the objects themselves.
+ * GrowPool() enlarges the block with realloc(), which can move the objects. Only a user that refers
+ * to its objects by index (the timer wheel, which grows its pool when it's full) may grow the pool,
+ * pointers to objects are invalid after a GrowPool().
+ */
+struct Pool {
+  uint8_t *memory;
+  size_t objectSize;
+  uint32_t capacity;
+  uint32_t used;      // Objects handed out from the never used tail of the pool
+  uint32_t freeHead;  // Index of the first released object, POOL_NONE if none
+  uint32_t noFree;
+};
+
+#define POOL_NONE UINT32_MAX
+
+int InitPool(struct Pool *pool, const size_t objectSize, const uint32_t capacity);
+void FreePool(struct Pool *pool);
+int GrowPool(struct Pool *pool, const uint32_t capacity);
+void *PoolAlloc(struct Pool *pool);
+void PoolRelease(struct Pool *pool, void *object);
+uint32_t GetPoolNoAllocated(const struct Pool *pool);
+
+static inline void *PoolAt(const struct Pool *pool, const uint32_t index) {
+  return pool->memory + (size_t)index * pool->objectSize;
+}
+
+static inline uint32_t PoolIndex(const struct Pool *pool, const void *object) {
+  return (uint32_t)(((const uint8_t *)object - pool->memory) / pool->objectSize);
+}
@@ -2,6 +2,7 @@
 //
 // SPDX-License-Identifier: CPL-1.0
 
+#include <stdlib.h>
 #include <string.h>
 
 #include "port.h"
@@ -28,18 +29,6 @@ void SetPortRange(struct Port *port, const uint16_t start, const uint16_t end) {
   port->range.end = end;
 }
 
-int IsPortPresent(const struct Port *port, const int portLength, const uint16_t portNumber) {
-  int i;
-
-  for (i = 0; i < portLength; i++) {
-    if (IsPortInRange(&port[i], portNumber) == TRUE) {
-      return TRUE;
-    }
-  }
-
-  return FALSE;
-}
-
 int IsPortInRange(const struct Port *port, const uint16_t portNumber) {
   if (port->single == portNumber) {
     return TRUE;
@@ -103,16 +92,60 @@ int ParsePort(const char *portString, struct Port *port) {
   return TRUE;
 }
 
-int GetNoPorts(const struct Port *port, const int portLength) {
+struct PortBitmap *AllocPortBitmap(const struct Port *port, const int portLength) {
   int i;
-  int noPorts = 0;
+  uint32_t j, start, end;
+  struct PortBitmap *bitmap;
+
+  if ((bitmap = calloc(1, sizeof(struct PortBitmap))) == NULL) {
+    Error("Unable to allocate memory for port bitmap");
+    return NULL;
+  }
 
   for (i = 0; i < portLength; i++) {
     if (IsPortSingle(&port[i])) {
-      noPorts++;
+      start = end = port[i].single;
     } else {
-      noPorts += port[i].range.end - port[i].range.start + 1;
+      start = port[i].range.start;
+      end = port[i].range.end;
+    }
+
+    for (j = start; j <= end; j++) {
+      SetPortInBitmap(bitmap, (uint16_t)j);
+    }
+  }
+
+  return bitmap;
+}
+
+/* Returns the lowest port number >= from present in the bitmap, or ERROR if there are none */
+int GetNextPortInBitmap(const struct PortBitmap *bitmap, const int from) {
+  int word;
+  uint64_t bits;
+
+  if (from < 0 || from >= PORT_BITMAP_WORDS * 64) {
+    return ERROR;
+  }
+
+  word = from >> 6;
+  bits = bitmap->bits[word] & (~(uint64_t)0 << (from & 63));
+
+  while (bits == 0) {
+    if (++word == PORT_BITMAP_WORDS) {
+      return ERROR;
     }
+    bits = bitmap->bits[word];
+  }
+
+  return (word << 6) + __builtin_ctzll(bits);
+}
+
+int GetNoPorts(const struct PortBitmap *bitmap) {
+  int i;
+  int noPorts = 0;
+
+  for (i = 0; i < PORT_BITMAP_WORDS; i++) {
+    noPorts += __builtin_popcountll(bitmap->bits[i]);
   }
 
   return noPorts;
@@ -15,11 +15,28 @@ struct Port {
   struct PortRange range;
 };
 
+#define PORT_BITMAP_WORDS (65536 / 64)
+
+/* One bit per port number, compiled from a struct Port list so that
+ * per-packet lookups doesn't need to walk the list */
+struct PortBitmap {
+  uint64_t bits[PORT_BITMAP_WORDS];
+};
+
 void ResetPort(struct Port *port);
 void SetPortSingle(struct Port *port, const uint16_t single);
 void SetPortRange(struct Port *port, const uint16_t start, const uint16_t end);
-int IsPortPresent(const struct Port *port, const int portLength, const uint16_t portNumber);
 int IsPortInRange(const struct Port *port, const uint16_t portNumber);
 int IsPortSingle(const struct Port *port);
 int ParsePort(const char *portString, struct Port *port);
-int GetNoPorts(const struct Port *port, const int portLength);
+struct PortBitmap *AllocPortBitmap(const struct Port *port, const int portLength);
+int GetNextPortInBitmap(const struct PortBitmap *bitmap, const int from);
+int GetNoPorts(const struct PortBitmap *bitmap);
+
+static inline void SetPortInBitmap(struct PortBitmap *bitmap, const uint16_t portNumber) {
+  bitmap->bits[portNumber >> 6] |= (uint64_t)1 << (portNumber & 63);
+}
+
+static inline int IsPortInBitmap(const struct PortBitmap *bitmap, const uint16_t portNumber) {
+  return (int)((bitmap->bits[portNumber >> 6] >> (portNumber & 63)) & 1);
+}
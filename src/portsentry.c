@@ -55,6 +55,11 @@ int main(int argc, char *argv[]) {
     }
   }
 
+  // Not fatal, log entries are written directly instead
+  if (InitLogger() != TRUE) {
+    Error("Unable to start logger thread, logging synchronously");
+  }
+
   if (InitSentry() != TRUE) {
     fprintf(stderr, "Could not initialize sentry. Shutting down.\n");
     goto exit;
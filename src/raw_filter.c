@@ -0,0 +1,244 @@
+// SPDX-FileCopyrightText: 2024 Marcus Hufvudsson <mh@protohuf.com>
+//
+// SPDX-License-Identifier: CPL-1.0
+
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <linux/filter.h>
+
+#include "portsentry.h"
+#include "config_data.h"
+#include "raw_filter.h"
+#include "io.h"
+#include "util.h"
+
+#define RAW_FILTER_ACCEPT 0xffffffff
+#define RAW_FILTER_REJECT 0
+
+#define TCP_FLAG_ACK_RST 0x14  // TH_ACK | TH_RST
+#define IP_FRAGMENT_OFFSET 0x1fff
+
+/* Extension headers which may precede the TCP/UDP header in an IPv6 packet. Following
+ * the chain is left to SetPacketInfoFromPacket(), the filter just lets these through.
+ * Headers rejected by SetPacketInfoFromPacket() anyway (fragment, no next, experimental) are not listed.
+ */
+static const uint8_t IPV6_PASS_HEADERS[] = {0, 43, 50, 51, 60, 135, 139, 140};
+
+struct FilterProgram {
+  struct sock_filter *insns;
+  int length;
+  int size;
+};
+
+static int Emit(struct FilterProgram *prog, const uint16_t code, const uint8_t jt, const uint8_t jf, const uint32_t k);
+static int EmitPortChecks(struct FilterProgram *prog, const struct Port *ports, const int portsLength);
+static int EmitHeaderLength(struct FilterProgram *prog, const int isIpv6);
+static int EmitTcpSection(struct FilterProgram *prog, const int isIpv6);
+static int EmitUdpSection(struct FilterProgram *prog, const int isIpv6);
+static int BuildFilter(struct FilterProgram *prog, const int family);
+static uint32_t GetAcceptValue(void);
+
+/* Build a classic BPF program matching the configured TCP/UDP ports and attach it to
+ * the AF_PACKET socket. The socket is opened with SOCK_DGRAM so the program sees the packet
+ * starting at the IP header. Packets the filter rejects never leave the kernel, all
+ * checks in userspace are still performed on the packets that pass.
+ * Returns TRUE if the filter was attached, FALSE if the socket is left unfiltered.
+ */
+int AttachRawFilter(const int sockfd, const int family) {
+  int status = FALSE;
+  struct FilterProgram prog;
+  struct sock_fprog fprog;
+  char err[ERRNOMAXBUF];
+
+  assert(family == AF_INET || family == AF_INET6);
+
+  memset(&prog, 0, sizeof(prog));
+
+  if (BuildFilter(&prog, family) != TRUE) {
+    goto exit;
+  }
+
+  if (prog.length > BPF_MAXINSNS) {
+    Error("Too many ports for the %s socket filter (%d instructions, max %d), all packets will be inspected in userspace", (family == AF_INET) ? "IPv4" : "IPv6", prog.length, BPF_MAXINSNS);
+    goto exit;
+  }
+
+  fprog.len = (unsigned short)prog.length;
+  fprog.filter = prog.insns;
+
+  if (setsockopt(sockfd, SOL_SOCKET, SO_ATTACH_FILTER, &fprog, sizeof(fprog)) == -1) {
+    Error("Unable to attach %s socket filter: %s", (family == AF_INET) ? "IPv4" : "IPv6", ErrnoString(err, sizeof(err)));
+    goto exit;
+  }
+
+  Debug("Attached %s socket filter of %d instructions on socket %d", (family == AF_INET) ? "IPv4" : "IPv6", prog.length, sockfd);
+  status = TRUE;
+
+exit:
+  if (prog.insns != NULL) {
+    free(prog.insns);
+  }
+
+  return status;
+}
+
+static int Emit(struct FilterProgram *prog, const uint16_t code, const uint8_t jt, const uint8_t jf, const uint32_t k) {
+  struct sock_filter *insns;
+
+  if (prog->length == prog->size) {
+    prog->size = (prog->size == 0) ? 64 : prog->size * 2;
+    if ((insns = realloc(prog->insns, prog->size * sizeof(struct sock_filter))) == NULL) {
+      Error("Unable to allocate memory for socket filter");
+      return ERROR;
+    }
+    prog->insns = insns;
+  }
+
+  prog->insns[prog->length].code = code;
+  prog->insns[prog->length].jt = jt;
+  prog->insns[prog->length].jf = jf;
+  prog->insns[prog->length].k = k;
+  prog->length++;
+
+  return TRUE;
+}
+
+/* Expects the destination port in A. Each port entry accepts on a match, otherwise
+ * falls through to the next entry and finally to a reject.
+ */
+static int EmitPortChecks(struct FilterProgram *prog, const struct Port *ports, const int portsLength) {
+  int i;
+
+  for (i = 0; i < portsLength; i++) {
+    if (IsPortSingle(&ports[i])) {
+      if (Emit(prog, BPF_JMP | BPF_JEQ | BPF_K, 0, 1, ports[i].single) != TRUE)
+        return ERROR;
+    } else {
+      if (Emit(prog, BPF_JMP | BPF_JGE | BPF_K, 0, 2, ports[i].range.start) != TRUE)
+        return ERROR;
+      if (Emit(prog, BPF_JMP | BPF_JGT | BPF_K, 1, 0, ports[i].range.end) != TRUE)
+        return ERROR;
+    }
+
+    if (Emit(prog, BPF_RET | BPF_K, 0, 0, GetAcceptValue()) != TRUE)
+      return ERROR;
+  }
+
+  return Emit(prog, BPF_RET | BPF_K, 0, 0, RAW_FILTER_REJECT);
+}
+
+/* Sets X to the length of the IP header, rejecting IPv4 packets which are not the first fragment */
+static int EmitHeaderLength(struct FilterProgram *prog, const int isIpv6) {
+  if (isIpv6) {
+    return Emit(prog, BPF_LDX | BPF_IMM, 0, 0, 40);
+  }
+
+  if (Emit(prog, BPF_LD | BPF_H | BPF_ABS, 0, 0, 6) != TRUE)
+    return ERROR;
+  if (Emit(prog, BPF_JMP | BPF_JSET | BPF_K, 0, 1, IP_FRAGMENT_OFFSET) != TRUE)
+    return ERROR;
+  if (Emit(prog, BPF_RET | BPF_K, 0, 0, RAW_FILTER_REJECT) != TRUE)
+    return ERROR;
+
+  return Emit(prog, BPF_LDX | BPF_B | BPF_MSH, 0, 0, 0);
+}
+
+static int EmitTcpSection(struct FilterProgram *prog, const int isIpv6) {
+  if (configData.tcpPortsLength == 0) {
+    return Emit(prog, BPF_RET | BPF_K, 0, 0, RAW_FILTER_REJECT);
+  }
+
+  if (EmitHeaderLength(prog, isIpv6) != TRUE)
+    return ERROR;
+
+  // Same as in userspace, ignore packets with ACK or RST set
+  if (Emit(prog, BPF_LD | BPF_B | BPF_IND, 0, 0, 13) != TRUE)
+    return ERROR;
+  if (Emit(prog, BPF_JMP | BPF_JSET | BPF_K, 0, 1, TCP_FLAG_ACK_RST) != TRUE)
+    return ERROR;
+  if (Emit(prog, BPF_RET | BPF_K, 0, 0, RAW_FILTER_REJECT) != TRUE)
+    return ERROR;
+
+  if (Emit(prog, BPF_LD | BPF_H | BPF_IND, 0, 0, 2) != TRUE)
+    return ERROR;
+
+  return EmitPortChecks(prog, configData.tcpPorts, configData.tcpPortsLength);
+}
+
+static int EmitUdpSection(struct FilterProgram *prog, const int isIpv6) {
+  if (configData.udpPortsLength == 0) {
+    return Emit(prog, BPF_RET | BPF_K, 0, 0, RAW_FILTER_REJECT);
+  }
+
+  if (EmitHeaderLength(prog, isIpv6) != TRUE)
+    return ERROR;
+
+  if (Emit(prog, BPF_LD | BPF_H | BPF_IND, 0, 0, 2) != TRUE)
+    return ERROR;
+
+  return EmitPortChecks(prog, configData.udpPorts, configData.udpPortsLength);
+}
+
+/* Program layout:
+ *  load protocol / next header
+ *  jeq TCP -> ja tcp section
+ *  jeq UDP -> ja udp section
+ *  (IPv6 only) jeq extension header -> accept
+ *  reject
+ *  tcp section
+ *  udp section
+ * The jumps into the sections are patched once the size of the tcp section is known.
+ */
+static int BuildFilter(struct FilterProgram *prog, const int family) {
+  const int isIpv6 = (family == AF_INET6);
+  int tcpJump, udpJump, tcpStart;
+  size_t i;
+
+  if (Emit(prog, BPF_LD | BPF_B | BPF_ABS, 0, 0, isIpv6 ? 6 : 9) != TRUE)
+    return ERROR;
+
+  if (Emit(prog, BPF_JMP | BPF_JEQ | BPF_K, 0, 1, IPPROTO_TCP) != TRUE)
+    return ERROR;
+  tcpJump = prog->length;
+  if (Emit(prog, BPF_JMP | BPF_JA, 0, 0, 0) != TRUE)
+    return ERROR;
+
+  if (Emit(prog, BPF_JMP | BPF_JEQ | BPF_K, 0, 1, IPPROTO_UDP) != TRUE)
+    return ERROR;
+  udpJump = prog->length;
+  if (Emit(prog, BPF_JMP | BPF_JA, 0, 0, 0) != TRUE)
+    return ERROR;
+
+  if (isIpv6) {
+    for (i = 0; i < sizeof(IPV6_PASS_HEADERS); i++) {
+      if (Emit(prog, BPF_JMP | BPF_JEQ | BPF_K, (uint8_t)(sizeof(IPV6_PASS_HEADERS) - i), 0, IPV6_PASS_HEADERS[i]) != TRUE)
+        return ERROR;
+    }
+  }
+
+  if (Emit(prog, BPF_RET | BPF_K, 0, 0, RAW_FILTER_REJECT) != TRUE)
+    return ERROR;
+
+  if (isIpv6) {
+    if (Emit(prog, BPF_RET | BPF_K, 0, 0, GetAcceptValue()) != TRUE)
+      return ERROR;
+  }
+
+  tcpStart = prog->length;
+  if (EmitTcpSection(prog, isIpv6) != TRUE)
+    return ERROR;
+
+  prog->insns[udpJump].k = prog->length - (udpJump + 1);
+  prog->insns[tcpJump].k = tcpStart - (tcpJump + 1);
+
+  return EmitUdpSection(prog, isIpv6);
+}
+
+// The return value of an accepting filter is the number of bytes to keep, with CAPTURE_SNAPLEN only the headers are kept
+static uint32_t GetAcceptValue(void) {
+  return (configData.captureSnaplen > 0) ? (uint32_t)configData.captureSnaplen : RAW_FILTER_ACCEPT;
+}
@@ -0,0 +1,7 @@
+// SPDX-FileCopyrightText: 2024 Marcus Hufvudsson <mh@protohuf.com>
+//
+// SPDX-License-Identifier: CPL-1.0
+
+#pragma once
+
+int AttachRawFilter(const int sockfd, const int family);
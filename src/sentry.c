@@ -5,6 +5,7 @@
 #include <string.h>
 #include <netdb.h>
 #include <assert.h>
+#include <time.h>
 
 #include "portsentry.h"
 #include "config_data.h"
@@ -12,23 +13,59 @@
 #include "io.h"
 #include "util.h"
 #include "packet_info.h"
+#include "sentry.h"
 #include "state_machine.h"
 #include "block.h"
+#include "block_executor.h"
+#include "history.h"
+#ifdef __linux__
+#include "nft.h"
+#include "listen_cache.h"
+#endif
 
 #define MAX_BUF_SCAN_EVENT 1024
+#define MAX_BUF_SCAN_EVENT_JSON 4096
+#define SENTRY_TIMER_INTERVAL 1000  // ms
+#define HISTORY_BATCH_SIZE (16 * 1024)
+#define FIBONACCI_HASH_64 0x9E3779B97F4A7C15ULL
+#define BATCH_SOURCE_SLOTS (SENTRY_BATCH_SIZE * 2)  // Power of two
+
+// The packets of a batch from the same source share the lookups which don't change between them
+struct BatchSource {
+  struct PacketInfoCold cold;
+  uint8_t version;
+  struct in6_addr address;
+  int isResolved;
+  int isIgnored;
+  int isBlocked;  // -100 => not looked up yet
+  char resolvedHost[NI_MAXHOST];
+};
 
 static uint8_t isInitialized = FALSE;
 static struct IgnoreState is = {0};
 static struct BlockedState bs = {0};
 static struct SentryState ss = {0};
+static struct ExpiredBlocks expired = {0};
+
+// Only used from RunSentryBatch(), which is called from the sentry loop only
+static struct BatchSource batchSources[SENTRY_BATCH_SIZE];
+static char historyBatch[HISTORY_BATCH_SIZE];
+static size_t historyBatchLen = 0;
 
 static void LogScanEvent(const char *target, const char *resolvedHost, const int protocol, const uint16_t port, const struct ip *ip, const struct tcphdr *tcp, const int flagIgnored, const int flagTriggerCountExceeded, const int flagDontBlock, const int flagBlockSuccessful);
+static void WriteScanEventJson(const char *target, const char *resolvedHost, const int protocol, const uint16_t port, const struct ip *ip, const struct tcphdr *tcp, const int flagIgnored, const int flagTriggerCountExceeded, const int flagDontBlock, const int flagBlockSuccessful);
+static char *AppendRaw(char *p, const char *end, const char *str, const size_t len);
+static char *AppendUint(char *p, const char *end, uint64_t value);
+static char *AppendJsonFlag(char *p, const char *end, const int flag);
+static void AddHistoryRecord(const char *record, const size_t len);
+static void FlushHistoryRecords(void);
+static void RunSentryChunk(const struct PacketInfo *pis, const size_t n);
+static uint32_t GetBatchSources(const struct PacketInfo *pis, const size_t n, uint8_t *sourceIndex);
+static void RunSentryPacket(const struct PacketInfo *pi, struct BatchSource *source);
 
 static void LogScanEvent(const char *target, const char *resolvedHost, const int protocol, const uint16_t port, const struct ip *ip, const struct tcphdr *tcp, const int flagIgnored, const int flagTriggerCountExceeded, const int flagDontBlock, const int flagBlockSuccessful) {
   int ret, bufsize = MAX_BUF_SCAN_EVENT;
   char buf[MAX_BUF_SCAN_EVENT], *p = buf;
-  char err[ERRNOMAXBUF];
-  FILE *output;
 
   if (CreateDateTime(p, bufsize) != TRUE) {
     return;
@@ -61,8 +98,9 @@ static void LogScanEvent(const char *target, const char *resolvedHost, const int
                                                                                                   : "false",
                  (flagDontBlock == TRUE) ? "true" : (flagDontBlock == -100) ? "unset"
                                                                             : "false",
-                 (flagBlockSuccessful == TRUE) ? "true" : (flagBlockSuccessful == -100) ? "unset"
-                                                                                        : "false");
+                 (flagBlockSuccessful == TRUE) ? "true" : (flagBlockSuccessful == BLOCK_QUEUED) ? "queued"
+                                                      : (flagBlockSuccessful == -100)         ? "unset"
+                                                                                              : "false");
 
   if (ret >= bufsize) {
     Error("Unable to log scan event due to internal buffer too small");
@@ -77,6 +115,11 @@ static void LogScanEvent(const char *target, const char *resolvedHost, const int
     return;
   }
 
+  if (configData.historyFormat == HISTORY_FORMAT_JSON) {
+    WriteScanEventJson(target, resolvedHost, protocol, port, ip, tcp, flagIgnored, flagTriggerCountExceeded, flagDontBlock, flagBlockSuccessful);
+    return;
+  }
+
   bufsize -= ret;
   p += ret;
 
@@ -87,20 +130,153 @@ static void LogScanEvent(const char *target, const char *resolvedHost, const int
     return;
   }
 
-  bufsize -= ret;
   p += ret;
 
-  if ((output = fopen(configData.historyFile, "a")) == NULL) {
-    Log("Unable to open history log file: %s (%s)", configData.historyFile, ErrnoString(err, sizeof(err)));
+  AddHistoryRecord(buf, (size_t)(p - buf));
+}
+
+/* Write the scan event to the history file as a line of JSON. The fields are appended directly
+ * rather than formatted, flags which weren't evaluated (-100) are null.
+ */
+static void WriteScanEventJson(const char *target, const char *resolvedHost, const int protocol, const uint16_t port, const struct ip *ip, const struct tcphdr *tcp, const int flagIgnored, const int flagTriggerCountExceeded, const int flagDontBlock, const int flagBlockSuccessful) {
+  char buf[MAX_BUF_SCAN_EVENT_JSON], *p = buf;
+  const char *end = buf + sizeof(buf);
+  struct timespec ts;
+
+  if (GetRealTime(&ts) == ERROR) {
+    Error("Unable to get current clock time");
     return;
   }
 
-  if (fwrite(buf, 1, strlen(buf), output) < strlen(buf)) {
-    Error("Unable to write history file");
+#define APPEND_LITERAL(str) p = AppendRaw(p, end, str, sizeof(str) - 1)
+  APPEND_LITERAL("{\"time_ns\":");
+  p = AppendUint(p, end, (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec);
+  APPEND_LITERAL(",\"source\":");
+  p = AppendJsonString(p, end, target);
+  APPEND_LITERAL(",\"host\":");
+  p = AppendJsonString(p, end, resolvedHost);
+  APPEND_LITERAL(",\"protocol\":");
+  p = AppendJsonString(p, end, (protocol == IPPROTO_TCP) ? "TCP" : "UDP");
+  APPEND_LITERAL(",\"port\":");
+  p = AppendUint(p, end, port);
+  APPEND_LITERAL(",\"type\":");
+  p = AppendJsonString(p, end, (configData.sentryMode == SENTRY_MODE_CONNECT) ? "Connect" : (protocol == IPPROTO_TCP) ? ReportPacketType(tcp)
+                                                                                                                     : "UDP");
+  APPEND_LITERAL(",\"tcp_flags\":");
+  if (tcp != NULL) {
+    p = AppendUint(p, end, tcp->th_flags);
+  } else {
+    APPEND_LITERAL("null");
+  }
+  APPEND_LITERAL(",\"ip_options\":");
+  p = AppendJsonFlag(p, end, (ip != NULL) ? (ip->ip_hl > 5) : -100);
+  APPEND_LITERAL(",\"ignored\":");
+  p = AppendJsonFlag(p, end, flagIgnored);
+  APPEND_LITERAL(",\"triggered\":");
+  p = AppendJsonFlag(p, end, flagTriggerCountExceeded);
+  APPEND_LITERAL(",\"noblock\":");
+  p = AppendJsonFlag(p, end, flagDontBlock);
+  APPEND_LITERAL(",\"blocked\":");
+  if (flagBlockSuccessful == BLOCK_QUEUED) {
+    APPEND_LITERAL("\"queued\"");
+  } else {
+    p = AppendJsonFlag(p, end, flagBlockSuccessful);
+  }
+  APPEND_LITERAL("}\n");
+#undef APPEND_LITERAL
+
+  if (p == NULL) {
+    Error("Unable to log scan event due to internal buffer too small");
     return;
   }
 
-  fclose(output);
+  AddHistoryRecord(buf, (size_t)(p - buf));
+}
+
+// The Append functions return the new end of the string, or NULL if it doesn't fit (or p is already NULL)
+static char *AppendRaw(char *p, const char *end, const char *str, const size_t len) {
+  if (p == NULL || (size_t)(end - p) < len) {
+    return NULL;
+  }
+
+  memcpy(p, str, len);
+
+  return p + len;
+}
+
+char *AppendJsonString(char *p, const char *end, const char *str) {
+  static const char hex[] = "0123456789abcdef";
+  const unsigned char *s = (const unsigned char *)str;
+
+  if (p == NULL || p == end) {
+    return NULL;
+  }
+
+  *p++ = '"';
+
+  for (; *s != '\0'; s++) {
+    if (*s == '"' || *s == '\\') {
+      if (end - p < 2) {
+        return NULL;
+      }
+      *p++ = '\\';
+      *p++ = (char)*s;
+    } else if (*s < 0x20) {
+      if (end - p < 6) {
+        return NULL;
+      }
+      memcpy(p, "\\u00", 4);
+      p[4] = hex[*s >> 4];
+      p[5] = hex[*s & 0x0F];
+      p += 6;
+    } else {
+      if (p == end) {
+        return NULL;
+      }
+      *p++ = (char)*s;
+    }
+  }
+
+  return AppendRaw(p, end, "\"", 1);
+}
+
+static char *AppendUint(char *p, const char *end, uint64_t value) {
+  char digits[20];
+  int i = sizeof(digits);
+
+  do {
+    digits[--i] = (char)('0' + value % 10);
+    value /= 10;
+  } while (value != 0);
+
+  return AppendRaw(p, end, digits + i, sizeof(digits) - i);
+}
+
+static char *AppendJsonFlag(char *p, const char *end, const int flag) {
+  if (flag == TRUE) {
+    return AppendRaw(p, end, "true", 4);
+  } else if (flag == -100) {
+    return AppendRaw(p, end, "null", 4);
+  }
+
+  return AppendRaw(p, end, "false", 5);
+}
+
+// History records are collected during a batch and handed to the history writer together
+static void AddHistoryRecord(const char *record, const size_t len) {
+  if (len > sizeof(historyBatch) - historyBatchLen) {
+    FlushHistoryRecords();
+  }
+
+  memcpy(historyBatch + historyBatchLen, record, len);
+  historyBatchLen += len;
+}
+
+static void FlushHistoryRecords(void) {
+  if (historyBatchLen > 0) {
+    WriteHistory(historyBatch, historyBatchLen);
+    historyBatchLen = 0;
+  }
 }
 
 int InitSentry(void) {
@@ -127,8 +303,52 @@ int InitSentry(void) {
     }
   }
 
-  if (ss.isInitialized == FALSE) {
-    InitSentryState(&ss);
+  if (ss.isInitialized == FALSE && InitSentryState(&ss) != TRUE) {
+    FreeIgnore(&is);
+    BlockedStateFree(&bs);
+    return ERROR;
+  }
+
+#ifdef __linux__
+  if (InitNft() == ERROR) {
+    FreeIgnore(&is);
+    BlockedStateFree(&bs);
+    FreeSentryState(&ss);
+    return ERROR;
+  }
+#endif
+
+  // Blocks which expired while portsentry wasn't running are undone before the blocked hosts are restored
+  if (ExpireBlocked(&bs, &expired) > 0) {
+    UndisposeTargets(&expired);
+  }
+
+#ifdef __linux__
+  // Not fatal, hosts are still detected and new blocks might succeed
+  if (configData.nftRestore == TRUE && NftRestoreBlocked(&bs) != TRUE) {
+    Error("Unable to restore blocked hosts from %s into nftables", configData.blockedFile);
+  }
+#endif
+
+  if (configData.blockAsync == TRUE && InitBlockExecutor(&bs) != TRUE) {
+    FreeIgnore(&is);
+    BlockedStateFree(&bs);
+    FreeSentryState(&ss);
+#ifdef __linux__
+    FreeNft();
+#endif
+    return ERROR;
+  }
+
+  if (InitHistory() != TRUE) {
+    FreeBlockExecutor();
+    FreeIgnore(&is);
+    BlockedStateFree(&bs);
+    FreeSentryState(&ss);
+#ifdef __linux__
+    FreeNft();
+#endif
+    return ERROR;
   }
 
   isInitialized = TRUE;
@@ -144,41 +364,214 @@ void FreeSentry(void) {
     FreeIgnore(&is);
   }
 
+  // Wait for queued blocks before the blocked state goes away
+  FreeBlockExecutor();
+
+  FreeHistory();
+
+#ifdef __linux__
+  FreeNft();
+#endif
+
   if (bs.isInitialized == TRUE) {
     BlockedStateFree(&bs);
   }
 
+  if (ss.isInitialized == TRUE) {
+    FreeSentryState(&ss);
+  }
+
+  FreeExpiredBlocks(&expired);
+
   isInitialized = FALSE;
 }
 
-void RunSentry(const struct PacketInfo *pi) {
-  char resolvedHost[NI_MAXHOST];
-  int flagIgnored = -100, flagTriggerCountExceeded = -100, flagDontBlock = -100, flagBlockSuccessful = -100;  // -100 => unset
+/* The poll() timeout in ms for the sentry loops. Expiring blocks and flushing the blocked file
+ * need a wakeup every second, unless the block executor takes care of it.
+ */
+int GetSentryPollTimeout(void) {
+  if (configData.blockAsync == TRUE) {
+    return -1;
+  }
+
+  return (configData.blockTimeout > 0 || bs.log.noUnsynced > 0) ? SENTRY_TIMER_INTERVAL : -1;
+}
 
+// Called by the sentry loops after each poll(), does nothing until a block expires or the blocked file is due a flush
+void RunSentryTimers(void) {
   assert(isInitialized == TRUE);
-  assert(pi != NULL);
 
-  if (configData.resolveHost == TRUE) {
-    ResolveAddr(pi, resolvedHost, NI_MAXHOST);
-  } else {
-    snprintf(resolvedHost, NI_MAXHOST, "%s", pi->saddr);
+#ifdef __linux__
+  MaintainListenCache();
+#endif
+
+  if (configData.blockAsync == TRUE) {
+    return;
+  }
+
+  if (ExpireBlocked(&bs, &expired) > 0) {
+    UndisposeTargets(&expired);
   }
 
-  if ((flagIgnored = IgnoreIpIsPresent(&is, GetSourceSockaddrFromPacketInfo(pi))) == ERROR) {
-    flagIgnored = FALSE;
-  } else if (flagIgnored == TRUE) {
-    Verbose("Host: %s found in ignore file %s, aborting actions", pi->saddr, configData.ignoreFile);
+  MaintainBlockedFile(&bs);
+}
+
+/* Copy a packet into the batch, the headers are copied since the packet memory may be reused before the batch
+ * is run. A packet with headers too large to copy is run on its own, after the packets before it.
+ */
+void AddToSentryBatch(struct SentryBatch *batch, const struct PacketInfo *pi) {
+  struct PacketInfo *copy;
+  uint32_t length = 0;
+
+  if (pi->packet != NULL) {
+    length = pi->l4Offset + ((pi->protocol == IPPROTO_TCP) ? sizeof(struct tcphdr) : sizeof(struct udphdr));
+  }
+
+  if (length > SENTRY_BATCH_HEADER_SIZE) {
+    FlushSentryBatch(batch);
+    RunSentryBatch(pi, 1);
+    return;
+  }
+
+  copy = &batch->pis[batch->count];
+  *copy = *pi;
+
+  if (pi->packet != NULL) {
+    memcpy(batch->headers[batch->count], pi->packet, length);
+    copy->packet = batch->headers[batch->count];
+    copy->packetLength = length;
+  }
+
+  if (++batch->count == SENTRY_BATCH_SIZE) {
+    FlushSentryBatch(batch);
+  }
+}
+
+void FlushSentryBatch(struct SentryBatch *batch) {
+  if (batch->count > 0) {
+    RunSentryBatch(batch->pis, batch->count);
+    batch->count = 0;
+  }
+}
+
+/* Run the packets through the sentry engine, in order. Within a batch the address of each source is
+ * formatted, resolved and looked up in the ignore list and blocked set once, the state table and blocked
+ * set slots of all sources are prefetched up front and the history records are written together.
+ */
+void RunSentryBatch(const struct PacketInfo *pis, const size_t n) {
+  size_t i;
+
+  assert(isInitialized == TRUE);
+  assert(pis != NULL);
+
+  for (i = 0; i < n; i += SENTRY_BATCH_SIZE) {
+    RunSentryChunk(pis + i, (n - i < SENTRY_BATCH_SIZE) ? n - i : SENTRY_BATCH_SIZE);
+  }
+
+  FlushHistoryRecords();
+}
+
+static void RunSentryChunk(const struct PacketInfo *pis, const size_t n) {
+  uint8_t sourceIndex[SENTRY_BATCH_SIZE];
+  uint32_t noSources, i;
+
+  noSources = GetBatchSources(pis, n, sourceIndex);
+
+  for (i = 0; i < noSources; i++) {
+    PrefetchState(&ss, &batchSources[i].cold.sa);
+    if (configData.blockAsync == FALSE) {
+      PrefetchBlocked(&batchSources[i].cold.sa, &bs);
+    }
+  }
+
+  for (i = 0; i < n; i++) {
+    if (sourceIndex[i] != UINT8_MAX) {
+      RunSentryPacket(&pis[i], &batchSources[sourceIndex[i]]);
+    }
+  }
+}
+
+/* Dedupe the sources of the packets into batchSources with a small open addressing table, sourceIndex
+ * is set to the source of each packet (or UINT8_MAX if the packet has no usable source address).
+ */
+static uint32_t GetBatchSources(const struct PacketInfo *pis, const size_t n, uint8_t *sourceIndex) {
+  uint8_t slots[BATCH_SOURCE_SLOTS];  // Index into batchSources + 1, 0 is empty
+  uint32_t noSources = 0, slot, i;
+  uint64_t hi, lo;
+  struct BatchSource *source;
+
+  memset(slots, 0, sizeof(slots));
+
+  for (i = 0; i < n; i++) {
+    memcpy(&hi, pis[i].source.s6_addr, sizeof(hi));
+    memcpy(&lo, pis[i].source.s6_addr + sizeof(hi), sizeof(lo));
+    slot = (uint32_t)(((hi ^ (lo * FIBONACCI_HASH_64)) * FIBONACCI_HASH_64) >> 57) & (BATCH_SOURCE_SLOTS - 1);
+
+    for (; slots[slot] != 0; slot = (slot + 1) & (BATCH_SOURCE_SLOTS - 1)) {
+      source = &batchSources[slots[slot] - 1];
+      if (source->version == pis[i].version && memcmp(&source->address, &pis[i].source, sizeof(struct in6_addr)) == 0) {
+        break;
+      }
+    }
+
+    if (slots[slot] != 0) {
+      sourceIndex[i] = slots[slot] - 1;
+      continue;
+    }
+
+    source = &batchSources[noSources];
+    if (FillPacketInfoCold(&pis[i], &source->cold) != TRUE) {
+      sourceIndex[i] = UINT8_MAX;
+      continue;
+    }
+
+    source->version = pis[i].version;
+    source->address = pis[i].source;
+    source->isResolved = FALSE;
+    source->isIgnored = -100;
+    source->isBlocked = -100;
+    slots[slot] = (uint8_t)(noSources + 1);
+    sourceIndex[i] = (uint8_t)noSources++;
+  }
+
+  return noSources;
+}
+
+static void RunSentryPacket(const struct PacketInfo *pi, struct BatchSource *source) {
+  int flagIgnored = -100, flagTriggerCountExceeded = -100, flagDontBlock = -100, flagBlockSuccessful = -100;  // -100 => unset
+
+  if (source->isResolved == FALSE) {
+    if (configData.resolveHost == TRUE) {
+      ResolveAddr(&source->cold, source->resolvedHost, NI_MAXHOST);
+    } else {
+      SafeStrncpy(source->resolvedHost, source->cold.saddr, NI_MAXHOST);
+    }
+    source->isResolved = TRUE;
+  }
+
+  if (source->isIgnored == -100 && (source->isIgnored = IgnoreIpIsPresent(&is, &source->cold.sa)) == ERROR) {
+    source->isIgnored = FALSE;
+  }
+
+  if ((flagIgnored = source->isIgnored) == TRUE) {
+    Verbose("Host: %s found in ignore file %s, aborting actions", source->cold.saddr, configData.ignoreFile);
     goto sentry_exit;
   }
 
-  if ((flagTriggerCountExceeded = CheckState(&ss, GetSourceSockaddrFromPacketInfo(pi))) != TRUE) {
+  if ((flagTriggerCountExceeded = CheckState(&ss, &source->cold.sa)) != TRUE) {
     goto sentry_exit;
   }
 
+  // The listen cache which let the packet through can be stale, confirm with a bind() probe before acting on it
+  if (RecheckPortInUse(pi) != FALSE) {
+    Verbose("Port %d/%s is in use by a local service, ignoring host: %s", pi->port, GetProtocolString(pi->protocol), source->cold.saddr);
+    return;
+  }
+
   if (configData.sentryMode == SENTRY_MODE_CONNECT && pi->protocol == IPPROTO_TCP) {
-    XmitBannerIfConfigured(IPPROTO_TCP, pi->tcpAcceptSocket, NULL, 0);
+    XmitBannerIfConfigured(IPPROTO_TCP, pi->connect->tcpAcceptSocket, NULL, 0);
   } else if (configData.sentryMode == SENTRY_MODE_CONNECT && pi->protocol == IPPROTO_UDP) {
-    XmitBannerIfConfigured(IPPROTO_UDP, pi->listenSocket, GetClientSockaddrFromPacketInfo(pi), GetClientSockaddrLenFromPacketInfo(pi));
+    XmitBannerIfConfigured(IPPROTO_UDP, pi->connect->listenSocket, GetClientSockaddrFromPacketInfo(pi), GetClientSockaddrLenFromPacketInfo(pi));
   }
 
   // If in log-only mode, don't run any of the blocking code
@@ -191,19 +584,40 @@ void RunSentry(const struct PacketInfo *pi) {
     flagDontBlock = FALSE;
   }
 
-  if (IsBlocked(GetSourceSockaddrFromPacketInfo(pi), &bs) == FALSE) {
-    if (DisposeTarget(pi->saddr, pi->port, pi->protocol) != TRUE) {
-      Error("attackalert: Error during target dispose %s/%s!", resolvedHost, pi->saddr);
+  // Once a source is blocked (or queued) within the batch it stays blocked, so it's only looked up once
+  if (source->isBlocked == -100) {
+    if (configData.blockAsync == TRUE) {
+      source->isBlocked = IsBlockedOrQueued(&source->cold.sa);
+    } else {
+      source->isBlocked = IsBlocked(&source->cold.sa, &bs);
+    }
+  }
+
+  if (source->isBlocked == FALSE) {
+    if (configData.blockAsync == TRUE) {
+      // The outcome is logged by the executor once the blocking actions have run
+      if (QueueBlock(source->cold.saddr, &source->cold.sa, pi->port, pi->protocol) == TRUE) {
+        source->isBlocked = BLOCK_QUEUED;
+        flagBlockSuccessful = BLOCK_QUEUED;
+      } else {
+        flagBlockSuccessful = FALSE;
+      }
+    } else if (DisposeTarget(source->cold.saddr, pi->port, pi->protocol) != TRUE) {
+      Error("attackalert: Error during target dispose %s/%s!", source->resolvedHost, source->cold.saddr);
       flagBlockSuccessful = FALSE;
     } else {
-      WriteBlockedFile(GetSourceSockaddrFromPacketInfo(pi), &bs);
+      WriteBlockedFile(&source->cold.sa, &bs);
+      source->isBlocked = TRUE;
       flagBlockSuccessful = TRUE;
     }
+  } else if (source->isBlocked == BLOCK_QUEUED) {
+    Log("attackalert: Host: %s/%s is already queued to be blocked Ignoring", source->resolvedHost, source->cold.saddr);
+    flagBlockSuccessful = BLOCK_QUEUED;
   } else {
-    Log("attackalert: Host: %s/%s is already blocked Ignoring", resolvedHost, pi->saddr);
+    Log("attackalert: Host: %s/%s is already blocked Ignoring", source->resolvedHost, source->cold.saddr);
     flagBlockSuccessful = TRUE;
   }
 
 sentry_exit:
-  LogScanEvent(pi->saddr, resolvedHost, pi->protocol, pi->port, pi->ip, pi->tcp, flagIgnored, flagTriggerCountExceeded, flagDontBlock, flagBlockSuccessful);
+  LogScanEvent(source->cold.saddr, source->resolvedHost, pi->protocol, pi->port, GetIpHeader(pi), GetTcpHeader(pi), flagIgnored, flagTriggerCountExceeded, flagDontBlock, flagBlockSuccessful);
 }
@@ -4,8 +4,26 @@
 
 #pragma once
 
+#include <stddef.h>
+
 #include "packet_info.h"
 
+#define SENTRY_BATCH_SIZE 64
+#define SENTRY_BATCH_HEADER_SIZE 128  // Enough for the ip header with options and a tcp/udp header
+
+/* Packets collected by a sentry loop, to be run through RunSentryBatch() together */
+struct SentryBatch {
+  struct PacketInfo pis[SENTRY_BATCH_SIZE];
+  _Alignas(8) unsigned char headers[SENTRY_BATCH_SIZE][SENTRY_BATCH_HEADER_SIZE];
+  size_t count;
+};
+
 int InitSentry(void);
 void FreeSentry(void);
-void RunSentry(const struct PacketInfo *pi);
+int GetSentryPollTimeout(void);
+void RunSentryTimers(void);
+void AddToSentryBatch(struct SentryBatch *batch, const struct PacketInfo *pi);
+void FlushSentryBatch(struct SentryBatch *batch);
+void RunSentryBatch(const struct PacketInfo *pis, const size_t n);
+// Append str as a quoted JSON string, returns the new end or NULL if it doesn't fit (or p is NULL)
+char *AppendJsonString(char *p, const char *end, const char *str);
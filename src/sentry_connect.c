@@ -37,6 +37,7 @@ struct ConnectionData {
 
 static int SetConnectionData(struct ConnectionData **cd, const int cdIdx, const uint16_t port, const int proto, const int family);
 static int ConstructConnectionData(struct ConnectionData **cd);
+static int SetConnectionDataForPorts(struct ConnectionData **cd, int *cdIdx, const struct PortBitmap *bitmap, const int proto);
 static void FreeConnectionData(struct ConnectionData **cd, int *cdSize);
 static int PrepareNoFds(void);
 
@@ -47,10 +48,11 @@ int PortSentryConnectMode(void) {
   socklen_t clientLength;
   int incomingSockfd = -1, result;
   int count = 0;
-  char err[ERRNOMAXBUF];
+  char err[ERRNOMAXBUF], saddr[INET6_ADDRSTRLEN];
   struct pollfd *fds = NULL;
   struct ConnectionData *connectionData = NULL;
   struct PacketInfo pi;
+  struct ConnectInfo ci;
   int connectionDataSize = 0;
   char tmp;
 
@@ -78,7 +80,7 @@ int PortSentryConnectMode(void) {
   Log("PortSentry is now active and listening.");
 
   while (g_isRunning == TRUE) {
-    result = poll(fds, connectionDataSize, -1);
+    result = poll(fds, connectionDataSize, GetSentryPollTimeout());
 
     if (result == -1) {
       if (errno == EINTR) {
@@ -86,9 +88,12 @@ int PortSentryConnectMode(void) {
       }
       Error("poll() failed %s", ErrnoString(err, sizeof(err)));
       goto exit;
-    } else if (result == 0) {
-      Error("poll() timed out. Aborting.");
-      goto exit;
+    }
+
+    RunSentryTimers();
+
+    if (result == 0) {
+      continue;
     }
 
     for (count = 0; count < connectionDataSize; count++) {
@@ -128,15 +133,17 @@ int PortSentryConnectMode(void) {
       }
 
       ClearPacketInfo(&pi);
-      SetPacketInfoFromConnectData(&pi, connectionData[count].port, connectionData[count].family, connectionData[count].protocol, connectionData[count].sockfd, incomingSockfd, &client4, &client6);
+      SetPacketInfoFromConnectData(&pi, &ci, connectionData[count].port, connectionData[count].family, connectionData[count].protocol, connectionData[count].sockfd, incomingSockfd, &client4, &client6);
 
-      Debug("RunSentry connect mode: accepted %s connection from: %s", GetProtocolString(pi.protocol), pi.saddr);
+      if ((configData.logFlags & LOGFLAG_DEBUG) != 0 && GetSourceAddrString(&pi, saddr, sizeof(saddr)) == TRUE) {
+        Debug("RunSentry connect mode: accepted %s connection from: %s", GetProtocolString(pi.protocol), saddr);
+      }
 
-      RunSentry(&pi);
+      RunSentryBatch(&pi, 1);
       if (incomingSockfd != -1) {
         close(incomingSockfd);
         incomingSockfd = -1;
-        pi.tcpAcceptSocket = -1;
+        ci.tcpAcceptSocket = -1;
       }
     }
   }
@@ -202,91 +209,40 @@ static int SetConnectionData(struct ConnectionData **cd, const int cdIdx, const
 }
 
 int ConstructConnectionData(struct ConnectionData **cd) {
-  int i, j, cdIdx = 0, ret;
+  int cdIdx = 0;
 
-  /* OpenBSD doesn't support IPv4/IPv6 dual-stack sockets,
-   * so we need to manually open an IPv4 socket */
-  for (i = 0; i < configData.tcpPortsLength; i++) {
-    if (IsPortSingle(&configData.tcpPorts[i])) {
-      ret = SetConnectionData(cd, cdIdx, configData.tcpPorts[i].single, IPPROTO_TCP, AF_INET6);
-      if (ret == TRUE) {
-        cdIdx++;
-      } else if (ret == ERROR) {
-        goto err;
-      }
-#ifdef __OpenBSD__
-      ret = SetConnectionData(cd, cdIdx, configData.tcpPorts[i].single, IPPROTO_TCP, AF_INET);
-      if (ret == TRUE) {
-        cdIdx++;
-      } else if (ret == ERROR) {
-        goto err;
-      }
-#endif
-    } else {
-      for (j = configData.tcpPorts[i].range.start; j <= configData.tcpPorts[i].range.end; j++) {
-        ret = SetConnectionData(cd, cdIdx, j, IPPROTO_TCP, AF_INET6);
-        if (ret == TRUE) {
-          cdIdx++;
-        } else if (ret == ERROR) {
-          goto err;
-        }
-#ifdef __OpenBSD__
-        ret = SetConnectionData(cd, cdIdx, j, IPPROTO_TCP, AF_INET);
-        if (ret == TRUE) {
-          cdIdx++;
-        } else if (ret == ERROR) {
-          goto err;
-        }
-#endif
-      }
-    }
+  if (SetConnectionDataForPorts(cd, &cdIdx, configData.tcpPortBitmap, IPPROTO_TCP) == ERROR ||
+      SetConnectionDataForPorts(cd, &cdIdx, configData.udpPortBitmap, IPPROTO_UDP) == ERROR) {
+    FreeConnectionData(cd, &cdIdx);
+    cdIdx = 0;
   }
 
-  for (i = 0; i < configData.udpPortsLength; i++) {
-    if (IsPortSingle(&configData.udpPorts[i])) {
-      ret = SetConnectionData(cd, cdIdx, configData.udpPorts[i].single, IPPROTO_UDP, AF_INET6);
-      if (ret == TRUE) {
-        cdIdx++;
-      } else if (ret == ERROR) {
-        goto err;
-      }
-#ifdef __OpenBSD__
-      ret = SetConnectionData(cd, cdIdx, configData.udpPorts[i].single, IPPROTO_UDP, AF_INET);
-      if (ret == TRUE) {
-        cdIdx++;
-      } else if (ret == ERROR) {
-        goto err;
-      }
-#endif
-    } else {
-      for (j = configData.udpPorts[i].range.start; j <= configData.udpPorts[i].range.end; j++) {
-        ret = SetConnectionData(cd, cdIdx, j, IPPROTO_UDP, AF_INET6);
-        if (ret == TRUE) {
-          cdIdx++;
-        } else if (ret == ERROR) {
-          goto err;
-        }
+  return cdIdx;
+}
+
+static int SetConnectionDataForPorts(struct ConnectionData **cd, int *cdIdx, const struct PortBitmap *bitmap, const int proto) {
+  int port, ret;
+
+  for (port = GetNextPortInBitmap(bitmap, 0); port != ERROR; port = GetNextPortInBitmap(bitmap, port + 1)) {
+    ret = SetConnectionData(cd, *cdIdx, port, proto, AF_INET6);
+    if (ret == TRUE) {
+      (*cdIdx)++;
+    } else if (ret == ERROR) {
+      return ERROR;
+    }
 #ifdef __OpenBSD__
-        ret = SetConnectionData(cd, cdIdx, j, IPPROTO_UDP, AF_INET);
-        if (ret == TRUE) {
-          cdIdx++;
-        } else if (ret == ERROR) {
-          goto err;
-        }
-#endif
-      }
+    /* OpenBSD doesn't support IPv4/IPv6 dual-stack sockets,
+     * so we need to manually open an IPv4 socket */
+    ret = SetConnectionData(cd, *cdIdx, port, proto, AF_INET);
+    if (ret == TRUE) {
+      (*cdIdx)++;
+    } else if (ret == ERROR) {
+      return ERROR;
     }
+#endif
   }
 
-  goto exit;
-
-err:
-  FreeConnectionData(cd, &cdIdx);
-  cdIdx = 0;
-
-exit:
-
-  return cdIdx;
+  return TRUE;
 }
 
 void FreeConnectionData(struct ConnectionData **cd, int *cdSize) {
@@ -303,8 +259,8 @@ static int PrepareNoFds(void) {
   struct rlimit rlim;
   char err[ERRNOMAXBUF];
 
-  noFds = GetNoPorts(configData.tcpPorts, configData.tcpPortsLength);
-  noFds += GetNoPorts(configData.udpPorts, configData.udpPortsLength);
+  noFds = GetNoPorts(configData.tcpPortBitmap);
+  noFds += GetNoPorts(configData.udpPortBitmap);
 #ifdef __OpenBSD__
   /* OpenBSD doesn't support IPv4/IPv6 dual-stack sockets,
    * so we need to double the number of file descriptors */
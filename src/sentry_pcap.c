@@ -15,6 +15,7 @@
 #include <errno.h>
 
 #include "portsentry.h"
+#include "config_data.h"
 #include "sentry_pcap.h"
 #include "pcap_listener.h"
 #include "pcap_device.h"
@@ -40,6 +41,8 @@ static void HandleInterfaceRemoved(struct Device *device, struct pollfd **fds, i
 
 extern uint8_t g_isRunning;
 
+static struct SentryBatch batch;
+
 #ifdef FUZZ_SENTRY_PCAP_PREP_PACKET
 uint8_t g_isRunning = TRUE;
 int LLVMFuzzerTestOneInput(const uint8_t *Data, size_t Size) {
@@ -88,7 +91,11 @@ int PortSentryPcap(void) {
       }
       Error("poll() failed %s", ErrnoString(err, sizeof(err)));
       goto exit;
-    } else if (ret == 0) {
+    }
+
+    RunSentryTimers();
+
+    if (ret == 0) {
       continue;
     }
 
@@ -116,6 +123,8 @@ int PortSentryPcap(void) {
             Error("Got PCAP_ERROR_BREAK, ignoring");
           }
         } while (ret > 0);
+
+        FlushSentryBatch(&batch);
       } else if (fds[i].revents & POLLERR) {
         if ((current = GetDeviceByFd(lm, fds[i].fd)) == NULL) {
           Error("On POLLERR: Unable to find device by fd %d in main pcap loop", fds[i].fd);
@@ -141,13 +150,18 @@ exit:
 static void HandlePacket(u_char *args, const struct pcap_pkthdr *header, const u_char *packet) {
   struct Device *device = (struct Device *)args;
   struct PacketInfo pi;
-  (void)header;
 
-  if (PrepPacket(&pi, device, packet, header->len) == FALSE) {
+  // Only caplen bytes are captured, len is the length of the packet on the wire
+  if (PrepPacket(&pi, device, packet, header->caplen) == FALSE) {
     return;
   }
 
-  if (pi.protocol == IPPROTO_TCP && (((pi.tcp->th_flags & TH_ACK) != 0) || ((pi.tcp->th_flags & TH_RST) != 0))) {
+  if (pi.protocol == IPPROTO_TCP && (((pi.tcpFlags & TH_ACK) != 0) || ((pi.tcpFlags & TH_RST) != 0))) {
+    return;
+  }
+
+  // The pcap filter should only let monitored ports through, but it's cheap to make sure
+  if (IsPortInBitmap((pi.protocol == IPPROTO_TCP) ? configData.tcpPortBitmap : configData.udpPortBitmap, pi.port) == FALSE) {
     return;
   }
 
@@ -156,7 +170,7 @@ static void HandlePacket(u_char *args, const struct pcap_pkthdr *header, const u
     return;
   }
 
-  RunSentry(&pi);
+  AddToSentryBatch(&batch, &pi);
 }
 
 static int PrepPacket(struct PacketInfo *pi, const struct Device *device, const u_char *packet, const uint32_t packetLength) {
@@ -217,6 +231,10 @@ static int PrepPacket(struct PacketInfo *pi, const struct Device *device, const
     return FALSE;
   }
 
+  if (packetLength <= (uint32_t)ipOffset) {
+    return FALSE;
+  }
+
   ClearPacketInfo(pi);
   return SetPacketInfoFromPacket(pi, (unsigned char *)packet + ipOffset, packetLength - ipOffset);
 }
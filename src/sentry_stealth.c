@@ -24,6 +24,9 @@
 #include "portsentry.h"
 #include "config_data.h"
 #include "packet_info.h"
+#include "packet_ring.h"
+#include "packet_batch.h"
+#include "raw_filter.h"
 #include "io.h"
 #include "util.h"
 #include "sentry.h"
@@ -32,14 +35,16 @@
 
 extern uint8_t g_isRunning;
 
+static struct SentryBatch batch;
+
 static int PacketRead(const int socket, char *buffer, const int bufferLen);
+static void HandlePacket(const unsigned char *packet, const uint32_t packetLength);
 
 #ifdef FUZZ_SENTRY_STEALTH_PREP_PACKET
 uint8_t g_isRunning = TRUE;
 int LLVMFuzzerTestOneInput(const uint8_t *Data, size_t Size) {
   struct PacketInfo pi;
   ClearPacketInfo(&pi);
-  pi.packetLength = IP_MAXPACKET;
   if (SetPacketInfoFromPacket(&pi, (unsigned char *)Data, Size) != TRUE) {
     return -1;
   }
@@ -52,7 +57,8 @@ int PortSentryStealthMode(void) {
   int status = EXIT_FAILURE, result, nfds = NFDS, i;
   char packetBuffer[IP_MAXPACKET], err[ERRNOMAXBUF];
   struct pollfd fds[NFDS];
-  struct PacketInfo pi;
+  struct PacketRing rings[NFDS];
+  struct PacketBatch batches[NFDS];
 
   assert(configData.sentryMode == SENTRY_MODE_STEALTH);
 
@@ -60,6 +66,8 @@ int PortSentryStealthMode(void) {
   for (i = 0; i < nfds; i++) {
     fds[i].fd = -1;
     fds[i].events = POLLIN;
+    ResetPacketRing(&rings[i]);
+    ResetPacketBatch(&batches[i]);
   }
 
   /* Listen for IPv4 and IPv6 packets on different sockets, it will probably(?)
@@ -68,27 +76,48 @@ int PortSentryStealthMode(void) {
    */
   if ((fds[0].fd = socket(AF_PACKET, SOCK_DGRAM, htons(ETH_P_IP))) < 0) {
     Error("Unable to create socket: %s", ErrnoString(err, sizeof(err)));
-    return ERROR;
+    goto exit;
   }
 
   if ((fds[1].fd = socket(AF_PACKET, SOCK_DGRAM, htons(ETH_P_IPV6))) < 0) {
     Error("Unable to create socket: %s", ErrnoString(err, sizeof(err)));
-    return ERROR;
+    goto exit;
+  }
+
+  // Let the kernel drop packets to ports we don't monitor. Not fatal, all checks are also done in userspace
+  AttachRawFilter(fds[0].fd, AF_INET);
+  AttachRawFilter(fds[1].fd, AF_INET6);
+
+  if (configData.rawRingSize > 0) {
+    for (i = 0; i < nfds; i++) {
+      if (SetupPacketRing(&rings[i], fds[i].fd, configData.rawRingSize, configData.rawRingTimeout) != TRUE) {
+        goto exit;
+      }
+    }
+  } else if (configData.rawBatchSize > 0) {
+    for (i = 0; i < nfds; i++) {
+      if (SetupPacketBatch(&batches[i], fds[i].fd, configData.rawBatchSize, (configData.captureSnaplen > 0) ? configData.captureSnaplen : PACKET_BATCH_SNAPLEN) != TRUE) {
+        goto exit;
+      }
+    }
   }
 
   Log("PortSentry is now active and listening.");
 
   while (g_isRunning == TRUE) {
-    result = poll(fds, nfds, -1);
+    result = poll(fds, nfds, GetSentryPollTimeout());
     if (result == -1) {
       if (errno == EINTR) {
         continue;
       }
       Error("poll() failed: %s. Aborting.", ErrnoString(err, sizeof(err)));
       goto exit;
-    } else if (result == 0) {
-      Error("poll() timed out. Aborting.");
-      goto exit;
+    }
+
+    RunSentryTimers();
+
+    if (result == 0) {
+      continue;
     }
 
     for (i = 0; i < nfds; i++) {
@@ -96,37 +125,23 @@ int PortSentryStealthMode(void) {
         continue;
       }
 
-      if ((packetLen = PacketRead(fds[i].fd, packetBuffer, IP_MAXPACKET)) == ERROR)
-        continue;
-
-      ClearPacketInfo(&pi);
-      pi.packetLength = IP_MAXPACKET;
-      if (SetPacketInfoFromPacket(&pi, (unsigned char *)packetBuffer, packetLen) != TRUE) {
+      if (configData.rawRingSize > 0) {
+        PacketRingDispatch(&rings[i], HandlePacket);
         continue;
       }
 
-      if (pi.protocol == IPPROTO_TCP) {
-        if (((pi.tcp->th_flags & TH_ACK) != 0) || ((pi.tcp->th_flags & TH_RST) != 0)) {
-          continue;
-        }
-        if (IsPortPresent(configData.tcpPorts, configData.tcpPortsLength, pi.port) == FALSE) {
-          continue;
-        }
-      } else if (pi.protocol == IPPROTO_UDP) {
-        if (IsPortPresent(configData.udpPorts, configData.udpPortsLength, pi.port) == FALSE) {
-          continue;
-        }
-      } else {
-        Error("Unknown protocol %d. Skipping", pi.protocol);
+      if (configData.rawBatchSize > 0) {
+        PacketBatchDispatch(&batches[i], HandlePacket);
         continue;
       }
 
-      if (IsPortInUse(&pi) != FALSE) {
+      if ((packetLen = PacketRead(fds[i].fd, packetBuffer, (configData.captureSnaplen > 0) ? configData.captureSnaplen : IP_MAXPACKET)) == ERROR)
         continue;
-      }
 
-      RunSentry(&pi);
+      HandlePacket((unsigned char *)packetBuffer, packetLen);
     }
+
+    FlushSentryBatch(&batch);
   }
 
   status = EXIT_SUCCESS;
@@ -134,6 +149,10 @@ int PortSentryStealthMode(void) {
 exit:
 
   for (i = 0; i < nfds; i++) {
+    FreePacketRing(&rings[i]);
+    LogPacketBatchStats(&batches[i]);
+    FreePacketBatch(&batches[i]);
+
     if (fds[i].fd != -1)
       close(fds[i].fd);
   }
@@ -141,6 +160,37 @@ exit:
   return status;
 }
 
+static void HandlePacket(const unsigned char *packet, const uint32_t packetLength) {
+  struct PacketInfo pi;
+
+  ClearPacketInfo(&pi);
+  if (SetPacketInfoFromPacket(&pi, packet, packetLength) != TRUE) {
+    return;
+  }
+
+  if (pi.protocol == IPPROTO_TCP) {
+    if (((pi.tcpFlags & TH_ACK) != 0) || ((pi.tcpFlags & TH_RST) != 0)) {
+      return;
+    }
+    if (IsPortInBitmap(configData.tcpPortBitmap, pi.port) == FALSE) {
+      return;
+    }
+  } else if (pi.protocol == IPPROTO_UDP) {
+    if (IsPortInBitmap(configData.udpPortBitmap, pi.port) == FALSE) {
+      return;
+    }
+  } else {
+    Error("Unknown protocol %d. Skipping", pi.protocol);
+    return;
+  }
+
+  if (IsPortInUse(&pi) != FALSE) {
+    return;
+  }
+
+  AddToSentryBatch(&batch, &pi);
+}
+
 static int PacketRead(const int socket, char *buffer, const int bufferLen) {
   char err[ERRNOMAXBUF];
   ssize_t result;
@@ -7,10 +7,12 @@
 #include <stdint.h>
 
 #include "portsentry.h"
+#include "history.h"
 
 extern uint8_t g_isRunning;
 
 void ExitSignalHandler(int signum);
+void ReopenSignalHandler(int signum);
 
 int SetupSignalHandlers(void) {
   struct sigaction sa;
@@ -29,6 +31,12 @@ int SetupSignalHandlers(void) {
     return FALSE;
   }
 
+  sa.sa_handler = ReopenSignalHandler;
+  if (sigaction(SIGHUP, &sa, NULL) == -1) {
+    perror("sigaction SIGHUP");
+    return FALSE;
+  }
+
   return TRUE;
 }
 
@@ -36,3 +44,8 @@ void ExitSignalHandler(int signum) {
   (void)signum;
   g_isRunning = FALSE;
 }
+
+void ReopenSignalHandler(int signum) {
+  (void)signum;
+  RequestHistoryReopen();
+}
@@ -4,6 +4,7 @@
 
 #include <string.h>
 #include <assert.h>
+#include <time.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
@@ -14,95 +15,94 @@
 #include "io.h"
 #include "state_machine.h"
 
-#define MAX_HASH_SIZE 1000000
+static int CheckStateEntry(struct StateTable *table, const void *key, const uint32_t now);
+static uint32_t GetMonotonicSeconds(void);
 
-static int CheckStateIpv4(struct SentryState *state, struct sockaddr_in *addr);
-static int CheckStateIpv6(struct SentryState *state, struct sockaddr_in6 *addr);
+static int CheckStateEntry(struct StateTable *table, const void *key, const uint32_t now) {
+  struct StateEntry *entry;
+  int isNew;
 
-static int CheckStateIpv4(struct SentryState *state, struct sockaddr_in *addr) {
-  struct sockaddr_in *addr_in = (struct sockaddr_in *)addr;
-  struct AddrStateIpv4 *addrStateIpv4;
+  entry = StateTableTouch(table, key, &isNew);
 
-  HASH_FIND(hh, state->addrStateIpv4, &addr_in->sin_addr.s_addr, sizeof(in_addr_t), addrStateIpv4);
+  if (isNew == TRUE) {
+    entry->counter.windowStart = now;
+  }
 
-  if (addrStateIpv4 == NULL) {
-    if (HASH_COUNT(state->addrStateIpv4) >= MAX_HASH_SIZE) {
-      addrStateIpv4 = state->addrStateIpv4;
-      HASH_DEL(state->addrStateIpv4, addrStateIpv4);
-      free(addrStateIpv4);
-    }
+  return UpdateStateCounter(&entry->counter, now);
+}
 
-    if ((addrStateIpv4 = malloc(sizeof(struct AddrStateIpv4))) == NULL) {
-      Error("Unable to allocate new memory for AddrStateIpv4");
-      return ERROR;
-    }
-    addrStateIpv4->ip = addr_in->sin_addr.s_addr;
-    addrStateIpv4->count = 0;
+/* Register a hit and return TRUE if the hits within the window reach the trigger count.
+ * With no window configured, hits are counted for as long as the source is tracked.
+ */
+int UpdateStateCounter(struct StateCounter *counter, const uint32_t now) {
+  const uint32_t window = (uint32_t)configData.scanTriggerWindow;
+  uint32_t elapsed;
+  int estimate;
+
+  if (window == 0) {
+    counter->count++;
+    return (counter->count >= configData.configTriggerCount) ? TRUE : FALSE;
+  }
 
-    HASH_ADD(hh, state->addrStateIpv4, ip, sizeof(in_addr_t), addrStateIpv4);
+  elapsed = now - counter->windowStart;
+  if (elapsed >= 2 * window) {
+    counter->prevCount = 0;
+    counter->count = 0;
+    counter->windowStart = now;
+  } else if (elapsed >= window) {
+    counter->prevCount = counter->count;
+    counter->count = 0;
+    counter->windowStart += window;
   }
 
-  addrStateIpv4->count++;
+  counter->count++;
 
-  if (addrStateIpv4->count >= configData.configTriggerCount) {
-    return TRUE;
-  }
+  elapsed = now - counter->windowStart;
+  estimate = counter->count + (int)(((int64_t)counter->prevCount * (window - elapsed)) / window);
 
-  return FALSE;
+  return (estimate >= configData.configTriggerCount) ? TRUE : FALSE;
 }
 
-static int CheckStateIpv6(struct SentryState *state, struct sockaddr_in6 *addr) {
-  struct sockaddr_in6 *addr_in6 = (struct sockaddr_in6 *)addr;
-  struct AddrStateIpv6 *addrStateIpv6;
+static uint32_t GetMonotonicSeconds(void) {
+  struct timespec ts;
 
-  HASH_FIND(hh, state->addrStateIpv6, &addr_in6->sin6_addr, sizeof(struct in6_addr), addrStateIpv6);
+  if (clock_gettime(CLOCK_MONOTONIC, &ts) == -1) {
+    return (uint32_t)time(NULL);
+  }
 
-  if (addrStateIpv6 == NULL) {
-    if (HASH_COUNT(state->addrStateIpv6) >= MAX_HASH_SIZE) {
-      addrStateIpv6 = state->addrStateIpv6;
-      HASH_DEL(state->addrStateIpv6, addrStateIpv6);
-      free(addrStateIpv6);
-    }
+  return (uint32_t)ts.tv_sec;
+}
 
-    if ((addrStateIpv6 = malloc(sizeof(struct AddrStateIpv6))) == NULL) {
-      Error("Unable to allocate new memory for AddrStateIpv6");
+/* Reserve SCAN_STATE_SIZE entries per address family up front, so no allocations are done
+ * while tracking sources. Returns TRUE on success and ERROR if the tables can't be reserved.
+ */
+int InitSentryState(struct SentryState *sentryState) {
+  memset(sentryState, 0, sizeof(struct SentryState));
+
+  // State is only tracked when a trigger count is set, see CheckState()
+  if (configData.configTriggerCount > 0) {
+    if (InitStateTable(&sentryState->tableIpv4, sizeof(in_addr_t), configData.scanStateSize) != TRUE ||
+        InitStateTable(&sentryState->tableIpv6, sizeof(struct in6_addr), configData.scanStateSize) != TRUE) {
+      Error("Unable to allocate memory for sentry state");
+      FreeSentryState(sentryState);
       return ERROR;
     }
-    addrStateIpv6->ip = addr_in6->sin6_addr;
-    addrStateIpv6->count = 0;
 
-    HASH_ADD(hh, state->addrStateIpv6, ip, sizeof(struct in6_addr), addrStateIpv6);
-  }
-
-  addrStateIpv6->count++;
-
-  if (addrStateIpv6->count >= configData.configTriggerCount) {
-    return TRUE;
+    Debug("Sentry state can track %d IPv4 and %d IPv6 sources using %zu bytes", configData.scanStateSize, configData.scanStateSize,
+          (size_t)sentryState->tableIpv4.capacity * (1 + sizeof(in_addr_t) + sizeof(struct StateEntry)) +
+              (size_t)sentryState->tableIpv6.capacity * (1 + sizeof(struct in6_addr) + sizeof(struct StateEntry)));
   }
 
-  return FALSE;
-}
-
-void InitSentryState(struct SentryState *sentryState) {
-  sentryState->addrStateIpv4 = NULL;
-  sentryState->addrStateIpv6 = NULL;
   sentryState->isInitialized = TRUE;
+
+  return TRUE;
 }
 
 void FreeSentryState(struct SentryState *sentryState) {
-  struct AddrStateIpv4 *addrStateIpv4, *tmpAddrStateIpv4;
-  struct AddrStateIpv6 *addrStateIpv6, *tmpAddrStateIpv6;
-
-  HASH_ITER(hh, sentryState->addrStateIpv4, addrStateIpv4, tmpAddrStateIpv4) {
-    HASH_DEL(sentryState->addrStateIpv4, addrStateIpv4);
-    free(addrStateIpv4);
-  }
-
-  HASH_ITER(hh, sentryState->addrStateIpv6, addrStateIpv6, tmpAddrStateIpv6) {
-    HASH_DEL(sentryState->addrStateIpv6, addrStateIpv6);
-    free(addrStateIpv6);
-  }
+  FreeStateTable(&sentryState->tableIpv4);
+  FreeStateTable(&sentryState->tableIpv6);
 
+  memset(sentryState, 0, sizeof(struct SentryState));
   sentryState->isInitialized = FALSE;
 }
 
@@ -123,11 +123,23 @@ int CheckState(struct SentryState *state, struct sockaddr *addr) {
   }
 
   if (addr->sa_family == AF_INET) {
-    return CheckStateIpv4(state, (struct sockaddr_in *)addr);
+    return CheckStateEntry(&state->tableIpv4, &((struct sockaddr_in *)addr)->sin_addr.s_addr, GetMonotonicSeconds());
   } else if (addr->sa_family == AF_INET6) {
-    return CheckStateIpv6(state, (struct sockaddr_in6 *)addr);
+    return CheckStateEntry(&state->tableIpv6, &((struct sockaddr_in6 *)addr)->sin6_addr, GetMonotonicSeconds());
   }
 
   Error("Unsupported address family");
   return ERROR;
 }
+
+void PrefetchState(const struct SentryState *state, const struct sockaddr *addr) {
+  if (state->isInitialized == FALSE || configData.configTriggerCount == 0) {
+    return;
+  }
+
+  if (addr->sa_family == AF_INET) {
+    StateTablePrefetch(&state->tableIpv4, &((const struct sockaddr_in *)addr)->sin_addr.s_addr);
+  } else if (addr->sa_family == AF_INET6) {
+    StateTablePrefetch(&state->tableIpv6, &((const struct sockaddr_in6 *)addr)->sin6_addr);
+  }
+}
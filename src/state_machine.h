@@ -4,28 +4,19 @@
 
 #pragma once
 
+#include <stdint.h>
 #include <netinet/in.h>
 
-#include "uthash.h"
-
-struct AddrStateIpv4 {
-  in_addr_t ip;
-  int count;
-  UT_hash_handle hh;
-};
-
-struct AddrStateIpv6 {
-  struct in6_addr ip;
-  int count;
-  UT_hash_handle hh;
-};
+#include "state_table.h"
 
 struct SentryState {
-  struct AddrStateIpv4 *addrStateIpv4;
-  struct AddrStateIpv6 *addrStateIpv6;
+  struct StateTable tableIpv4;  // Keyed on in_addr_t
+  struct StateTable tableIpv6;  // Keyed on struct in6_addr
   uint8_t isInitialized;
 };
 
-void InitSentryState(struct SentryState *sentryState);
+int InitSentryState(struct SentryState *sentryState);
 void FreeSentryState(struct SentryState *sentryState);
 int CheckState(struct SentryState *state, struct sockaddr *addr);
+void PrefetchState(const struct SentryState *state, const struct sockaddr *addr);
+int UpdateStateCounter(struct StateCounter *counter, const uint32_t now);
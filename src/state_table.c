@@ -0,0 +1,414 @@
+// SPDX-FileCopyrightText: 2024 Marcus Hufvudsson <mh@protohuf.com>
+//
+// SPDX-License-Identifier: CPL-1.0
+
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "portsentry.h"
+#include "state_table.h"
+#include "io.h"
+
+#define CTRL_EMPTY ((int8_t)-128)
+#define CTRL_DELETED ((int8_t)-2)
+#define FIBONACCI_HASH_64 0x9E3779B97F4A7C15ULL
+
+static inline uint64_t HashKey(const uint8_t *key, const uint8_t keyLength);
+static inline uint32_t GetStartGroup(const struct StateTable *table, const uint64_t hash);
+static inline int8_t GetHashTag(const uint64_t hash);
+static inline int KeyEquals(const uint8_t *a, const uint8_t *b, const uint8_t keyLength);
+static inline uint32_t MatchTag(const int8_t *group, const int8_t tag);
+static inline uint32_t MatchEmpty(const int8_t *group);
+static inline uint32_t MatchEmptyOrDeleted(const int8_t *group);
+static uint32_t FindSlot(const struct StateTable *table, const uint8_t *key, const uint64_t hash);
+static uint32_t FindInsertSlot(const struct StateTable *table, const uint64_t hash);
+static void EraseSlot(struct StateTable *table, const uint32_t slot);
+static void Rebuild(struct StateTable *table);
+static void MoveSlot(struct StateTable *table, const uint32_t from, const uint32_t to);
+static void SwapSlots(struct StateTable *table, const uint32_t a, const uint32_t b);
+static inline uint32_t SwapIndex(const uint32_t index, const uint32_t a, const uint32_t b);
+static int AllocArrays(struct StateTable *table);
+static void LruUnlink(struct StateTable *table, const uint32_t slot);
+static void LruPushFront(struct StateTable *table, const uint32_t slot);
+
+/* The table is sized so that at maxEntries it's at most 7/8 full, counting an extra 1/8 of
+ * maxEntries as room for deleted slots before the table needs to be rebuilt.
+ * Returns TRUE on success and ERROR if the memory can't be allocated.
+ */
+int InitStateTable(struct StateTable *table, const uint8_t keyLength, const uint32_t maxEntries) {
+  uint64_t slots;
+
+  assert(table != NULL);
+  assert(keyLength == 4 || keyLength == 16);
+  assert(maxEntries > 0);
+
+  memset(table, 0, sizeof(struct StateTable));
+
+  slots = (((uint64_t)maxEntries + maxEntries / 8) * 8 + 6) / 7;
+  table->noGroups = (uint32_t)((slots + STATE_TABLE_GROUP_SIZE - 1) / STATE_TABLE_GROUP_SIZE);
+  table->capacity = table->noGroups * STATE_TABLE_GROUP_SIZE;
+  table->growthLimit = (uint32_t)(((uint64_t)table->capacity * 7) / 8);
+  table->maxEntries = maxEntries;
+  table->keyLength = keyLength;
+  table->lruHead = STATE_TABLE_NONE;
+  table->lruTail = STATE_TABLE_NONE;
+
+  if (AllocArrays(table) != TRUE) {
+    FreeStateTable(table);
+    return ERROR;
+  }
+
+  return TRUE;
+}
+
+void FreeStateTable(struct StateTable *table) {
+  if (table->ctrl != NULL) {
+    free(table->ctrl);
+  }
+
+  if (table->keys != NULL) {
+    free(table->keys);
+  }
+
+  if (table->entries != NULL) {
+    free(table->entries);
+  }
+
+  memset(table, 0, sizeof(struct StateTable));
+}
+
+/* Look up the key and mark it as most recently used. A missing key is inserted with a zeroed counter,
+ * evicting the least recently used entry if the table is full, and isNew is set to TRUE.
+ */
+struct StateEntry *StateTableTouch(struct StateTable *table, const void *key, int *isNew) {
+  uint64_t hash = HashKey(key, table->keyLength);
+  uint32_t slot;
+
+  if ((slot = FindSlot(table, key, hash)) != STATE_TABLE_NONE) {
+    LruUnlink(table, slot);
+    LruPushFront(table, slot);
+    *isNew = FALSE;
+    return &table->entries[slot];
+  }
+
+  if (table->count >= table->maxEntries) {
+    EraseSlot(table, table->lruTail);
+  }
+
+  if (table->count + table->noDeleted >= table->growthLimit) {
+    Rebuild(table);
+  }
+
+  slot = FindInsertSlot(table, hash);
+  if (table->ctrl[slot] == CTRL_DELETED) {
+    table->noDeleted--;
+  }
+
+  table->ctrl[slot] = GetHashTag(hash);
+  memcpy(table->keys + (size_t)slot * table->keyLength, key, table->keyLength);
+  memset(&table->entries[slot].counter, 0, sizeof(struct StateCounter));
+  LruPushFront(table, slot);
+  table->count++;
+
+  *isNew = TRUE;
+  return &table->entries[slot];
+}
+
+// Start loading the control bytes and keys of the group a key is probed from, ahead of StateTableTouch()
+void StateTablePrefetch(const struct StateTable *table, const void *key) {
+  uint32_t group;
+
+  if (table->ctrl == NULL) {
+    return;
+  }
+
+  group = GetStartGroup(table, HashKey(key, table->keyLength));
+  __builtin_prefetch(table->ctrl + (size_t)group * STATE_TABLE_GROUP_SIZE, 0);
+  __builtin_prefetch(table->keys + (size_t)group * STATE_TABLE_GROUP_SIZE * table->keyLength, 0);
+}
+
+static inline uint64_t HashKey(const uint8_t *key, const uint8_t keyLength) {
+  uint32_t k;
+  uint64_t hi, lo;
+
+  if (keyLength == 4) {
+    memcpy(&k, key, sizeof(k));
+    return (uint64_t)k * FIBONACCI_HASH_64;
+  }
+
+  memcpy(&hi, key, sizeof(hi));
+  memcpy(&lo, key + sizeof(hi), sizeof(lo));
+
+  return (hi ^ (lo * FIBONACCI_HASH_64)) * FIBONACCI_HASH_64;
+}
+
+// The high bits of a multiplicative hash are the well mixed ones, use them for both the group and the tag
+static inline uint32_t GetStartGroup(const struct StateTable *table, const uint64_t hash) {
+  return (uint32_t)((((hash >> 25) & 0xffffffff) * table->noGroups) >> 32);
+}
+
+static inline int8_t GetHashTag(const uint64_t hash) {
+  return (int8_t)(hash >> 57);
+}
+
+static inline int KeyEquals(const uint8_t *a, const uint8_t *b, const uint8_t keyLength) {
+  uint32_t a4, b4;
+
+  if (keyLength == 4) {
+    memcpy(&a4, a, sizeof(a4));
+    memcpy(&b4, b, sizeof(b4));
+    return a4 == b4;
+  }
+
+  return memcmp(a, b, keyLength) == 0;
+}
+
+// Bitmask of the slots in the group whose control byte equals tag
+static inline uint32_t MatchTag(const int8_t *group, const int8_t tag) {
+#ifdef __SSE2__
+  __m128i ctrl = _mm_loadu_si128((const __m128i *)group);
+  return (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(ctrl, _mm_set1_epi8(tag)));
+#else
+  uint32_t i, mask = 0;
+
+  for (i = 0; i < STATE_TABLE_GROUP_SIZE; i++) {
+    mask |= (uint32_t)(group[i] == tag) << i;
+  }
+
+  return mask;
+#endif
+}
+
+static inline uint32_t MatchEmpty(const int8_t *group) {
+  return MatchTag(group, CTRL_EMPTY);
+}
+
+// Empty and deleted are the only control bytes with the high bit set
+static inline uint32_t MatchEmptyOrDeleted(const int8_t *group) {
+#ifdef __SSE2__
+  return (uint32_t)_mm_movemask_epi8(_mm_loadu_si128((const __m128i *)group));
+#else
+  uint32_t i, mask = 0;
+
+  for (i = 0; i < STATE_TABLE_GROUP_SIZE; i++) {
+    mask |= (uint32_t)(group[i] < 0) << i;
+  }
+
+  return mask;
+#endif
+}
+
+static uint32_t FindSlot(const struct StateTable *table, const uint8_t *key, const uint64_t hash) {
+  uint32_t group = GetStartGroup(table, hash), probe, mask, slot;
+  int8_t tag = GetHashTag(hash);
+
+  for (probe = 0; probe < table->noGroups; probe++) {
+    mask = MatchTag(table->ctrl + (size_t)group * STATE_TABLE_GROUP_SIZE, tag);
+
+    while (mask != 0) {
+      slot = group * STATE_TABLE_GROUP_SIZE + __builtin_ctz(mask);
+      if (KeyEquals(table->keys + (size_t)slot * table->keyLength, key, table->keyLength)) {
+        return slot;
+      }
+      mask &= mask - 1;
+    }
+
+    // A key is never placed beyond a group with an empty slot
+    if (MatchEmpty(table->ctrl + (size_t)group * STATE_TABLE_GROUP_SIZE) != 0) {
+      break;
+    }
+
+    group = (group + 1 == table->noGroups) ? 0 : group + 1;
+  }
+
+  return STATE_TABLE_NONE;
+}
+
+// The table is never full (see growthLimit) so a free slot is always found
+static uint32_t FindInsertSlot(const struct StateTable *table, const uint64_t hash) {
+  uint32_t group = GetStartGroup(table, hash), mask;
+
+  while ((mask = MatchEmptyOrDeleted(table->ctrl + (size_t)group * STATE_TABLE_GROUP_SIZE)) == 0) {
+    group = (group + 1 == table->noGroups) ? 0 : group + 1;
+  }
+
+  return group * STATE_TABLE_GROUP_SIZE + __builtin_ctz(mask);
+}
+
+/* If the group has an empty slot no probe can have passed through it, so the slot can be
+ * marked empty right away. Otherwise it must be marked deleted to keep probe sequences intact.
+ */
+static void EraseSlot(struct StateTable *table, const uint32_t slot) {
+  const int8_t *group = table->ctrl + (size_t)(slot / STATE_TABLE_GROUP_SIZE) * STATE_TABLE_GROUP_SIZE;
+
+  LruUnlink(table, slot);
+
+  if (MatchEmpty(group) != 0) {
+    table->ctrl[slot] = CTRL_EMPTY;
+  } else {
+    table->ctrl[slot] = CTRL_DELETED;
+    table->noDeleted++;
+  }
+
+  table->count--;
+}
+
+/* Get rid of deleted slots in place, so the packet path never allocates. Used slots are first marked
+ * deleted and deleted slots empty, then every marked entry is reinserted: it stays where it is if that's
+ * already the first group with a free slot in its probe sequence, it's moved if that group has an empty
+ * slot and otherwise swapped with the marked entry occupying the slot, which is then reinserted in turn.
+ * Entries keep their place on the LRU list.
+ */
+static void Rebuild(struct StateTable *table) {
+  uint32_t i, target;
+  uint64_t hash;
+
+  for (i = 0; i < table->capacity; i++) {
+    if (table->ctrl[i] == CTRL_DELETED) {
+      table->ctrl[i] = CTRL_EMPTY;
+    } else if (table->ctrl[i] != CTRL_EMPTY) {
+      table->ctrl[i] = CTRL_DELETED;
+    }
+  }
+
+  table->noDeleted = 0;
+
+  for (i = 0; i < table->capacity; i++) {
+    while (table->ctrl[i] == CTRL_DELETED) {
+      hash = HashKey(table->keys + (size_t)i * table->keyLength, table->keyLength);
+      target = FindInsertSlot(table, hash);
+
+      if (target / STATE_TABLE_GROUP_SIZE == i / STATE_TABLE_GROUP_SIZE) {
+        table->ctrl[i] = GetHashTag(hash);
+      } else if (table->ctrl[target] == CTRL_EMPTY) {
+        table->ctrl[target] = GetHashTag(hash);
+        table->ctrl[i] = CTRL_EMPTY;
+        MoveSlot(table, i, target);
+      } else {
+        table->ctrl[target] = GetHashTag(hash);
+        SwapSlots(table, i, target);
+      }
+    }
+  }
+}
+
+static int AllocArrays(struct StateTable *table) {
+  table->ctrl = malloc(table->capacity);
+  table->keys = malloc((size_t)table->capacity * table->keyLength);
+  table->entries = malloc((size_t)table->capacity * sizeof(struct StateEntry));
+
+  if (table->ctrl == NULL || table->keys == NULL || table->entries == NULL) {
+    Error("Unable to allocate memory for state table of %u slots", table->capacity);
+    if (table->ctrl != NULL)
+      free(table->ctrl);
+    if (table->keys != NULL)
+      free(table->keys);
+    if (table->entries != NULL)
+      free(table->entries);
+    table->ctrl = NULL;
+    table->keys = NULL;
+    table->entries = NULL;
+    return ERROR;
+  }
+
+  memset(table->ctrl, CTRL_EMPTY, table->capacity);
+
+  return TRUE;
+}
+
+// Move the key and entry of a used slot to an unused one, relinking its LRU neighbours
+static void MoveSlot(struct StateTable *table, const uint32_t from, const uint32_t to) {
+  struct StateEntry *entry = &table->entries[to];
+
+  memcpy(table->keys + (size_t)to * table->keyLength, table->keys + (size_t)from * table->keyLength, table->keyLength);
+  *entry = table->entries[from];
+
+  if (entry->lruPrev != STATE_TABLE_NONE) {
+    table->entries[entry->lruPrev].lruNext = to;
+  } else {
+    table->lruHead = to;
+  }
+
+  if (entry->lruNext != STATE_TABLE_NONE) {
+    table->entries[entry->lruNext].lruPrev = to;
+  } else {
+    table->lruTail = to;
+  }
+}
+
+// Swap the keys and entries of two used slots, which may be neighbours on the LRU list
+static void SwapSlots(struct StateTable *table, const uint32_t a, const uint32_t b) {
+  uint8_t key[16];
+  struct StateEntry entryA = table->entries[a], entryB = table->entries[b];
+  struct StateEntry *entry;
+  uint32_t slot, i;
+
+  memcpy(key, table->keys + (size_t)a * table->keyLength, table->keyLength);
+  memcpy(table->keys + (size_t)a * table->keyLength, table->keys + (size_t)b * table->keyLength, table->keyLength);
+  memcpy(table->keys + (size_t)b * table->keyLength, key, table->keyLength);
+
+  table->entries[a] = entryB;
+  table->entries[b] = entryA;
+  table->lruHead = SwapIndex(table->lruHead, a, b);
+  table->lruTail = SwapIndex(table->lruTail, a, b);
+
+  for (i = 0; i < 2; i++) {
+    slot = (i == 0) ? a : b;
+    entry = &table->entries[slot];
+    entry->lruPrev = SwapIndex(entry->lruPrev, a, b);
+    entry->lruNext = SwapIndex(entry->lruNext, a, b);
+
+    if (entry->lruPrev != STATE_TABLE_NONE && entry->lruPrev != a && entry->lruPrev != b) {
+      table->entries[entry->lruPrev].lruNext = slot;
+    }
+
+    if (entry->lruNext != STATE_TABLE_NONE && entry->lruNext != a && entry->lruNext != b) {
+      table->entries[entry->lruNext].lruPrev = slot;
+    }
+  }
+}
+
+static inline uint32_t SwapIndex(const uint32_t index, const uint32_t a, const uint32_t b) {
+  if (index == a) {
+    return b;
+  } else if (index == b) {
+    return a;
+  }
+
+  return index;
+}
+
+static void LruUnlink(struct StateTable *table, const uint32_t slot) {
+  struct StateEntry *entry = &table->entries[slot];
+
+  if (entry->lruPrev != STATE_TABLE_NONE) {
+    table->entries[entry->lruPrev].lruNext = entry->lruNext;
+  } else {
+    table->lruHead = entry->lruNext;
+  }
+
+  if (entry->lruNext != STATE_TABLE_NONE) {
+    table->entries[entry->lruNext].lruPrev = entry->lruPrev;
+  } else {
+    table->lruTail = entry->lruPrev;
+  }
+}
+
+static void LruPushFront(struct StateTable *table, const uint32_t slot) {
+  struct StateEntry *entry = &table->entries[slot];
+
+  entry->lruPrev = STATE_TABLE_NONE;
+  entry->lruNext = table->lruHead;
+
+  if (table->lruHead != STATE_TABLE_NONE) {
+    table->entries[table->lruHead].lruPrev = slot;
+  } else {
+    table->lruTail = slot;
+  }
+
+  table->lruHead = slot;
+}
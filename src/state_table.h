@@ -0,0 +1,48 @@
+// SPDX-FileCopyrightText: 2024 Marcus Hufvudsson <mh@protohuf.com>
+//
+// SPDX-License-Identifier: CPL-1.0
+
+#pragma once
+#include <stdint.h>
+
+#define STATE_TABLE_GROUP_SIZE 16
+#define STATE_TABLE_NONE UINT32_MAX
+
+/* Hits from a source are counted in fixed windows of SCAN_TRIGGER_WINDOW seconds. The previous
+ * window is weighted by how much of it still overlaps the sliding window ending now. */
+struct StateCounter {
+  uint32_t windowStart;
+  int count;
+  int prevCount;
+};
+
+struct StateEntry {
+  struct StateCounter counter;
+  uint32_t lruPrev;  // Slot indexes, STATE_TABLE_NONE terminates the list
+  uint32_t lruNext;
+};
+
+/* Open addressing hash table of fixed capacity (Swiss table style). Slots are probed a group of
+ * 16 control bytes at a time, each control byte is either empty, deleted or holds 7 bits of the
+ * key's hash, so most non-matching slots are rejected without touching the keys.
+ * Keys and entries are stored in flat arrays indexed by slot. All entries are also on an LRU list.
+ */
+struct StateTable {
+  int8_t *ctrl;
+  uint8_t *keys;
+  struct StateEntry *entries;
+  uint32_t noGroups;
+  uint32_t capacity;     // noGroups * STATE_TABLE_GROUP_SIZE
+  uint32_t maxEntries;   // Entries allowed before the least recently used is evicted
+  uint32_t growthLimit;  // Used + deleted slots allowed before the table is rebuilt
+  uint32_t count;
+  uint32_t noDeleted;
+  uint32_t lruHead;  // Most recently used
+  uint32_t lruTail;  // Least recently used
+  uint8_t keyLength;
+};
+
+int InitStateTable(struct StateTable *table, const uint8_t keyLength, const uint32_t maxEntries);
+void FreeStateTable(struct StateTable *table);
+struct StateEntry *StateTableTouch(struct StateTable *table, const void *key, int *isNew);
+void StateTablePrefetch(const struct StateTable *table, const void *key);
@@ -0,0 +1,172 @@
+// SPDX-FileCopyrightText: 2024 Marcus Hufvudsson <mh@protohuf.com>
+//
+// SPDX-License-Identifier: CPL-1.0
+
+#include <string.h>
+#include <assert.h>
+
+#include "portsentry.h"
+#include "timer_wheel.h"
+#include "io.h"
+
+#define TIMER_WHEEL_MASK (TIMER_WHEEL_SLOTS - 1)
+
+struct TimerNode {
+  uint64_t expires;
+  uint32_t next;  // Next timer in the same slot, POOL_NONE terminates the list
+  uint32_t pad;
+  uint8_t data[];
+};
+
+static void InsertTimer(struct TimerWheel *tw, const uint32_t index);
+static uint32_t Cascade(struct TimerWheel *tw, const int level);
+
+/* capacity is the number of timers to reserve memory for, the pool is grown when it runs out.
+ * Returns TRUE on success and ERROR if the memory can't be allocated.
+ */
+int InitTimerWheel(struct TimerWheel *tw, const size_t dataSize, const uint32_t capacity, const uint64_t now) {
+  int level, slot;
+
+  assert(tw != NULL);
+  assert(capacity > 0);
+
+  memset(tw, 0, sizeof(struct TimerWheel));
+
+  if (InitPool(&tw->pool, sizeof(struct TimerNode) + ((dataSize + 7) & ~(size_t)7), capacity) != TRUE) {
+    return ERROR;
+  }
+
+  for (level = 0; level < TIMER_WHEEL_LEVELS; level++) {
+    for (slot = 0; slot < TIMER_WHEEL_SLOTS; slot++) {
+      tw->slots[level][slot] = POOL_NONE;
+    }
+  }
+
+  tw->nextTick = now;
+  tw->isInitialized = TRUE;
+
+  return TRUE;
+}
+
+void FreeTimerWheel(struct TimerWheel *tw) {
+  if (tw->isInitialized == FALSE) {
+    return;
+  }
+
+  FreePool(&tw->pool);
+  memset(tw, 0, sizeof(struct TimerWheel));
+}
+
+/* Add a timer firing once the wheel is advanced to expires (in ticks), a timer in the past fires on the next advance.
+ * Returns a pointer to the timer's data or NULL on allocation failure. The pointer is only valid until the next
+ * call to AddTimer(), since the pool can be moved when it's grown.
+ */
+void *AddTimer(struct TimerWheel *tw, const uint64_t expires) {
+  struct TimerNode *node;
+
+  assert(tw->isInitialized == TRUE);
+
+  if ((node = PoolAlloc(&tw->pool)) == NULL) {
+    if (tw->pool.capacity >= POOL_NONE / 2 || GrowPool(&tw->pool, tw->pool.capacity * 2) != TRUE) {
+      Error("Unable to allocate memory for timer");
+      return NULL;
+    }
+    node = PoolAlloc(&tw->pool);
+  }
+
+  node->expires = expires;
+  InsertTimer(tw, PoolIndex(&tw->pool, node));
+  tw->count++;
+
+  return node->data;
+}
+
+/* Fire all timers expiring at or before now, callback is called with each timer's data before the timer
+ * is released. The callback must not add timers. Returns the number of fired timers.
+ */
+uint32_t AdvanceTimerWheel(struct TimerWheel *tw, const uint64_t now, void (*callback)(void *data, void *ctx), void *ctx) {
+  struct TimerNode *node;
+  uint32_t index, next, noFired = 0;
+  int level;
+
+  assert(tw->isInitialized == TRUE);
+
+  // Nothing can fire, skip the idle ticks
+  if (tw->count == 0) {
+    if (now >= tw->nextTick) {
+      tw->nextTick = now + 1;
+    }
+    return 0;
+  }
+
+  while (tw->nextTick <= now) {
+    // Refill the lower levels from the next slot of each level that wrapped around
+    for (level = 1; level < TIMER_WHEEL_LEVELS && ((tw->nextTick >> (TIMER_WHEEL_BITS * (level - 1))) & TIMER_WHEEL_MASK) == 0; level++) {
+      if (Cascade(tw, level) != 0) {
+        break;
+      }
+    }
+
+    index = tw->slots[0][tw->nextTick & TIMER_WHEEL_MASK];
+    tw->slots[0][tw->nextTick & TIMER_WHEEL_MASK] = POOL_NONE;
+    tw->nextTick++;
+
+    while (index != POOL_NONE) {
+      node = PoolAt(&tw->pool, index);
+      next = node->next;
+
+      callback(node->data, ctx);
+
+      PoolRelease(&tw->pool, node);
+      tw->count--;
+      noFired++;
+      index = next;
+    }
+  }
+
+  return noFired;
+}
+
+/* The slot is picked from the expiry time rather than from the distance to it, the distance only
+ * selects the level. This keeps timers in a higher level slot in expiry order relative to the cascades.
+ */
+static void InsertTimer(struct TimerWheel *tw, const uint32_t index) {
+  struct TimerNode *node = PoolAt(&tw->pool, index);
+  uint64_t expires = node->expires, delta;
+  uint32_t *slot;
+  int level = 0;
+
+  if (expires < tw->nextTick) {
+    expires = tw->nextTick;
+  }
+
+  delta = expires - tw->nextTick;
+  if (delta > TIMER_WHEEL_MAX_DELTA) {
+    delta = TIMER_WHEEL_MAX_DELTA;
+    expires = tw->nextTick + delta;
+  }
+
+  while (level < TIMER_WHEEL_LEVELS - 1 && delta >= (1ULL << (TIMER_WHEEL_BITS * (level + 1)))) {
+    level++;
+  }
+
+  slot = &tw->slots[level][(expires >> (TIMER_WHEEL_BITS * level)) & TIMER_WHEEL_MASK];
+  node->next = *slot;
+  *slot = index;
+}
+
+// Move the timers of the current slot of level to lower levels, returns the slot index
+static uint32_t Cascade(struct TimerWheel *tw, const int level) {
+  const uint32_t slot = (uint32_t)((tw->nextTick >> (TIMER_WHEEL_BITS * level)) & TIMER_WHEEL_MASK);
+  uint32_t index = tw->slots[level][slot], next;
+
+  tw->slots[level][slot] = POOL_NONE;
+
+  while (index != POOL_NONE) {
+    next = ((struct TimerNode *)PoolAt(&tw->pool, index))->next;
+    InsertTimer(tw, index);
+    index = next;
+  }
+
+  return slot;
+}
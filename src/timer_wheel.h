@@ -0,0 +1,34 @@
+// SPDX-FileCopyrightText: 2024 Marcus Hufvudsson <mh@protohuf.com>
+//
+// SPDX-License-Identifier: CPL-1.0
+
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+
+#include "pool.h"
+
+#define TIMER_WHEEL_LEVELS 4
+#define TIMER_WHEEL_BITS 6
+#define TIMER_WHEEL_SLOTS (1 << TIMER_WHEEL_BITS)
+#define TIMER_WHEEL_MAX_DELTA ((1ULL << (TIMER_WHEEL_LEVELS * TIMER_WHEEL_BITS)) - 1)
+
+/* Hierarchical timer wheel. Level 0 has one slot per tick, each slot of level n covers 64^n ticks.
+ * A timer is placed in the lowest level able to hold it and is moved (cascaded) one level down each
+ * time the level below wraps around, so adding a timer and expiring it are both O(1).
+ * With 4 levels of 64 slots timers up to 2^24 ticks ahead are tracked exactly, timers further
+ * ahead are parked in the last slot of the top level until they are in range.
+ * Timers are pool objects linked by index, each one carries dataSize bytes of user data.
+ */
+struct TimerWheel {
+  struct Pool pool;
+  uint32_t slots[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS];  // Index of the first timer, POOL_NONE if empty
+  uint64_t nextTick;                                      // All timers expiring before nextTick have fired
+  uint32_t count;
+  uint8_t isInitialized;
+};
+
+int InitTimerWheel(struct TimerWheel *tw, const size_t dataSize, const uint32_t capacity, const uint64_t now);
+void FreeTimerWheel(struct TimerWheel *tw);
+void *AddTimer(struct TimerWheel *tw, const uint64_t expires);
+uint32_t AdvanceTimerWheel(struct TimerWheel *tw, const uint64_t now, void (*callback)(void *data, void *ctx), void *ctx);
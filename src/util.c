@@ -26,8 +26,50 @@
 #include "portsentry.h"
 #include "util.h"
 #include "packet_info.h"
+#ifdef __linux__
+#include "listen_cache.h"
+#include "nft.h"
+#endif
 
 static char *Realloc(char *filter, int newLen);
+static int GetBlockProtoConfig(const int protocol);
+static int ProbePortInUse(const struct PacketInfo *pi);
+static void DisposeTargetsWithOption(const struct BlockTarget *targets, const int count, int *statuses, const int blockProtoConfig);
+static void RunCmdForTargets(const struct BlockTarget *targets, const int count, int *statuses, const int blockProtoConfig, const char *targetList);
+
+static const uint32_t crc32Table[256] = {
+    0x00000000, 0x77073096, 0xEE0E612C, 0x990951BA, 0x076DC419, 0x706AF48F, 0xE963A535, 0x9E6495A3,
+    0x0EDB8832, 0x79DCB8A4, 0xE0D5E91E, 0x97D2D988, 0x09B64C2B, 0x7EB17CBD, 0xE7B82D07, 0x90BF1D91,
+    0x1DB71064, 0x6AB020F2, 0xF3B97148, 0x84BE41DE, 0x1ADAD47D, 0x6DDDE4EB, 0xF4D4B551, 0x83D385C7,
+    0x136C9856, 0x646BA8C0, 0xFD62F97A, 0x8A65C9EC, 0x14015C4F, 0x63066CD9, 0xFA0F3D63, 0x8D080DF5,
+    0x3B6E20C8, 0x4C69105E, 0xD56041E4, 0xA2677172, 0x3C03E4D1, 0x4B04D447, 0xD20D85FD, 0xA50AB56B,
+    0x35B5A8FA, 0x42B2986C, 0xDBBBC9D6, 0xACBCF940, 0x32D86CE3, 0x45DF5C75, 0xDCD60DCF, 0xABD13D59,
+    0x26D930AC, 0x51DE003A, 0xC8D75180, 0xBFD06116, 0x21B4F4B5, 0x56B3C423, 0xCFBA9599, 0xB8BDA50F,
+    0x2802B89E, 0x5F058808, 0xC60CD9B2, 0xB10BE924, 0x2F6F7C87, 0x58684C11, 0xC1611DAB, 0xB6662D3D,
+    0x76DC4190, 0x01DB7106, 0x98D220BC, 0xEFD5102A, 0x71B18589, 0x06B6B51F, 0x9FBFE4A5, 0xE8B8D433,
+    0x7807C9A2, 0x0F00F934, 0x9609A88E, 0xE10E9818, 0x7F6A0DBB, 0x086D3D2D, 0x91646C97, 0xE6635C01,
+    0x6B6B51F4, 0x1C6C6162, 0x856530D8, 0xF262004E, 0x6C0695ED, 0x1B01A57B, 0x8208F4C1, 0xF50FC457,
+    0x65B0D9C6, 0x12B7E950, 0x8BBEB8EA, 0xFCB9887C, 0x62DD1DDF, 0x15DA2D49, 0x8CD37CF3, 0xFBD44C65,
+    0x4DB26158, 0x3AB551CE, 0xA3BC0074, 0xD4BB30E2, 0x4ADFA541, 0x3DD895D7, 0xA4D1C46D, 0xD3D6F4FB,
+    0x4369E96A, 0x346ED9FC, 0xAD678846, 0xDA60B8D0, 0x44042D73, 0x33031DE5, 0xAA0A4C5F, 0xDD0D7CC9,
+    0x5005713C, 0x270241AA, 0xBE0B1010, 0xC90C2086, 0x5768B525, 0x206F85B3, 0xB966D409, 0xCE61E49F,
+    0x5EDEF90E, 0x29D9C998, 0xB0D09822, 0xC7D7A8B4, 0x59B33D17, 0x2EB40D81, 0xB7BD5C3B, 0xC0BA6CAD,
+    0xEDB88320, 0x9ABFB3B6, 0x03B6E20C, 0x74B1D29A, 0xEAD54739, 0x9DD277AF, 0x04DB2615, 0x73DC1683,
+    0xE3630B12, 0x94643B84, 0x0D6D6A3E, 0x7A6A5AA8, 0xE40ECF0B, 0x9309FF9D, 0x0A00AE27, 0x7D079EB1,
+    0xF00F9344, 0x8708A3D2, 0x1E01F268, 0x6906C2FE, 0xF762575D, 0x806567CB, 0x196C3671, 0x6E6B06E7,
+    0xFED41B76, 0x89D32BE0, 0x10DA7A5A, 0x67DD4ACC, 0xF9B9DF6F, 0x8EBEEFF9, 0x17B7BE43, 0x60B08ED5,
+    0xD6D6A3E8, 0xA1D1937E, 0x38D8C2C4, 0x4FDFF252, 0xD1BB67F1, 0xA6BC5767, 0x3FB506DD, 0x48B2364B,
+    0xD80D2BDA, 0xAF0A1B4C, 0x36034AF6, 0x41047A60, 0xDF60EFC3, 0xA867DF55, 0x316E8EEF, 0x4669BE79,
+    0xCB61B38C, 0xBC66831A, 0x256FD2A0, 0x5268E236, 0xCC0C7795, 0xBB0B4703, 0x220216B9, 0x5505262F,
+    0xC5BA3BBE, 0xB2BD0B28, 0x2BB45A92, 0x5CB36A04, 0xC2D7FFA7, 0xB5D0CF31, 0x2CD99E8B, 0x5BDEAE1D,
+    0x9B64C2B0, 0xEC63F226, 0x756AA39C, 0x026D930A, 0x9C0906A9, 0xEB0E363F, 0x72076785, 0x05005713,
+    0x95BF4A82, 0xE2B87A14, 0x7BB12BAE, 0x0CB61B38, 0x92D28E9B, 0xE5D5BE0D, 0x7CDCEFB7, 0x0BDBDF21,
+    0x86D3D2D4, 0xF1D4E242, 0x68DDB3F8, 0x1FDA836E, 0x81BE16CD, 0xF6B9265B, 0x6FB077E1, 0x18B74777,
+    0x88085AE6, 0xFF0F6A70, 0x66063BCA, 0x11010B5C, 0x8F659EFF, 0xF862AE69, 0x616BFFD3, 0x166CCF45,
+    0xA00AE278, 0xD70DD2EE, 0x4E048354, 0x3903B3C2, 0xA7672661, 0xD06016F7, 0x4969474D, 0x3E6E77DB,
+    0xAED16A4A, 0xD9D65ADC, 0x40DF0B66, 0x37D83BF0, 0xA9BCAE53, 0xDEBB9EC5, 0x47B2CF7F, 0x30B5FFE9,
+    0xBDBDF21C, 0xCABAC28A, 0x53B39330, 0x24B4A3A6, 0xBAD03605, 0xCDD70693, 0x54DE5729, 0x23D967BF,
+    0xB3667A2E, 0xC4614AB8, 0x5D681B02, 0x2A6F2B94, 0xB40BBE37, 0xC30C8EA1, 0x5A05DF1B, 0x2D02EF8D};
 
 /* A replacement for strncpy that covers mistakes a little better */
 char *SafeStrncpy(char *dest, const char *src, size_t size) {
@@ -45,9 +87,9 @@ char *SafeStrncpy(char *dest, const char *src, size_t size) {
   return (dest);
 }
 
-void ResolveAddr(const struct PacketInfo *pi, char *resolvedHost, const int resolvedHostSize) {
-  if (getnameinfo(GetSourceSockaddrFromPacketInfo(pi), GetSourceSockaddrLenFromPacketInfo(pi), resolvedHost, resolvedHostSize, NULL, 0, NI_NUMERICHOST) != 0) {
-    Error("Unable to resolve address for %s", pi->saddr);
+void ResolveAddr(const struct PacketInfoCold *cold, char *resolvedHost, const int resolvedHostSize) {
+  if (getnameinfo(&cold->sa, cold->saLen, resolvedHost, resolvedHostSize, NULL, 0, NI_NUMERICHOST) != 0) {
+    Error("Unable to resolve address for %s", cold->saddr);
     snprintf(resolvedHost, resolvedHostSize, "<unknown>");
   }
 
@@ -76,7 +118,7 @@ long getLong(const char *buffer) {
 }
 
 int DisposeTarget(const char *target, int port, int protocol) {
-  int status, killRunCmdStatus, killHostsDenyStatus, killRouteStatus;
+  int status, killRunCmdStatus, killHostsDenyStatus, killRouteStatus, killNftStatus = FALSE;
   int blockProtoConfig;
 
   if (protocol == IPPROTO_TCP) {
@@ -96,6 +138,7 @@ int DisposeTarget(const char *target, int port, int protocol) {
     Debug("DisposeTarget: runCmdFirst: %d", configData.runCmdFirst);
     Debug("DisposeTarget: killHostsDeny: %s", configData.killHostsDeny);
     Debug("DisposeTarget: killRoute: %s (%lu)", configData.killRoute, strlen(configData.killRoute));
+    Debug("DisposeTarget: nftTable: %s", configData.nftTable);
 
     // Need to init variable to avoid uninitialized variable warning for some compilers
     killRunCmdStatus = FALSE;
@@ -104,6 +147,9 @@ int DisposeTarget(const char *target, int port, int protocol) {
       killRunCmdStatus = KillRunCmd(target, port, configData.killRunCmd, GetSentryModeString(configData.sentryMode));
     }
 
+#ifdef __linux__
+    killNftStatus = NftBlockTarget(target);
+#endif
     killHostsDenyStatus = KillHostsDeny(target, port, configData.killHostsDeny, GetSentryModeString(configData.sentryMode));
     killRouteStatus = KillRoute(target, port, configData.killRoute, GetSentryModeString(configData.sentryMode));
 
@@ -113,7 +159,7 @@ int DisposeTarget(const char *target, int port, int protocol) {
 
     /* It's going to be impossible to determine a cookie cutter course of action which will work for everyone, so,
      * if there are multiple actions to take, we'll consider the host "blocked" if any of the actions succeed. */
-    if (killRunCmdStatus == TRUE || killHostsDenyStatus == TRUE || killRouteStatus == TRUE) {
+    if (killRunCmdStatus == TRUE || killHostsDenyStatus == TRUE || killRouteStatus == TRUE || killNftStatus == TRUE) {
       status = TRUE;
     } else {
       status = FALSE;
@@ -128,6 +174,183 @@ int DisposeTarget(const char *target, int port, int protocol) {
   return status;
 }
 
+/* Block a batch of targets, see DisposeTarget() for the actions taken. KILL_ROUTE and KILL_RUN_CMD commands
+ * using the $TARGETS$ token are run once for the whole batch, otherwise they are run once per target.
+ * All nftables elements are added in a single transaction. statuses[i] is set to TRUE if targets[i] was blocked.
+ */
+void DisposeTargets(const struct BlockTarget *targets, const int count, int *statuses) {
+  int i;
+
+  for (i = 0; i < count; i++) {
+    statuses[i] = FALSE;
+  }
+
+  DisposeTargetsWithOption(targets, count, statuses, 1);
+  DisposeTargetsWithOption(targets, count, statuses, 2);
+}
+
+/* Undo the blocking actions for hosts whose BLOCK_TIMEOUT has passed. The hosts are removed from the nftables
+ * sets and hosts.deny in one go, routes and firewall rules added by KILL_ROUTE are left to UNBLOCK_CMD.
+ */
+void UndisposeTargets(const struct ExpiredBlocks *expired) {
+  const char **targets;
+  uint32_t i;
+
+  if (expired->count == 0) {
+    return;
+  }
+
+  if ((targets = malloc(expired->count * sizeof(const char *))) == NULL) {
+    Error("Unable to allocate memory to unblock %u expired hosts", expired->count);
+    return;
+  }
+
+  for (i = 0; i < expired->count; i++) {
+    targets[i] = expired->targets[i];
+    Log("attackalert: Block of host %s has expired", targets[i]);
+  }
+
+  // UnblockHostsDeny() looks up the hosts in the sorted list
+  qsort(targets, expired->count, sizeof(const char *), CompareStrings);
+
+#ifdef __linux__
+  NftUnblockTargets(targets, (int)expired->count);
+#endif
+  UnblockHostsDeny(targets, (int)expired->count, configData.killHostsDeny);
+
+  for (i = 0; i < expired->count; i++) {
+    UnblockRunCmd(targets[i], configData.unblockCmd);
+  }
+
+  free(targets);
+}
+
+static int GetBlockProtoConfig(const int protocol) {
+  if (protocol == IPPROTO_TCP) {
+    return configData.blockTCP;
+  } else if (protocol == IPPROTO_UDP) {
+    return configData.blockUDP;
+  }
+
+  return ERROR;
+}
+
+// Only the targets whose protocol is set to blockProtoConfig (BLOCK_TCP/BLOCK_UDP) are handled
+static void DisposeTargetsWithOption(const struct BlockTarget *targets, const int count, int *statuses, const int blockProtoConfig) {
+  char *targetList = NULL;
+  int i, targetListLen = 0, status = FALSE;
+#ifdef __linux__
+  char *nftList = NULL;
+  int nftListLen = 0;
+  uint8_t *isNftTarget = NULL;
+#endif
+
+  for (i = 0; i < count; i++) {
+    if (GetBlockProtoConfig(targets[i].protocol) == blockProtoConfig) {
+      targetList = ReallocAndAppend(targetList, &targetListLen, (targetList == NULL) ? "%s" : " %s", targets[i].target);
+    }
+  }
+
+  if (targetList == NULL) {
+    return;
+  }
+
+  Debug("DisposeTargets: disposing of hosts %s with option: %d", targetList, blockProtoConfig);
+
+  if (blockProtoConfig == 2 || configData.runCmdFirst == TRUE) {
+    RunCmdForTargets(targets, count, statuses, blockProtoConfig, targetList);
+  }
+
+  if (blockProtoConfig == 2) {
+    goto exit;
+  }
+
+#ifdef __linux__
+  // Only the targets actually added to the transaction are blocked by it, e.g. not those without a set for their family
+  if ((isNftTarget = calloc((size_t)count, sizeof(uint8_t))) == NULL) {
+    Error("Unable to allocate memory to block hosts %s via nftables", targetList);
+  } else {
+    for (i = 0; i < count; i++) {
+      if (GetBlockProtoConfig(targets[i].protocol) == blockProtoConfig && NftAddTarget(targets[i].target) == TRUE) {
+        isNftTarget[i] = TRUE;
+        nftList = ReallocAndAppend(nftList, &nftListLen, (nftList == NULL) ? "%s" : " %s", targets[i].target);
+      }
+    }
+  }
+
+  if (nftList != NULL) {
+    if (NftCommit() == TRUE) {
+      Log("attackalert: Hosts %s have been blocked via nftables table %s %s", nftList, configData.nftFamily, configData.nftTable);
+      for (i = 0; i < count; i++) {
+        if (isNftTarget[i] == TRUE) {
+          statuses[i] = TRUE;
+        }
+      }
+    } else {
+      Error("There was an error trying to block hosts %s via nftables", nftList);
+    }
+  }
+#endif
+
+  for (i = 0; i < count; i++) {
+    if (GetBlockProtoConfig(targets[i].protocol) == blockProtoConfig &&
+        KillHostsDeny(targets[i].target, targets[i].port, configData.killHostsDeny, GetSentryModeString(configData.sentryMode)) == TRUE) {
+      statuses[i] = TRUE;
+    }
+  }
+
+  if (strstr(configData.killRoute, "$TARGETS$") != NULL) {
+    status = KillRouteTargets(targetList, configData.killRoute, GetSentryModeString(configData.sentryMode));
+  }
+
+  for (i = 0; i < count; i++) {
+    if (GetBlockProtoConfig(targets[i].protocol) != blockProtoConfig) {
+      continue;
+    }
+
+    if (strstr(configData.killRoute, "$TARGETS$") == NULL) {
+      status = KillRoute(targets[i].target, targets[i].port, configData.killRoute, GetSentryModeString(configData.sentryMode));
+    }
+
+    if (status == TRUE) {
+      statuses[i] = TRUE;
+    }
+  }
+
+  if (configData.runCmdFirst == FALSE) {
+    RunCmdForTargets(targets, count, statuses, blockProtoConfig, targetList);
+  }
+
+exit:
+#ifdef __linux__
+  free(nftList);
+  free(isNftTarget);
+#endif
+  free(targetList);
+}
+
+static void RunCmdForTargets(const struct BlockTarget *targets, const int count, int *statuses, const int blockProtoConfig, const char *targetList) {
+  int i, status = FALSE;
+
+  if (strstr(configData.killRunCmd, "$TARGETS$") != NULL) {
+    status = KillRunCmdTargets(targetList, configData.killRunCmd, GetSentryModeString(configData.sentryMode));
+  }
+
+  for (i = 0; i < count; i++) {
+    if (GetBlockProtoConfig(targets[i].protocol) != blockProtoConfig) {
+      continue;
+    }
+
+    if (strstr(configData.killRunCmd, "$TARGETS$") == NULL) {
+      status = KillRunCmd(targets[i].target, targets[i].port, configData.killRunCmd, GetSentryModeString(configData.sentryMode));
+    }
+
+    if (status == TRUE) {
+      statuses[i] = TRUE;
+    }
+  }
+}
+
 const char *GetProtocolString(int proto) {
   switch (proto) {
   case IPPROTO_TCP:
@@ -187,7 +410,38 @@ int SetupPort(int family, uint16_t port, int proto) {
   return sock;
 }
 
+/* Returns TRUE if a local service uses the port of the packet, FALSE if not and ERROR if unable to tell.
+ * On Linux the listen cache is used when available, see RecheckPortInUse().
+ */
 int IsPortInUse(struct PacketInfo *pi) {
+#ifdef __linux__
+  int ret;
+
+  if (configData.listenCacheRefresh > 0 && (ret = IsPortListening(pi->protocol, pi->port)) != ERROR) {
+    return ret;
+  }
+#endif
+
+  return ProbePortInUse(pi);
+}
+
+/* The listen cache can lag up to LISTEN_CACHE_REFRESH behind a service which just started listening.
+ * Called before acting on a packet which passed IsPortInUse(), probes the port with bind() if the
+ * cache may have been used. Returns as IsPortInUse().
+ */
+int RecheckPortInUse(const struct PacketInfo *pi) {
+#ifdef __linux__
+  if (configData.listenCacheRefresh > 0 && configData.sentryMode == SENTRY_MODE_STEALTH) {
+    return ProbePortInUse(pi);
+  }
+#else
+  (void)pi;
+#endif
+
+  return FALSE;
+}
+
+static int ProbePortInUse(const struct PacketInfo *pi) {
   int sock;
 
   sock = SetupPort((pi->version == 4) ? AF_INET : AF_INET6, pi->port, pi->protocol);
@@ -236,48 +490,72 @@ char *ErrnoString(char *buf, const size_t buflen) {
   return p;
 }
 
+/* The date and zone parts of the timestamp only change once a second, they are formatted by localtime_r()
+ * and strftime() when the second changes and reused until then. Only the milliseconds are formatted per call.
+ */
 int CreateDateTime(char *buf, const int size) {
-  char *p = buf;
-  int ret, current_size = size;
+  static _Thread_local time_t cachedSecond = -1;
+  static _Thread_local char cachedDate[32];  // %Y-%m-%dT%H:%M:%S.
+  static _Thread_local char cachedZone[16];  // %z
+  static _Thread_local size_t cachedDateLen, cachedZoneLen;
   struct tm tm, *tmptr;
   struct timespec ts;
+  long ms;
 
-  if (clock_gettime(CLOCK_REALTIME, &ts) == -1) {
+  if (GetRealTime(&ts) == ERROR) {
     Error("Unable to get current clock time");
     return ERROR;
   }
 
-  tmptr = localtime_r(&ts.tv_sec, &tm);
+  if (ts.tv_sec != cachedSecond) {
+    tmptr = localtime_r(&ts.tv_sec, &tm);
 
-  if (tmptr != &tm) {
-    Error("Unable to determine local time");
-    return ERROR;
-  }
+    if (tmptr != &tm) {
+      Error("Unable to determine local time");
+      return ERROR;
+    }
 
-  if ((ret = strftime(p, current_size, "%Y-%m-%dT%H:%M:%S.", tmptr)) == 0) {
-    Error("Unable to write datetime format to buffer, insufficient space");
-    return ERROR;
-  }
+    if ((cachedDateLen = strftime(cachedDate, sizeof(cachedDate), "%Y-%m-%dT%H:%M:%S.", tmptr)) == 0) {
+      Error("Unable to write datetime format to buffer, insufficient space");
+      return ERROR;
+    }
 
-  current_size -= ret;
-  p += ret;
+    if ((cachedZoneLen = strftime(cachedZone, sizeof(cachedZone), "%z", tmptr)) == 0) {
+      Error("Unable to fit TZ id, insufficient space\n");
+      return ERROR;
+    }
 
-  if ((ret = snprintf(p, current_size, "%03ld", ts.tv_nsec / 1000000)) >= current_size) {
+    cachedSecond = ts.tv_sec;
+  }
+
+  if (size < 0 || (size_t)size < cachedDateLen + 3 + cachedZoneLen + 1) {
     Error("Insufficient buffer space to write datetime");
     return ERROR;
   }
 
-  current_size -= ret;
-  p += ret;
+  ms = ts.tv_nsec / 1000000;
 
-  if ((ret = strftime(p, current_size, "%z", tmptr)) == 0) {
-    Error("Unable to fit TZ id, insufficient space\n");
-    return ERROR;
-  }
+  memcpy(buf, cachedDate, cachedDateLen);
+  buf += cachedDateLen;
+  *buf++ = (char)('0' + ms / 100);
+  *buf++ = (char)('0' + ms / 10 % 10);
+  *buf++ = (char)('0' + ms % 10);
+  memcpy(buf, cachedZone, cachedZoneLen + 1);
 
   return TRUE;
 }
 
+// Wall clock time of an event, read from the coarse clock if COARSE_TIMESTAMPS is set
+int GetRealTime(struct timespec *ts) {
+#ifdef CLOCK_REALTIME_COARSE
+  if (configData.coarseTimestamps == TRUE) {
+    return (clock_gettime(CLOCK_REALTIME_COARSE, ts) == -1) ? ERROR : TRUE;
+  }
+#endif
+
+  return (clock_gettime(CLOCK_REALTIME, ts) == -1) ? ERROR : TRUE;
+}
+
 int ntohstr(char *buf, const int bufSize, const uint32_t addr) {
   struct in_addr saddr;
 
@@ -355,27 +633,39 @@ char *ReallocAndAppend(char *filter, int *filterLen, const char *append, ...) {
   return filter;
 }
 
+/* CRC-32 (IEEE 802.3), computed a byte at a time. Pass 0 as crc for the first block of data,
+ * or the result of the previous block to continue the checksum.
+ */
+uint32_t Crc32(uint32_t crc, const void *data, const size_t len) {
+  const uint8_t *p = data;
+  size_t i;
+
+  crc = ~crc;
+  for (i = 0; i < len; i++) {
+    crc = (crc >> 8) ^ crc32Table[(crc ^ p[i]) & 0xFF];
+  }
+
+  return ~crc;
+}
+
+// qsort()/bsearch() comparator for an array of strings, the order UnblockHostsDeny() expects its targets in
+int CompareStrings(const void *a, const void *b) {
+  return strcmp(*(const char *const *)a, *(const char *const *)b);
+}
+
 #ifndef NDEBUG
 void DebugWritePacketToFs(const struct PacketInfo *pi) {
   int fd = -1;
   char filename[64], err[ERRNOMAXBUF];
-  int ipLen;
-  unsigned char *ip;
+  const struct tcphdr *tcp = GetTcpHeader(pi);
+  const struct udphdr *udp = GetUdpHeader(pi);
 
-  if (pi->ip != NULL) {
-    ip = (unsigned char *)pi->ip;
-  } else if (pi->ip6 != NULL) {
-    ip = (unsigned char *)pi->ip6;
-  } else {
+  if (pi->packet == NULL) {
     Error("No IP address to write to file");
     goto exit;
   }
 
-  if (pi->tcp != NULL) {
-    ipLen = (unsigned char *)pi->tcp - ip;
-  } else if (pi->udp != NULL) {
-    ipLen = (unsigned char *)pi->udp - ip;
-  } else {
+  if (tcp == NULL && udp == NULL) {
     Error("No TCP or UDP header to write to file");
     goto exit;
   }
@@ -392,18 +682,18 @@ void DebugWritePacketToFs(const struct PacketInfo *pi) {
     goto exit;
   }
 
-  if (write(fd, ip, ipLen) == -1) {
+  if (write(fd, pi->packet, pi->l4Offset) == -1) {
     Error("Unable to write IP header to file %s: %s", filename, ErrnoString(err, sizeof(err)));
     goto exit;
   }
 
-  if (pi->tcp != NULL) {
-    if (write(fd, pi->tcp, sizeof(struct tcphdr)) == -1) {
+  if (tcp != NULL) {
+    if (write(fd, tcp, sizeof(struct tcphdr)) == -1) {
       Error("Unable to write TCP header to file %s: %s", filename, ErrnoString(err, sizeof(err)));
       goto exit;
     }
-  } else if (pi->udp != NULL) {
-    if (write(fd, pi->udp, sizeof(struct udphdr)) == -1) {
+  } else if (udp != NULL) {
+    if (write(fd, udp, sizeof(struct udphdr)) == -1) {
       Error("Unable to write UDP header to file %s: %s", filename, ErrnoString(err, sizeof(err)));
       goto exit;
     }
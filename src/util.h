@@ -5,6 +5,7 @@
 
 #pragma once
 #include <stdint.h>
+#include <time.h>
 #include <sys/types.h>
 #include <unistd.h>
 #include <netinet/in.h>
@@ -13,21 +14,34 @@
 #include <netinet/ip.h>
 
 #include "packet_info.h"
+#include "block.h"
+
+struct BlockTarget {
+  const char *target;
+  int port;
+  int protocol;
+};
 
 char *SafeStrncpy(char *, const char *, size_t);
-void ResolveAddr(const struct PacketInfo *pi, char *resolvedHost, const int resolvedHostSize);
+void ResolveAddr(const struct PacketInfoCold *cold, char *resolvedHost, const int resolvedHostSize);
 long getLong(const char *buffer);
 int DisposeTarget(const char *, int, int);
+void DisposeTargets(const struct BlockTarget *targets, const int count, int *statuses);
+void UndisposeTargets(const struct ExpiredBlocks *expired);
 const char *GetProtocolString(int proto);
 const char *GetFamilyString(int family);
 const char *GetSocketTypeString(int type);
 int SetupPort(int family, uint16_t port, int proto);
 int IsPortInUse(struct PacketInfo *pi);
+int RecheckPortInUse(const struct PacketInfo *pi);
 char *ReportPacketType(const struct tcphdr *);
 char *ErrnoString(char *buf, const size_t buflen);
 int CreateDateTime(char *buf, const int size);
+int GetRealTime(struct timespec *ts);
 int ntohstr(char *buf, const int bufSize, const uint32_t addr);
 int StrToUint16_t(const char *str, uint16_t *val);
+uint32_t Crc32(uint32_t crc, const void *data, const size_t len);
+int CompareStrings(const void *a, const void *b);
 __attribute__((format(printf, 3, 4))) char *ReallocAndAppend(char *filter, int *filterLen, const char *append, ...);
 
 #ifndef NDEBUG
@@ -138,17 +138,14 @@ confirmBlockFileSize() {
   [ -z "$noIpv4" ] && noIpv4=0
   [ -z "$noIpv6" ] && noIpv6=0
 
-  # Linux uses 2 bytes for address family identifier, BSD uses 1
-  if [ "$(uname -s)" = "Linux" ]; then
-    local family_size=2
-  else
-    local family_size=1
-  fi
-
   verbose "expect block file contains $noIpv4 IPv4 and $noIpv6 IPv6 entries"
-  # ipv4 = 4 bytes for address + X bytes address family identifier
-  # ipv6 = 16 bytes for address + X bytes address family identifier
-  local sum=$((($noIpv4 * (4 + $family_size)) + ($noIpv6 * (16 + $family_size))))
+  # 32 bytes header, followed by the log records
+  # ipv4 = 4 bytes for address + 1 byte record type + 4 bytes checksum
+  # ipv6 = 16 bytes for address + 1 byte record type + 4 bytes checksum
+  local sum=0
+  if [ $(($noIpv4 + $noIpv6)) -gt 0 ]; then
+    sum=$((32 + ($noIpv4 * 9) + ($noIpv6 * 21)))
+  fi
   if [ $(/bin/ls -l $TEST_DIR/portsentry.blocked |tr -s ' '|cut -d ' ' -f 5) -ne $sum ]; then
     err "Expected block file size $sum, found $(/bin/ls -l $TEST_DIR/portsentry.blocked |tr -s ' '|cut -d ' ' -f 5)"
   fi
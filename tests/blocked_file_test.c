@@ -0,0 +1,807 @@
+// SPDX-FileCopyrightText: 2024 Marcus Hufvudsson <mh@protohuf.com>
+//
+// SPDX-License-Identifier: CPL-1.0
+
+#include <arpa/inet.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../src/block.h"
+#include "../src/config_data.h"
+#include "../src/portsentry.h"
+#include "../src/util.h"
+#include "unit_test.h"
+
+#define NO_ADDRESSES 1000
+
+// Offsets of the blocked file header fields and log record types, see block.c
+#define HEADER_VERSION 8
+#define HEADER_SIZE 12
+#define HEADER_CHECKSUM 24
+#define RECORD_ADD_IPV4 0x04
+#define RECORD_ADD_IPV6 0x06
+#define RECORD_DEL_IPV4 0x84
+#define RECORD_DEL_IPV6 0x86
+#define RECORD_SIZE_IPV4 (1 + sizeof(uint32_t) + sizeof(uint64_t) + sizeof(uint32_t))  // Of an added address
+#define RECORD_SIZE_IPV6 (1 + sizeof(struct in6_addr) + sizeof(uint64_t) + sizeof(uint32_t))
+#define ADDRESSES_SIZE (NO_ADDRESSES * (sizeof(uint32_t) + sizeof(struct in6_addr)))  // Sorted sections of WriteSnapshot()
+#define SECTIONS_SIZE (ADDRESSES_SIZE + 2 * NO_ADDRESSES * sizeof(uint64_t))             // Including the block times
+#define LOG_BUFFER 4096  // At most this much of the log can be torn by a crash
+
+static char dir[64];  // mkdtemp() template, see main()
+
+static struct sockaddr_in MakeIpv4(const uint32_t n) {
+  struct sockaddr_in sin;
+
+  memset(&sin, 0, sizeof(sin));
+  sin.sin_family = AF_INET;
+  sin.sin_addr.s_addr = htonl(0x0a000000 + n);  // 10.0.0.0 + n
+
+  return sin;
+}
+
+static struct sockaddr_in6 MakeIpv6(const uint32_t n) {
+  struct sockaddr_in6 sin6;
+  uint32_t be = htonl(n);
+
+  memset(&sin6, 0, sizeof(sin6));
+  sin6.sin6_family = AF_INET6;
+  sin6.sin6_addr.s6_addr[0] = 0x20;
+  sin6.sin6_addr.s6_addr[1] = 0x01;
+  sin6.sin6_addr.s6_addr[2] = 0x0d;
+  sin6.sin6_addr.s6_addr[3] = 0xb8;
+  memcpy(&sin6.sin6_addr.s6_addr[12], &be, sizeof(be));  // 2001:db8::n
+
+  return sin6;
+}
+
+static int IsBlocked4(const struct BlockedState *bs, const uint32_t n) {
+  struct sockaddr_in sin = MakeIpv4(n);
+  return IsBlocked((struct sockaddr *)&sin, bs);
+}
+
+static int IsBlocked6(const struct BlockedState *bs, const uint32_t n) {
+  struct sockaddr_in6 sin6 = MakeIpv6(n);
+  return IsBlocked((struct sockaddr *)&sin6, bs);
+}
+
+static int Block4(struct BlockedState *bs, const uint32_t n) {
+  struct sockaddr_in sin = MakeIpv4(n);
+  return WriteBlockedFile((struct sockaddr *)&sin, bs);
+}
+
+static int Block6(struct BlockedState *bs, const uint32_t n) {
+  struct sockaddr_in6 sin6 = MakeIpv6(n);
+  return WriteBlockedFile((struct sockaddr *)&sin6, bs);
+}
+
+// Returns the file size or -1 if the file doesn't exist
+static off_t GetFileSize(const char *path) {
+  struct stat st;
+
+  if (stat(path, &st) == -1) {
+    return -1;
+  }
+
+  return st.st_size;
+}
+
+// Read the whole file into a malloc()ed buffer
+static uint8_t *ReadFile(const char *path, size_t *len) {
+  uint8_t *buf;
+  off_t size;
+  FILE *fp;
+
+  if ((size = GetFileSize(path)) == -1 || (fp = fopen(path, "r")) == NULL) {
+    return NULL;
+  }
+
+  if ((buf = malloc((size_t)size + 1)) != NULL && fread(buf, 1, (size_t)size, fp) != (size_t)size) {
+    free(buf);
+    buf = NULL;
+  }
+
+  fclose(fp);
+  *len = (size_t)size;
+
+  return buf;
+}
+
+static int WriteFile(const char *path, const uint8_t *buf, const size_t len) {
+  FILE *fp;
+  int status;
+
+  if ((fp = fopen(path, "w")) == NULL) {
+    return FALSE;
+  }
+
+  status = (fwrite(buf, 1, len, fp) == len) ? TRUE : FALSE;
+  fclose(fp);
+
+  return status;
+}
+
+static int AppendFile(const char *path, const uint8_t *buf, const size_t len) {
+  FILE *fp;
+  int status;
+
+  if ((fp = fopen(path, "a")) == NULL) {
+    return FALSE;
+  }
+
+  status = (fwrite(buf, 1, len, fp) == len) ? TRUE : FALSE;
+  fclose(fp);
+
+  return status;
+}
+
+/* Append a log record in the format of version. Version 1 records have no checksum, from version 3 an added
+ * address is followed by its block time.
+ */
+static int AppendRecord(const uint8_t type, const uint32_t n, const uint32_t version, const uint64_t blockTime) {
+  uint8_t record[RECORD_SIZE_IPV6];
+  struct sockaddr_in6 sin6;
+  struct sockaddr_in sin;
+  size_t addrLen, len;
+  uint32_t crc;
+
+  record[0] = type;
+  if ((type & 0x7F) == RECORD_ADD_IPV4) {
+    sin = MakeIpv4(n);
+    addrLen = sizeof(sin.sin_addr);
+    memcpy(record + 1, &sin.sin_addr, addrLen);
+  } else {
+    sin6 = MakeIpv6(n);
+    addrLen = sizeof(sin6.sin6_addr);
+    memcpy(record + 1, &sin6.sin6_addr, addrLen);
+  }
+
+  len = 1 + addrLen;
+  if (version >= 3 && (type & 0x80) == 0) {
+    memcpy(record + len, &blockTime, sizeof(blockTime));
+    len += sizeof(blockTime);
+  }
+
+  if (version > 1) {
+    crc = Crc32(0, record, len);
+    memcpy(record + len, &crc, sizeof(crc));
+    len += sizeof(crc);
+  }
+
+  return AppendFile(configData.blockedFile, record, len);
+}
+
+// Number of moved aside <file>.corrupt-<time> files, they are removed
+static int RemoveCorruptFiles(void) {
+  char path[PATH_MAX];
+  struct dirent *entry;
+  DIR *d;
+  int count = 0;
+
+  if ((d = opendir(dir)) == NULL) {
+    return 0;
+  }
+
+  while ((entry = readdir(d)) != NULL) {
+    if (strstr(entry->d_name, ".corrupt-") != NULL) {
+      snprintf(path, sizeof(path), "%s/%s", dir, entry->d_name);
+      unlink(path);
+      count++;
+    }
+  }
+
+  closedir(d);
+
+  return count;
+}
+
+// Start over with an empty blocked file
+static void ResetBlockedFile(void) {
+  CHECK(WriteFile(configData.blockedFile, NULL, 0) == TRUE);
+  RemoveCorruptFiles();
+}
+
+/* Block NO_ADDRESSES IPv4 and IPv6 addresses (including 0.0.0.0 and ::) and compact them into the
+ * sorted sections. Returns the header size of the written file.
+ */
+static uint32_t WriteSnapshot(void) {
+  struct BlockedState bs;
+  struct sockaddr_in6 zero6;
+  struct sockaddr_in zero4;
+  uint32_t i, headerSize = 0;
+  uint8_t *buf;
+  size_t len;
+
+  ResetBlockedFile();
+  CHECK(BlockedStateInit(&bs) == TRUE);
+
+  for (i = 1; i < NO_ADDRESSES; i++) {
+    CHECK(Block4(&bs, i) == TRUE);
+    CHECK(Block6(&bs, i) == TRUE);
+  }
+
+  memset(&zero4, 0, sizeof(zero4));
+  zero4.sin_family = AF_INET;
+  memset(&zero6, 0, sizeof(zero6));
+  zero6.sin6_family = AF_INET6;
+  CHECK(WriteBlockedFile((struct sockaddr *)&zero4, &bs) == TRUE);
+  CHECK(WriteBlockedFile((struct sockaddr *)&zero6, &bs) == TRUE);
+
+  CHECK(RewriteBlockedFile(&bs) == TRUE);
+  BlockedStateFree(&bs);
+
+  if ((buf = ReadFile(configData.blockedFile, &len)) != NULL) {
+    memcpy(&headerSize, buf + HEADER_SIZE, sizeof(headerSize));
+    free(buf);
+  }
+
+  return headerSize;
+}
+
+// Turn the file of WriteSnapshot() into a file of an older version, which has no block times
+static void DowngradeSnapshot(const uint32_t version) {
+  uint32_t headerSize, checksum;
+  uint8_t *buf;
+  size_t len;
+
+  if ((buf = ReadFile(configData.blockedFile, &len)) == NULL) {
+    CHECK(buf != NULL);
+    return;
+  }
+
+  memcpy(&headerSize, buf + HEADER_SIZE, sizeof(headerSize));
+  checksum = Crc32(0, buf + headerSize, ADDRESSES_SIZE);
+  memcpy(buf + HEADER_VERSION, &version, sizeof(version));
+  memcpy(buf + HEADER_CHECKSUM, &checksum, sizeof(checksum));
+  CHECK(WriteFile(configData.blockedFile, buf, headerSize + ADDRESSES_SIZE) == TRUE);
+
+  free(buf);
+}
+
+static void TestCrc32(void) {
+  const char *check = "123456789";
+
+  // The standard check value of CRC-32 (IEEE 802.3)
+  CHECK(Crc32(0, check, strlen(check)) == 0xCBF43926);
+  CHECK(Crc32(0, NULL, 0) == 0);
+
+  // A checksum can be continued over several blocks
+  CHECK(Crc32(Crc32(0, check, 4), check + 4, strlen(check) - 4) == 0xCBF43926);
+}
+
+static void TestRoundTrip(void) {
+  struct BlockedState bs;
+  uint32_t headerSize, i, prev, addr4;
+  uint8_t *buf;
+  size_t len;
+
+  headerSize = WriteSnapshot();
+  CHECK(headerSize >= 32);
+  CHECK(GetFileSize(configData.blockedFile) == (off_t)(headerSize + SECTIONS_SIZE));
+
+  // The sections are sorted in address order
+  if ((buf = ReadFile(configData.blockedFile, &len)) != NULL) {
+    for (i = 1, prev = 0; i < NO_ADDRESSES; i++) {
+      memcpy(&addr4, buf + headerSize + i * sizeof(uint32_t), sizeof(addr4));
+      CHECK(ntohl(addr4) > prev);
+      prev = ntohl(addr4);
+    }
+
+    for (i = 1; i < NO_ADDRESSES; i++) {
+      CHECK(memcmp(buf + headerSize + NO_ADDRESSES * sizeof(uint32_t) + (i - 1) * sizeof(struct in6_addr),
+                   buf + headerSize + NO_ADDRESSES * sizeof(uint32_t) + i * sizeof(struct in6_addr), sizeof(struct in6_addr)) < 0);
+    }
+
+    free(buf);
+  }
+
+  CHECK(BlockedStateInit(&bs) == TRUE);
+  for (i = 1; i < NO_ADDRESSES; i++) {
+    CHECK(IsBlocked4(&bs, i) == TRUE);
+    CHECK(IsBlocked6(&bs, i) == TRUE);
+  }
+  CHECK(IsBlocked4(&bs, NO_ADDRESSES) == FALSE);
+  CHECK(IsBlocked6(&bs, NO_ADDRESSES) == FALSE);
+  BlockedStateFree(&bs);
+
+  CHECK(RemoveCorruptFiles() == 0);
+}
+
+// A file failing its checksum is moved aside and nothing in it is trusted
+static void TestChecksumMismatch(void) {
+  struct BlockedState bs;
+  uint32_t headerSize;
+  uint8_t *buf;
+  size_t len;
+
+  headerSize = WriteSnapshot();
+
+  if ((buf = ReadFile(configData.blockedFile, &len)) == NULL) {
+    CHECK(buf != NULL);
+    return;
+  }
+
+  buf[headerSize + 100] ^= 0x01;
+  CHECK(WriteFile(configData.blockedFile, buf, len) == TRUE);
+
+  CHECK(BlockedStateInit(&bs) == FALSE);
+  CHECK(IsBlocked4(&bs, 1) == FALSE);
+  CHECK(IsBlocked6(&bs, 1) == FALSE);
+  CHECK(GetFileSize(configData.blockedFile) == -1);
+  CHECK(RemoveCorruptFiles() == 1);
+
+  // The caller then writes a new file with what could be loaded
+  CHECK(RewriteBlockedFile(&bs) == TRUE);
+  BlockedStateFree(&bs);
+  CHECK(BlockedStateInit(&bs) == TRUE);
+  BlockedStateFree(&bs);
+
+  free(buf);
+}
+
+static void TestTruncatedSections(void) {
+  struct BlockedState bs;
+  uint32_t headerSize;
+
+  headerSize = WriteSnapshot();
+  CHECK(truncate(configData.blockedFile, headerSize + NO_ADDRESSES * sizeof(uint32_t) / 2) == 0);
+
+  CHECK(BlockedStateInit(&bs) == FALSE);
+  CHECK(IsBlocked4(&bs, 1) == FALSE);
+  CHECK(GetFileSize(configData.blockedFile) == -1);
+  CHECK(RemoveCorruptFiles() == 1);
+  BlockedStateFree(&bs);
+}
+
+// A file of a newer version is left alone
+static void TestUnsupportedVersion(void) {
+  struct BlockedState bs;
+  uint32_t version = 99;
+  uint8_t *buf;
+  size_t len;
+
+  WriteSnapshot();
+
+  if ((buf = ReadFile(configData.blockedFile, &len)) == NULL) {
+    CHECK(buf != NULL);
+    return;
+  }
+
+  memcpy(buf + HEADER_VERSION, &version, sizeof(version));
+  CHECK(WriteFile(configData.blockedFile, buf, len) == TRUE);
+
+  CHECK(BlockedStateInit(&bs) == ERROR);
+  CHECK(GetFileSize(configData.blockedFile) == (off_t)len);
+  CHECK(RemoveCorruptFiles() == 0);
+
+  free(buf);
+}
+
+// Files without the magic are read as records of a sa_family_t followed by the address
+static void TestLegacyFile(void) {
+  uint8_t buf[(sizeof(sa_family_t) + sizeof(struct in6_addr)) * 4 + 1];
+  struct BlockedState bs;
+  struct sockaddr_in sin;
+  struct sockaddr_in6 sin6;
+  sa_family_t family;
+  size_t len = 0;
+  uint32_t i;
+
+  for (i = 1; i <= 2; i++) {
+    family = AF_INET;
+    sin = MakeIpv4(i);
+    memcpy(buf + len, &family, sizeof(family));
+    memcpy(buf + len + sizeof(family), &sin.sin_addr, sizeof(sin.sin_addr));
+    len += sizeof(family) + sizeof(sin.sin_addr);
+
+    family = AF_INET6;
+    sin6 = MakeIpv6(i);
+    memcpy(buf + len, &family, sizeof(family));
+    memcpy(buf + len + sizeof(family), &sin6.sin6_addr, sizeof(sin6.sin6_addr));
+    len += sizeof(family) + sizeof(sin6.sin6_addr);
+  }
+
+  // Loaded and converted
+  ResetBlockedFile();
+  CHECK(WriteFile(configData.blockedFile, buf, len) == TRUE);
+  CHECK(BlockedStateInit(&bs) == FALSE);
+  CHECK(IsBlocked4(&bs, 1) == TRUE && IsBlocked4(&bs, 2) == TRUE);
+  CHECK(IsBlocked6(&bs, 1) == TRUE && IsBlocked6(&bs, 2) == TRUE);
+  CHECK(RemoveCorruptFiles() == 0);
+  CHECK(RewriteBlockedFile(&bs) == TRUE);
+  BlockedStateFree(&bs);
+  CHECK(BlockedStateInit(&bs) == TRUE);
+  CHECK(IsBlocked4(&bs, 2) == TRUE && IsBlocked6(&bs, 2) == TRUE);
+  BlockedStateFree(&bs);
+
+  // A trailing partial record is damage, the complete records are kept
+  buf[len++] = 0xff;
+  ResetBlockedFile();
+  CHECK(WriteFile(configData.blockedFile, buf, len) == TRUE);
+  CHECK(BlockedStateInit(&bs) == FALSE);
+  CHECK(IsBlocked4(&bs, 2) == TRUE && IsBlocked6(&bs, 2) == TRUE);
+  CHECK(RemoveCorruptFiles() == 1);
+  BlockedStateFree(&bs);
+}
+
+// Records appended after the last compaction are replayed on top of the sorted sections
+static void TestLogReplay(void) {
+  struct BlockedState bs;
+
+  WriteSnapshot();
+
+  CHECK(BlockedStateInit(&bs) == TRUE);
+  CHECK(Block4(&bs, 5000) == TRUE);
+  CHECK(Block6(&bs, 5000) == TRUE);
+  CHECK(Block4(&bs, 1) == TRUE);  // Already blocked, not logged again
+  BlockedStateFree(&bs);
+
+  CHECK(AppendRecord(RECORD_DEL_IPV4, 1, 3, 0) == TRUE);
+  CHECK(AppendRecord(RECORD_DEL_IPV6, 1, 3, 0) == TRUE);
+  CHECK(AppendRecord(RECORD_ADD_IPV4, 6000, 3, (uint64_t)time(NULL)) == TRUE);
+
+  CHECK(BlockedStateInit(&bs) == TRUE);
+  CHECK(bs.log.noSnapshot == 2 * NO_ADDRESSES);
+  CHECK(bs.log.noRecords == 5);
+  CHECK(IsBlocked4(&bs, 5000) == TRUE && IsBlocked6(&bs, 5000) == TRUE);
+  CHECK(IsBlocked4(&bs, 6000) == TRUE);
+  CHECK(IsBlocked4(&bs, 1) == FALSE && IsBlocked6(&bs, 1) == FALSE);
+  CHECK(IsBlocked4(&bs, 2) == TRUE && IsBlocked6(&bs, 2) == TRUE);
+  BlockedStateFree(&bs);
+
+  CHECK(RemoveCorruptFiles() == 0);
+}
+
+// A record cut short or failing its checksum at the end of the log is what a crash leaves behind, it's cut off
+static void TestTornTail(void) {
+  struct BlockedState bs;
+  uint32_t i;
+  off_t validSize;
+  uint8_t *buf;
+  size_t len;
+
+  WriteSnapshot();
+
+  CHECK(BlockedStateInit(&bs) == TRUE);
+  for (i = 2000; i < 2010; i++) {
+    CHECK(Block4(&bs, i) == TRUE);
+  }
+  BlockedStateFree(&bs);
+
+  validSize = GetFileSize(configData.blockedFile);
+  CHECK(AppendRecord(RECORD_ADD_IPV6, 2010, 3, (uint64_t)time(NULL)) == TRUE);
+  CHECK(truncate(configData.blockedFile, validSize + RECORD_SIZE_IPV6 - 5) == 0);
+
+  CHECK(BlockedStateInit(&bs) == TRUE);
+  CHECK(IsBlocked4(&bs, 2009) == TRUE);
+  CHECK(IsBlocked6(&bs, 2010) == FALSE);
+  CHECK(bs.log.noRecords == 10);
+  BlockedStateFree(&bs);
+  CHECK(GetFileSize(configData.blockedFile) == validSize);
+
+  // The last record with a bad checksum
+  CHECK(AppendRecord(RECORD_ADD_IPV4, 2010, 3, (uint64_t)time(NULL)) == TRUE);
+  if ((buf = ReadFile(configData.blockedFile, &len)) != NULL) {
+    buf[len - 1] ^= 0x80;
+    CHECK(WriteFile(configData.blockedFile, buf, len) == TRUE);
+    free(buf);
+  }
+
+  CHECK(BlockedStateInit(&bs) == TRUE);
+  CHECK(IsBlocked4(&bs, 2009) == TRUE);
+  CHECK(IsBlocked4(&bs, 2010) == FALSE);
+  BlockedStateFree(&bs);
+  CHECK(GetFileSize(configData.blockedFile) == validSize);
+
+  CHECK(RemoveCorruptFiles() == 0);
+}
+
+/* An invalid record with more of the log after it than a crash can tear is damage. The file is moved
+ * aside and only the sections and the records before the invalid one are loaded.
+ */
+static void TestDamagedLog(void) {
+  struct BlockedState bs;
+  uint32_t headerSize, i;
+  uint8_t *buf;
+  size_t len;
+
+  headerSize = WriteSnapshot();
+
+  CHECK(BlockedStateInit(&bs) == TRUE);
+  for (i = 0; i < 2 * LOG_BUFFER / RECORD_SIZE_IPV4; i++) {
+    CHECK(Block4(&bs, 10000 + i) == TRUE);
+  }
+  BlockedStateFree(&bs);
+
+  if ((buf = ReadFile(configData.blockedFile, &len)) == NULL) {
+    CHECK(buf != NULL);
+    return;
+  }
+
+  // Bad checksum of the 11th record
+  buf[headerSize + SECTIONS_SIZE + 11 * RECORD_SIZE_IPV4 - 1] ^= 0x01;
+  CHECK(WriteFile(configData.blockedFile, buf, len) == TRUE);
+  free(buf);
+
+  CHECK(BlockedStateInit(&bs) == FALSE);
+  CHECK(IsBlocked4(&bs, 1) == TRUE);
+  CHECK(IsBlocked4(&bs, 10009) == TRUE);
+  CHECK(IsBlocked4(&bs, 10010) == FALSE);
+  CHECK(IsBlocked4(&bs, 10500) == FALSE);
+  CHECK(GetFileSize(configData.blockedFile) == -1);
+  CHECK(RemoveCorruptFiles() == 1);
+  BlockedStateFree(&bs);
+}
+
+// The log is never replayed on top of sections which failed their checksum
+static void TestLogOnDamagedSections(void) {
+  struct BlockedState bs;
+  uint32_t headerSize;
+  uint8_t *buf;
+  size_t len;
+
+  headerSize = WriteSnapshot();
+  CHECK(AppendRecord(RECORD_ADD_IPV4, 3000, 3, (uint64_t)time(NULL)) == TRUE);
+
+  if ((buf = ReadFile(configData.blockedFile, &len)) == NULL) {
+    CHECK(buf != NULL);
+    return;
+  }
+
+  buf[headerSize] ^= 0x01;
+  CHECK(WriteFile(configData.blockedFile, buf, len) == TRUE);
+  free(buf);
+
+  CHECK(BlockedStateInit(&bs) == FALSE);
+  CHECK(IsBlocked4(&bs, 3000) == FALSE);
+  CHECK(RemoveCorruptFiles() == 1);
+  BlockedStateFree(&bs);
+}
+
+// Version 1 records have no checksum, the file is loaded and converted
+static void TestVersion1(void) {
+  struct BlockedState bs;
+
+  WriteSnapshot();
+  DowngradeSnapshot(1);
+
+  CHECK(AppendRecord(RECORD_ADD_IPV4, 4000, 1, 0) == TRUE);
+  CHECK(AppendRecord(RECORD_ADD_IPV6, 4000, 1, 0) == TRUE);
+
+  CHECK(BlockedStateInit(&bs) == FALSE);
+  CHECK(IsBlocked4(&bs, 1) == TRUE && IsBlocked6(&bs, 1) == TRUE);
+  CHECK(IsBlocked4(&bs, 4000) == TRUE && IsBlocked6(&bs, 4000) == TRUE);
+  CHECK(RemoveCorruptFiles() == 0);
+  BlockedStateFree(&bs);
+}
+
+/* Version 2 files have no block times, the addresses get a full BLOCK_TIMEOUT from when they are loaded and the
+ * file is converted
+ */
+static void TestVersion2(void) {
+  struct ExpiredBlocks expired = {0};
+  struct BlockedState bs;
+
+  configData.blockTimeout = 60;
+
+  WriteSnapshot();
+  DowngradeSnapshot(2);
+
+  CHECK(AppendRecord(RECORD_ADD_IPV4, 4000, 2, 0) == TRUE);
+  CHECK(AppendRecord(RECORD_DEL_IPV6, 1, 2, 0) == TRUE);
+
+  CHECK(BlockedStateInit(&bs) == FALSE);
+  CHECK(IsBlocked4(&bs, 1) == TRUE && IsBlocked4(&bs, 4000) == TRUE);
+  CHECK(IsBlocked6(&bs, 1) == FALSE && IsBlocked6(&bs, 2) == TRUE);
+  CHECK(ExpireBlocked(&bs, &expired) == 0);
+  CHECK(RemoveCorruptFiles() == 0);
+
+  CHECK(RewriteBlockedFile(&bs) == TRUE);
+  BlockedStateFree(&bs);
+  CHECK(BlockedStateInit(&bs) == TRUE);
+  CHECK(IsBlocked4(&bs, 4000) == TRUE && IsBlocked6(&bs, 2) == TRUE);
+  CHECK(ExpireBlocked(&bs, &expired) == 0);
+  BlockedStateFree(&bs);
+
+  FreeExpiredBlocks(&expired);
+  configData.blockTimeout = 0;
+}
+
+static int IsExpired(const struct ExpiredBlocks *expired, const char *target) {
+  uint32_t i;
+
+  for (i = 0; i < expired->count; i++) {
+    if (strcmp(expired->targets[i], target) == 0) {
+      return TRUE;
+    }
+  }
+
+  return FALSE;
+}
+
+static void IgnoreTimer(void *data, void *ctx) {
+  (void)data;
+  (void)ctx;
+}
+
+/* The block times are kept in the log and the sorted sections, so after a restart each address only gets what
+ * remains of its BLOCK_TIMEOUT. A block which expired while not running expires on the first ExpireBlocked().
+ */
+static void TestBlockTimes(void) {
+  struct ExpiredBlocks expired = {0};
+  struct BlockedState bs;
+  const uint64_t now = (uint64_t)time(NULL);
+  uint64_t tick;
+  uint32_t i;
+
+  configData.blockTimeout = 3600;
+
+  ResetBlockedFile();
+  CHECK(BlockedStateInit(&bs) == TRUE);
+  CHECK(Block4(&bs, 1) == TRUE);
+  BlockedStateFree(&bs);
+
+  CHECK(AppendRecord(RECORD_ADD_IPV4, 2, 3, now - 7200) == TRUE);
+  CHECK(AppendRecord(RECORD_ADD_IPV6, 2, 3, now - 1800) == TRUE);
+  CHECK(AppendRecord(RECORD_ADD_IPV4, 3, 3, now + 86400) == TRUE);  // The clock was set back
+  CHECK(AppendRecord(RECORD_ADD_IPV4, 4, 3, now - 1800) == TRUE);
+
+  CHECK(BlockedStateInit(&bs) == TRUE);
+  CHECK(IsBlocked4(&bs, 2) == TRUE);
+  CHECK(ExpireBlocked(&bs, &expired) == 1);
+  CHECK(expired.count == 1 && IsExpired(&expired, "10.0.0.2") == TRUE);
+  CHECK(IsBlocked4(&bs, 2) == FALSE);
+  CHECK(IsBlocked4(&bs, 1) == TRUE && IsBlocked6(&bs, 2) == TRUE && IsBlocked4(&bs, 3) == TRUE);
+  CHECK(ExpireBlocked(&bs, &expired) == 0);
+
+  // Growing the set keeps the times, new blocks start now
+  for (i = 100; i < 100 + NO_ADDRESSES; i++) {
+    CHECK(Block4(&bs, i) == TRUE);
+  }
+
+  // Compacted into the sorted sections, the times are kept
+  CHECK(RewriteBlockedFile(&bs) == TRUE);
+
+  // Half of the timeout was left of 10.0.0.4 and 2001:db8::2, the rest got a full timeout
+  tick = bs.expiry.nextTick;
+  CHECK(AdvanceTimerWheel(&bs.expiry, tick + 1700, IgnoreTimer, NULL) == 0);
+  CHECK(AdvanceTimerWheel(&bs.expiry, tick + 1900, IgnoreTimer, NULL) == 2);
+  CHECK(AdvanceTimerWheel(&bs.expiry, tick + 3500, IgnoreTimer, NULL) == 0);
+  CHECK(AdvanceTimerWheel(&bs.expiry, tick + 3700, IgnoreTimer, NULL) == 2 + NO_ADDRESSES);
+  BlockedStateFree(&bs);
+
+  configData.blockTimeout = 1000;
+  CHECK(BlockedStateInit(&bs) == TRUE);
+  CHECK(ExpireBlocked(&bs, &expired) == 2);
+  CHECK(IsExpired(&expired, "10.0.0.4") == TRUE && IsExpired(&expired, "2001:db8::2") == TRUE);
+  CHECK(IsBlocked4(&bs, 1) == TRUE && IsBlocked4(&bs, 3) == TRUE && IsBlocked4(&bs, 100) == TRUE);
+  CHECK(IsBlocked4(&bs, 4) == FALSE && IsBlocked6(&bs, 2) == FALSE);
+  BlockedStateFree(&bs);
+
+  // The removals were logged
+  CHECK(BlockedStateInit(&bs) == TRUE);
+  CHECK(IsBlocked4(&bs, 4) == FALSE && IsBlocked6(&bs, 2) == FALSE);
+  CHECK(ExpireBlocked(&bs, &expired) == 0);
+  BlockedStateFree(&bs);
+
+  FreeExpiredBlocks(&expired);
+  configData.blockTimeout = 0;
+}
+
+// Once the log outgrows the sorted sections it's compacted into them
+static void TestCompaction(void) {
+  struct BlockedState bs;
+  uint32_t i, noBlocked = 2 * LOG_BUFFER;
+
+  ResetBlockedFile();
+
+  CHECK(BlockedStateInit(&bs) == TRUE);
+  for (i = 1; i <= noBlocked; i++) {
+    CHECK(Block4(&bs, i) == TRUE);
+  }
+  CHECK(bs.log.noRecords == noBlocked);
+  CHECK(MaintainBlockedFile(&bs) == TRUE);
+  CHECK(bs.log.noRecords == 0);
+  CHECK(bs.log.noSnapshot == noBlocked);
+
+  // The log starts over in the compacted file
+  CHECK(Block6(&bs, 1) == TRUE);
+  BlockedStateFree(&bs);
+
+  CHECK(BlockedStateInit(&bs) == TRUE);
+  CHECK(bs.log.noSnapshot == noBlocked && bs.log.noRecords == 1);
+  CHECK(IsBlocked4(&bs, 1) == TRUE && IsBlocked4(&bs, noBlocked) == TRUE);
+  CHECK(IsBlocked6(&bs, 1) == TRUE);
+  BlockedStateFree(&bs);
+}
+
+// Number of files in the test directory, a failed or finished rewrite leaves no temporary file behind
+static int CountFiles(void) {
+  struct dirent *entry;
+  DIR *d;
+  int count = 0;
+
+  if ((d = opendir(dir)) == NULL) {
+    return -1;
+  }
+
+  while ((entry = readdir(d)) != NULL) {
+    if (strcmp(entry->d_name, ".") != 0 && strcmp(entry->d_name, "..") != 0) {
+      count++;
+    }
+  }
+
+  closedir(d);
+
+  return count;
+}
+
+// The rewritten file keeps the mode of the one it replaces, a symbolic link is left alone
+static void TestReplacement(void) {
+  struct BlockedState bs;
+  struct stat st;
+  char target[PATH_MAX];
+
+  ResetBlockedFile();
+  CHECK(chmod(configData.blockedFile, 0640) == 0);
+
+  CHECK(BlockedStateInit(&bs) == TRUE);
+  CHECK(Block4(&bs, 1) == TRUE);
+  CHECK(RewriteBlockedFile(&bs) == TRUE);
+  CHECK(stat(configData.blockedFile, &st) == 0 && (st.st_mode & 07777) == 0640);
+  CHECK(CountFiles() == 1);
+  BlockedStateFree(&bs);
+
+  snprintf(target, sizeof(target), "%s/target", dir);
+  CHECK(rename(configData.blockedFile, target) == 0);
+  CHECK(symlink(target, configData.blockedFile) == 0);
+
+  CHECK(BlockedStateInit(&bs) == TRUE);
+  CHECK(RewriteBlockedFile(&bs) == ERROR);
+  CHECK(lstat(configData.blockedFile, &st) == 0 && S_ISLNK(st.st_mode));
+  CHECK(CountFiles() == 2);
+  BlockedStateFree(&bs);
+
+  unlink(configData.blockedFile);
+  CHECK(rename(target, configData.blockedFile) == 0);
+}
+
+int main(void) {
+  ResetConfigData(&configData);
+
+  snprintf(dir, sizeof(dir), "/tmp/portsentry_blocked_test.XXXXXX");
+  if (mkdtemp(dir) == NULL) {
+    fprintf(stderr, "Unable to create temporary directory\n");
+    return EXIT_FAILURE;
+  }
+  snprintf(configData.blockedFile, sizeof(configData.blockedFile), "%s/portsentry.blocked", dir);
+
+  TestCrc32();
+  TestRoundTrip();
+  TestChecksumMismatch();
+  TestTruncatedSections();
+  TestUnsupportedVersion();
+  TestLegacyFile();
+  TestLogReplay();
+  TestTornTail();
+  TestDamagedLog();
+  TestLogOnDamagedSections();
+  TestVersion1();
+  TestVersion2();
+  TestBlockTimes();
+  TestCompaction();
+  TestReplacement();
+
+  unlink(configData.blockedFile);
+  RemoveCorruptFiles();
+  rmdir(dir);
+
+  return TEST_RESULT();
+}
@@ -0,0 +1,87 @@
+// SPDX-FileCopyrightText: 2024 Marcus Hufvudsson <mh@protohuf.com>
+//
+// SPDX-License-Identifier: CPL-1.0
+
+#include <arpa/inet.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../src/config_data.h"
+#include "../src/io.h"
+#include "../src/portsentry.h"
+#include "unit_test.h"
+
+#define KILL_HOSTS_DENY "ALL: $TARGET$ : DENY"
+#define KILL_HOSTS_DENY_ALL_TOKENS "ALL: $TARGET$ : DENY # portsentry $MODE$ $PORT$"
+
+// Build the line the way KillHostsDeny() does and check that it's matched back to the same target
+static int RoundTrip(const char *killString, const char *target, const int port, const char *mode) {
+  char temp[MAXBUF], temp2[MAXBUF], line[MAXBUF], portString[16], matched[INET6_ADDRSTRLEN];
+
+  snprintf(portString, sizeof(portString), "%d", port);
+
+  if (SubstString(target, "$TARGET$", killString, temp, MAXBUF) == ERROR ||
+      SubstString(portString, "$PORT$", temp, temp2, MAXBUF) == ERROR ||
+      SubstString(mode, "$MODE$", temp2, line, MAXBUF) == ERROR) {
+    return ERROR;
+  }
+
+  if (MatchHostsDenyLine(line, killString, matched, sizeof(matched)) != TRUE) {
+    return FALSE;
+  }
+
+  return (strcmp(matched, target) == 0) ? TRUE : FALSE;
+}
+
+static int Match(const char *line, const char *killString, const char *expectedTarget) {
+  char target[INET6_ADDRSTRLEN];
+
+  if (MatchHostsDenyLine(line, killString, target, sizeof(target)) != TRUE) {
+    return FALSE;
+  }
+
+  return (strcmp(target, expectedTarget) == 0) ? TRUE : FALSE;
+}
+
+static int NoMatch(const char *line, const char *killString) {
+  char target[INET6_ADDRSTRLEN];
+
+  return (MatchHostsDenyLine(line, killString, target, sizeof(target)) == FALSE) ? TRUE : FALSE;
+}
+
+int main(void) {
+  char target[8];
+
+  ResetConfigData(&configData);
+
+  CHECK(RoundTrip(KILL_HOSTS_DENY, "192.168.1.5", 22, "tcp") == TRUE);
+  CHECK(RoundTrip(KILL_HOSTS_DENY, "2001:db8::1", 22, "udp") == TRUE);
+  CHECK(RoundTrip(KILL_HOSTS_DENY, "::ffff:10.0.0.1", 22, "tcp") == TRUE);
+  CHECK(RoundTrip(KILL_HOSTS_DENY_ALL_TOKENS, "10.0.0.1", 65535, "stcp") == TRUE);
+  CHECK(RoundTrip(KILL_HOSTS_DENY_ALL_TOKENS, "fe80::1", 1, "audp") == TRUE);
+  CHECK(RoundTrip("$TARGET$", "10.0.0.1", 1, "tcp") == TRUE);
+
+  CHECK(Match("ALL: 10.1.2.3 : DENY", KILL_HOSTS_DENY, "10.1.2.3") == TRUE);
+  CHECK(Match("ALL: 10.1.2.3 : DENY # portsentry tcp 8080", KILL_HOSTS_DENY_ALL_TOKENS, "10.1.2.3") == TRUE);
+
+  // Lines portsentry didn't write are kept
+  CHECK(NoMatch("", KILL_HOSTS_DENY) == TRUE);
+  CHECK(NoMatch("# ALL: 10.1.2.3 : DENY", KILL_HOSTS_DENY) == TRUE);
+  CHECK(NoMatch("sshd: 10.1.2.3 : DENY", KILL_HOSTS_DENY) == TRUE);
+  CHECK(NoMatch("ALL: 10.1.2.3 : DENY extra", KILL_HOSTS_DENY) == TRUE);
+  CHECK(NoMatch("ALL: 10.1.2.3 : DEN", KILL_HOSTS_DENY) == TRUE);
+  CHECK(NoMatch("ALL: 10.1.2.3, 10.1.2.4 : DENY", KILL_HOSTS_DENY) == TRUE);
+  CHECK(NoMatch("ALL:  : DENY", KILL_HOSTS_DENY) == TRUE);
+  CHECK(NoMatch("ALL: evil.example : DENY", KILL_HOSTS_DENY) == TRUE);
+  CHECK(NoMatch("ALL: 10.1.2.3 : DENY # portsentry tcp ", KILL_HOSTS_DENY_ALL_TOKENS) == TRUE);
+  CHECK(NoMatch("ALL: 10.1.2.3 : DENY # portsentry  22", KILL_HOSTS_DENY_ALL_TOKENS) == TRUE);
+  CHECK(NoMatch("ALL: 10.1.2.3 : DENY # portsentry tcp 2x", KILL_HOSTS_DENY_ALL_TOKENS) == TRUE);
+
+  // A target not fitting the buffer is not matched rather than truncated
+  CHECK(MatchHostsDenyLine("ALL: 10.1.2.3 : DENY", KILL_HOSTS_DENY, target, sizeof(target)) == FALSE);
+  CHECK(MatchHostsDenyLine("ALL: 1.2.3.4 : DENY", KILL_HOSTS_DENY, target, sizeof(target)) == TRUE);
+  CHECK(strcmp(target, "1.2.3.4") == 0);
+
+  return TEST_RESULT();
+}
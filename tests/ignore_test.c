@@ -0,0 +1,226 @@
+// SPDX-FileCopyrightText: 2024 Marcus Hufvudsson <mh@protohuf.com>
+//
+// SPDX-License-Identifier: CPL-1.0
+
+#include <arpa/inet.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "../src/config_data.h"
+#include "../src/ignore.h"
+#include "../src/portsentry.h"
+#include "unit_test.h"
+
+#define NO_RANDOM_LOOKUPS 200000
+
+static const char *IGNORE_LIST =
+    "# Prefixes both on and off nibble boundaries\n"
+    "127.0.0.1\n"
+    "10.0.0.0/8\n"
+    "10.1.0.0/16\n"
+    "192.168.8.0/21\n"
+    "172.16.5.77/27\n"
+    "203.0.113.9/31\n"
+    "100.64.0.0/10\n"
+    "::1\n"
+    "fe80::/10\n"
+    "2001:db8::/33\n"
+    "2001:db8:1234:5678::/61\n";
+
+static int WriteIgnoreFile(const char *content, char *path, const size_t pathSize) {
+  int fd;
+
+  snprintf(path, pathSize, "/tmp/portsentry_ignore_test.XXXXXX");
+  if ((fd = mkstemp(path)) == -1) {
+    return FALSE;
+  }
+
+  if (write(fd, content, strlen(content)) != (ssize_t)strlen(content)) {
+    close(fd);
+    return FALSE;
+  }
+
+  close(fd);
+  return TRUE;
+}
+
+static int LookupAddress(const struct IgnoreState *is, const char *address) {
+  struct sockaddr_in6 sin6;
+  struct sockaddr_in sin4;
+
+  memset(&sin4, 0, sizeof(sin4));
+  memset(&sin6, 0, sizeof(sin6));
+
+  if (inet_pton(AF_INET, address, &sin4.sin_addr) == 1) {
+    sin4.sin_family = AF_INET;
+    return IgnoreIpIsPresent(is, (struct sockaddr *)&sin4);
+  }
+
+  if (inet_pton(AF_INET6, address, &sin6.sin6_addr) == 1) {
+    sin6.sin6_family = AF_INET6;
+    return IgnoreIpIsPresent(is, (struct sockaddr *)&sin6);
+  }
+
+  return ERROR;
+}
+
+// Linear scan of the parsed list, what the trie lookup must agree with
+static int ReferenceLookup(const struct IgnoreState *is, const int family, const uint8_t *key) {
+  const uint8_t *ip, *mask;
+  int i, j, len = (family == AF_INET) ? 4 : 16;
+
+  for (i = 0; i < is->ignoreIpListSize; i++) {
+    if (is->ignoreIpList[i].family != family) {
+      continue;
+    }
+
+    ip = (family == AF_INET) ? (const uint8_t *)&is->ignoreIpList[i].ip.addr4 : is->ignoreIpList[i].ip.addr6.s6_addr;
+    mask = (family == AF_INET) ? (const uint8_t *)&is->ignoreIpList[i].mask.mask4 : is->ignoreIpList[i].mask.mask6.s6_addr;
+
+    for (j = 0; j < len; j++) {
+      if ((key[j] & mask[j]) != (ip[j] & mask[j])) {
+        break;
+      }
+    }
+
+    if (j == len) {
+      return TRUE;
+    }
+  }
+
+  return FALSE;
+}
+
+static void TestKnownAddresses(const struct IgnoreState *is) {
+  CHECK(LookupAddress(is, "127.0.0.1") == TRUE);
+  CHECK(LookupAddress(is, "127.0.0.2") == FALSE);
+  CHECK(LookupAddress(is, "10.255.255.255") == TRUE);
+  CHECK(LookupAddress(is, "11.0.0.0") == FALSE);
+  CHECK(LookupAddress(is, "192.168.8.0") == TRUE);
+  CHECK(LookupAddress(is, "192.168.15.255") == TRUE);
+  CHECK(LookupAddress(is, "192.168.16.0") == FALSE);
+  CHECK(LookupAddress(is, "192.168.7.255") == FALSE);
+  CHECK(LookupAddress(is, "172.16.5.64") == TRUE);
+  CHECK(LookupAddress(is, "172.16.5.95") == TRUE);
+  CHECK(LookupAddress(is, "172.16.5.96") == FALSE);
+  CHECK(LookupAddress(is, "203.0.113.8") == TRUE);
+  CHECK(LookupAddress(is, "203.0.113.10") == FALSE);
+  CHECK(LookupAddress(is, "100.127.255.255") == TRUE);
+  CHECK(LookupAddress(is, "100.128.0.0") == FALSE);
+
+  CHECK(LookupAddress(is, "::1") == TRUE);
+  CHECK(LookupAddress(is, "::2") == FALSE);
+  CHECK(LookupAddress(is, "febf:ffff::1") == TRUE);
+  CHECK(LookupAddress(is, "fec0::1") == FALSE);
+  CHECK(LookupAddress(is, "2001:db8:7fff::1") == TRUE);
+  CHECK(LookupAddress(is, "2001:db8:8000::1") == FALSE);
+  CHECK(LookupAddress(is, "2001:db8:1234:5678::1") == TRUE);
+  CHECK(LookupAddress(is, "2001:db8:1234:567f:ffff::1") == TRUE);
+
+  // An IPv4 prefix must not match the same bytes as an IPv6 address
+  CHECK(LookupAddress(is, "a00::") == FALSE);
+}
+
+// Random addresses sharing leading bits with the list entries, so most lookups go deep into the trie
+static void TestRandomAddresses(const struct IgnoreState *is) {
+  struct sockaddr_in6 sin6;
+  struct sockaddr_in sin4;
+  const struct IgnoreIp *base;
+  uint8_t *key;
+  int i, j, len, noMatches = 0;
+
+  srandom(4711);
+
+  for (i = 0; i < NO_RANDOM_LOOKUPS; i++) {
+    base = &is->ignoreIpList[random() % is->ignoreIpListSize];
+    memset(&sin4, 0, sizeof(sin4));
+    memset(&sin6, 0, sizeof(sin6));
+
+    if (base->family == AF_INET) {
+      sin4.sin_family = AF_INET;
+      sin4.sin_addr = base->ip.addr4;
+      key = (uint8_t *)&sin4.sin_addr;
+      len = 4;
+    } else {
+      sin6.sin6_family = AF_INET6;
+      sin6.sin6_addr = base->ip.addr6;
+      key = sin6.sin6_addr.s6_addr;
+      len = 16;
+    }
+
+    // Flip a few random bits
+    for (j = random() % 4; j > 0; j--) {
+      key[random() % len] ^= (uint8_t)(1 << (random() % 8));
+    }
+
+    if (base->family == AF_INET) {
+      CHECK(IgnoreIpIsPresent(is, (struct sockaddr *)&sin4) == ReferenceLookup(is, AF_INET, key));
+    } else {
+      CHECK(IgnoreIpIsPresent(is, (struct sockaddr *)&sin6) == ReferenceLookup(is, AF_INET6, key));
+    }
+
+    noMatches += ReferenceLookup(is, base->family, key);
+  }
+
+  // Both outcomes must have been exercised
+  CHECK(noMatches > 0 && noMatches < NO_RANDOM_LOOKUPS);
+}
+
+static void TestMatchAll(void) {
+  struct IgnoreState is;
+  char path[PATH_MAX];
+
+  memset(&is, 0, sizeof(is));
+
+  CHECK(WriteIgnoreFile("0.0.0.0/0\n", path, sizeof(path)) == TRUE);
+  snprintf(configData.ignoreFile, sizeof(configData.ignoreFile), "%s", path);
+  CHECK(InitIgnore(&is) == TRUE);
+  CHECK(LookupAddress(&is, "198.51.100.1") == TRUE);
+  CHECK(LookupAddress(&is, "2001:db8::1") == FALSE);
+  FreeIgnore(&is);
+  unlink(path);
+}
+
+static void TestInvalidFile(void) {
+  struct IgnoreState is;
+  char path[PATH_MAX];
+
+  memset(&is, 0, sizeof(is));
+
+  CHECK(WriteIgnoreFile("10.0.0.0/33\n", path, sizeof(path)) == TRUE);
+  snprintf(configData.ignoreFile, sizeof(configData.ignoreFile), "%s", path);
+  CHECK(InitIgnore(&is) == ERROR);
+  CHECK(is.isInitialized == FALSE);
+  unlink(path);
+}
+
+int main(void) {
+  struct IgnoreState is;
+  char path[PATH_MAX];
+
+  ResetConfigData(&configData);
+  memset(&is, 0, sizeof(is));
+
+  CHECK(WriteIgnoreFile(IGNORE_LIST, path, sizeof(path)) == TRUE);
+  snprintf(configData.ignoreFile, sizeof(configData.ignoreFile), "%s", path);
+
+  if (InitIgnore(&is) != TRUE) {
+    fprintf(stderr, "Unable to read ignore file %s\n", path);
+    unlink(path);
+    return EXIT_FAILURE;
+  }
+
+  CHECK(is.ignoreIpListSize == 11);
+  TestKnownAddresses(&is);
+  TestRandomAddresses(&is);
+
+  FreeIgnore(&is);
+  unlink(path);
+
+  TestMatchAll();
+  TestInvalidFile();
+
+  return TEST_RESULT();
+}
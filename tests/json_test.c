@@ -0,0 +1,92 @@
+// SPDX-FileCopyrightText: 2024 Marcus Hufvudsson <mh@protohuf.com>
+//
+// SPDX-License-Identifier: CPL-1.0
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../src/portsentry.h"
+#include "../src/sentry.h"
+#include "unit_test.h"
+
+#define GUARD 'X'
+
+// Escape str into a buffer of exactly bufSize bytes and compare with expected (NULL if it shouldn't fit)
+static int Escape(const char *str, const size_t bufSize, const char *expected) {
+  char buf[256], *p;
+
+  memset(buf, GUARD, sizeof(buf));
+  p = AppendJsonString(buf, buf + bufSize, str);
+
+  // Nothing may be written past the end, even when the string doesn't fit
+  if (buf[bufSize] != GUARD) {
+    return FALSE;
+  }
+
+  if (expected == NULL) {
+    return (p == NULL) ? TRUE : FALSE;
+  }
+
+  if (p == NULL || (size_t)(p - buf) != strlen(expected)) {
+    return FALSE;
+  }
+
+  return (memcmp(buf, expected, strlen(expected)) == 0) ? TRUE : FALSE;
+}
+
+static void TestEscaping(void) {
+  CHECK(Escape("", 64, "\"\"") == TRUE);
+  CHECK(Escape("192.168.1.5", 64, "\"192.168.1.5\"") == TRUE);
+  CHECK(Escape("host.example.com", 64, "\"host.example.com\"") == TRUE);
+
+  CHECK(Escape("a\"b", 64, "\"a\\\"b\"") == TRUE);
+  CHECK(Escape("a\\b", 64, "\"a\\\\b\"") == TRUE);
+  CHECK(Escape("\"\\\"", 64, "\"\\\"\\\\\\\"\"") == TRUE);
+
+  // Control characters are always written as \u00XX
+  CHECK(Escape("\n", 64, "\"\\u000a\"") == TRUE);
+  CHECK(Escape("\t\r", 64, "\"\\u0009\\u000d\"") == TRUE);
+  CHECK(Escape("\x01\x1f", 64, "\"\\u0001\\u001f\"") == TRUE);
+  CHECK(Escape("a\x1b[31mb", 64, "\"a\\u001b[31mb\"") == TRUE);
+
+  // Space, DEL and UTF-8 sequences are passed through
+  CHECK(Escape(" ~\x7f", 64, "\" ~\x7f\"") == TRUE);
+  CHECK(Escape("h\xc3\xa5st", 64, "\"h\xc3\xa5st\"") == TRUE);
+  CHECK(Escape("\xe2\x82\xac\xf0\x9f\x98\x80", 64, "\"\xe2\x82\xac\xf0\x9f\x98\x80\"") == TRUE);
+}
+
+static void TestBufferEnd(void) {
+  char buf[16], *p;
+
+  // Exactly fitting and one byte short, for each kind of character
+  CHECK(Escape("abc", 5, "\"abc\"") == TRUE);
+  CHECK(Escape("abc", 4, NULL) == TRUE);
+  CHECK(Escape("abc", 3, NULL) == TRUE);
+  CHECK(Escape("\"", 4, "\"\\\"\"") == TRUE);
+  CHECK(Escape("\"", 3, NULL) == TRUE);
+  CHECK(Escape("\"", 2, NULL) == TRUE);
+  CHECK(Escape("\n", 8, "\"\\u000a\"") == TRUE);
+  CHECK(Escape("\n", 7, NULL) == TRUE);
+  CHECK(Escape("\n", 6, NULL) == TRUE);
+  CHECK(Escape("", 2, "\"\"") == TRUE);
+  CHECK(Escape("", 1, NULL) == TRUE);
+  CHECK(Escape("", 0, NULL) == TRUE);
+
+  // A previous failure is passed on
+  CHECK(AppendJsonString(NULL, buf + sizeof(buf), "abc") == NULL);
+
+  // Appending continues from the returned end
+  p = AppendJsonString(buf, buf + sizeof(buf), "a");
+  CHECK(p == buf + 3);
+  p = AppendJsonString(p, buf + sizeof(buf), "b\\");
+  CHECK(p == buf + 8);
+  CHECK(p != NULL && memcmp(buf, "\"a\"\"b\\\\\"", 8) == 0);
+}
+
+int main(void) {
+  TestEscaping();
+  TestBufferEnd();
+
+  return TEST_RESULT();
+}
@@ -0,0 +1,125 @@
+// SPDX-FileCopyrightText: 2024 Marcus Hufvudsson <mh@protohuf.com>
+//
+// SPDX-License-Identifier: CPL-1.0
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../src/pool.h"
+#include "../src/portsentry.h"
+#include "unit_test.h"
+
+#define CAPACITY 1000
+#define OBJECT_SIZE 37  // Not a multiple of the free list link size
+#define NO_OPERATIONS 500000
+
+// Every allocated object is filled with its own index, so overlapping objects or a corrupted free list show up
+static void Fill(const struct Pool *pool, void *object) {
+  uint32_t index = PoolIndex(pool, object);
+  memset(object, (int)(index & 0xff), OBJECT_SIZE);
+}
+
+static int IsIntact(const struct Pool *pool, const uint32_t index) {
+  const uint8_t *object = PoolAt(pool, index);
+
+  for (int i = 0; i < OBJECT_SIZE; i++) {
+    if (object[i] != (index & 0xff)) {
+      return FALSE;
+    }
+  }
+
+  return TRUE;
+}
+
+static void TestExhaustAndReuse(void) {
+  struct Pool pool;
+  void *objects[CAPACITY], *object;
+  int i;
+
+  CHECK(InitPool(&pool, OBJECT_SIZE, CAPACITY) == TRUE);
+
+  for (i = 0; i < CAPACITY; i++) {
+    objects[i] = PoolAlloc(&pool);
+    CHECK(objects[i] != NULL);
+    CHECK(PoolIndex(&pool, objects[i]) == (uint32_t)i);
+  }
+
+  CHECK(PoolAlloc(&pool) == NULL);
+  CHECK(GetPoolNoAllocated(&pool) == CAPACITY);
+
+  // Released objects are handed out again, most recently released first
+  PoolRelease(&pool, objects[10]);
+  PoolRelease(&pool, objects[500]);
+  CHECK(GetPoolNoAllocated(&pool) == CAPACITY - 2);
+  CHECK(PoolAlloc(&pool) == objects[500]);
+  CHECK(PoolAlloc(&pool) == objects[10]);
+  CHECK(PoolAlloc(&pool) == NULL);
+
+  // Growing keeps the index of every object and hands out the new tail
+  for (i = 0; i < CAPACITY; i++) {
+    Fill(&pool, PoolAt(&pool, i));
+  }
+  CHECK(GrowPool(&pool, CAPACITY * 2) == TRUE);
+  for (i = 0; i < CAPACITY; i++) {
+    CHECK(IsIntact(&pool, i) == TRUE);
+  }
+  CHECK((object = PoolAlloc(&pool)) != NULL);
+  CHECK(PoolIndex(&pool, object) == CAPACITY);
+
+  // Shrinking is ignored
+  CHECK(GrowPool(&pool, 10) == TRUE);
+  CHECK(pool.capacity == CAPACITY * 2);
+
+  FreePool(&pool);
+  CHECK(pool.memory == NULL);
+}
+
+static void TestRandomAllocRelease(void) {
+  struct Pool pool;
+  uint32_t live[CAPACITY], noLive = 0, i, j;
+  uint8_t isLive[CAPACITY];
+  void *object;
+
+  CHECK(InitPool(&pool, OBJECT_SIZE, CAPACITY) == TRUE);
+  memset(isLive, 0, sizeof(isLive));
+  srandom(4711);
+
+  for (i = 0; i < NO_OPERATIONS; i++) {
+    if (noLive < CAPACITY && (noLive == 0 || random() % 2 == 0)) {
+      object = PoolAlloc(&pool);
+      CHECK(object != NULL);
+      if (object == NULL) {
+        break;
+      }
+
+      // Never hand out an object that is already in use
+      CHECK(isLive[PoolIndex(&pool, object)] == FALSE);
+      isLive[PoolIndex(&pool, object)] = TRUE;
+      live[noLive++] = PoolIndex(&pool, object);
+      Fill(&pool, object);
+    } else {
+      j = (uint32_t)random() % noLive;
+      CHECK(IsIntact(&pool, live[j]) == TRUE);
+      isLive[live[j]] = FALSE;
+      PoolRelease(&pool, PoolAt(&pool, live[j]));
+      live[j] = live[--noLive];
+    }
+
+    CHECK(GetPoolNoAllocated(&pool) == noLive);
+  }
+
+  for (i = 0; i < noLive; i++) {
+    CHECK(IsIntact(&pool, live[i]) == TRUE);
+  }
+
+  FreePool(&pool);
+}
+
+int main(void) {
+  TestExhaustAndReuse();
+  TestRandomAllocRelease();
+
+  return TEST_RESULT();
+}
@@ -0,0 +1,191 @@
+// SPDX-FileCopyrightText: 2024 Marcus Hufvudsson <mh@protohuf.com>
+//
+// SPDX-License-Identifier: CPL-1.0
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <unistd.h>
+
+#include "../src/config_data.h"
+#include "../src/port.h"
+#include "../src/portsentry.h"
+#include "../src/raw_filter.h"
+#include "unit_test.h"
+
+#define PACKET_SIZE 100
+#define TCP_SYN 0x02
+#define TCP_RST 0x04
+#define TCP_ACK 0x10
+#define IPV4_MF 0x20  // More fragments, in the high byte of the fragment field
+
+/* The filter is run by the kernel on a unix datagram socketpair, which accepts socket filters
+ * just like the AF_PACKET socket. A rejected packet is silently dropped, an accepted one is
+ * received truncated to the filter's return value.
+ */
+static int sv[2] = {-1, -1};
+
+// Returns the number of bytes received, 0 if the filter rejected the packet
+static ssize_t Run(const uint8_t *packet) {
+  uint8_t buf[PACKET_SIZE];
+  ssize_t len;
+
+  if (send(sv[0], packet, PACKET_SIZE, 0) != PACKET_SIZE) {
+    return -1;
+  }
+
+  if ((len = recv(sv[1], buf, sizeof(buf), MSG_DONTWAIT)) == -1) {
+    return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+  }
+
+  return len;
+}
+
+static uint8_t *Ipv4(uint8_t *packet, const uint8_t protocol, const int noOptionWords, const uint16_t port, const uint8_t flags) {
+  const int hl = 20 + noOptionWords * 4;
+
+  memset(packet, 0, PACKET_SIZE);
+  packet[0] = (uint8_t)(0x40 | (hl / 4));
+  packet[9] = protocol;
+  packet[hl + 2] = (uint8_t)(port >> 8);
+  packet[hl + 3] = (uint8_t)(port & 0xff);
+  packet[hl + 13] = flags;
+
+  return packet;
+}
+
+static uint8_t *Ipv6(uint8_t *packet, const uint8_t nextHeader, const uint16_t port, const uint8_t flags) {
+  memset(packet, 0, PACKET_SIZE);
+  packet[0] = 0x60;
+  packet[6] = nextHeader;
+  packet[42] = (uint8_t)(port >> 8);
+  packet[43] = (uint8_t)(port & 0xff);
+  packet[53] = flags;
+
+  return packet;
+}
+
+static int IsAccepted(const uint8_t *packet) {
+  return (Run(packet) == PACKET_SIZE) ? TRUE : FALSE;
+}
+
+static int IsRejected(const uint8_t *packet) {
+  return (Run(packet) == 0) ? TRUE : FALSE;
+}
+
+static void TestIpv4(void) {
+  uint8_t p[PACKET_SIZE];
+
+  CHECK(AttachRawFilter(sv[1], AF_INET) == TRUE);
+
+  CHECK(IsAccepted(Ipv4(p, IPPROTO_TCP, 0, 22, TCP_SYN)) == TRUE);
+  CHECK(IsAccepted(Ipv4(p, IPPROTO_TCP, 0, 22, 0)) == TRUE);
+  CHECK(IsRejected(Ipv4(p, IPPROTO_TCP, 0, 23, TCP_SYN)) == TRUE);
+  CHECK(IsRejected(Ipv4(p, IPPROTO_TCP, 0, 999, TCP_SYN)) == TRUE);
+  CHECK(IsAccepted(Ipv4(p, IPPROTO_TCP, 0, 1000, TCP_SYN)) == TRUE);
+  CHECK(IsAccepted(Ipv4(p, IPPROTO_TCP, 0, 2000, TCP_SYN)) == TRUE);
+  CHECK(IsRejected(Ipv4(p, IPPROTO_TCP, 0, 2001, TCP_SYN)) == TRUE);
+  CHECK(IsAccepted(Ipv4(p, IPPROTO_TCP, 0, 65535, TCP_SYN)) == TRUE);
+
+  // Same as in userspace, ACK or RST is never a scan
+  CHECK(IsRejected(Ipv4(p, IPPROTO_TCP, 0, 22, TCP_SYN | TCP_ACK)) == TRUE);
+  CHECK(IsRejected(Ipv4(p, IPPROTO_TCP, 0, 22, TCP_RST)) == TRUE);
+
+  // The TCP header is found after IP options
+  CHECK(IsAccepted(Ipv4(p, IPPROTO_TCP, 1, 22, TCP_SYN)) == TRUE);
+  CHECK(IsRejected(Ipv4(p, IPPROTO_TCP, 10, 23, TCP_SYN)) == TRUE);
+  CHECK(IsAccepted(Ipv4(p, IPPROTO_TCP, 10, 1500, TCP_SYN)) == TRUE);
+
+  // Only the first fragment carries the ports
+  Ipv4(p, IPPROTO_TCP, 0, 22, TCP_SYN);
+  p[6] = IPV4_MF;
+  CHECK(IsAccepted(p) == TRUE);
+  p[7] = 1;
+  CHECK(IsRejected(p) == TRUE);
+
+  CHECK(IsAccepted(Ipv4(p, IPPROTO_UDP, 0, 53, 0)) == TRUE);
+  CHECK(IsRejected(Ipv4(p, IPPROTO_UDP, 0, 54, 0)) == TRUE);
+  CHECK(IsRejected(Ipv4(p, IPPROTO_UDP, 0, 22, 0)) == TRUE);
+
+  // The UDP section doesn't look at TCP flags
+  CHECK(IsAccepted(Ipv4(p, IPPROTO_UDP, 0, 53, TCP_ACK)) == TRUE);
+
+  CHECK(IsRejected(Ipv4(p, IPPROTO_ICMP, 0, 22, 0)) == TRUE);
+  CHECK(IsRejected(Ipv4(p, 0, 0, 22, 0)) == TRUE);
+}
+
+static void TestIpv6(void) {
+  uint8_t p[PACKET_SIZE];
+
+  CHECK(AttachRawFilter(sv[1], AF_INET6) == TRUE);
+
+  CHECK(IsAccepted(Ipv6(p, IPPROTO_TCP, 22, TCP_SYN)) == TRUE);
+  CHECK(IsRejected(Ipv6(p, IPPROTO_TCP, 23, TCP_SYN)) == TRUE);
+  CHECK(IsAccepted(Ipv6(p, IPPROTO_TCP, 1234, TCP_SYN)) == TRUE);
+  CHECK(IsRejected(Ipv6(p, IPPROTO_TCP, 22, TCP_ACK)) == TRUE);
+
+  CHECK(IsAccepted(Ipv6(p, IPPROTO_UDP, 53, 0)) == TRUE);
+  CHECK(IsRejected(Ipv6(p, IPPROTO_UDP, 1000, 0)) == TRUE);
+
+  // Extension headers are left to userspace, except the ones it rejects anyway
+  CHECK(IsAccepted(Ipv6(p, IPPROTO_HOPOPTS, 23, 0)) == TRUE);
+  CHECK(IsAccepted(Ipv6(p, IPPROTO_ROUTING, 23, 0)) == TRUE);
+  CHECK(IsAccepted(Ipv6(p, IPPROTO_DSTOPTS, 23, 0)) == TRUE);
+  CHECK(IsAccepted(Ipv6(p, 140, 23, 0)) == TRUE);
+  CHECK(IsRejected(Ipv6(p, IPPROTO_FRAGMENT, 22, 0)) == TRUE);
+  CHECK(IsRejected(Ipv6(p, IPPROTO_NONE, 22, 0)) == TRUE);
+  CHECK(IsRejected(Ipv6(p, IPPROTO_ICMPV6, 22, 0)) == TRUE);
+}
+
+static void TestNoPortsAndSnaplen(void) {
+  uint8_t p[PACKET_SIZE];
+  int udpPortsLength = configData.udpPortsLength;
+
+  // Without UDP ports all UDP is rejected, TCP is unaffected
+  configData.udpPortsLength = 0;
+  CHECK(AttachRawFilter(sv[1], AF_INET) == TRUE);
+  CHECK(IsRejected(Ipv4(p, IPPROTO_UDP, 0, 53, 0)) == TRUE);
+  CHECK(IsAccepted(Ipv4(p, IPPROTO_TCP, 0, 22, TCP_SYN)) == TRUE);
+  configData.udpPortsLength = udpPortsLength;
+
+  // With CAPTURE_SNAPLEN only the headers are kept
+  configData.captureSnaplen = 64;
+  CHECK(AttachRawFilter(sv[1], AF_INET6) == TRUE);
+  CHECK(Run(Ipv6(p, IPPROTO_TCP, 22, TCP_SYN)) == 64);
+  CHECK(Run(Ipv6(p, IPPROTO_DSTOPTS, 22, 0)) == 64);
+  CHECK(IsRejected(Ipv6(p, IPPROTO_TCP, 23, TCP_SYN)) == TRUE);
+  configData.captureSnaplen = 0;
+}
+
+int main(void) {
+  struct Port tcpPorts[3], udpPorts[1];
+
+  ResetConfigData(&configData);
+
+  SetPortSingle(&tcpPorts[0], 22);
+  SetPortRange(&tcpPorts[1], 1000, 2000);
+  SetPortSingle(&tcpPorts[2], 65535);
+  SetPortSingle(&udpPorts[0], 53);
+  configData.tcpPorts = tcpPorts;
+  configData.tcpPortsLength = 3;
+  configData.udpPorts = udpPorts;
+  configData.udpPortsLength = 1;
+
+  if (socketpair(AF_UNIX, SOCK_DGRAM, 0, sv) == -1) {
+    perror("socketpair");
+    return EXIT_FAILURE;
+  }
+
+  TestIpv4();
+  TestIpv6();
+  TestNoPortsAndSnaplen();
+
+  close(sv[0]);
+  close(sv[1]);
+
+  return TEST_RESULT();
+}
@@ -0,0 +1,196 @@
+// SPDX-FileCopyrightText: 2024 Marcus Hufvudsson <mh@protohuf.com>
+//
+// SPDX-License-Identifier: CPL-1.0
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../src/config_data.h"
+#include "../src/portsentry.h"
+#include "../src/state_machine.h"
+#include "../src/state_table.h"
+#include "unit_test.h"
+
+#define MAX_ENTRIES 200
+#define NO_KEYS 450  // More sources than the table holds, so entries are evicted and slots deleted
+#define NO_OPERATIONS 300000
+
+/* Reference LRU list, reference[0] is the most recently used key id */
+static uint32_t reference[MAX_ENTRIES];
+static uint32_t noReference;
+
+static void MakeKey(const uint32_t id, const uint8_t keyLength, uint8_t *key) {
+  memset(key, 0, 16);
+
+  if (keyLength == 4) {
+    memcpy(key, &id, sizeof(id));
+  } else {
+    // 2001:db8::/32 with the id spread over the address
+    key[0] = 0x20;
+    key[1] = 0x01;
+    key[2] = 0x0d;
+    key[3] = 0xb8;
+    memcpy(key + 6, &id, sizeof(id));
+    memcpy(key + 12, &id, sizeof(id));
+  }
+}
+
+// Returns TRUE if the id was already present
+static int ReferenceTouch(const uint32_t id) {
+  uint32_t i;
+  int isPresent = FALSE;
+
+  for (i = 0; i < noReference; i++) {
+    if (reference[i] == id) {
+      isPresent = TRUE;
+      break;
+    }
+  }
+
+  if (isPresent == FALSE) {
+    i = (noReference < MAX_ENTRIES) ? noReference++ : noReference - 1;  // Evict the least recently used
+  }
+
+  memmove(&reference[1], &reference[0], i * sizeof(uint32_t));
+  reference[0] = id;
+
+  return isPresent;
+}
+
+// Walk the LRU list both ways and compare it with the reference
+static int IsLruConsistent(const struct StateTable *table) {
+  uint8_t key[16];
+  uint32_t slot, prev = STATE_TABLE_NONE, i = 0;
+
+  if (table->count != noReference) {
+    return FALSE;
+  }
+
+  for (slot = table->lruHead; slot != STATE_TABLE_NONE; slot = table->entries[slot].lruNext, i++) {
+    if (i >= noReference || table->entries[slot].lruPrev != prev) {
+      return FALSE;
+    }
+
+    MakeKey(reference[i], table->keyLength, key);
+    if (memcmp(table->keys + (size_t)slot * table->keyLength, key, table->keyLength) != 0) {
+      return FALSE;
+    }
+
+    prev = slot;
+  }
+
+  return (i == noReference && table->lruTail == prev) ? TRUE : FALSE;
+}
+
+static void TestTable(const uint8_t keyLength) {
+  struct StateTable table;
+  struct StateEntry *entry;
+  uint8_t key[16];
+  uint32_t i, id;
+  int isNew;
+
+  noReference = 0;
+  CHECK(InitStateTable(&table, keyLength, MAX_ENTRIES) == TRUE);
+  CHECK(table.capacity % STATE_TABLE_GROUP_SIZE == 0);
+  CHECK(table.capacity >= MAX_ENTRIES + MAX_ENTRIES / 8);
+
+  srandom(4711);
+
+  for (i = 0; i < NO_OPERATIONS; i++) {
+    // Mostly a hot set of recently seen sources, sometimes any source
+    id = (noReference == 0 || random() % 4 == 0) ? (uint32_t)random() % NO_KEYS : reference[random() % noReference];
+    MakeKey(id, keyLength, key);
+
+    StateTablePrefetch(&table, key);
+    entry = StateTableTouch(&table, key, &isNew);
+    CHECK(entry != NULL);
+    CHECK(isNew == (ReferenceTouch(id) == TRUE ? FALSE : TRUE));
+
+    // An entry keeps its data until it's evicted
+    if (isNew == TRUE) {
+      CHECK(entry->counter.count == 0 && entry->counter.prevCount == 0 && entry->counter.windowStart == 0);
+      entry->counter.count = (int)id;
+    } else {
+      CHECK(entry->counter.count == (int)id);
+    }
+
+    CHECK(table.count + table.noDeleted <= table.growthLimit);
+
+    if (i % 1000 == 0) {
+      CHECK(IsLruConsistent(&table) == TRUE);
+    }
+  }
+
+  CHECK(IsLruConsistent(&table) == TRUE);
+
+  FreeStateTable(&table);
+  CHECK(table.ctrl == NULL && table.keys == NULL && table.entries == NULL);
+}
+
+static void TestCounter(void) {
+  struct StateCounter counter;
+  uint32_t t;
+
+  configData.scanTriggerWindow = 10;
+  configData.configTriggerCount = 5;
+
+  // Five hits within one window trigger
+  memset(&counter, 0, sizeof(counter));
+  for (t = 0; t < 4; t++) {
+    CHECK(UpdateStateCounter(&counter, t) == FALSE);
+  }
+  CHECK(UpdateStateCounter(&counter, 4) == TRUE);
+
+  /* Four hits in the previous window still count for the part of it that overlaps the
+   * sliding window: at 12 seconds 8/10 of them (3), at 14 seconds 6/10 of them (2) */
+  memset(&counter, 0, sizeof(counter));
+  for (t = 0; t < 4; t++) {
+    CHECK(UpdateStateCounter(&counter, t) == FALSE);
+  }
+  CHECK(UpdateStateCounter(&counter, 12) == FALSE);
+  CHECK(counter.windowStart == 10 && counter.prevCount == 4 && counter.count == 1);
+  CHECK(UpdateStateCounter(&counter, 13) == FALSE);
+  CHECK(UpdateStateCounter(&counter, 14) == TRUE);
+
+  // Hits more than two windows old are forgotten
+  memset(&counter, 0, sizeof(counter));
+  for (t = 0; t < 4; t++) {
+    CHECK(UpdateStateCounter(&counter, t) == FALSE);
+  }
+  CHECK(UpdateStateCounter(&counter, 25) == FALSE);
+  CHECK(counter.windowStart == 25 && counter.prevCount == 0 && counter.count == 1);
+
+  // A steady rate below the trigger count never triggers
+  memset(&counter, 0, sizeof(counter));
+  for (t = 0; t < 1000; t += 3) {
+    CHECK(UpdateStateCounter(&counter, t) == FALSE);
+  }
+
+  // The monotonic clock wrapping around doesn't reset the window
+  memset(&counter, 0, sizeof(counter));
+  counter.windowStart = UINT32_MAX - 1;
+  for (t = UINT32_MAX - 1; t != 2; t++) {
+    CHECK(UpdateStateCounter(&counter, t) == FALSE);
+  }
+  CHECK(UpdateStateCounter(&counter, 2) == TRUE);
+
+  // Without a window hits are counted for as long as the source is tracked
+  configData.scanTriggerWindow = 0;
+  configData.configTriggerCount = 3;
+  memset(&counter, 0, sizeof(counter));
+  CHECK(UpdateStateCounter(&counter, 0) == FALSE);
+  CHECK(UpdateStateCounter(&counter, 1000) == FALSE);
+  CHECK(UpdateStateCounter(&counter, 100000) == TRUE);
+}
+
+int main(void) {
+  ResetConfigData(&configData);
+
+  TestTable(4);
+  TestTable(16);
+  TestCounter();
+
+  return TEST_RESULT();
+}
@@ -0,0 +1,151 @@
+// SPDX-FileCopyrightText: 2024 Marcus Hufvudsson <mh@protohuf.com>
+//
+// SPDX-License-Identifier: CPL-1.0
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../src/portsentry.h"
+#include "../src/timer_wheel.h"
+#include "unit_test.h"
+
+#define START 1000003  // Not aligned to any level
+#define NO_RANDOM_TIMERS 2000
+#define MAX_TIMERS (NO_RANDOM_TIMERS + 64)
+
+struct TestTimer {
+  uint64_t expires;
+  uint32_t id;
+};
+
+// The window of the current advance, a timer must fire in the advance ending at its expiry
+struct AdvanceWindow {
+  uint64_t from;  // Exclusive
+  uint64_t to;    // Inclusive
+  uint8_t hasFired[MAX_TIMERS];
+  uint32_t noFired;
+};
+
+static void OnTimer(void *data, void *ctx) {
+  struct TestTimer *timer = data;
+  struct AdvanceWindow *window = ctx;
+
+  CHECK(timer->expires > window->from && timer->expires <= window->to);
+  CHECK(window->hasFired[timer->id] == FALSE);
+  window->hasFired[timer->id] = TRUE;
+  window->noFired++;
+}
+
+static void Add(struct TimerWheel *tw, const uint64_t expires, const uint32_t id) {
+  struct TestTimer *timer;
+
+  CHECK((timer = AddTimer(tw, expires)) != NULL);
+  if (timer != NULL) {
+    timer->expires = expires;
+    timer->id = id;
+  }
+}
+
+static int CompareExpiry(const void *a, const void *b) {
+  uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+  return (x > y) - (x < y);
+}
+
+/* Timers around every level boundary and beyond the 2^24 tick range, plus random ones. Advancing to
+ * just before and then to each expiry checks that no timer fires early, late or twice while cascading.
+ */
+static void TestExactExpiry(void) {
+  static const uint64_t deltas[] = {0, 1, 2, 63, 64, 65, 127, 128, 4095, 4096, 4097, 262143, 262144, 262145,
+                                    TIMER_WHEEL_MAX_DELTA - 1, TIMER_WHEEL_MAX_DELTA, TIMER_WHEEL_MAX_DELTA + 1,
+                                    TIMER_WHEEL_MAX_DELTA + 64, 2 * TIMER_WHEEL_MAX_DELTA + 12345, 4 * TIMER_WHEEL_MAX_DELTA};
+  static struct AdvanceWindow window;
+  static uint64_t expiries[MAX_TIMERS];
+  struct TimerWheel tw;
+  uint32_t noTimers = 0, i;
+  uint64_t now = START - 1;
+
+  memset(&window, 0, sizeof(window));
+
+  // A small capacity makes the pool grow while timers are queued
+  CHECK(InitTimerWheel(&tw, sizeof(struct TestTimer), 4, START) == TRUE);
+
+  for (i = 0; i < sizeof(deltas) / sizeof(deltas[0]); i++) {
+    expiries[noTimers] = START + deltas[i];
+    Add(&tw, expiries[noTimers], noTimers);
+    noTimers++;
+  }
+
+  srandom(4711);
+  for (i = 0; i < NO_RANDOM_TIMERS; i++) {
+    expiries[noTimers] = START + ((((uint64_t)random() << 31) | (uint64_t)random()) % (3 * TIMER_WHEEL_MAX_DELTA));
+    Add(&tw, expiries[noTimers], noTimers);
+    noTimers++;
+  }
+
+  CHECK(tw.count == noTimers);
+
+  qsort(expiries, noTimers, sizeof(uint64_t), CompareExpiry);
+
+  for (i = 0; i < noTimers; i++) {
+    if (expiries[i] <= now) {
+      continue;
+    }
+
+    window.from = now;
+    window.to = expiries[i] - 1;
+    AdvanceTimerWheel(&tw, window.to, OnTimer, &window);
+    now = window.to;
+
+    window.from = now;
+    window.to = expiries[i];
+    CHECK(AdvanceTimerWheel(&tw, window.to, OnTimer, &window) > 0);
+    now = window.to;
+  }
+
+  CHECK(window.noFired == noTimers);
+  CHECK(tw.count == 0);
+
+  FreeTimerWheel(&tw);
+}
+
+static void TestPastAndIdle(void) {
+  static struct AdvanceWindow window;
+  struct TimerWheel tw;
+
+  memset(&window, 0, sizeof(window));
+  CHECK(InitTimerWheel(&tw, sizeof(struct TestTimer), 16, 100) == TRUE);
+
+  // Advancing an empty wheel skips straight to now
+  window.from = 0;
+  window.to = 5000000;
+  CHECK(AdvanceTimerWheel(&tw, 5000000, OnTimer, &window) == 0);
+  CHECK(tw.nextTick == 5000001);
+
+  // A timer in the past fires on the next advance
+  Add(&tw, 10, 0);
+  window.from = 9;
+  window.to = 5000001;
+  CHECK(AdvanceTimerWheel(&tw, 5000001, OnTimer, &window) == 1);
+
+  // Advancing backwards or to the same tick does nothing
+  Add(&tw, 5000010, 1);
+  window.from = 5000001;
+  window.to = 5000001;
+  CHECK(AdvanceTimerWheel(&tw, 4000000, OnTimer, &window) == 0);
+  CHECK(AdvanceTimerWheel(&tw, 5000001, OnTimer, &window) == 0);
+  window.to = 5000010;
+  CHECK(AdvanceTimerWheel(&tw, 5000010, OnTimer, &window) == 1);
+
+  CHECK(window.noFired == 2);
+  FreeTimerWheel(&tw);
+  CHECK(tw.isInitialized == FALSE);
+}
+
+int main(void) {
+  TestExactExpiry();
+  TestPastAndIdle();
+
+  return TEST_RESULT();
+}
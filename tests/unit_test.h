@@ -0,0 +1,23 @@
+// SPDX-FileCopyrightText: 2024 Marcus Hufvudsson <mh@protohuf.com>
+//
+// SPDX-License-Identifier: CPL-1.0
+
+#pragma once
+
+#include <stdio.h>
+#include <stdlib.h>
+
+/* Minimal checks for the unit test programs. A failed check is reported and the test continues,
+ * TEST_RESULT() gives the exit status for ctest.
+ */
+static int noFailedChecks = 0;
+
+#define CHECK(expr)                                                             \
+  do {                                                                          \
+    if (!(expr)) {                                                              \
+      fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #expr); \
+      noFailedChecks++;                                                         \
+    }                                                                           \
+  } while (0)
+
+#define TEST_RESULT() ((noFailedChecks == 0) ? EXIT_SUCCESS : EXIT_FAILURE)